@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "benchClient.h"
+#include "server.h"
+#include "router.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+#include "transferCompression.h"
+#include "fileHash.h"
+
+
+enum{ BENCH_SERVER_START_TRIES    = 200    };
+enum{ BENCH_SERVER_START_USECS    = 25000  };
+
+
+static int verifyChunk(void *verifierV, unsigned char *bytes, uint32_t bytesize);
+
+
+/*
+ * benchClient speaks the onionGet request protocol directly over a connected router, timing each response instead of writing the
+ * files to disk, so the benchmarks measure the server rather than the client's disk. It also starts the server under test. 
+ */
+
+
+/*
+ * benchFetchBatch requests fileCount files in one batch over router and receives every response, filling in results[fileCount].
+ * requestFlags is 0 or REQUEST_FLAG_SCHEDULED, which has the server send the files smallest first each preceded by its index, and may
+ * add REQUEST_FLAG_COMPRESSED, which has the responses framed and decompressed as they arrive (see transferCompression.h), and
+ * REQUEST_FLAG_HASHES, which has every chunk checked against the server's hashes (see fileHash.h).
+ * Returns 0 on error and 1 on success, after an error the remaining results are marked failed and the router should be discarded
+ */
+int benchFetchBatch(routerObject *router, char **fileNames, uint32_t fileCount, uint32_t requestFlags, benchFileResult *results)
+{
+  char            chunk[FILE_CHUNK_BYTESIZE]; 
+  uint32_t        requestBytesize = 0;
+  uint32_t        currentFile     = 0; 
+  uint32_t        received        = 0; 
+  uint32_t        fileIndex       = 0; 
+  uint32_t        bytesRemaining  = 0;
+  uint32_t        bytesToGet      = 0; 
+  uint64_t        requestSent     = 0; 
+  uint64_t        wireBytesize    = 0; 
+  int             success         = 0; 
+  transferDecoder decoder; 
+  hashVerifier    verifier; 
+  
+  memset(&decoder, 0, sizeof(decoder)); 
+  memset(&verifier, 0, sizeof(verifier)); 
+  
+  if(router == NULL || fileNames == NULL || results == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    requestBytesize += sizeof(uint32_t) + strlen(fileNames[currentFile]); 
+    results[currentFile].failed = 1; 
+  }
+  
+  //[request bytesize][first filename bytesize][first filename][second filename bytesize]...
+  if( !router->transmitBytesize(router, requestBytesize | requestFlags) ){
+    logEvent("Error", "Failed to transmit request bytesize");
+    return 0; 
+  }
+  
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    if( !router->transmitBytesize(router, strlen(fileNames[currentFile])) || !router->transmit(router, fileNames[currentFile], strlen(fileNames[currentFile])) ){
+      logEvent("Error", "Failed to transmit requested filename");
+      return 0; 
+    }
+  }
+  
+  requestSent = getMonotonicMicroseconds(); 
+  
+  for(received = 0; received != fileCount; received++){
+    currentFile = received; 
+    
+    if(requestFlags & REQUEST_FLAG_SCHEDULED){
+      if( !router->receive(router, &fileIndex, sizeof(uint32_t)) ){
+        logEvent("Error", "Failed to receive file index");
+        goto cleanup; 
+      }
+      
+      currentFile = ntohl(fileIndex); 
+      if(currentFile >= fileCount || !results[currentFile].failed){
+        logEvent("Error", "Server sent an invalid file index");
+        goto cleanup; 
+      }
+    }
+    
+    bytesRemaining = router->getIncomingBytesize(router); 
+    if(bytesRemaining == 0){
+      logEvent("Error", "Failed to receive file bytesize");
+      goto cleanup; 
+    }
+    
+    results[currentFile].timeToFirstByte = getMonotonicMicroseconds() - requestSent; 
+    results[currentFile].bytesize        = bytesRemaining; 
+    results[currentFile].wireBytesize    = bytesRemaining; 
+    results[currentFile].verified        = 0; 
+    
+    if( (requestFlags & REQUEST_FLAG_HASHES) && !hashReceive(&verifier, router, bytesRemaining) ){
+      logEvent("Error", "Failed to receive file hashes");
+      goto cleanup; 
+    }
+    
+    if(requestFlags & REQUEST_FLAG_COMPRESSED){
+      wireBytesize = decoder.wireBytesize; 
+      
+      if( !transferReceiveFile(&decoder, router, bytesRemaining, &verifyChunk, &verifier) ){
+        logEvent("Error", "Failed to receive framed file");
+        goto cleanup; 
+      }
+      
+      results[currentFile].wireBytesize = (uint32_t)(decoder.wireBytesize - wireBytesize); 
+      bytesRemaining                    = 0; 
+    }
+    
+    for(; bytesRemaining; bytesRemaining -= bytesToGet){
+      bytesToGet = (bytesRemaining < FILE_CHUNK_BYTESIZE) ? bytesRemaining : FILE_CHUNK_BYTESIZE; 
+      
+      if( !router->receive(router, chunk, bytesToGet) ){
+        logEvent("Error", "Failed to receive file chunk");
+        goto cleanup; 
+      }
+      
+      if( !hashVerifyChunk(&verifier, (unsigned char *)chunk, bytesToGet) ){
+        goto cleanup; 
+      }
+    }
+    
+    if( !hashVerifyEnd(&verifier) ){
+      goto cleanup; 
+    }
+    
+    results[currentFile].verified       = verifier.hashed; 
+    results[currentFile].completionTime = getMonotonicMicroseconds() - requestSent; 
+    results[currentFile].failed         = 0; 
+  }
+  
+  success = 1; 
+  
+  cleanup:
+    transferDecoderRelease(&decoder); 
+    hashVerifierRelease(&verifier); 
+    return success; 
+}
+
+
+//transferSink that checks what it is given against the file's hashes (which passes all of it unless the file is hashed) and drops it,
+//the benchmarks only time the files
+static int verifyChunk(void *verifierV, unsigned char *bytes, uint32_t bytesize)
+{
+  return hashVerifyChunk((hashVerifier *)verifierV, bytes, bytesize); 
+}
+
+
+//qsort comparator for uint64_t times
+int benchCompareTimes(const void *first, const void *second)
+{
+  uint64_t firstTime  = *(const uint64_t *)first;
+  uint64_t secondTime = *(const uint64_t *)second;
+  
+  return (firstTime > secondTime) - (firstTime < secondTime); 
+}
+
+
+/*
+ * benchPercentile returns the nearest rank percentile (0 to 100) of timeCount sorted times, or 0 if there are none
+ */
+uint64_t benchPercentile(uint64_t *sortedTimes, uint64_t timeCount, double percentile)
+{
+  uint64_t rank = 0; 
+  
+  if(sortedTimes == NULL || timeCount == 0){
+    return 0; 
+  }
+  
+  rank = (uint64_t)( (percentile / 100.0) * timeCount + 0.999999 ); 
+  if(rank == 0){
+    rank = 1; 
+  }
+  
+  if(rank > timeCount){
+    rank = timeCount; 
+  }
+  
+  return sortedTimes[rank - 1]; 
+}
+
+
+/*
+ * benchStartServer forks a child process serving sharedFolder on 127.0.0.1:port configured with options, returns the child's pid or -1
+ * on error. Stop it with SIGTERM
+ */
+pid_t benchStartServer(char *sharedFolder, uint32_t maxSharedFiles, uint32_t cacheMegabytes, uint32_t serverConnections, char *port,
+                       serverOptions *options)
+{
+  pid_t            server          = -1;
+  routerObject     *serverRouter   = NULL;
+  serverObject     *onionServer    = NULL;
+  diskFileObject   **fileBank      = NULL;
+  connectionObject **connectionBank = NULL;
+
+  //otherwise the child inherits anything still buffered and prints it again
+  fflush(stdout);
+
+  server = fork();
+  if(server != 0){
+    return server;
+  }
+
+  serverRouter   = newRouter();
+  fileBank       = (diskFileObject **)secureAllocate(maxSharedFiles * sizeof(diskFileObject *));
+  connectionBank = (connectionObject **)secureAllocate(serverConnections * sizeof(connectionObject *));
+  if(serverRouter == NULL || fileBank == NULL || connectionBank == NULL){
+    logEvent("Error", "Failed to allocate server state");
+    flushLog();
+    _exit(1);
+  }
+
+  onionServer = newServer(serverRouter, fileBank, maxSharedFiles, connectionBank, serverConnections);
+  if(onionServer == NULL){
+    logEvent("Error", "Failed to create server");
+    flushLog();
+    _exit(1);
+  }
+
+  if( !onionServer->configure(options) ){
+    logEvent("Error", "Failed to configure server");
+    flushLog();
+    _exit(1);
+  }
+
+  //doesn't return on success
+  onionServer->serve(sharedFolder, cacheMegabytes, "127.0.0.1", port);
+
+  logEvent("Error", "Server stopped serving");
+  flushLog();
+  _exit(1);
+}
+
+
+/*
+ * benchWaitForServer returns 1 once something accepts connections on 127.0.0.1:port, or 0 if nothing does in time. The probe is an
+ * empty request, which the server answers by closing the connection without counting it as a failure
+ */
+int benchWaitForServer(char *port)
+{
+  struct sockaddr_in address;
+  uint32_t           emptyRequest = 0;
+  char               drain;
+  int                probe        = -1;
+  uint32_t           tries        = BENCH_SERVER_START_TRIES;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family      = AF_INET;
+  address.sin_port        = htons((uint16_t)strtoul(port, NULL, 10));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  while(tries--){
+    probe = socket(AF_INET, SOCK_STREAM, 0);
+    if(probe == -1){
+      return 0;
+    }
+
+    if( connect(probe, (const struct sockaddr *)&address, sizeof(address)) == 0 ){
+      //waiting for the server to close its end keeps the probe out of whatever the caller measures next
+      if( send(probe, &emptyRequest, sizeof(emptyRequest), 0) == sizeof(emptyRequest) ){
+        while( recv(probe, &drain, sizeof(drain), 0) > 0 );
+      }
+
+      close(probe);
+      return 1;
+    }
+
+    close(probe);
+    usleep(BENCH_SERVER_START_USECS);
+  }
+
+  return 0;
+}
+
+
+/*
+ * benchFetchStats writes the stats output of the server with its stats endpoint on socketPath to outputPath, returns 0 on error and 1
+ * on success
+ */
+int benchFetchStats(const char *socketPath, const char *outputPath)
+{
+  struct sockaddr_un address;
+  char               buffer[4096];
+  ssize_t            bytesRead = 0;
+  int                stats     = -1;
+  FILE               *out      = NULL;
+
+  if(strlen(socketPath) >= sizeof(address.sun_path)){
+    logEvent("Error", "Stats socket path is too long");
+    return 0;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+  stats = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(stats == -1 || connect(stats, (const struct sockaddr *)&address, sizeof(address)) ){
+    logEvent("Error", "Failed to connect to the server's stats endpoint");
+    if(stats != -1){
+      close(stats);
+    }
+    return 0;
+  }
+
+  out = fopen(outputPath, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open stats output file");
+    close(stats);
+    return 0;
+  }
+
+  //any request that isn't HTTP gets the plain stats text
+  if( send(stats, "\n", 1, 0) != 1 ){
+    logEvent("Error", "Failed to request stats");
+    fclose(out);
+    close(stats);
+    return 0;
+  }
+
+  while( (bytesRead = recv(stats, buffer, sizeof(buffer), 0)) > 0 ){
+    fwrite(buffer, 1, (size_t)bytesRead, out);
+  }
+
+  fclose(out);
+  close(stats);
+
+  return bytesRead == 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include "router.h"
+#include "server.h"
+
+
+//timings are monotonic microseconds measured from the moment the whole batch request has been sent
+typedef struct benchFileResult{
+  uint64_t timeToFirstByte;   //until the file's response header arrived
+  uint64_t completionTime;    //until the file's last byte arrived
+  uint32_t bytesize;
+  uint32_t wireBytesize;      //what the response took on the wire, less than bytesize if it came compressed
+  int      verified;          //every chunk matched the server's hashes, 0 if the file wasn't hashed
+  int      failed; 
+}benchFileResult;
+
+
+int benchFetchBatch(routerObject *router, char **fileNames, uint32_t fileCount, uint32_t requestFlags, benchFileResult *results);
+int benchCompareTimes(const void *first, const void *second);
+uint64_t benchPercentile(uint64_t *sortedTimes, uint64_t timeCount, double percentile);
+
+pid_t benchStartServer(char *sharedFolder, uint32_t maxSharedFiles, uint32_t cacheMegabytes, uint32_t serverConnections, char *port,
+                       serverOptions *options);
+int   benchWaitForServer(char *port);
+int   benchFetchStats(const char *socketPath, const char *outputPath);
@@ -0,0 +1,791 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/vfs.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <linux/magic.h>
+
+//the file and connection banks are private to server.c, include it whole so their real code is what gets timed
+#include "server.c"
+
+
+/*
+ * componentBenchmark times the hot building blocks of the server on their own, so a regression in one shows up before it is lost in
+ * the noise of an end to end run (see loadGenerator):
+ *
+ *   memoryManager   secureAllocate + secureFree, and memoryClear, per bytesize
+ *   diskFile        dfRead of one chunk cold (evicted from the page cache first), warm (in the page cache) and cached (cacheBytes),
+ *                   and dfWrite of one chunk
+ *   file bank       getFileById hits and misses against the bank size
+ *   connection bank withdrawConnection + depositConnection with 1 to 8 threads contending
+ *
+ * Every case is calibrated to run for at least COMPONENT_MIN_SAMPLE_NSECS per sample, warmed up, then sampled repeatedly. The median
+ * and median absolute deviation of the per operation time are reported, they are far less disturbed by the odd preempted sample than
+ * the mean and standard deviation. Results are printed and written as JSON.
+ *
+ * Cold reads evict each chunk with posix_fadvise before reading it, which does nothing on tmpfs, so --dir should be on a real disk.
+ *
+ * usage: ./componentBenchmark [--samples N] [--warmup N] [--dir path] [--output path]
+ */
+
+
+enum{ COMPONENT_MAX_RESULTS        = 64                          };
+enum{ COMPONENT_MIN_SAMPLE_NSECS   = 1000000                     };
+enum{ COMPONENT_MAX_ITERATIONS     = 1 << 24                     };
+enum{ COMPONENT_FILE_BYTESIZE      = 512 * FILE_CHUNK_BYTESIZE   };   //32 MB
+enum{ COMPONENT_CONNECTION_BANK    = 64                          };
+enum{ COMPONENT_FILENAME_BYTESIZE  = 32                          };
+enum{ COMPONENT_FOLDER_BYTESIZE    = 4096                        };
+enum{ COMPONENT_PATH_BYTESIZE      = COMPONENT_FOLDER_BYTESIZE + COMPONENT_FILENAME_BYTESIZE + 1 };
+
+
+typedef struct componentConfig{
+  uint32_t samples;
+  uint32_t warmup;
+  char     *dir;
+  char     *outputPath;
+}componentConfig;
+
+typedef struct componentCase{
+  const char *group;
+  const char *name;
+  uint64_t   parameter;                                        //bytesize, bank size or thread count depending on the group
+  double     (*timeSample)(void *context, uint32_t iterations);  //returns mean nanoseconds per operation over iterations
+  void       *context;
+  uint32_t   maxIterations;
+}componentCase;
+
+typedef struct componentResult{
+  const char *group;
+  const char *name;
+  uint64_t   parameter;
+  uint32_t   iterations;
+  double     median;
+  double     mad;
+  double     minimum;
+}componentResult;
+
+typedef struct sizeContext{
+  size_t bytesize;
+  void   *buffer;
+}sizeContext;
+
+typedef struct fileContext{
+  diskFileObject *file;
+  int            evictDescriptor;   //-1 unless reads are cold
+  uint32_t       nextChunk;
+  char           *buffer;
+}fileContext;
+
+typedef struct lookupContext{
+  char     **names;
+  uint32_t nameCount;
+  unsigned seed;
+  int      miss;
+}lookupContext;
+
+typedef struct contentionContext{
+  uint32_t          threads;
+  uint32_t          iterations;
+  pthread_barrier_t start;
+  pthread_mutex_t   lock;
+  uint64_t          elapsed;      //summed over the threads
+}contentionContext;
+
+
+static componentResult globalResults[COMPONENT_MAX_RESULTS];
+static uint32_t        globalResultCount = 0;
+
+
+static int      parseArguments(int argc, char *argv[], componentConfig *config);
+static int      runCase(componentConfig *config, componentCase *testCase);
+static int      compareDoubles(const void *a, const void *b);
+static uint64_t getNanoseconds(void);
+static int      benchmarkMemory(componentConfig *config);
+static int      benchmarkDiskFile(componentConfig *config, const char *folder);
+static int      benchmarkFileBank(componentConfig *config, const char *folder);
+static int      benchmarkConnectionBank(componentConfig *config);
+static int      createFile(const char *folder, const char *name, uint32_t bytesize);
+static double   timeAllocate(void *contextV, uint32_t iterations);
+static double   timeClear(void *contextV, uint32_t iterations);
+static double   timeRead(void *contextV, uint32_t iterations);
+static double   timeWrite(void *contextV, uint32_t iterations);
+static double   timeLookup(void *contextV, uint32_t iterations);
+static double   timeContention(void *contextV, uint32_t iterations);
+static void     *contend(void *contextV);
+static int      writeResults(componentConfig *config);
+
+
+
+int main(int argc, char *argv[])
+{
+  componentConfig config;
+  char            folder[COMPONENT_FOLDER_BYTESIZE];
+  int             status = 1;
+
+  if( !parseArguments(argc, argv, &config) ){
+    return 1;
+  }
+
+  if( snprintf(folder, sizeof(folder), "%s/componentBenchmark.XXXXXX", config.dir) >= (int)sizeof(folder) || mkdtemp(folder) == NULL ){
+    logEvent("Error", "Failed to create temporary folder");
+    return 1;
+  }
+
+  printf("%-16s %-24s %12s %10s %14s %12s %14s\n", "group", "case", "parameter", "iterations", "median ns/op", "MAD ns", "min ns/op");
+
+  if( benchmarkMemory(&config) && benchmarkDiskFile(&config, folder) && benchmarkFileBank(&config, folder) && benchmarkConnectionBank(&config) &&
+      writeResults(&config) ){
+    status = 0;
+  }
+
+  rmdir(folder);
+  flushLog();
+
+  return status;
+}
+
+
+
+static int parseArguments(int argc, char *argv[], componentConfig *config)
+{
+  int option = 0;
+
+  static struct option longOptions[] = {
+    { "samples", required_argument, NULL, 's' },
+    { "warmup" , required_argument, NULL, 'w' },
+    { "dir"    , required_argument, NULL, 'd' },
+    { "output" , required_argument, NULL, 'o' },
+    { NULL     , 0                , NULL, 0   }
+  };
+
+  config->samples    = 31;
+  config->warmup     = 5;
+  config->dir        = ".";
+  config->outputPath = "componentBenchmark.json";
+
+  while( (option = getopt_long(argc, argv, "s:w:d:o:", longOptions, NULL)) != -1 ){
+    switch(option){
+      case 's': config->samples    = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'w': config->warmup     = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'd': config->dir        = optarg; break;
+      case 'o': config->outputPath = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [--samples N] [--warmup N] [--dir path] [--output path]\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if(config->samples == 0){
+    logEvent("Error", "Sample count must be positive");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * runCase calibrates, warms up and samples testCase, then prints and records its result. Returns 0 on error and 1 on success
+ */
+static int runCase(componentConfig *config, componentCase *testCase)
+{
+  componentResult *result     = NULL;
+  double          *samples    = NULL;
+  double          *deviations = NULL;
+  double          perOp       = 0;
+  uint32_t        iterations  = 1;
+  uint32_t        sample      = 0;
+
+  if(globalResultCount == COMPONENT_MAX_RESULTS){
+    logEvent("Error", "Too many benchmark results");
+    return 0;
+  }
+
+  samples    = (double *)secureAllocate(config->samples * sizeof(double));
+  deviations = (double *)secureAllocate(config->samples * sizeof(double));
+  if(samples == NULL || deviations == NULL){
+    logEvent("Error", "Failed to allocate samples");
+    return 0;
+  }
+
+  //double the iterations until a sample is long enough for the clock to be irrelevant
+  while(1){
+    perOp = testCase->timeSample(testCase->context, iterations);
+    if(perOp * iterations >= COMPONENT_MIN_SAMPLE_NSECS || iterations * 2 > testCase->maxIterations){
+      break;
+    }
+    iterations *= 2;
+  }
+
+  for(sample = 0; sample != config->warmup; sample++){
+    testCase->timeSample(testCase->context, iterations);
+  }
+
+  for(sample = 0; sample != config->samples; sample++){
+    samples[sample] = testCase->timeSample(testCase->context, iterations);
+  }
+
+  qsort(samples, config->samples, sizeof(double), compareDoubles);
+
+  result             = &globalResults[globalResultCount++];
+  result->group      = testCase->group;
+  result->name       = testCase->name;
+  result->parameter  = testCase->parameter;
+  result->iterations = iterations;
+  result->median     = samples[config->samples / 2];
+  result->minimum    = samples[0];
+
+  for(sample = 0; sample != config->samples; sample++){
+    deviations[sample] = (samples[sample] > result->median) ? samples[sample] - result->median : result->median - samples[sample];
+  }
+
+  qsort(deviations, config->samples, sizeof(double), compareDoubles);
+  result->mad = deviations[config->samples / 2];
+
+  printf("%-16s %-24s %12llu %10u %14.1f %12.1f %14.1f\n", result->group, result->name, (unsigned long long)result->parameter,
+         result->iterations, result->median, result->mad, result->minimum);
+  fflush(stdout);
+
+  secureFree(&samples, config->samples * sizeof(double));
+  secureFree(&deviations, config->samples * sizeof(double));
+
+  return 1;
+}
+
+
+static int compareDoubles(const void *a, const void *b)
+{
+  double first  = *(const double *)a;
+  double second = *(const double *)b;
+
+  return (first > second) - (first < second);
+}
+
+
+static uint64_t getNanoseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+
+/****************** MEMORY MANAGER *******************/
+
+static int benchmarkMemory(componentConfig *config)
+{
+  static const size_t bytesizes[] = { 16, 256, 4096, FILE_CHUNK_BYTESIZE, 1048576 };
+  sizeContext         context;
+  componentCase       testCase;
+  uint32_t            size = 0;
+
+  for(size = 0; size != sizeof(bytesizes) / sizeof(bytesizes[0]); size++){
+    context.bytesize = bytesizes[size];
+    context.buffer   = NULL;
+
+    testCase = (componentCase){ "memoryManager", "secureAllocate+Free", bytesizes[size], timeAllocate, &context, COMPONENT_MAX_ITERATIONS };
+    if( !runCase(config, &testCase) ){
+      return 0;
+    }
+  }
+
+  for(size = 0; size != sizeof(bytesizes) / sizeof(bytesizes[0]); size++){
+    context.bytesize = bytesizes[size];
+    context.buffer   = secureAllocate(bytesizes[size]);
+    if(context.buffer == NULL){
+      logEvent("Error", "Failed to allocate buffer to clear");
+      return 0;
+    }
+
+    testCase = (componentCase){ "memoryManager", "memoryClear", bytesizes[size], timeClear, &context, COMPONENT_MAX_ITERATIONS };
+    if( !runCase(config, &testCase) ){
+      return 0;
+    }
+
+    secureFree(&context.buffer, bytesizes[size]);
+  }
+
+  return 1;
+}
+
+
+static double timeAllocate(void *contextV, uint32_t iterations)
+{
+  sizeContext *context   = (sizeContext *)contextV;
+  void        *memory    = NULL;
+  uint64_t    start      = getNanoseconds();
+  uint32_t    remaining  = iterations;
+
+  while(remaining--){
+    memory = secureAllocate(context->bytesize);
+    secureFree(&memory, context->bytesize);
+  }
+
+  return (double)(getNanoseconds() - start) / iterations;
+}
+
+
+static double timeClear(void *contextV, uint32_t iterations)
+{
+  sizeContext *context   = (sizeContext *)contextV;
+  uint64_t    start      = getNanoseconds();
+  uint32_t    remaining  = iterations;
+
+  while(remaining--){
+    memoryClear(context->buffer, context->bytesize);
+  }
+
+  return (double)(getNanoseconds() - start) / iterations;
+}
+
+
+
+/****************** DISK FILE *******************/
+
+static int benchmarkDiskFile(componentConfig *config, const char *folder)
+{
+  static char   readName[]  = "readChunks";
+  static char   writeName[] = "writeChunks";
+  char          path[COMPONENT_PATH_BYTESIZE];
+  struct statfs fileSystem;
+  fileContext   context;
+  componentCase testCase;
+  diskFileObject *readFile   = newDiskFile();
+  diskFileObject *cachedFile = newDiskFile();
+  diskFileObject *writeFile  = newDiskFile();
+  uint32_t      chunks       = COMPONENT_FILE_BYTESIZE / FILE_CHUNK_BYTESIZE;
+  int           status       = 0;
+
+  memset(&context, 0, sizeof(context));
+  context.evictDescriptor = -1;
+  context.buffer          = (char *)secureAllocate(FILE_CHUNK_BYTESIZE);
+
+  if(readFile == NULL || cachedFile == NULL || writeFile == NULL || context.buffer == NULL){
+    logEvent("Error", "Failed to allocate disk file benchmark state");
+    return 0;
+  }
+
+  if( !createFile(folder, readName, COMPONENT_FILE_BYTESIZE) || !createFile(folder, writeName, COMPONENT_FILE_BYTESIZE) ){
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", folder, readName);
+
+  if( !readFile->dfOpen(readFile, folder, readName, "r") || !cachedFile->dfOpen(cachedFile, folder, readName, "r") ||
+      !writeFile->dfOpen(writeFile, folder, writeName, "r+") ){
+    logEvent("Error", "Failed to open benchmark files");
+    goto cleanup;
+  }
+
+  if( statfs(folder, &fileSystem) == 0 && fileSystem.f_type == TMPFS_MAGIC ){
+    printf("warning: %s is on tmpfs, cold reads can't be evicted and will be as fast as warm ones\n", folder);
+  }
+
+  //cold, a second descriptor on the same file is enough to evict its pages, the page cache belongs to the inode
+  context.file            = readFile;
+  context.evictDescriptor = open(path, O_RDONLY);
+  if(context.evictDescriptor == -1 || fsync(context.evictDescriptor)){
+    logEvent("Error", "Failed to open file to evict its pages");
+    goto cleanup;
+  }
+
+  testCase = (componentCase){ "diskFile", "dfRead cold", FILE_CHUNK_BYTESIZE, timeRead, &context, chunks };
+  if( !runCase(config, &testCase) ){
+    goto cleanup;
+  }
+
+  close(context.evictDescriptor);
+  context.evictDescriptor = -1;
+
+  testCase = (componentCase){ "diskFile", "dfRead warm", FILE_CHUNK_BYTESIZE, timeRead, &context, COMPONENT_MAX_ITERATIONS };
+  if( !runCase(config, &testCase) ){
+    goto cleanup;
+  }
+
+  if( cachedFile->cacheBytes(cachedFile, COMPONENT_FILE_BYTESIZE, 0) != COMPONENT_FILE_BYTESIZE ){
+    logEvent("Error", "Failed to cache benchmark file");
+    goto cleanup;
+  }
+
+  context.file = cachedFile;
+  testCase     = (componentCase){ "diskFile", "dfRead cached", FILE_CHUNK_BYTESIZE, timeRead, &context, COMPONENT_MAX_ITERATIONS };
+  if( !runCase(config, &testCase) ){
+    goto cleanup;
+  }
+
+  context.file = writeFile;
+  testCase     = (componentCase){ "diskFile", "dfWrite", FILE_CHUNK_BYTESIZE, timeWrite, &context, COMPONENT_MAX_ITERATIONS };
+  if( !runCase(config, &testCase) ){
+    goto cleanup;
+  }
+
+  status = 1;
+
+  cleanup:
+    if(context.evictDescriptor != -1){
+      close(context.evictDescriptor);
+    }
+
+    readFile->closeTearDown(&readFile);
+    cachedFile->closeTearDown(&cachedFile);
+    writeFile->closeTearDown(&writeFile);
+    secureFree(&context.buffer, FILE_CHUNK_BYTESIZE);
+
+    snprintf(path, sizeof(path), "%s/%s", folder, readName);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", folder, writeName);
+    unlink(path);
+
+    return status;
+}
+
+
+/*
+ * createFile creates folder/name holding bytesize bytes of non zero data, returns 0 on error and 1 on success
+ */
+static int createFile(const char *folder, const char *name, uint32_t bytesize)
+{
+  char     path[COMPONENT_PATH_BYTESIZE];
+  char     block[FILE_CHUNK_BYTESIZE];
+  uint32_t bytesToWrite = 0;
+  FILE     *out         = NULL;
+
+  memset(block, 0x5a, sizeof(block));
+  snprintf(path, sizeof(path), "%s/%s", folder, name);
+
+  out = fopen(path, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to create benchmark file");
+    return 0;
+  }
+
+  for(; bytesize; bytesize -= bytesToWrite){
+    bytesToWrite = (bytesize < FILE_CHUNK_BYTESIZE) ? bytesize : FILE_CHUNK_BYTESIZE;
+    if( fwrite(block, 1, bytesToWrite, out) != bytesToWrite ){
+      logEvent("Error", "Failed to write benchmark file");
+      fclose(out);
+      return 0;
+    }
+  }
+
+  if( fclose(out) == EOF ){
+    logEvent("Error", "Failed to write benchmark file");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * timeRead reads successive chunks of the file, only the reads themselves are timed, not evicting them beforehand
+ */
+static double timeRead(void *contextV, uint32_t iterations)
+{
+  fileContext *context   = (fileContext *)contextV;
+  uint64_t    elapsed    = 0;
+  uint64_t    start      = 0;
+  uint32_t    offset     = 0;
+  uint32_t    remaining  = iterations;
+
+  while(remaining--){
+    offset            = context->nextChunk * FILE_CHUNK_BYTESIZE;
+    context->nextChunk = (context->nextChunk + 1) % (COMPONENT_FILE_BYTESIZE / FILE_CHUNK_BYTESIZE);
+
+    if(context->evictDescriptor != -1){
+      posix_fadvise(context->evictDescriptor, offset, FILE_CHUNK_BYTESIZE, POSIX_FADV_DONTNEED);
+    }
+
+    start = getNanoseconds();
+    if( !context->file->dfRead(context->file, context->buffer, FILE_CHUNK_BYTESIZE, offset) ){
+      logEvent("Error", "Failed to read chunk");
+    }
+    elapsed += getNanoseconds() - start;
+  }
+
+  return (double)elapsed / iterations;
+}
+
+
+static double timeWrite(void *contextV, uint32_t iterations)
+{
+  fileContext *context   = (fileContext *)contextV;
+  uint64_t    start      = getNanoseconds();
+  uint32_t    offset     = 0;
+  uint32_t    remaining  = iterations;
+
+  while(remaining--){
+    offset             = context->nextChunk * FILE_CHUNK_BYTESIZE;
+    context->nextChunk = (context->nextChunk + 1) % (COMPONENT_FILE_BYTESIZE / FILE_CHUNK_BYTESIZE);
+
+    if( context->file->dfWrite(context->file, context->buffer, FILE_CHUNK_BYTESIZE, offset) != FILE_CHUNK_BYTESIZE ){
+      logEvent("Error", "Failed to write chunk");
+    }
+  }
+
+  return (double)(getNanoseconds() - start) / iterations;
+}
+
+
+
+/****************** FILE BANK *******************/
+
+static int benchmarkFileBank(componentConfig *config, const char *folder)
+{
+  static const uint32_t bankSizes[] = { 16, 256, 4096 };
+  char                  path[COMPONENT_PATH_BYTESIZE];
+  struct rlimit         descriptors;
+  lookupContext         context;
+  componentCase         testCase;
+  uint32_t              bankSize  = 0;
+  uint32_t              size      = 0;
+  uint32_t              file      = 0;
+  int                   status    = 0;
+
+  //every shared file holds a descriptor open, as it does in the server
+  if( getrlimit(RLIMIT_NOFILE, &descriptors) == 0 && descriptors.rlim_cur < descriptors.rlim_max ){
+    descriptors.rlim_cur = descriptors.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &descriptors);
+    getrlimit(RLIMIT_NOFILE, &descriptors);
+  }
+
+  for(size = 0; size != sizeof(bankSizes) / sizeof(bankSizes[0]); size++){
+    bankSize = bankSizes[size];
+    if(bankSize + 64 > descriptors.rlim_cur){
+      printf("skipping a file bank of %u, only %llu descriptors are allowed\n", bankSize, (unsigned long long)descriptors.rlim_cur);
+      continue;
+    }
+
+    memset(&context, 0, sizeof(context));
+    context.nameCount     = bankSize;
+    context.seed          = 1;
+    context.names         = (char **)secureAllocate(bankSize * sizeof(char *));
+    globalMaxSharedFiles  = bankSize;
+    globalFileBank        = (diskFileObject **)secureAllocate(bankSize * sizeof(diskFileObject *));
+    if(context.names == NULL || globalFileBank == NULL){
+      logEvent("Error", "Failed to allocate file bank");
+      return 0;
+    }
+
+    initializeFileBank();
+
+    for(file = 0; file != bankSize; file++){
+      diskFileObject *sharedFile = newDiskFile();
+
+      context.names[file] = (char *)secureAllocate(COMPONENT_FILENAME_BYTESIZE);
+      if(sharedFile == NULL || context.names[file] == NULL){
+        logEvent("Error", "Failed to allocate shared file");
+        goto cleanup;
+      }
+
+      //names share a long prefix like real ones often do, so comparisons don't all stop at the first byte
+      snprintf(context.names[file], COMPONENT_FILENAME_BYTESIZE, "sharedFile%05u.dat", file);
+
+      if( !createFile(folder, context.names[file], 0) || !sharedFile->dfOpen(sharedFile, folder, context.names[file], "r") ||
+          depositFile(sharedFile) != 1 ){
+        logEvent("Error", "Failed to add shared file to the bank");
+        goto cleanup;
+      }
+    }
+
+    testCase = (componentCase){ "fileBank", "getFileById hit", bankSize, timeLookup, &context, COMPONENT_MAX_ITERATIONS };
+    if( !runCase(config, &testCase) ){
+      goto cleanup;
+    }
+
+    context.miss = 1;
+    testCase     = (componentCase){ "fileBank", "getFileById miss", bankSize, timeLookup, &context, COMPONENT_MAX_ITERATIONS };
+    if( !runCase(config, &testCase) ){
+      goto cleanup;
+    }
+
+    for(file = 0; file != bankSize; file++){
+      if(globalFileBank[file] != NULL){
+        globalFileBank[file]->closeTearDown(&globalFileBank[file]);
+      }
+
+      if(context.names[file] != NULL){
+        snprintf(path, sizeof(path), "%s/%s", folder, context.names[file]);
+        unlink(path);
+        secureFree(&context.names[file], COMPONENT_FILENAME_BYTESIZE);
+      }
+    }
+
+    secureFree(&context.names, bankSize * sizeof(char *));
+    secureFree(&globalFileBank, bankSize * sizeof(diskFileObject *));
+  }
+
+  return 1;
+
+  cleanup:
+    for(file = 0; file != bankSize; file++){
+      if(globalFileBank[file] != NULL){
+        globalFileBank[file]->closeTearDown(&globalFileBank[file]);
+      }
+
+      if(context.names[file] != NULL){
+        snprintf(path, sizeof(path), "%s/%s", folder, context.names[file]);
+        unlink(path);
+      }
+    }
+
+    return status;
+}
+
+
+/*
+ * timeLookup looks up random names in the bank, or for a miss a name of the same length that isn't there, which scans the whole bank
+ */
+static double timeLookup(void *contextV, uint32_t iterations)
+{
+  lookupContext *context  = (lookupContext *)contextV;
+  char          missing[] = "sharedFileXXXXX.dat";
+  char          *name     = NULL;
+  uint64_t      start     = getNanoseconds();
+  uint32_t      remaining = iterations;
+
+  while(remaining--){
+    name = context->miss ? missing : context->names[ (uint32_t)rand_r(&context->seed) % context->nameCount ];
+
+    if( (getFileById(name, strlen(name), NULL) == NULL) != context->miss ){
+      logEvent("Error", "Unexpected file bank lookup result");
+    }
+  }
+
+  return (double)(getNanoseconds() - start) / iterations;
+}
+
+
+
+/****************** CONNECTION BANK *******************/
+
+static int benchmarkConnectionBank(componentConfig *config)
+{
+  static const uint32_t threadCounts[] = { 1, 2, 4, 8 };
+  contentionContext     context;
+  componentCase         testCase;
+  uint32_t              threads = 0;
+
+  globalMaxConnections = COMPONENT_CONNECTION_BANK;
+  globalConnectionBank = (connectionObject **)secureAllocate(COMPONENT_CONNECTION_BANK * sizeof(connectionObject *));
+  if(globalConnectionBank == NULL || !initializeConnectionBank()){
+    logEvent("Error", "Failed to initialize connection bank");
+    return 0;
+  }
+
+  pthread_mutex_init(&context.lock, NULL);
+
+  for(threads = 0; threads != sizeof(threadCounts) / sizeof(threadCounts[0]); threads++){
+    context.threads = threadCounts[threads];
+
+    testCase = (componentCase){ "connectionBank", "withdraw+deposit", threadCounts[threads], timeContention, &context, COMPONENT_MAX_ITERATIONS };
+    if( !runCase(config, &testCase) ){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * timeContention has context->threads threads each withdraw and deposit a connection iterations times, and returns the mean time per
+ * pair as each thread sees it, which only stays flat as threads are added if the bank doesn't serialize them
+ */
+static double timeContention(void *contextV, uint32_t iterations)
+{
+  contentionContext *context = (contentionContext *)contextV;
+  pthread_t         threads[8];
+  uint32_t          thread   = 0;
+
+  context->iterations = iterations;
+  context->elapsed    = 0;
+  pthread_barrier_init(&context->start, NULL, context->threads);
+
+  for(thread = 0; thread != context->threads; thread++){
+    pthread_create(&threads[thread], NULL, contend, context);
+  }
+
+  for(thread = 0; thread != context->threads; thread++){
+    pthread_join(threads[thread], NULL);
+  }
+
+  pthread_barrier_destroy(&context->start);
+
+  return (double)context->elapsed / context->threads / iterations;
+}
+
+
+static void *contend(void *contextV)
+{
+  contentionContext *context    = (contentionContext *)contextV;
+  connectionObject  *connection = NULL;
+  uint32_t          remaining   = context->iterations;
+  uint64_t          start       = 0;
+
+  //thread creation is left out of the timing, every thread starts once they all exist
+  pthread_barrier_wait(&context->start);
+  start = getNanoseconds();
+
+  while(remaining--){
+    connection = withdrawConnection();
+    if(connection != NULL){
+      depositConnection(connection);
+    }
+  }
+
+  start = getNanoseconds() - start;
+
+  pthread_mutex_lock(&context->lock);
+  context->elapsed += start;
+  pthread_mutex_unlock(&context->lock);
+
+  return NULL;
+}
+
+
+
+/*
+ * writeResults writes every result to the output path as JSON, returns 0 on error and 1 on success
+ */
+static int writeResults(componentConfig *config)
+{
+  FILE     *out   = NULL;
+  uint32_t result = 0;
+
+  out = fopen(config->outputPath, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open output file");
+    return 0;
+  }
+
+  fprintf(out, "{\n  \"benchmark\": \"componentBenchmark\",\n  \"samples\": %u,\n  \"warmup\": %u,\n  \"results\": [\n", config->samples, config->warmup);
+
+  for(result = 0; result != globalResultCount; result++){
+    fprintf(out, "    { \"group\": \"%s\", \"case\": \"%s\", \"parameter\": %llu, \"iterations\": %u, \"medianNs\": %.1f, \"madNs\": %.1f, \"minNs\": %.1f }%s\n",
+            globalResults[result].group, globalResults[result].name, (unsigned long long)globalResults[result].parameter,
+            globalResults[result].iterations, globalResults[result].median, globalResults[result].mad, globalResults[result].minimum,
+            (result + 1 == globalResultCount) ? "" : ",");
+  }
+
+  fprintf(out, "  ]\n}\n");
+
+  if( fclose(out) == EOF ){
+    logEvent("Error", "Failed to write output file");
+    return 0;
+  }
+
+  return 1;
+}
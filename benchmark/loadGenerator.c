@@ -0,0 +1,812 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "benchClient.h"
+#include "torEmulator.h"
+#include "server.h"
+#include "router.h"
+#include "diskFile.h"
+#include "connection.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "perfCounters.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * loadGenerator is an end to end throughput and latency benchmark. It fills a temporary shared folder with files drawn from a size
+ * distribution, starts the server on it in a child process, and drives it over loopback with concurrent clients connecting with plain
+ * ipv4Connect (no Tor). Every client repeatedly opens a connection, requests a batch of random files and reads them back.
+ *
+ * With --tor the clients instead connect through the local SOCKS5 Tor emulator (see torEmulator.c) with socks5Connect, exactly as
+ * they would through Tor, so the effect of circuit setup, latency, jitter, bandwidth and failures can be measured offline.
+ *
+ * Results are printed and written as JSON so runs of different builds can be compared.
+ *
+ * usage: ./loadGenerator [--clients N] [--requests N] [--batch N] [--files N] [--sizes bytes:weight,...] [--cache-mb N]
+ *                        [--port N] [--seed N] [--output path] [--capture path] [--tor] [--tor-port N] [--tor-circuit-ms N]
+ *                        [--tor-latency-ms N] [--tor-jitter-ms N] [--tor-bandwidth-kbps N] [--tor-failure-ppm N] [--perf]
+ *                        [--stats path] [--lock-profile] [--request-costs] [--shape-kbps N] [--shape-connection-kbps N]
+ *                        [--shortest-first] [--read-ahead-kb N] [--io-threads N] [--stream-kb N]
+ *                        [--lock-cache] [--cache-arena] [--compress-cache] [--text-files] [--compress-transfers] [--verify-hashes]
+ *
+ * --capture has the server record the run for replay (see replay.c).
+ *
+ * --perf counts cycles, instructions, cache misses, context switches and page faults on the server's serving threads during the run
+ * (see perfCounters.c) and reports them per byte and per request.
+ *
+ * --stats writes the server's stats output (see metrics.c) at the end of the run to path. --lock-profile records how contended each of
+ * the server's locks was (see profiledMutex.c) into the stats, written to loadGenerator.stats unless --stats says otherwise.
+ * --request-costs likewise adds the system calls and bytes copied per request, averaged by file size (see requestCost.c).
+ *
+ * --shape-kbps and --shape-connection-kbps cap the server's egress in total and per connection (see shaper.c).
+ *
+ * --shortest-first asks the server to schedule each batch, sending its files smallest first (see REQUEST_FLAG_SCHEDULED).
+ *
+ * --read-ahead-kb has the server prefetch up to N KB past what each connection has sent, on into the batch's next file.
+ *
+ * --io-threads has N threads read the file chunks that aren't in memory while connections send (see ioPool.c).
+ *
+ * --stream-kb has the server read files of at least N KB past the page cache, with O_DIRECT where the filesystem allows it.
+ *
+ * --lock-cache has the server lock its file cache in RAM, as far as RLIMIT_MEMLOCK allows (see secureAllocateLocked). --cache-arena has it carve
+ * the cache from one arena of huge pages (see startCacheArena), the stats say which backing it got.
+ *
+ * --compress-cache has the server LZ4 compress its file cache, which needs a build with LZ4=1. The files are random bytes, which don't
+ * compress, unless --text-files fills them with log lines instead.
+ *
+ * --compress-transfers has the clients ask for compressed frames and the server zstd compress them (see transferCompression.h), which
+ * needs a build with ZSTD=1. The MB/s are then of the files as decompressed, the bytes they took on the wire are reported alongside.
+ *
+ * --verify-hashes has the server hash the files into an index beside the shared folder and the clients check every chunk against
+ * those hashes (see fileHash.h), which needs a build with BLAKE3=1. Files requested before the server got to them go unverified, the
+ * count of verified files is reported.
+ */
+
+
+enum{ BENCH_MAX_SIZE_CLASSES      = 16     };
+enum{ BENCH_FILENAME_BYTESIZE     = 32     };
+
+//the onion address the emulator maps to the benchmark server, any 16 character name will do
+static char benchOnionAddress[] = "onionbenchmarkxx.onion";
+
+
+typedef struct benchConfig{
+  uint32_t clients;
+  uint32_t requestsPerClient;
+  uint32_t batchSize;
+  uint32_t fileCount;
+  uint32_t cacheMegabytes;
+  uint32_t serverConnections;
+  uint32_t seed;
+  char     *sizes;
+  char     *port;
+  char     *outputPath;
+  char     *capturePath;
+  int               perf;
+  char              *statsPath;
+  int               lockProfile;
+  int               requestCosts;
+  uint64_t          shapeBytesPerSecond;
+  uint64_t          shapeConnectionBytesPerSecond;
+  int               shortestFirst;
+  uint32_t          readAheadBytesize;
+  uint32_t          ioThreads;
+  uint32_t          streamingBytesize;
+  int               lockCache;
+  int               cacheArena;
+  int               compressCache;
+  int               textFiles;
+  int               compressTransfers;
+  int               verifyHashes;
+  int               useTor;
+  torEmulatorConfig tor;
+  uint32_t sizeClassCount;
+  uint32_t sizeClassBytes[BENCH_MAX_SIZE_CLASSES];
+  uint32_t sizeClassWeights[BENCH_MAX_SIZE_CLASSES];
+  uint32_t totalWeight;
+}benchConfig;
+
+typedef struct benchClientThread{
+  pthread_t       thread;
+  uint32_t        clientNumber;
+  benchConfig     *config;
+  char            **fileNames;
+  benchFileResult *results;     //requestsPerClient * batchSize results for this client
+  uint32_t        failedBatches;
+}benchClientThread;
+
+
+static int      parseArguments(int argc, char *argv[], benchConfig *config);
+static int      parseSizes(benchConfig *config);
+static char     *createSharedFolder(benchConfig *config, char **fileNames);
+static void     fillText(char *block, uint32_t bytesize, unsigned *seed);
+static void     removeSharedFolder(char *sharedFolder, char **fileNames, uint32_t fileCount);
+static int      startTor(benchConfig *config);
+static int      connectClient(benchConfig *config, routerObject *router);
+static void     *runClient(void *clientV);
+static int      writeResults(benchConfig *config, benchClientThread *clients, uint64_t wallMicroseconds, perfCounts *perf);
+static void     writePerf(FILE *out, perfCounts *perf, uint64_t bytes, uint64_t requests, int json);
+
+
+
+int main(int argc, char *argv[])
+{
+  benchConfig       config;
+  serverOptions     serverOptions;
+  benchClientThread *clients      = NULL;
+  char              **fileNames   = NULL;
+  char              *sharedFolder = NULL;
+  pid_t             server        = -1;
+  perfCounterGroup  perfGroup;
+  perfCounts        perf;
+  uint32_t          client        = 0;
+  uint32_t          file          = 0;
+  uint64_t          start         = 0;
+  uint64_t          wallTime      = 0;
+  char              statsSocket[64];
+  char              hashIndex[PATH_MAX];
+  int               status        = 1;
+
+  if( !parseArguments(argc, argv, &config) ){
+    return 1;
+  }
+
+  memset(&serverOptions, 0, sizeof(serverOptions));
+
+  fileNames = (char **)secureAllocate(config.fileCount * sizeof(char *));
+  clients   = (benchClientThread *)secureAllocate(config.clients * sizeof(benchClientThread));
+  if(fileNames == NULL || clients == NULL){
+    logEvent("Error", "Failed to allocate benchmark state");
+    return 1;
+  }
+
+  sharedFolder = createSharedFolder(&config, fileNames);
+  if(sharedFolder == NULL){
+    logEvent("Error", "Failed to create the shared folder");
+    return 1;
+  }
+
+  serverOptions.capturePath              = config.capturePath;
+  serverOptions.lockProfiling            = config.lockProfile;
+  serverOptions.requestCosts             = config.requestCosts;
+  serverOptions.globalBytesPerSecond     = config.shapeBytesPerSecond;
+  serverOptions.connectionBytesPerSecond = config.shapeConnectionBytesPerSecond;
+  serverOptions.readAheadBytesize        = config.readAheadBytesize;
+  serverOptions.ioThreads                = config.ioThreads;
+  serverOptions.streamingBytesize        = config.streamingBytesize;
+  serverOptions.lockCache                = config.lockCache;
+  serverOptions.cacheArena               = config.cacheArena;
+  serverOptions.compressCache            = config.compressCache;
+  serverOptions.compressTransfers        = config.compressTransfers;
+
+  //the index goes beside the shared folder rather than in it, or the server would share it
+  snprintf(hashIndex, sizeof(hashIndex), "%s.hashes", sharedFolder);
+  if(config.verifyHashes){
+    serverOptions.hashIndexPath = hashIndex;
+  }
+
+  snprintf(statsSocket, sizeof(statsSocket), "/tmp/loadGenerator-%d.sock", (int)getpid());
+  if(config.statsPath != NULL){
+    serverOptions.metricsSocketPath = statsSocket;
+  }
+  
+  server = benchStartServer(sharedFolder, config.fileCount + 1, config.cacheMegabytes, config.serverConnections, config.port, &serverOptions);
+  if(server == -1 || !benchWaitForServer(config.port)){
+    logEvent("Error", "Failed to start the server");
+    goto cleanup;
+  }
+
+  if( config.useTor && !startTor(&config) ){
+    logEvent("Error", "Failed to start the Tor emulator");
+    goto cleanup;
+  }
+
+  //the server's main thread accepts connections and creates a thread per connection, counting it counts every serving thread
+  if( config.perf && !openPerfCounters(&perfGroup, server) ){
+    logEvent("Error", "Failed to open performance counters on the server");
+    goto cleanup;
+  }
+
+  start = getMonotonicMicroseconds();
+
+  for(client = 0; client != config.clients; client++){
+    clients[client].clientNumber = client;
+    clients[client].config       = &config;
+    clients[client].fileNames    = fileNames;
+    clients[client].results      = (benchFileResult *)secureAllocate(config.requestsPerClient * config.batchSize * sizeof(benchFileResult));
+
+    if(clients[client].results == NULL || pthread_create(&clients[client].thread, NULL, runClient, &clients[client]) != 0){
+      logEvent("Error", "Failed to start client thread");
+      goto cleanup;
+    }
+  }
+
+  for(client = 0; client != config.clients; client++){
+    pthread_join(clients[client].thread, NULL);
+  }
+
+  wallTime = getMonotonicMicroseconds() - start;
+
+  if(config.perf){
+    //serving threads only add their counts to the totals once they exit, give the last ones time to finish
+    usleep(100000);
+
+    if( !readPerfCounters(&perfGroup, &perf) ){
+      logEvent("Error", "Failed to read performance counters");
+      goto cleanup;
+    }
+
+    closePerfCounters(&perfGroup);
+  }
+
+  if( config.statsPath != NULL && !benchFetchStats(statsSocket, config.statsPath) ){
+    logEvent("Error", "Failed to fetch the server's stats");
+    goto cleanup;
+  }
+
+  if( !writeResults(&config, clients, wallTime, config.perf ? &perf : NULL) ){
+    logEvent("Error", "Failed to write results");
+    goto cleanup;
+  }
+
+  status = 0;
+
+  cleanup:
+    if(server != -1){
+      kill(server, SIGTERM);
+      waitpid(server, NULL, 0);
+    }
+
+    if(config.statsPath != NULL){
+      unlink(statsSocket);
+    }
+
+    if(config.verifyHashes){
+      unlink(hashIndex);
+    }
+
+    if(config.useTor){
+      stopTorEmulator();
+    }
+
+    removeSharedFolder(sharedFolder, fileNames, config.fileCount);
+
+    for(client = 0; clients != NULL && client != config.clients; client++){
+      if(clients[client].results != NULL){
+        secureFree(&clients[client].results, config.requestsPerClient * config.batchSize * sizeof(benchFileResult));
+      }
+    }
+
+    for(file = 0; fileNames != NULL && file != config.fileCount; file++){
+      if(fileNames[file] != NULL){
+        secureFree(&fileNames[file], BENCH_FILENAME_BYTESIZE);
+      }
+    }
+
+    if(clients != NULL){
+      secureFree(&clients, config.clients * sizeof(benchClientThread));
+    }
+
+    if(fileNames != NULL){
+      secureFree(&fileNames, config.fileCount * sizeof(char *));
+    }
+
+    //the benchmark's own allocations, the server runs in its own process
+    reportMemoryLeaks();
+    flushLog();
+    return status;
+}
+
+
+
+static int parseArguments(int argc, char *argv[], benchConfig *config)
+{
+  int option = 0;
+
+  static struct option longOptions[] = {
+    { "clients"           , required_argument, NULL, 'c' },
+    { "requests"          , required_argument, NULL, 'r' },
+    { "batch"             , required_argument, NULL, 'b' },
+    { "files"             , required_argument, NULL, 'f' },
+    { "sizes"             , required_argument, NULL, 's' },
+    { "cache-mb"          , required_argument, NULL, 'm' },
+    { "server-connections", required_argument, NULL, 'n' },
+    { "port"              , required_argument, NULL, 'p' },
+    { "seed"              , required_argument, NULL, 'S' },
+    { "output"            , required_argument, NULL, 'o' },
+    { "capture"           , required_argument, NULL, 'R' },
+    { "tor"               , no_argument      , NULL, 't' },
+    { "tor-port"          , required_argument, NULL, 'T' },
+    { "tor-circuit-ms"    , required_argument, NULL, 'C' },
+    { "tor-latency-ms"    , required_argument, NULL, 'L' },
+    { "tor-jitter-ms"     , required_argument, NULL, 'J' },
+    { "tor-bandwidth-kbps", required_argument, NULL, 'B' },
+    { "tor-failure-ppm"   , required_argument, NULL, 'F' },
+    { "perf"              , no_argument      , NULL, 'P' },
+    { "stats"             , required_argument, NULL, 'x' },
+    { "lock-profile"      , no_argument      , NULL, 'l' },
+    { "request-costs"     , no_argument      , NULL, 'q' },
+    { "shape-kbps"        , required_argument, NULL, 'k' },
+    { "shape-connection-kbps", required_argument, NULL, 'K' },
+    { "shortest-first"    , no_argument      , NULL, 'O' },
+    { "read-ahead-kb"     , required_argument, NULL, 'A' },
+    { "io-threads"        , required_argument, NULL, 'I' },
+    { "stream-kb"         , required_argument, NULL, 'D' },
+    { "lock-cache"        , no_argument      , NULL, 'M' },
+    { "cache-arena"       , no_argument      , NULL, 'H' },
+    { "compress-cache"    , no_argument      , NULL, 'Z' },
+    { "text-files"        , no_argument      , NULL, 'E' },
+    { "compress-transfers", no_argument      , NULL, 'W' },
+    { "verify-hashes"     , no_argument      , NULL, 'V' },
+    { NULL                , 0                , NULL, 0   }
+  };
+
+  memset(config, 0, sizeof(*config));
+
+  config->clients           = 16;
+  config->requestsPerClient = 50;
+  config->batchSize         = 4;
+  config->fileCount         = 64;
+  config->cacheMegabytes    = 64;
+  config->serverConnections = 64;
+  config->seed              = 1;
+  config->sizes             = "4096:60,65536:30,1048576:9,16777216:1";
+  config->port              = "48123";
+  config->outputPath        = "loadGenerator.json";
+  config->tor.listenPort    = "48124";
+
+  while( (option = getopt_long(argc, argv, "c:r:b:f:s:m:n:p:S:o:R:tT:C:L:J:B:F:Px:lqk:K:OA:I:D:MHZEWV", longOptions, NULL)) != -1 ){
+    switch(option){
+      case 'c': config->clients           = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'r': config->requestsPerClient = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'b': config->batchSize         = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'f': config->fileCount         = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'm': config->cacheMegabytes    = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'n': config->serverConnections = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'S': config->seed              = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 's': config->sizes             = optarg; break;
+      case 'p': config->port              = optarg; break;
+      case 'o': config->outputPath        = optarg; break;
+      case 'R': config->capturePath       = optarg; break;
+      case 'P': config->perf              = 1; break;
+      case 'x': config->statsPath         = optarg; break;
+      case 'l': config->lockProfile       = 1; break;
+      case 'q': config->requestCosts      = 1; break;
+      case 'k': config->shapeBytesPerSecond           = strtoull(optarg, NULL, 10) * 1000 / 8; break;
+      case 'K': config->shapeConnectionBytesPerSecond = strtoull(optarg, NULL, 10) * 1000 / 8; break;
+      case 'O': config->shortestFirst     = 1; break;
+      case 'A': config->readAheadBytesize = (uint32_t)strtoul(optarg, NULL, 10) * 1024; break;
+      case 'I': config->ioThreads         = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'D': config->streamingBytesize = (uint32_t)strtoul(optarg, NULL, 10) * 1024; break;
+      case 'M': config->lockCache         = 1; break;
+      case 'H': config->cacheArena        = 1; break;
+      case 'Z': config->compressCache     = 1; break;
+      case 'E': config->textFiles         = 1; break;
+      case 'W': config->compressTransfers = 1; break;
+      case 'V': config->verifyHashes      = 1; break;
+      //any of the emulator settings implies --tor
+      case 't': config->useTor = 1; break;
+      case 'T': config->useTor = 1; config->tor.listenPort               = optarg; break;
+      case 'C': config->useTor = 1; config->tor.circuitSetupMicroseconds = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'L': config->useTor = 1; config->tor.latencyMicroseconds      = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'J': config->useTor = 1; config->tor.jitterMicroseconds       = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'B': config->useTor = 1; config->tor.bytesPerSecond           = (uint32_t)strtoul(optarg, NULL, 10) * 1000 / 8; break;
+      case 'F': config->useTor = 1; config->tor.failurePerMillion        = (uint32_t)strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [--clients N] [--requests N] [--batch N] [--files N] [--sizes bytes:weight,...] [--cache-mb N] "
+                        "[--server-connections N] [--port N] [--seed N] [--output path] [--capture path] [--tor] [--tor-port N] [--tor-circuit-ms N] "
+                        "[--tor-latency-ms N] [--tor-jitter-ms N] [--tor-bandwidth-kbps N] [--tor-failure-ppm N] [--perf] [--stats path] [--lock-profile] [--request-costs] "
+                        "[--shape-kbps N] [--shape-connection-kbps N] [--shortest-first] [--read-ahead-kb N] [--io-threads N] [--stream-kb N] [--lock-cache] [--cache-arena] [--compress-cache] [--text-files] "
+                        "[--compress-transfers] [--verify-hashes]\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if(config->clients == 0 || config->requestsPerClient == 0 || config->batchSize == 0 || config->fileCount == 0 || config->serverConnections == 0){
+    logEvent("Error", "Client, request, batch, file and connection counts must be positive");
+    return 0;
+  }
+
+  if( (config->lockProfile || config->requestCosts) && config->statsPath == NULL){
+    config->statsPath = "loadGenerator.stats";
+  }
+
+  return parseSizes(config);
+}
+
+
+/*
+ * parseSizes parses the size distribution, a comma separated list of bytesize:weight pairs, returns 0 on error and 1 on success
+ */
+static int parseSizes(benchConfig *config)
+{
+  char          *cursor = config->sizes;
+  char          *end    = NULL;
+  unsigned long bytes   = 0;
+  unsigned long weight  = 0;
+
+  while(*cursor){
+    if(config->sizeClassCount == BENCH_MAX_SIZE_CLASSES){
+      logEvent("Error", "Too many size classes");
+      return 0;
+    }
+
+    bytes = strtoul(cursor, &end, 10);
+    if(end == cursor || *end != ':' || bytes == 0 || bytes > UINT32_MAX){
+      logEvent("Error", "Sizes must be a comma separated list of bytesize:weight");
+      return 0;
+    }
+
+    cursor = end + 1;
+    weight = strtoul(cursor, &end, 10);
+    if(end == cursor || (*end != ',' && *end != '\0') || weight == 0){
+      logEvent("Error", "Sizes must be a comma separated list of bytesize:weight");
+      return 0;
+    }
+
+    config->sizeClassBytes[config->sizeClassCount]   = (uint32_t)bytes;
+    config->sizeClassWeights[config->sizeClassCount] = (uint32_t)weight;
+    config->totalWeight                             += (uint32_t)weight;
+    config->sizeClassCount++;
+
+    cursor = (*end == ',') ? end + 1 : end;
+  }
+
+  if(config->sizeClassCount == 0){
+    logEvent("Error", "At least one size class is required");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * fillText fills block with server log lines, which compress about as well as the text, logs and JSON people share
+ */
+static void fillText(char *block, uint32_t bytesize, unsigned *seed)
+{
+  static const char *levels[]  = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+  static const char *actions[] = { "served", "looked up", "queued", "cached", "dropped connection for" };
+  char               line[160];
+  uint32_t           written   = 0;
+  uint32_t           length    = 0;
+
+  while(written < bytesize){
+    length = (uint32_t)snprintf(line, sizeof(line), "2026-%02u-%02uT%02u:%02u:%02u.%03u %-5s request %u %s file%05u in %u us\n",
+                                rand_r(seed) % 12 + 1, rand_r(seed) % 28 + 1, rand_r(seed) % 24, rand_r(seed) % 60, rand_r(seed) % 60,
+                                rand_r(seed) % 1000, levels[rand_r(seed) % 6], rand_r(seed) % 100000, actions[rand_r(seed) % 5],
+                                rand_r(seed) % 1000, rand_r(seed) % 20000);
+
+    length = (length < bytesize - written) ? length : bytesize - written;
+    memcpy(&block[written], line, length);
+    written += length;
+  }
+}
+
+
+/*
+ * createSharedFolder creates a temporary folder holding fileCount files with bytesizes drawn from the size distribution, and fills
+ * in their names. Returns the folder path on success and NULL on error
+ */
+static char *createSharedFolder(benchConfig *config, char **fileNames)
+{
+  static char folderTemplate[] = "/tmp/onionGetBench.XXXXXX";
+  char        *sharedFolder    = NULL;
+  char        path[sizeof(folderTemplate) + BENCH_FILENAME_BYTESIZE + 1];
+  char        block[FILE_CHUNK_BYTESIZE];
+  uint32_t    file             = 0;
+  uint32_t    pick             = 0;
+  uint32_t    sizeClass        = 0;
+  uint32_t    bytesRemaining   = 0;
+  uint32_t    bytesToWrite     = 0;
+  uint32_t    byte             = 0;
+  unsigned    seed             = config->seed;
+  FILE        *out             = NULL;
+
+  sharedFolder = mkdtemp(folderTemplate);
+  if(sharedFolder == NULL){
+    logEvent("Error", "Failed to create temporary folder");
+    return NULL;
+  }
+
+  //not all zero, so later compression of the cache or wire doesn't flatter the numbers
+  for(byte = 0; byte != FILE_CHUNK_BYTESIZE; byte++){
+    block[byte] = (char)rand_r(&seed);
+  }
+
+  if(config->textFiles){
+    fillText(block, FILE_CHUNK_BYTESIZE, &seed);
+  }
+
+  for(file = 0; file != config->fileCount; file++){
+    fileNames[file] = (char *)secureAllocate(BENCH_FILENAME_BYTESIZE);
+    if(fileNames[file] == NULL){
+      logEvent("Error", "Failed to allocate file name");
+      return NULL;
+    }
+
+    snprintf(fileNames[file], BENCH_FILENAME_BYTESIZE, "file%05u", file);
+    snprintf(path, sizeof(path), "%s/%s", sharedFolder, fileNames[file]);
+
+    pick = (uint32_t)rand_r(&seed) % config->totalWeight;
+    for(sizeClass = 0; pick >= config->sizeClassWeights[sizeClass]; sizeClass++){
+      pick -= config->sizeClassWeights[sizeClass];
+    }
+
+    out = fopen(path, "w");
+    if(out == NULL){
+      logEvent("Error", "Failed to create shared file");
+      return NULL;
+    }
+
+    for(bytesRemaining = config->sizeClassBytes[sizeClass]; bytesRemaining; bytesRemaining -= bytesToWrite){
+      bytesToWrite = (bytesRemaining < FILE_CHUNK_BYTESIZE) ? bytesRemaining : FILE_CHUNK_BYTESIZE;
+      if( fwrite(block, 1, bytesToWrite, out) != bytesToWrite ){
+        logEvent("Error", "Failed to write shared file");
+        fclose(out);
+        return NULL;
+      }
+    }
+
+    fclose(out);
+  }
+
+  return sharedFolder;
+}
+
+
+static void removeSharedFolder(char *sharedFolder, char **fileNames, uint32_t fileCount)
+{
+  char     path[4096];
+  uint32_t file = 0;
+
+  if(sharedFolder == NULL || fileNames == NULL){
+    return;
+  }
+
+  for(file = 0; file != fileCount && fileNames[file] != NULL; file++){
+    snprintf(path, sizeof(path), "%s/%s", sharedFolder, fileNames[file]);
+    unlink(path);
+  }
+
+  rmdir(sharedFolder);
+}
+
+
+/*
+ * startTor starts the Tor emulator in this process with the benchmark onion address mapped to the server, returns 0 on error and 1
+ * on success
+ */
+static int startTor(benchConfig *config)
+{
+  char mapping[sizeof(benchOnionAddress) + 32];
+
+  snprintf(mapping, sizeof(mapping), "%s=127.0.0.1:%s", benchOnionAddress, config->port);
+
+  //the emulator is listening once startTorEmulator returns
+  return addTorEmulatorMapping(&config->tor, mapping) && startTorEmulator(&config->tor);
+}
+
+
+static void *runClient(void *clientV)
+{
+  benchClientThread *client    = (benchClientThread *)clientV;
+  benchConfig       *config    = client->config;
+  routerObject      *router    = NULL;
+  char              **batch    = NULL;
+  uint32_t          flags      = 0;
+  uint32_t          request    = 0;
+  uint32_t          file       = 0;
+  unsigned          seed       = config->seed * 7919 + client->clientNumber;
+
+  batch = (char **)secureAllocate(config->batchSize * sizeof(char *));
+  if(batch == NULL){
+    logEvent("Error", "Failed to allocate batch");
+    client->failedBatches = config->requestsPerClient;
+    return NULL;
+  }
+
+  flags  = config->shortestFirst ? REQUEST_FLAG_SCHEDULED : 0;
+  flags |= config->compressTransfers ? REQUEST_FLAG_COMPRESSED : 0;
+  flags |= config->verifyHashes ? REQUEST_FLAG_HASHES : 0;
+
+  for(request = 0; request != config->requestsPerClient; request++){
+    for(file = 0; file != config->batchSize; file++){
+      batch[file] = client->fileNames[ (uint32_t)rand_r(&seed) % config->fileCount ];
+      client->results[request * config->batchSize + file].failed = 1;
+    }
+
+    router = newRouter();
+    if(router == NULL){
+      client->failedBatches++;
+      continue;
+    }
+
+    if( !connectClient(config, router) || !benchFetchBatch(router, batch, config->batchSize, flags, &client->results[request * config->batchSize]) ){
+      client->failedBatches++;
+    }
+
+    router->destroyRouter(&router);
+  }
+
+  secureFree(&batch, config->batchSize * sizeof(char *));
+
+  return NULL;
+}
+
+
+/*
+ * connectClient connects router to the server, directly or through the Tor emulator, returns 0 on error and 1 on success
+ */
+static int connectClient(benchConfig *config, routerObject *router)
+{
+  if( !config->useTor ){
+    return router->ipv4Connect(router, "127.0.0.1", config->port);
+  }
+
+  if( !router->ipv4Connect(router, "127.0.0.1", config->tor.listenPort) ){
+    return 0;
+  }
+
+  return router->socks5Connect(router, benchOnionAddress, ONION_ADDRESS_BYTESIZE, (uint16_t)strtoul(config->port, NULL, 10));
+}
+
+
+/*
+ * writeResults prints a summary and writes the JSON results to the output path, returns 0 on error and 1 on success
+ */
+static int writeResults(benchConfig *config, benchClientThread *clients, uint64_t wallMicroseconds, perfCounts *perf)
+{
+  uint64_t  resultCount     = (uint64_t)config->clients * config->requestsPerClient * config->batchSize;
+  uint64_t  *firstByteTimes = NULL;
+  uint64_t  *completeTimes  = NULL;
+  uint64_t  completed       = 0;
+  uint64_t  bytes           = 0;
+  uint64_t  wireBytes       = 0;
+  uint64_t  verified        = 0;
+  uint64_t  completeTotal   = 0;
+  uint64_t  failedBatches   = 0;
+  uint64_t  result          = 0;
+  uint32_t  client          = 0;
+  double    seconds         = wallMicroseconds / 1000000.0;
+  FILE      *out            = NULL;
+  benchFileResult *fileResult = NULL;
+
+  firstByteTimes = (uint64_t *)secureAllocate(resultCount * sizeof(uint64_t));
+  completeTimes  = (uint64_t *)secureAllocate(resultCount * sizeof(uint64_t));
+  if(firstByteTimes == NULL || completeTimes == NULL){
+    logEvent("Error", "Failed to allocate result arrays");
+    return 0;
+  }
+
+  for(client = 0; client != config->clients; client++){
+    failedBatches += clients[client].failedBatches;
+
+    for(result = 0; result != (uint64_t)config->requestsPerClient * config->batchSize; result++){
+      fileResult = &clients[client].results[result];
+      if(fileResult->failed){
+        continue;
+      }
+
+      firstByteTimes[completed] = fileResult->timeToFirstByte;
+      completeTimes[completed]  = fileResult->completionTime;
+      completeTotal            += fileResult->completionTime;
+      bytes                    += fileResult->bytesize;
+      wireBytes                += fileResult->wireBytesize;
+      verified                 += fileResult->verified;
+      completed++;
+    }
+  }
+
+  qsort(firstByteTimes, completed, sizeof(uint64_t), benchCompareTimes);
+  qsort(completeTimes, completed, sizeof(uint64_t), benchCompareTimes);
+
+  printf("%llu files, %.1f MB in %.3f s: %.2f MB/s, %.1f requests/s, %llu failed batches\n", (unsigned long long)completed, bytes / 1e6, seconds,
+         bytes / 1e6 / seconds, completed / seconds, (unsigned long long)failedBatches);
+  printf("time to first byte us  p50 %llu  p99 %llu  p999 %llu\n", (unsigned long long)benchPercentile(firstByteTimes, completed, 50),
+         (unsigned long long)benchPercentile(firstByteTimes, completed, 99), (unsigned long long)benchPercentile(firstByteTimes, completed, 99.9));
+  printf("completion time us     p50 %llu  p99 %llu  p999 %llu  mean %llu\n", (unsigned long long)benchPercentile(completeTimes, completed, 50),
+         (unsigned long long)benchPercentile(completeTimes, completed, 99), (unsigned long long)benchPercentile(completeTimes, completed, 99.9),
+         (unsigned long long)(completed ? completeTotal / completed : 0));
+  if(config->compressTransfers){
+    printf("on the wire %.1f MB: %.2f MB/s, %.2fx compression\n", wireBytes / 1e6, wireBytes / 1e6 / seconds, wireBytes ? (double)bytes / wireBytes : 0);
+  }
+  if(config->verifyHashes){
+    printf("verified %llu of %llu files against the server's hashes\n", (unsigned long long)verified, (unsigned long long)completed);
+  }
+
+  if(perf != NULL){
+    writePerf(stdout, perf, bytes, completed, 0);
+  }
+
+  out = fopen(config->outputPath, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open output file");
+    return 0;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"benchmark\": \"loadGenerator\",\n");
+  fprintf(out, "  \"clients\": %u,\n  \"requestsPerClient\": %u,\n  \"batchSize\": %u,\n  \"files\": %u,\n  \"sizes\": \"%s\",\n  \"cacheMegabytes\": %u,\n",
+          config->clients, config->requestsPerClient, config->batchSize, config->fileCount, config->sizes, config->cacheMegabytes);
+  fprintf(out, "  \"shortestFirst\": %s,\n", config->shortestFirst ? "true" : "false");
+  fprintf(out, "  \"tor\": %s,\n", config->useTor ? "true" : "false");
+  if(config->useTor){
+    fprintf(out, "  \"torCircuitMicroseconds\": %u,\n  \"torLatencyMicroseconds\": %u,\n  \"torJitterMicroseconds\": %u,\n"
+                 "  \"torBytesPerSecond\": %u,\n  \"torFailurePerMillion\": %u,\n", config->tor.circuitSetupMicroseconds,
+            config->tor.latencyMicroseconds, config->tor.jitterMicroseconds, config->tor.bytesPerSecond, config->tor.failurePerMillion);
+  }
+  fprintf(out, "  \"wallSeconds\": %.6f,\n  \"filesCompleted\": %llu,\n  \"failedBatches\": %llu,\n  \"bytes\": %llu,\n", seconds,
+          (unsigned long long)completed, (unsigned long long)failedBatches, (unsigned long long)bytes);
+  fprintf(out, "  \"megabytesPerSecond\": %.3f,\n  \"requestsPerSecond\": %.3f,\n", bytes / 1e6 / seconds, completed / seconds);
+  fprintf(out, "  \"compressTransfers\": %s,\n  \"wireBytes\": %llu,\n", config->compressTransfers ? "true" : "false", (unsigned long long)wireBytes);
+  fprintf(out, "  \"verifyHashes\": %s,\n  \"filesVerified\": %llu,\n", config->verifyHashes ? "true" : "false", (unsigned long long)verified);
+  fprintf(out, "  \"timeToFirstByteMicroseconds\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu },\n",
+          (unsigned long long)benchPercentile(firstByteTimes, completed, 50), (unsigned long long)benchPercentile(firstByteTimes, completed, 99),
+          (unsigned long long)benchPercentile(firstByteTimes, completed, 99.9), (unsigned long long)benchPercentile(firstByteTimes, completed, 100));
+  fprintf(out, "  \"completionMicroseconds\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %llu }%s\n",
+          (unsigned long long)benchPercentile(completeTimes, completed, 50), (unsigned long long)benchPercentile(completeTimes, completed, 99),
+          (unsigned long long)benchPercentile(completeTimes, completed, 99.9), (unsigned long long)benchPercentile(completeTimes, completed, 100),
+          (unsigned long long)(completed ? completeTotal / completed : 0), (perf != NULL) ? "," : "");
+  if(perf != NULL){
+    writePerf(out, perf, bytes, completed, 1);
+  }
+  fprintf(out, "}\n");
+
+  fclose(out);
+
+  secureFree(&firstByteTimes, resultCount * sizeof(uint64_t));
+  secureFree(&completeTimes, resultCount * sizeof(uint64_t));
+
+  return 1;
+}
+
+
+/*
+ * writePerf writes the counters and what they cost per byte and per request, as a line of text or as the "perf" JSON member.
+ * Counters the machine doesn't have are left out
+ */
+static void writePerf(FILE *out, perfCounts *perf, uint64_t bytes, uint64_t requests, int json)
+{
+  int counter = 0;
+
+  fprintf(out, json ? "  \"perf\": {" : "perf");
+
+  for(counter = 0; counter != PERF_COUNTER_COUNT; counter++){
+    if(perf->available[counter]){
+      fprintf(out, json ? " \"%s\": %llu," : "  %s %llu", perfCounterName(counter), (unsigned long long)perf->values[counter]);
+    }
+  }
+
+  if(perf->available[PERF_COUNTER_CYCLES] && bytes){
+    fprintf(out, json ? " \"cycles_per_byte\": %.4f," : "  cycles/byte %.4f", (double)perf->values[PERF_COUNTER_CYCLES] / bytes);
+  }
+
+  if(perf->available[PERF_COUNTER_CYCLES] && perf->available[PERF_COUNTER_INSTRUCTIONS] && perf->values[PERF_COUNTER_CYCLES]){
+    fprintf(out, json ? " \"instructions_per_cycle\": %.4f," : "  instructions/cycle %.4f",
+            (double)perf->values[PERF_COUNTER_INSTRUCTIONS] / perf->values[PERF_COUNTER_CYCLES]);
+  }
+
+  for(counter = PERF_COUNTER_CACHE_MISSES; counter != PERF_COUNTER_COUNT && requests; counter++){
+    if(perf->available[counter]){
+      fprintf(out, json ? " \"%s_per_request\": %.4f," : "  %s/request %.4f", perfCounterName(counter), (double)perf->values[counter] / requests);
+    }
+  }
+
+  //every JSON member above ends in a comma, close with the request count so the object stays valid whatever was available
+  fprintf(out, json ? " \"requests\": %llu }\n" : "  over %llu requests\n", (unsigned long long)requests);
+}
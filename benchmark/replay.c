@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "benchClient.h"
+#include "capture.h"
+#include "server.h"
+#include "router.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * replay re-issues the connections in a capture file (see capture.h, recorded with serverOptions.capturePath or loadGenerator
+ * --capture) against a server, each at its recorded arrival time divided by --speed, and reports throughput and latency. Replay is open
+ * loop like the real traffic was: a connection starts when it is due whether or not earlier ones have finished, and how late the
+ * workers were in starting them is reported so a replay that couldn't keep up is obvious.
+ *
+ * By default a server is started on a temporary folder holding a file of the recorded bytesize for every file that was found in the
+ * capture, contents are never captured so they are synthesized. With --external the capture is replayed against a server already
+ * listening on 127.0.0.1:--port instead, --populate writes the files for such a server to a folder and exits.
+ *
+ * usage: ./replay --capture path [--speed F] [--workers N] [--port N] [--cache-mb N] [--server-connections N] [--external]
+ *                 [--populate folder] [--output path]
+ */
+
+
+enum{ REPLAY_INITIAL_CONNECTIONS = 1024 };
+enum{ REPLAY_MAX_WORKERS         = 1024 };
+
+
+typedef struct replayConfig{
+  char     *capturePath;
+  char     *port;
+  char     *outputPath;
+  char     *populateFolder;
+  double   speed;                //0 replays every connection as soon as a worker is free
+  uint32_t workers;
+  uint32_t cacheMegabytes;
+  uint32_t serverConnections;
+  int      external;
+}replayConfig;
+
+typedef struct replayConnection{
+  capturedConnection captured;
+  benchFileResult    *results;
+  uint64_t           lateness;     //microseconds between when the connection was due and when it started
+  int                failed;
+}replayConnection;
+
+typedef struct replayState{
+  replayConfig     *config;
+  replayConnection *connections;
+  uint64_t         connectionCount;
+  atomic_ullong    nextConnection;
+  uint64_t         start;
+}replayState;
+
+
+static int      parseArguments(int argc, char *argv[], replayConfig *config);
+static int      loadCapture(replayState *state);
+static int      populateFolder(replayState *state, const char *folder, uint32_t *fileCount);
+static int      safeFilename(const char *name);
+static void     removeFolder(replayState *state, char *folder);
+static void     *runWorker(void *stateV);
+static int      writeResults(replayState *state, uint64_t wallMicroseconds);
+
+
+
+int main(int argc, char *argv[])
+{
+  static char      folderTemplate[] = "/tmp/onionGetReplay.XXXXXX";
+  replayConfig     config;
+  replayState      state;
+  serverOptions    options;
+  pthread_t        *workers        = NULL;
+  char             *sharedFolder   = NULL;
+  pid_t            server          = -1;
+  uint32_t         fileCount       = 0;
+  uint32_t         worker          = 0;
+  uint64_t         wallTime        = 0;
+  int              status          = 1;
+
+  if( !parseArguments(argc, argv, &config) ){
+    return 1;
+  }
+
+  memset(&state, 0, sizeof(state));
+  memset(&options, 0, sizeof(options));
+  state.config = &config;
+
+  if( !loadCapture(&state) ){
+    logEvent("Error", "Failed to load capture");
+    return 1;
+  }
+
+  if(config.populateFolder != NULL){
+    status = !populateFolder(&state, config.populateFolder, &fileCount);
+    printf("wrote %u files to %s\n", fileCount, config.populateFolder);
+    flushLog();
+    return status;
+  }
+
+  if( !config.external ){
+    sharedFolder = mkdtemp(folderTemplate);
+    if(sharedFolder == NULL || !populateFolder(&state, sharedFolder, &fileCount)){
+      logEvent("Error", "Failed to create the shared folder");
+      goto cleanup;
+    }
+
+    server = benchStartServer(sharedFolder, fileCount + 1, config.cacheMegabytes, config.serverConnections, config.port, &options);
+    if(server == -1 || !benchWaitForServer(config.port)){
+      logEvent("Error", "Failed to start the server");
+      goto cleanup;
+    }
+  }
+
+  workers = (pthread_t *)secureAllocate(config.workers * sizeof(pthread_t));
+  if(workers == NULL){
+    logEvent("Error", "Failed to allocate workers");
+    goto cleanup;
+  }
+
+  state.start = getMonotonicMicroseconds();
+
+  for(worker = 0; worker != config.workers; worker++){
+    if( pthread_create(&workers[worker], NULL, runWorker, &state) != 0 ){
+      logEvent("Error", "Failed to start worker thread");
+      break;
+    }
+  }
+
+  while(worker--){
+    pthread_join(workers[worker], NULL);
+  }
+
+  wallTime = getMonotonicMicroseconds() - state.start;
+
+  if( writeResults(&state, wallTime) ){
+    status = 0;
+  }
+
+  cleanup:
+    if(server != -1){
+      kill(server, SIGTERM);
+      waitpid(server, NULL, 0);
+    }
+
+    removeFolder(&state, sharedFolder);
+    flushLog();
+    return status;
+}
+
+
+
+static int parseArguments(int argc, char *argv[], replayConfig *config)
+{
+  int option = 0;
+
+  static struct option longOptions[] = {
+    { "capture"           , required_argument, NULL, 'c' },
+    { "speed"             , required_argument, NULL, 's' },
+    { "workers"           , required_argument, NULL, 'w' },
+    { "port"              , required_argument, NULL, 'p' },
+    { "cache-mb"          , required_argument, NULL, 'm' },
+    { "server-connections", required_argument, NULL, 'n' },
+    { "external"          , no_argument      , NULL, 'e' },
+    { "populate"          , required_argument, NULL, 'P' },
+    { "output"            , required_argument, NULL, 'o' },
+    { NULL                , 0                , NULL, 0   }
+  };
+
+  memset(config, 0, sizeof(*config));
+
+  config->speed             = 1;
+  config->workers           = 64;
+  config->port              = "48123";
+  config->cacheMegabytes    = 64;
+  config->serverConnections = 64;
+  config->outputPath        = "replay.json";
+
+  while( (option = getopt_long(argc, argv, "c:s:w:p:m:n:eP:o:", longOptions, NULL)) != -1 ){
+    switch(option){
+      case 'c': config->capturePath       = optarg; break;
+      case 's': config->speed             = strtod(optarg, NULL); break;
+      case 'w': config->workers           = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'p': config->port              = optarg; break;
+      case 'm': config->cacheMegabytes    = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'n': config->serverConnections = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'e': config->external          = 1; break;
+      case 'P': config->populateFolder    = optarg; break;
+      case 'o': config->outputPath        = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s --capture path [--speed F] [--workers N] [--port N] [--cache-mb N] [--server-connections N] [--external] "
+                        "[--populate folder] [--output path]\n", argv[0]);
+        return 0;
+    }
+  }
+
+  if(config->capturePath == NULL){
+    logEvent("Error", "A capture file is required");
+    return 0;
+  }
+
+  if(config->speed < 0 || config->workers == 0 || config->workers > REPLAY_MAX_WORKERS || config->serverConnections == 0){
+    logEvent("Error", "Speed can't be negative, and worker and connection counts must be positive");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * loadCapture reads every connection that requested at least one file from the capture, returns 0 on error and 1 on success
+ */
+static int loadCapture(replayState *state)
+{
+  FILE               *in           = NULL;
+  replayConnection   *grown        = NULL;
+  capturedConnection captured;
+  uint64_t           captureStart  = 0;
+  uint64_t           capacity      = REPLAY_INITIAL_CONNECTIONS;
+  int                readStatus    = 0;
+
+  in = openCapture(state->config->capturePath, &captureStart);
+  if(in == NULL){
+    return 0;
+  }
+
+  state->connections = (replayConnection *)secureAllocate(capacity * sizeof(replayConnection));
+  if(state->connections == NULL){
+    logEvent("Error", "Failed to allocate connections");
+    fclose(in);
+    return 0;
+  }
+
+  while( (readStatus = readCapturedConnection(in, &captured)) == 1 ){
+    //connections that never got as far as naming a file (port probes, bad requests) have nothing to replay
+    if(captured.fileCount == 0){
+      continue;
+    }
+
+    if(state->connectionCount == capacity){
+      grown = (replayConnection *)secureAllocate(2 * capacity * sizeof(replayConnection));
+      if(grown == NULL){
+        logEvent("Error", "Failed to allocate connections");
+        fclose(in);
+        return 0;
+      }
+
+      memcpy(grown, state->connections, capacity * sizeof(replayConnection));
+      secureFree(&state->connections, capacity * sizeof(replayConnection));
+      state->connections = grown;
+      capacity          *= 2;
+    }
+
+    state->connections[state->connectionCount].captured = captured;
+    state->connections[state->connectionCount].results  = (benchFileResult *)secureAllocate(captured.fileCount * sizeof(benchFileResult));
+    if(state->connections[state->connectionCount].results == NULL){
+      logEvent("Error", "Failed to allocate results");
+      fclose(in);
+      return 0;
+    }
+
+    state->connectionCount++;
+  }
+
+  fclose(in);
+
+  if(readStatus == -1){
+    return 0;
+  }
+
+  printf("loaded %llu connections from %s\n", (unsigned long long)state->connectionCount, state->config->capturePath);
+
+  return 1;
+}
+
+
+/*
+ * populateFolder creates every file the capture found, at its recorded bytesize, in folder and counts them. Returns 0 on error and 1
+ * on success
+ */
+static int populateFolder(replayState *state, const char *folder, uint32_t *fileCount)
+{
+  char         path[4096];
+  char         block[FILE_CHUNK_BYTESIZE];
+  capturedFile *file          = NULL;
+  uint64_t     connection     = 0;
+  uint32_t     fileNumber     = 0;
+  uint32_t     bytesRemaining = 0;
+  uint32_t     bytesToWrite   = 0;
+  FILE         *out           = NULL;
+
+  memset(block, 0x5a, sizeof(block));
+  *fileCount = 0;
+
+  for(connection = 0; connection != state->connectionCount; connection++){
+    for(fileNumber = 0; fileNumber != state->connections[connection].captured.fileCount; fileNumber++){
+      file = &state->connections[connection].captured.files[fileNumber];
+
+      //names in a capture come from clients, never let one escape the folder
+      if( !file->found || !safeFilename(file->name) ){
+        continue;
+      }
+
+      snprintf(path, sizeof(path), "%s/%s", folder, file->name);
+
+      if( access(path, F_OK) == 0 ){
+        continue;
+      }
+
+      out = fopen(path, "w");
+      if(out == NULL){
+        logEvent("Error", "Failed to create replayed file");
+        return 0;
+      }
+
+      for(bytesRemaining = file->bytesize; bytesRemaining; bytesRemaining -= bytesToWrite){
+        bytesToWrite = (bytesRemaining < FILE_CHUNK_BYTESIZE) ? bytesRemaining : FILE_CHUNK_BYTESIZE;
+        if( fwrite(block, 1, bytesToWrite, out) != bytesToWrite ){
+          logEvent("Error", "Failed to write replayed file");
+          fclose(out);
+          return 0;
+        }
+      }
+
+      if( fclose(out) == EOF ){
+        logEvent("Error", "Failed to write replayed file");
+        return 0;
+      }
+
+      (*fileCount)++;
+    }
+  }
+
+  return 1;
+}
+
+
+static int safeFilename(const char *name)
+{
+  return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+
+static void removeFolder(replayState *state, char *folder)
+{
+  char     path[4096];
+  uint64_t connection = 0;
+  uint32_t file       = 0;
+
+  if(folder == NULL){
+    return;
+  }
+
+  for(connection = 0; connection != state->connectionCount; connection++){
+    for(file = 0; file != state->connections[connection].captured.fileCount; file++){
+      if( safeFilename(state->connections[connection].captured.files[file].name) ){
+        snprintf(path, sizeof(path), "%s/%s", folder, state->connections[connection].captured.files[file].name);
+        unlink(path);
+      }
+    }
+  }
+
+  rmdir(folder);
+}
+
+
+static void *runWorker(void *stateV)
+{
+  replayState      *state      = (replayState *)stateV;
+  replayConnection *connection = NULL;
+  routerObject     *router     = NULL;
+  char             **names     = NULL;
+  uint64_t         index       = 0;
+  uint64_t         due         = 0;
+  uint64_t         now         = 0;
+  uint32_t         file        = 0;
+
+  names = (char **)secureAllocate(CAPTURE_RECORD_BYTESIZE * sizeof(char *));
+  if(names == NULL){
+    logEvent("Error", "Failed to allocate file names");
+    return NULL;
+  }
+
+  while( (index = atomic_fetch_add(&state->nextConnection, 1)) < state->connectionCount ){
+    connection = &state->connections[index];
+    due        = state->start + ((state->config->speed > 0) ? (uint64_t)(connection->captured.arrival / state->config->speed) : 0);
+
+    now = getMonotonicMicroseconds();
+    if(due > now){
+      usleep((useconds_t)(due - now));
+      now = getMonotonicMicroseconds();
+    }
+
+    connection->lateness = (now > due) ? now - due : 0;
+
+    for(file = 0; file != connection->captured.fileCount; file++){
+      names[file] = connection->captured.files[file].name;
+    }
+
+    router = newRouter();
+    if(router == NULL){
+      connection->failed = 1;
+      continue;
+    }
+
+    if( !router->ipv4Connect(router, "127.0.0.1", state->config->port) ||
+        !benchFetchBatch(router, names, connection->captured.fileCount, 0, connection->results) ){
+      connection->failed = 1;
+    }
+
+    router->destroyRouter(&router);
+  }
+
+  secureFree(&names, CAPTURE_RECORD_BYTESIZE * sizeof(char *));
+
+  return NULL;
+}
+
+
+/*
+ * writeResults prints a summary and writes the JSON results to the output path, returns 0 on error and 1 on success
+ */
+static int writeResults(replayState *state, uint64_t wallMicroseconds)
+{
+  replayConnection *connection      = NULL;
+  benchFileResult  *result          = NULL;
+  uint64_t         *firstByteTimes  = NULL;
+  uint64_t         *completeTimes   = NULL;
+  uint64_t         *lateness        = NULL;
+  uint64_t         fileTotal        = 0;
+  uint64_t         completed        = 0;
+  uint64_t         bytes            = 0;
+  uint64_t         failed           = 0;
+  uint64_t         mismatched       = 0;
+  uint64_t         index            = 0;
+  uint64_t         capturedSpan     = 0;
+  uint32_t         file             = 0;
+  double           seconds          = wallMicroseconds / 1000000.0;
+  FILE             *out             = NULL;
+
+  for(index = 0; index != state->connectionCount; index++){
+    fileTotal += state->connections[index].captured.fileCount;
+  }
+
+  firstByteTimes = (uint64_t *)secureAllocate((fileTotal + 1) * sizeof(uint64_t));
+  completeTimes  = (uint64_t *)secureAllocate((fileTotal + 1) * sizeof(uint64_t));
+  lateness       = (uint64_t *)secureAllocate((state->connectionCount + 1) * sizeof(uint64_t));
+  if(firstByteTimes == NULL || completeTimes == NULL || lateness == NULL){
+    logEvent("Error", "Failed to allocate result arrays");
+    return 0;
+  }
+
+  for(index = 0; index != state->connectionCount; index++){
+    connection      = &state->connections[index];
+    lateness[index] = connection->lateness;
+    failed         += connection->failed;
+
+    if(connection->captured.arrival > capturedSpan){
+      capturedSpan = connection->captured.arrival;
+    }
+
+    for(file = 0; file != connection->captured.fileCount; file++){
+      result = &connection->results[file];
+      if(result->failed){
+        continue;
+      }
+
+      //the replaying server should have every file the recorded one did, at the same bytesize
+      if(connection->captured.files[file].found && result->bytesize != connection->captured.files[file].bytesize){
+        mismatched++;
+      }
+
+      firstByteTimes[completed] = result->timeToFirstByte;
+      completeTimes[completed]  = result->completionTime;
+      bytes                    += result->bytesize;
+      completed++;
+    }
+  }
+
+  qsort(firstByteTimes, completed, sizeof(uint64_t), benchCompareTimes);
+  qsort(completeTimes, completed, sizeof(uint64_t), benchCompareTimes);
+  qsort(lateness, state->connectionCount, sizeof(uint64_t), benchCompareTimes);
+
+  printf("%llu connections, %llu files, %.1f MB in %.3f s (captured over %.3f s at speed %g): %.2f MB/s, %.1f requests/s\n",
+         (unsigned long long)state->connectionCount, (unsigned long long)completed, bytes / 1e6, seconds, capturedSpan / 1e6,
+         state->config->speed, bytes / 1e6 / seconds, completed / seconds);
+  printf("%llu failed connections, %llu files with a different bytesize than captured\n", (unsigned long long)failed, (unsigned long long)mismatched);
+  printf("time to first byte us  p50 %llu  p99 %llu  p999 %llu\n", (unsigned long long)benchPercentile(firstByteTimes, completed, 50),
+         (unsigned long long)benchPercentile(firstByteTimes, completed, 99), (unsigned long long)benchPercentile(firstByteTimes, completed, 99.9));
+  printf("completion time us     p50 %llu  p99 %llu  p999 %llu\n", (unsigned long long)benchPercentile(completeTimes, completed, 50),
+         (unsigned long long)benchPercentile(completeTimes, completed, 99), (unsigned long long)benchPercentile(completeTimes, completed, 99.9));
+  printf("start lateness us      p50 %llu  p99 %llu  max %llu\n", (unsigned long long)benchPercentile(lateness, state->connectionCount, 50),
+         (unsigned long long)benchPercentile(lateness, state->connectionCount, 99), (unsigned long long)benchPercentile(lateness, state->connectionCount, 100));
+
+  out = fopen(state->config->outputPath, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open output file");
+    return 0;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"benchmark\": \"replay\",\n  \"capture\": \"%s\",\n  \"speed\": %g,\n  \"workers\": %u,\n", state->config->capturePath,
+          state->config->speed, state->config->workers);
+  fprintf(out, "  \"connections\": %llu,\n  \"failedConnections\": %llu,\n  \"filesCompleted\": %llu,\n  \"bytesizeMismatches\": %llu,\n",
+          (unsigned long long)state->connectionCount, (unsigned long long)failed, (unsigned long long)completed, (unsigned long long)mismatched);
+  fprintf(out, "  \"capturedSeconds\": %.6f,\n  \"wallSeconds\": %.6f,\n  \"bytes\": %llu,\n", capturedSpan / 1e6, seconds, (unsigned long long)bytes);
+  fprintf(out, "  \"megabytesPerSecond\": %.3f,\n  \"requestsPerSecond\": %.3f,\n", bytes / 1e6 / seconds, completed / seconds);
+  fprintf(out, "  \"timeToFirstByteMicroseconds\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu },\n",
+          (unsigned long long)benchPercentile(firstByteTimes, completed, 50), (unsigned long long)benchPercentile(firstByteTimes, completed, 99),
+          (unsigned long long)benchPercentile(firstByteTimes, completed, 99.9), (unsigned long long)benchPercentile(firstByteTimes, completed, 100));
+  fprintf(out, "  \"completionMicroseconds\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu },\n",
+          (unsigned long long)benchPercentile(completeTimes, completed, 50), (unsigned long long)benchPercentile(completeTimes, completed, 99),
+          (unsigned long long)benchPercentile(completeTimes, completed, 99.9), (unsigned long long)benchPercentile(completeTimes, completed, 100));
+  fprintf(out, "  \"startLatenessMicroseconds\": { \"p50\": %llu, \"p99\": %llu, \"max\": %llu }\n",
+          (unsigned long long)benchPercentile(lateness, state->connectionCount, 50), (unsigned long long)benchPercentile(lateness, state->connectionCount, 99),
+          (unsigned long long)benchPercentile(lateness, state->connectionCount, 100));
+  fprintf(out, "}\n");
+
+  fclose(out);
+
+  secureFree(&firstByteTimes, (fileTotal + 1) * sizeof(uint64_t));
+  secureFree(&completeTimes, (fileTotal + 1) * sizeof(uint64_t));
+  secureFree(&lateness, (state->connectionCount + 1) * sizeof(uint64_t));
+
+  return 1;
+}
@@ -0,0 +1,655 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "torEmulator.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * torEmulator is a local stand in for Tor's SocksPort, for benchmarking the client offline under Tor like conditions. It speaks the
+ * subset of SOCKS5 router.c uses (no authentication, CONNECT to a domain name, see initializeSocks5Protocol / sendSocks5ConnectRequest /
+ * socksResponseValidate), maps fake .onion names to local servers, and relays the stream with added circuit setup time, latency,
+ * jitter, a bandwidth cap and random stream failures.
+ *
+ * Each direction of a stream is relayed by a reader thread and a writer thread sharing a window of cells, the reader stamps each cell
+ * with when it may be delivered and the writer delivers it then. Like Tor's circuit window, at most TOR_EMULATOR_WINDOW_CELLS are in
+ * flight per direction, so latency limits throughput to window / round trip just as it does over a real circuit.
+ */
+
+
+enum{ TOR_EMULATOR_CELL_BYTESIZE   = 8192 };
+enum{ TOR_EMULATOR_WINDOW_CELLS    = 64   };   //512 KB in flight per direction, about Tor's circuit window
+enum{ SOCKS_REPLY_BYTESIZE         = 10   };
+
+
+typedef struct relayCell{
+  uint32_t bytesize;
+  uint64_t deliverAt;
+  unsigned char data[TOR_EMULATOR_CELL_BYTESIZE];
+}relayCell;
+
+typedef struct relayDirection{
+  struct relayStream *stream;
+  int                from;
+  int                to;
+  pthread_mutex_t    lock;
+  pthread_cond_t     changed;
+  uint32_t           head;           //next cell the reader fills
+  uint32_t           tail;           //next cell the writer delivers
+  int                readerDone;
+  int                writerDone;
+  uint64_t           lastDeliverAt;
+  uint64_t           nextSendAllowed;
+  unsigned           seed;
+  relayCell          cells[TOR_EMULATOR_WINDOW_CELLS];
+}relayDirection;
+
+typedef struct relayListener{
+  torEmulatorConfig *config;
+  int               listenSocket;
+  atomic_int        stopping;
+  pthread_t         acceptThread;
+}relayListener;
+
+typedef struct relayStream{
+  torEmulatorConfig *config;
+  int               clientSocket;
+  int               serverSocket;
+  pthread_mutex_t   lock;
+  uint32_t          threadsRunning;
+  relayDirection    upstream;      //client to server
+  relayDirection    downstream;    //server to client
+}relayStream;
+
+
+//the emulator a process runs, stopTorEmulator frees it
+static relayListener *globalListener = NULL;
+
+
+static void     *acceptStreams(void *listenerV);
+static void     *handleStream(void *streamV);
+static int      socksHandshake(relayStream *stream);
+static int      connectMapping(torEmulatorConfig *config, const char *onionAddress, uint8_t onionBytesize);
+static int      receiveExactly(int socket, void *buffer, size_t bytesize);
+static int      sendExactly(int socket, const void *buffer, size_t bytesize);
+static int      startDirection(relayStream *stream, relayDirection *direction, int from, int to, unsigned seed);
+static void     *readDirection(void *directionV);
+static void     *writeDirection(void *directionV);
+static void     finishThread(relayStream *stream);
+static void     sleepUntil(uint64_t microseconds);
+
+
+
+/*
+ * addTorEmulatorMapping adds a mapping in the form name.onion=host:port, returns 0 on error and 1 on success
+ */
+int addTorEmulatorMapping(torEmulatorConfig *config, const char *mapping)
+{
+  const char         *separator = NULL;
+  const char         *colon     = NULL;
+  torEmulatorMapping *entry     = NULL;
+  unsigned long      port       = 0;
+
+  if(config == NULL || mapping == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(config->mappingCount == TOR_EMULATOR_MAX_MAPPINGS){
+    logEvent("Error", "Too many onion mappings");
+    return 0;
+  }
+
+  separator = strchr(mapping, '=');
+  colon     = (separator != NULL) ? strrchr(separator, ':') : NULL;
+  if(separator == NULL || colon == NULL || separator - mapping != ONION_ADDRESS_BYTESIZE || colon - separator - 1 >= 64 || colon == separator + 1){
+    logEvent("Error", "Mappings must be in the form abcdefghijklmnop.onion=host:port");
+    return 0;
+  }
+
+  port = strtoul(colon + 1, NULL, 10);
+  if(port == 0 || port > HIGHEST_VALID_PORT){
+    logEvent("Error", "Mapping port must be between 1 and 65535");
+    return 0;
+  }
+
+  entry = &config->mappings[config->mappingCount++];
+
+  memset(entry, 0, sizeof(*entry));
+  memcpy(entry->onionAddress, mapping, ONION_ADDRESS_BYTESIZE);
+  memcpy(entry->host, separator + 1, colon - separator - 1);
+  entry->port = (uint16_t)port;
+
+  return 1;
+}
+
+
+/*
+ * startTorEmulator starts accepting SOCKS5 connections on 127.0.0.1:config->listenPort on a background thread, config must outlive
+ * the emulator. Returns 0 on error and 1 on success
+ */
+int startTorEmulator(torEmulatorConfig *config)
+{
+  struct sockaddr_in address;
+  relayListener      *listener    = NULL;
+  int                listenSocket = -1;
+  int                reuse        = 1;
+
+  if(config == NULL || config->listenPort == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(globalListener != NULL){
+    logEvent("Error", "The Tor emulator is already running");
+    return 0;
+  }
+
+  listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenSocket == -1){
+    logEvent("Error", "Failed to create emulator socket");
+    return 0;
+  }
+
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family      = AF_INET;
+  address.sin_port        = htons((uint16_t)strtoul(config->listenPort, NULL, 10));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if( bind(listenSocket, (const struct sockaddr *)&address, sizeof(address)) || listen(listenSocket, SOMAXCONN) ){
+    logEvent("Error", "Failed to listen on emulator port");
+    close(listenSocket);
+    return 0;
+  }
+
+  listener = (relayListener *)secureAllocate(sizeof(*listener));
+  if(listener == NULL){
+    logEvent("Error", "Failed to allocate emulator listener");
+    close(listenSocket);
+    return 0;
+  }
+
+  listener->config       = config;
+  listener->listenSocket = listenSocket;
+  atomic_init(&listener->stopping, 0);
+
+  if( pthread_create(&listener->acceptThread, NULL, acceptStreams, (void *)listener) != 0 ){
+    logEvent("Error", "Failed to create emulator thread");
+    secureFree(&listener, sizeof(*listener));
+    close(listenSocket);
+    return 0;
+  }
+
+  globalListener = listener;
+
+  return 1;
+}
+
+
+/*
+ * stopTorEmulator stops accepting SOCKS5 connections and frees the listener, streams already being relayed finish on their own threads
+ */
+void stopTorEmulator(void)
+{
+  if(globalListener == NULL){
+    return;
+  }
+
+  //shutting the socket down wakes the accept thread, which sees it is stopping rather than a failed accept
+  atomic_store(&globalListener->stopping, 1);
+  shutdown(globalListener->listenSocket, SHUT_RDWR);
+  pthread_join(globalListener->acceptThread, NULL);
+
+  close(globalListener->listenSocket);
+  secureFree(&globalListener, sizeof(*globalListener));
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void *acceptStreams(void *listenerV)
+{
+  relayListener *listener = (relayListener *)listenerV;
+  relayStream   *stream   = NULL;
+  pthread_t     streamThread;
+  int           clientSocket = -1;
+  int           noDelay      = 1;
+
+  while(1){
+    clientSocket = accept(listener->listenSocket, NULL, NULL);
+    if(clientSocket == -1 && atomic_load(&listener->stopping)){
+      break;
+    }
+
+    if(clientSocket == -1){
+      logEvent("Error", "Failed to accept emulator connection");
+      continue;
+    }
+
+    stream = (relayStream *)secureAllocate(sizeof(*stream));
+    if(stream == NULL){
+      logEvent("Error", "Failed to allocate relay stream");
+      close(clientSocket);
+      continue;
+    }
+
+    //the emulator relays writes as they come, Nagle would hold back the small ones and add delay that isn't configured
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    stream->config       = listener->config;
+    stream->clientSocket = clientSocket;
+    stream->serverSocket = -1;
+    pthread_mutex_init(&stream->lock, NULL);
+
+    if( pthread_create(&streamThread, NULL, handleStream, (void *)stream) != 0 ){
+      logEvent("Error", "Failed to create relay stream thread");
+      close(clientSocket);
+      secureFree(&stream, sizeof(*stream));
+      continue;
+    }
+
+    pthread_detach(streamThread);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * handleStream performs the SOCKS5 handshake for a new stream and then starts relaying it in both directions
+ */
+static void *handleStream(void *streamV)
+{
+  relayStream *stream = (relayStream *)streamV;
+  unsigned    seed    = (unsigned)getMonotonicMicroseconds() ^ (unsigned)stream->clientSocket;
+
+  if( !socksHandshake(stream) ){
+    close(stream->clientSocket);
+    if(stream->serverSocket != -1){
+      close(stream->serverSocket);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    secureFree(&stream, sizeof(*stream));
+    return NULL;
+  }
+
+  //four relay threads, the last one to finish closes the sockets and frees the stream. startDirection accounts for the threads of its
+  //own direction if it fails, the downstream ones are accounted for here if it is never started
+  stream->threadsRunning = 4;
+
+  if( !startDirection(stream, &stream->upstream, stream->clientSocket, stream->serverSocket, seed) ){
+    finishThread(stream);
+    finishThread(stream);
+    return NULL;
+  }
+
+  startDirection(stream, &stream->downstream, stream->serverSocket, stream->clientSocket, seed * 31 + 7);
+
+  return NULL;
+}
+
+
+/*
+ * socksHandshake reads the method selection and CONNECT request from the client, connects to the mapped server and replies.
+ * Returns 0 on error (a failure reply has been sent where the protocol allows) and 1 on success
+ */
+static int socksHandshake(relayStream *stream)
+{
+  unsigned char request[4];
+  unsigned char methods[255];
+  char          onionAddress[255];
+  unsigned char onionBytesize = 0;
+  unsigned char port[2];
+  unsigned char reply[SOCKS_REPLY_BYTESIZE] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+
+  // | VER | NMETHODS | METHODS |
+  if( !receiveExactly(stream->clientSocket, request, 2) || request[0] != 5 || !receiveExactly(stream->clientSocket, methods, request[1]) ){
+    logEvent("Error", "Invalid SOCKS5 method selection");
+    return 0;
+  }
+
+  if( memchr(methods, 0, request[1]) == NULL ){
+    sendExactly(stream->clientSocket, "\005\377", 2);
+    logEvent("Error", "SOCKS5 client doesn't support no authentication");
+    return 0;
+  }
+
+  if( !sendExactly(stream->clientSocket, "\005\000", 2) ){
+    return 0;
+  }
+
+  // | VER | CMD | RSV | ATYP | DST.ADDR | DST.PORT |, only CONNECT to a domain name is supported, as that is all Tor needs for onions
+  if( !receiveExactly(stream->clientSocket, request, 4) || request[0] != 5 ){
+    logEvent("Error", "Invalid SOCKS5 request");
+    return 0;
+  }
+
+  if(request[1] != 1 || request[3] != 3){
+    reply[1] = (request[1] != 1) ? 7 : 8;   //command not supported, address type not supported
+    sendExactly(stream->clientSocket, reply, SOCKS_REPLY_BYTESIZE);
+    logEvent("Error", "Only SOCKS5 CONNECT to a domain name is supported");
+    return 0;
+  }
+
+  if( !receiveExactly(stream->clientSocket, &onionBytesize, 1) || !receiveExactly(stream->clientSocket, onionAddress, onionBytesize) || !receiveExactly(stream->clientSocket, port, 2) ){
+    logEvent("Error", "Failed to receive SOCKS5 destination");
+    return 0;
+  }
+
+  stream->serverSocket = connectMapping(stream->config, onionAddress, onionBytesize);
+  if(stream->serverSocket == -1){
+    reply[1] = 4;   //host unreachable, what Tor reports for an unknown onion
+    sendExactly(stream->clientSocket, reply, SOCKS_REPLY_BYTESIZE);
+    return 0;
+  }
+
+  if(stream->config->circuitSetupMicroseconds){
+    usleep(stream->config->circuitSetupMicroseconds);
+  }
+
+  return sendExactly(stream->clientSocket, reply, SOCKS_REPLY_BYTESIZE);
+}
+
+
+/*
+ * connectMapping connects to the server mapped to onionAddress, returns the connected socket or -1 on error
+ */
+static int connectMapping(torEmulatorConfig *config, const char *onionAddress, uint8_t onionBytesize)
+{
+  struct addrinfo    hints;
+  struct addrinfo    *resolved = NULL;
+  torEmulatorMapping *mapping  = NULL;
+  char               port[8];
+  uint32_t           entry     = 0;
+  int                server    = -1;
+  int                noDelay   = 1;
+
+  for(entry = 0; entry != config->mappingCount; entry++){
+    if( onionBytesize == ONION_ADDRESS_BYTESIZE && !memcmp(config->mappings[entry].onionAddress, onionAddress, ONION_ADDRESS_BYTESIZE) ){
+      mapping = &config->mappings[entry];
+      break;
+    }
+  }
+
+  if(mapping == NULL){
+    logEvent("Error", "No mapping for requested onion address");
+    return -1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%u", mapping->port);
+
+  if( getaddrinfo(mapping->host, port, &hints, &resolved) ){
+    logEvent("Error", "Failed to resolve mapped server");
+    return -1;
+  }
+
+  server = socket(AF_INET, SOCK_STREAM, 0);
+  if(server == -1 || connect(server, resolved->ai_addr, resolved->ai_addrlen)){
+    logEvent("Error", "Failed to connect to mapped server");
+    if(server != -1){
+      close(server);
+    }
+    freeaddrinfo(resolved);
+    return -1;
+  }
+
+  freeaddrinfo(resolved);
+
+  setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  return server;
+}
+
+
+static int receiveExactly(int socket, void *buffer, size_t bytesize)
+{
+  size_t  received    = 0;
+  ssize_t recvReturn  = 0;
+
+  for(received = 0; received != bytesize; received += recvReturn){
+    recvReturn = recv(socket, &((unsigned char *)buffer)[received], bytesize - received, 0);
+    if(recvReturn <= 0){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+static int sendExactly(int socket, const void *buffer, size_t bytesize)
+{
+  size_t  sent        = 0;
+  ssize_t sendReturn  = 0;
+
+  for(sent = 0; sent != bytesize; sent += sendReturn){
+    sendReturn = send(socket, &((const unsigned char *)buffer)[sent], bytesize - sent, MSG_NOSIGNAL);
+    if(sendReturn <= 0){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * startDirection starts the reader and writer threads relaying from one socket to another, returns 0 on error and 1 on success. On
+ * error the stream is shut down and the threads that weren't started are counted as finished
+ */
+static int startDirection(relayStream *stream, relayDirection *direction, int from, int to, unsigned seed)
+{
+  pthread_t reader;
+  pthread_t writer;
+
+  direction->stream = stream;
+  direction->from   = from;
+  direction->to     = to;
+  direction->seed   = seed;
+  pthread_mutex_init(&direction->lock, NULL);
+  pthread_cond_init(&direction->changed, NULL);
+
+  if( pthread_create(&reader, NULL, readDirection, (void *)direction) != 0 ){
+    logEvent("Error", "Failed to create relay reader thread");
+    shutdown(stream->clientSocket, SHUT_RDWR);
+    shutdown(stream->serverSocket, SHUT_RDWR);
+    finishThread(stream);
+    finishThread(stream);
+    return 0;
+  }
+
+  pthread_detach(reader);
+
+  if( pthread_create(&writer, NULL, writeDirection, (void *)direction) != 0 ){
+    logEvent("Error", "Failed to create relay writer thread");
+    //the reader sees the sockets shut down and finishes on its own
+    pthread_mutex_lock(&direction->lock);
+    direction->writerDone = 1;
+    pthread_cond_broadcast(&direction->changed);
+    pthread_mutex_unlock(&direction->lock);
+    shutdown(stream->clientSocket, SHUT_RDWR);
+    shutdown(stream->serverSocket, SHUT_RDWR);
+    finishThread(stream);
+    return 0;
+  }
+
+  pthread_detach(writer);
+
+  return 1;
+}
+
+
+/*
+ * readDirection reads cells into the window and stamps each with its delivery time, blocking while the window is full
+ */
+static void *readDirection(void *directionV)
+{
+  relayDirection    *direction = (relayDirection *)directionV;
+  torEmulatorConfig *config    = direction->stream->config;
+  relayCell         *cell      = NULL;
+  ssize_t           received   = 0;
+  int64_t           jitter     = 0;
+  uint64_t          deliverAt  = 0;
+
+  while(1){
+    pthread_mutex_lock(&direction->lock);
+    while(direction->head - direction->tail == TOR_EMULATOR_WINDOW_CELLS && !direction->writerDone){
+      pthread_cond_wait(&direction->changed, &direction->lock);
+    }
+    if(direction->writerDone){
+      pthread_mutex_unlock(&direction->lock);
+      break;
+    }
+    cell = &direction->cells[direction->head % TOR_EMULATOR_WINDOW_CELLS];
+    pthread_mutex_unlock(&direction->lock);
+
+    received = recv(direction->from, cell->data, TOR_EMULATOR_CELL_BYTESIZE, 0);
+    if(received <= 0){
+      break;
+    }
+
+    jitter    = config->jitterMicroseconds ? (int64_t)(rand_r(&direction->seed) % (2 * config->jitterMicroseconds + 1)) - config->jitterMicroseconds : 0;
+    deliverAt = getMonotonicMicroseconds() + config->latencyMicroseconds + jitter;
+
+    //a stream is delivered in order, jitter can delay a cell but never reorder it
+    if(deliverAt < direction->lastDeliverAt){
+      deliverAt = direction->lastDeliverAt;
+    }
+    direction->lastDeliverAt = deliverAt;
+
+    cell->bytesize  = (uint32_t)received;
+    cell->deliverAt = deliverAt;
+
+    pthread_mutex_lock(&direction->lock);
+    direction->head++;
+    pthread_cond_broadcast(&direction->changed);
+    pthread_mutex_unlock(&direction->lock);
+  }
+
+  pthread_mutex_lock(&direction->lock);
+  direction->readerDone = 1;
+  pthread_cond_broadcast(&direction->changed);
+  pthread_mutex_unlock(&direction->lock);
+
+  finishThread(direction->stream);
+
+  return NULL;
+}
+
+
+/*
+ * writeDirection delivers cells when they are due, paced to the bandwidth cap, and cuts the stream at random if failures are configured
+ */
+static void *writeDirection(void *directionV)
+{
+  relayDirection    *direction = (relayDirection *)directionV;
+  torEmulatorConfig *config    = direction->stream->config;
+  relayCell         *cell      = NULL;
+  uint64_t          now        = 0;
+
+  while(1){
+    pthread_mutex_lock(&direction->lock);
+    while(direction->head == direction->tail && !direction->readerDone){
+      pthread_cond_wait(&direction->changed, &direction->lock);
+    }
+    if(direction->head == direction->tail){
+      pthread_mutex_unlock(&direction->lock);
+      shutdown(direction->to, SHUT_WR);
+      break;
+    }
+    cell = &direction->cells[direction->tail % TOR_EMULATOR_WINDOW_CELLS];
+    pthread_mutex_unlock(&direction->lock);
+
+    sleepUntil(cell->deliverAt);
+
+    if(config->bytesPerSecond){
+      now = getMonotonicMicroseconds();
+      if(direction->nextSendAllowed < now){
+        direction->nextSendAllowed = now;
+      }
+      sleepUntil(direction->nextSendAllowed);
+      direction->nextSendAllowed += (uint64_t)cell->bytesize * 1000000ULL / config->bytesPerSecond;
+    }
+
+    if( config->failurePerMillion && (uint32_t)(rand_r(&direction->seed) % 1000000) < config->failurePerMillion ){
+      //cut the whole stream, like a circuit collapsing
+      shutdown(direction->stream->clientSocket, SHUT_RDWR);
+      shutdown(direction->stream->serverSocket, SHUT_RDWR);
+      break;
+    }
+
+    if( !sendExactly(direction->to, cell->data, cell->bytesize) ){
+      shutdown(direction->from, SHUT_RD);
+      break;
+    }
+
+    pthread_mutex_lock(&direction->lock);
+    direction->tail++;
+    pthread_cond_broadcast(&direction->changed);
+    pthread_mutex_unlock(&direction->lock);
+  }
+
+  pthread_mutex_lock(&direction->lock);
+  direction->writerDone = 1;
+  pthread_cond_broadcast(&direction->changed);
+  pthread_mutex_unlock(&direction->lock);
+
+  //wake a reader blocked in recv
+  shutdown(direction->from, SHUT_RD);
+
+  finishThread(direction->stream);
+
+  return NULL;
+}
+
+
+/*
+ * finishThread is called as each relay thread exits, the last one closes the sockets and frees the stream
+ */
+static void finishThread(relayStream *stream)
+{
+  uint32_t remaining = 0;
+
+  pthread_mutex_lock(&stream->lock);
+  remaining = --stream->threadsRunning;
+  pthread_mutex_unlock(&stream->lock);
+
+  if(remaining){
+    return;
+  }
+
+  close(stream->clientSocket);
+  close(stream->serverSocket);
+  pthread_mutex_destroy(&stream->lock);
+  secureFree(&stream, sizeof(*stream));
+}
+
+
+static void sleepUntil(uint64_t microseconds)
+{
+  uint64_t now = getMonotonicMicroseconds();
+
+  if(microseconds > now){
+    usleep((useconds_t)(microseconds - now));
+  }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include "ogEnums.h"
+
+
+enum{ TOR_EMULATOR_MAX_MAPPINGS = 16 };
+
+
+typedef struct torEmulatorMapping{
+  char     onionAddress[ONION_ADDRESS_BYTESIZE + 1];
+  char     host[64];
+  uint16_t port;
+}torEmulatorMapping;
+
+//a zeroed torEmulatorConfig (plus a port and mappings) relays without adding any delay or failures
+typedef struct torEmulatorConfig{
+  char               *listenPort;
+  uint32_t           circuitSetupMicroseconds;   //delay before a CONNECT succeeds, models building the circuit
+  uint32_t           latencyMicroseconds;        //one way delay added to everything relayed
+  uint32_t           jitterMicroseconds;         //latency varies uniformly by up to this much either way
+  uint32_t           bytesPerSecond;             //bandwidth cap per stream and direction, 0 for unlimited
+  uint32_t           failurePerMillion;          //chance that a stream is cut at each relayed cell
+  uint32_t           mappingCount;
+  torEmulatorMapping mappings[TOR_EMULATOR_MAX_MAPPINGS];
+}torEmulatorConfig;
+
+
+int addTorEmulatorMapping(torEmulatorConfig *config, const char *mapping);
+int startTorEmulator(torEmulatorConfig *config);
+void stopTorEmulator(void);
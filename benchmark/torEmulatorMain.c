@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "torEmulator.h"
+#include "macros.h"
+
+
+/*
+ * torEmulator runs the SOCKS5 Tor stand in on its own, for pointing a client at it by hand
+ * 
+ * usage: ./torEmulator --listen port --map name.onion=host:port [--map ...] [--circuit-ms N] [--latency-ms N] [--jitter-ms N]
+ *                      [--bandwidth-kbps N] [--failure-ppm N]
+ */
+
+
+int main(int argc, char *argv[])
+{
+  torEmulatorConfig config;
+  int               option = 0;
+  
+  static struct option longOptions[] = {
+    { "listen"        , required_argument, NULL, 'l' },
+    { "map"           , required_argument, NULL, 'M' },
+    { "circuit-ms"    , required_argument, NULL, 'c' },
+    { "latency-ms"    , required_argument, NULL, 'L' },
+    { "jitter-ms"     , required_argument, NULL, 'j' },
+    { "bandwidth-kbps", required_argument, NULL, 'b' },
+    { "failure-ppm"   , required_argument, NULL, 'f' },
+    { NULL            , 0                , NULL, 0   }
+  };
+  
+  memset(&config, 0, sizeof(config)); 
+  
+  while( (option = getopt_long(argc, argv, "l:M:c:L:j:b:f:", longOptions, NULL)) != -1 ){
+    switch(option){
+      case 'l': config.listenPort               = optarg; break;
+      case 'c': config.circuitSetupMicroseconds = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'L': config.latencyMicroseconds      = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'j': config.jitterMicroseconds       = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'b': config.bytesPerSecond           = (uint32_t)strtoul(optarg, NULL, 10) * 1000; break;
+      case 'f': config.failurePerMillion        = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'M':
+        if( !addTorEmulatorMapping(&config, optarg) ){
+          return 1; 
+        }
+        break; 
+      default:
+        fprintf(stderr, "usage: %s --listen port --map name.onion=host:port [--map ...] [--circuit-ms N] [--latency-ms N] [--jitter-ms N] "
+                        "[--bandwidth-kbps N] [--failure-ppm N]\n", argv[0]);
+        return 1; 
+    }
+  }
+  
+  if(config.listenPort == NULL || config.mappingCount == 0){
+    logEvent("Error", "A listen port and at least one mapping are required");
+    return 1; 
+  }
+  
+  if( !startTorEmulator(&config) ){
+    logEvent("Error", "Failed to start the Tor emulator");
+    return 1; 
+  }
+  
+  //the emulator runs on its own threads
+  while(1){
+    pause(); 
+  }
+}
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "benchClient.h"
+#include "client.h"
+#include "server.h"
+#include "router.h"
+#include "diskFile.h"
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+#include "delta.h"
+#include "fileHash.h"
+
+
+/*
+ * transferCheck runs the server on loopback and checks that what the client ends up with is what was shared, byte for byte, on the
+ * paths the benchmarks only time:
+ *
+ *   deltas    the client's updateFiles rebuilding old copies of edited, grown, shrunk and shifted files in place (see delta.h) and
+ *             checking them against the server's hashes, then again once the copies are current
+ *   hashes    that every chunk is checked against the server's hash index (see fileHash.h). A chunk corrupted on disk behind the
+ *             server's back, a file changed without its index record noticing, and a corrupted index are all rejected, while
+ *             a file whose change the index does notice is hashed again and passes
+ *
+ * The checks need a build with BLAKE3=1, without it they are reported skipped. Exits 0 if every check ran and passed and 1 otherwise,
+ * so a build that can't check anything doesn't pass.
+ *
+ * The server listens on port, and on the few ports after it for the restarts of the hash checks.
+ *
+ * usage: ./transferCheck [port]
+ */
+
+
+enum{ CHECK_BASE_BYTESIZE         = 6 * 1024 * 1024 };
+enum{ CHECK_SERVER_CACHE_MB       = 0               };
+enum{ CHECK_SERVER_CONNECTIONS    = 4               };
+enum{ CHECK_MAX_FILES             = 16              };
+enum{ CHECK_HASH_TRIES            = 200             };
+enum{ CHECK_HASH_WAIT_USECS       = 25000           };
+
+//what became of a file fetched with its hashes
+enum{ FETCH_FAILED = 0, FETCH_UNVERIFIED = 1, FETCH_VERIFIED = 2, FETCH_REJECTED = 3 };
+
+
+//a shared file and the client's old copy of it. The copy is the first copyBytesize bytes of the base, the shared file is the copy with
+//spliceRemove bytes at spliceOffset replaced by spliceInsert new bytes
+typedef struct deltaCase{
+  const char *name;
+  uint32_t   copyBytesize;      //0 for no copy
+  uint32_t   spliceOffset;
+  uint32_t   spliceRemove;
+  uint32_t   spliceInsert;
+}deltaCase;
+
+
+static const deltaCase deltaCases[] = {
+  { "edited"    , 6 * 1024 * 1024 , 3 * 1024 * 1024 , 100             , 100               },
+  { "appended"  , 4 * 1024 * 1024 , 4 * 1024 * 1024 , 0               , 100000            },
+  { "truncated" , 6 * 1024 * 1024 , 3 * 1024 * 1024 , 3 * 1024 * 1024 , 0                 },
+  { "deleted"   , 6 * 1024 * 1024 , 3000000         , 10000           , 0                 },
+  { "inserted"  , 5 * 1024 * 1024 , 3000000         , 0               , 10000             },
+  { "new"       , 0               , 0               , 0               , 2 * 1024 * 1024 + 123 },
+  { "unchanged" , 5 * 1024 * 1024 + 17 , 0          , 0               , 0                 },
+  { "tiny"      , 12              , 0               , 3               , 3                 }
+};
+
+
+static int  checkDeltas(char *port, unsigned char *base, unsigned char *fresh);
+static int  checkHashes(uint32_t port, unsigned char *base, unsigned char *fresh);
+static pid_t startHashServer(char *sharedFolder, char *indexPath, uint32_t port, char *portString);
+static int  fetchHashed(char *port, char *name);
+static int  waitForHashed(char *port, char *name);
+static int  waitForIndex(const char *indexPath, struct timespec *after);
+static int  flipByte(const char *folder, const char *name, int64_t offset);
+static int  touchFile(const char *folder, const char *name);
+static int  writeDeltaCase(const char *sharedFolder, const char *copyFolder, const deltaCase *testCase, unsigned char *base,
+                           unsigned char *fresh);
+static int  writeFile(const char *folder, const char *name, const unsigned char *bytes, uint32_t bytesize, const char *mode);
+static int  filesMatch(const char *firstFolder, const char *secondFolder, const char *name);
+static int  updateCopies(char *port, char *copyFolder, char **fileNames, uint32_t fileCount);
+static void stopServer(pid_t server);
+static void removeFolder(const char *folder, char **fileNames, uint32_t fileCount);
+
+
+
+int main(int argc, char *argv[])
+{
+  char          *port   = "18473";
+  unsigned char *base   = NULL;
+  unsigned char *fresh  = NULL;
+  unsigned      seed    = 1;
+  uint32_t      byte    = 0;
+  int           failed  = 0;
+
+  if(argc > 1){
+    port = argv[1];
+  }
+
+  base  = (unsigned char *)secureAllocate(CHECK_BASE_BYTESIZE);
+  fresh = (unsigned char *)secureAllocate(CHECK_BASE_BYTESIZE);
+  if(base == NULL || fresh == NULL){
+    logEvent("Error", "Failed to allocate check files");
+    return 1;
+  }
+
+  //random, so no block of a file matches another by accident
+  for(byte = 0; byte != CHECK_BASE_BYTESIZE; byte++){
+    base[byte]  = (unsigned char)rand_r(&seed);
+    fresh[byte] = (unsigned char)rand_r(&seed);
+  }
+
+  if( !deltaAvailable() ){
+    printf("deltas     skipped, needs a build with BLAKE3=1\n");
+    failed = 1;
+  }
+  else if( !checkDeltas(port, base, fresh) ){
+    failed = 1;
+  }
+
+  if( !hashAvailable() ){
+    printf("hashes     skipped, needs a build with BLAKE3=1\n");
+    failed = 1;
+  }
+  else if( !checkHashes((uint32_t)strtoul(port, NULL, 10) + 1, base, fresh) ){
+    failed = 1;
+  }
+
+  secureFree(&base, CHECK_BASE_BYTESIZE);
+  secureFree(&fresh, CHECK_BASE_BYTESIZE);
+
+  flushLog();
+  return failed;
+}
+
+
+/*
+ * checkDeltas shares the new version of every delta case with a hash index, waits for the server to hash them, has the client update
+ * its old copies, and checks every copy came out the same as what is shared, then does it again now the copies are current. Returns 0
+ * if a check failed and 1 if they all passed
+ */
+static int checkDeltas(char *port, unsigned char *base, unsigned char *fresh)
+{
+  static char   sharedTemplate[] = "/tmp/onionGetCheck.XXXXXX";
+  static char   copyTemplate[]   = "/tmp/onionGetCopies.XXXXXX";
+  char          *sharedFolder    = NULL;
+  char          *copyFolder      = NULL;
+  char          *fileNames[CHECK_MAX_FILES];
+  char          indexPath[4096];
+  serverOptions options;
+  pid_t         server           = -1;
+  uint32_t      fileCount        = sizeof(deltaCases) / sizeof(deltaCases[0]);
+  uint32_t      file             = 0;
+  uint32_t      round            = 0;
+  int           passed           = 0;
+
+  sharedFolder = mkdtemp(sharedTemplate);
+  copyFolder   = mkdtemp(copyTemplate);
+  if(sharedFolder == NULL || copyFolder == NULL){
+    logEvent("Error", "Failed to create temporary folders");
+    return 0;
+  }
+
+  for(file = 0; file != fileCount; file++){
+    fileNames[file] = (char *)deltaCases[file].name;
+  }
+
+  snprintf(indexPath, sizeof(indexPath), "%s.hashes", sharedFolder);
+
+  for(file = 0; file != fileCount; file++){
+    if( !writeDeltaCase(sharedFolder, copyFolder, &deltaCases[file], base, fresh) ){
+      goto cleanup;
+    }
+  }
+
+  memset(&options, 0, sizeof(options));
+  options.deltaTransfers = 1;
+  options.hashIndexPath  = indexPath;
+
+  server = benchStartServer(sharedFolder, CHECK_MAX_FILES, CHECK_SERVER_CACHE_MB, CHECK_SERVER_CONNECTIONS, port, &options);
+  if(server == -1 || !benchWaitForServer(port)){
+    logEvent("Error", "Failed to start the server");
+    goto cleanup;
+  }
+
+  //files are hashed in the background after the server starts, and a delta without hashes would go unchecked
+  for(file = 0; file != fileCount; file++){
+    if( waitForHashed(port, fileNames[file]) != FETCH_VERIFIED ){
+      printf("deltas     FAILED, the server didn't hash %s in time\n", fileNames[file]);
+      goto cleanup;
+    }
+  }
+
+  for(round = 0; round != 2; round++){
+    if( !updateCopies(port, copyFolder, fileNames, fileCount) ){
+      printf("deltas     FAILED, the client couldn't update its copies\n");
+      goto cleanup;
+    }
+
+    for(file = 0; file != fileCount; file++){
+      if( !filesMatch(sharedFolder, copyFolder, fileNames[file]) ){
+        printf("deltas     FAILED, %s %s differs from what is shared\n", fileNames[file], round ? "brought up to date again" : "rebuilt");
+        goto cleanup;
+      }
+    }
+  }
+
+  printf("deltas     passed, %u copies rebuilt and verified byte for byte, twice\n", fileCount);
+  passed = 1;
+
+  cleanup:
+    stopServer(server);
+    removeFolder(sharedFolder, fileNames, fileCount);
+    removeFolder(copyFolder, fileNames, fileCount);
+    unlink(indexPath);
+    return passed;
+}
+
+
+/*
+ * checkHashes shares three files with a hash index and checks what is rejected as the files and the index are corrupted between
+ * restarts of the server, each on the next port from port. Returns 0 if a check failed and 1 if they all passed
+ */
+static int checkHashes(uint32_t port, unsigned char *base, unsigned char *fresh)
+{
+  static char     sharedTemplate[] = "/tmp/onionGetCheck.XXXXXX";
+  char            *sharedFolder    = NULL;
+  char            *fileNames[]     = { "intact", "corrupted", "stale" };
+  char            indexPath[4096];
+  char            portString[16];
+  struct stat     index;
+  pid_t           server           = -1;
+  uint32_t        fileCount        = sizeof(fileNames) / sizeof(fileNames[0]);
+  uint32_t        file             = 0;
+  uint32_t        rejected         = 0;
+  uint32_t        verified         = 0;
+  int             passed           = 0;
+
+  sharedFolder = mkdtemp(sharedTemplate);
+  if(sharedFolder == NULL){
+    logEvent("Error", "Failed to create temporary folder");
+    return 0;
+  }
+
+  //the index goes beside the shared folder rather than in it, or the server would share it
+  snprintf(indexPath, sizeof(indexPath), "%s.hashes", sharedFolder);
+
+  if( !writeFile(sharedFolder, "intact", base, 3 * 1024 * 1024 + 5, "w") || !writeFile(sharedFolder, "corrupted", fresh, 2 * 1024 * 1024, "w") ||
+      !writeFile(sharedFolder, "stale", base + 7, 1024 * 1024 + 3, "w") ){
+    goto cleanup;
+  }
+
+  //hashed from scratch and persisted, everything passes
+  server = startHashServer(sharedFolder, indexPath, port++, portString);
+  for(file = 0; server != -1 && file != fileCount; file++){
+    if( waitForHashed(portString, fileNames[file]) != FETCH_VERIFIED ){
+      printf("hashes     FAILED, %s wasn't verified once hashed\n", fileNames[file]);
+      goto cleanup;
+    }
+  }
+
+  if( server == -1 || !waitForIndex(indexPath, NULL) ){
+    printf("hashes     FAILED, the index wasn't written\n");
+    goto cleanup;
+  }
+
+  //a chunk rots on disk behind the server's back, its hashes no longer match
+  if( !flipByte(sharedFolder, "corrupted", 1024 * 1024 + 7) ){
+    goto cleanup;
+  }
+
+  if( fetchHashed(portString, "corrupted") != FETCH_REJECTED || fetchHashed(portString, "intact") != FETCH_VERIFIED ){
+    printf("hashes     FAILED, a corrupted chunk wasn't rejected, or an intact file was\n");
+    goto cleanup;
+  }
+
+  stopServer(server);
+  server = -1;
+
+  //changed with its identity in the index left as it was, the index's hashes are stale and loaded as they are
+  if( !flipByte(sharedFolder, "corrupted", 1024 * 1024 + 7) || !flipByte(sharedFolder, "stale", 12345) ){
+    goto cleanup;
+  }
+
+  server = startHashServer(sharedFolder, indexPath, port++, portString);
+  if( server == -1 || fetchHashed(portString, "stale") != FETCH_REJECTED || fetchHashed(portString, "corrupted") != FETCH_VERIFIED ){
+    printf("hashes     FAILED, a file the stale index doesn't match wasn't rejected, or a restored one was\n");
+    goto cleanup;
+  }
+
+  stopServer(server);
+  server = -1;
+
+  //a new mtime is a change the index notices, the file is hashed again and passes
+  if( stat(indexPath, &index) || !touchFile(sharedFolder, "stale") ){
+    goto cleanup;
+  }
+
+  server = startHashServer(sharedFolder, indexPath, port++, portString);
+  if( server == -1 || waitForHashed(portString, "stale") != FETCH_VERIFIED ){
+    printf("hashes     FAILED, a file changed since it was indexed wasn't hashed again\n");
+    goto cleanup;
+  }
+
+  if( !waitForIndex(indexPath, &index.st_mtim) ){
+    printf("hashes     FAILED, the index wasn't rewritten\n");
+    goto cleanup;
+  }
+
+  stopServer(server);
+  server = -1;
+
+  //the last byte of the index is the last chunk hash of whichever file it holds last, that file alone no longer matches
+  if( !flipByte(indexPath, NULL, -1) ){
+    goto cleanup;
+  }
+
+  server = startHashServer(sharedFolder, indexPath, port++, portString);
+  for(file = 0; server != -1 && file != fileCount; file++){
+    switch( fetchHashed(portString, fileNames[file]) ){
+      case FETCH_REJECTED: rejected++; break;
+      case FETCH_VERIFIED: verified++; break;
+    }
+  }
+
+  if(rejected != 1 || verified != fileCount - 1){
+    printf("hashes     FAILED, a corrupted index rejected %u files and verified %u\n", rejected, verified);
+    goto cleanup;
+  }
+
+  printf("hashes     passed, corrupted chunks, stale and corrupted index records rejected\n");
+  passed = 1;
+
+  cleanup:
+    stopServer(server);
+    removeFolder(sharedFolder, fileNames, fileCount);
+    unlink(indexPath);
+    return passed;
+}
+
+
+//starts a server sharing sharedFolder with its hash index at indexPath on port, written to portString, returns its pid or -1 on error
+static pid_t startHashServer(char *sharedFolder, char *indexPath, uint32_t port, char *portString)
+{
+  serverOptions options;
+  pid_t         server = -1;
+
+  memset(&options, 0, sizeof(options));
+  options.hashIndexPath = indexPath;
+
+  snprintf(portString, 16, "%u", port);
+
+  //uncached, so what is corrupted on disk is what is sent
+  server = benchStartServer(sharedFolder, CHECK_MAX_FILES, CHECK_SERVER_CACHE_MB, CHECK_SERVER_CONNECTIONS, portString, &options);
+  if(server != -1 && !benchWaitForServer(portString)){
+    stopServer(server);
+    server = -1;
+  }
+
+  if(server == -1){
+    logEvent("Error", "Failed to start the server");
+  }
+
+  return server;
+}
+
+
+//fetches name with its hashes on a new connection, returns one of the FETCH values
+static int fetchHashed(char *port, char *name)
+{
+  routerObject    *router  = NULL;
+  benchFileResult result;
+  int             outcome  = FETCH_FAILED;
+
+  router = newRouter();
+  if(router == NULL || !router->ipv4Connect(router, "127.0.0.1", port)){
+    logEvent("Error", "Failed to connect to the server");
+    goto cleanup;
+  }
+
+  //the server sends until it is done, a failed fetch over a connection that worked is the client rejecting what it got
+  if( benchFetchBatch(router, &name, 1, REQUEST_FLAG_HASHES, &result) ){
+    outcome = result.verified ? FETCH_VERIFIED : FETCH_UNVERIFIED;
+  }
+  else{
+    outcome = FETCH_REJECTED;
+  }
+
+  cleanup:
+    if(router != NULL){
+      router->destroyRouter(&router);
+    }
+    return outcome;
+}
+
+
+//fetches name until the server has hashed it, returns the FETCH value of the first fetch that wasn't unverified
+static int waitForHashed(char *port, char *name)
+{
+  uint32_t tries   = CHECK_HASH_TRIES;
+  int      outcome = FETCH_UNVERIFIED;
+
+  while( tries-- && (outcome = fetchHashed(port, name)) == FETCH_UNVERIFIED ){
+    usleep(CHECK_HASH_WAIT_USECS);
+  }
+
+  return outcome;
+}
+
+
+//returns 1 once the index at indexPath exists, and was modified after after if it isn't NULL, or 0 if that doesn't happen in time
+static int waitForIndex(const char *indexPath, struct timespec *after)
+{
+  struct stat index;
+  uint32_t    tries = CHECK_HASH_TRIES;
+
+  while(tries--){
+    if( !stat(indexPath, &index) && (after == NULL || index.st_mtim.tv_sec > after->tv_sec ||
+        (index.st_mtim.tv_sec == after->tv_sec && index.st_mtim.tv_nsec > after->tv_nsec)) ){
+      return 1;
+    }
+
+    usleep(CHECK_HASH_WAIT_USECS);
+  }
+
+  return 0;
+}
+
+
+/*
+ * flipByte inverts the byte at offset of folder/name, or of the path folder if name is NULL, counting back from the end if offset is
+ * negative. The file keeps its times, so the change goes unnoticed by anything that goes by them. Returns 0 on error and 1 on success
+ */
+static int flipByte(const char *folder, const char *name, int64_t offset)
+{
+  char            path[4096];
+  struct stat     status;
+  struct timespec times[2];
+  unsigned char   byte  = 0;
+  int             file  = -1;
+  int             done  = 0;
+
+  if(name != NULL){
+    snprintf(path, sizeof(path), "%s/%s", folder, name);
+  }
+  else{
+    snprintf(path, sizeof(path), "%s", folder);
+  }
+
+  file = open(path, O_RDWR);
+  if(file == -1 || fstat(file, &status)){
+    goto cleanup;
+  }
+
+  if(offset < 0){
+    offset += status.st_size;
+  }
+
+  if( pread(file, &byte, 1, offset) != 1 ){
+    goto cleanup;
+  }
+
+  byte = ~byte;
+  times[0] = status.st_atim;
+  times[1] = status.st_mtim;
+
+  done = pwrite(file, &byte, 1, offset) == 1 && !futimens(file, times);
+
+  cleanup:
+    if(file != -1){
+      close(file);
+    }
+    if( !done ){
+      logEvent("Error", "Failed to corrupt a check file");
+    }
+    return done;
+}
+
+
+//sets the times of folder/name to now, returns 0 on error and 1 on success
+static int touchFile(const char *folder, const char *name)
+{
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/%s", folder, name);
+
+  if( utimensat(AT_FDCWD, path, NULL, 0) ){
+    logEvent("Error", "Failed to touch a check file");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * writeDeltaCase writes the shared file of testCase to sharedFolder and the old copy to copyFolder, returns 0 on error and 1 on
+ * success
+ */
+static int writeDeltaCase(const char *sharedFolder, const char *copyFolder, const deltaCase *testCase, unsigned char *base,
+                          unsigned char *fresh)
+{
+  uint32_t tailOffset = testCase->spliceOffset + testCase->spliceRemove;
+
+  if( testCase->copyBytesize && !writeFile(copyFolder, testCase->name, base, testCase->copyBytesize, "w") ){
+    return 0;
+  }
+
+  return writeFile(sharedFolder, testCase->name, base, testCase->spliceOffset, "w") &&
+         writeFile(sharedFolder, testCase->name, fresh, testCase->spliceInsert, "a") &&
+         (tailOffset >= testCase->copyBytesize ||
+          writeFile(sharedFolder, testCase->name, base + tailOffset, testCase->copyBytesize - tailOffset, "a"));
+}
+
+
+//writes or appends bytesize bytes to folder/name depending on mode, returns 0 on error and 1 on success
+static int writeFile(const char *folder, const char *name, const unsigned char *bytes, uint32_t bytesize, const char *mode)
+{
+  char path[4096];
+  FILE *out    = NULL;
+  int  written = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", folder, name);
+
+  out = fopen(path, mode);
+  if(out == NULL){
+    logEvent("Error", "Failed to create check file");
+    return 0;
+  }
+
+  written = (fwrite(bytes, 1, bytesize, out) == bytesize);
+  if( fclose(out) || !written ){
+    logEvent("Error", "Failed to write check file");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+//returns 1 if folder/name is the same, byte for byte, in both folders, otherwise 0
+static int filesMatch(const char *firstFolder, const char *secondFolder, const char *name)
+{
+  char   firstPath[4096];
+  char   secondPath[4096];
+  char   firstChunk[FILE_CHUNK_BYTESIZE];
+  char   secondChunk[FILE_CHUNK_BYTESIZE];
+  FILE   *first      = NULL;
+  FILE   *second     = NULL;
+  size_t firstRead   = 0;
+  size_t secondRead  = 0;
+  int    match       = 0;
+
+  snprintf(firstPath, sizeof(firstPath), "%s/%s", firstFolder, name);
+  snprintf(secondPath, sizeof(secondPath), "%s/%s", secondFolder, name);
+
+  first  = fopen(firstPath, "r");
+  second = fopen(secondPath, "r");
+  if(first == NULL || second == NULL){
+    goto cleanup;
+  }
+
+  do{
+    firstRead  = fread(firstChunk, 1, sizeof(firstChunk), first);
+    secondRead = fread(secondChunk, 1, sizeof(secondChunk), second);
+    if( firstRead != secondRead || memcmp(firstChunk, secondChunk, firstRead) ){
+      goto cleanup;
+    }
+  }while(firstRead == sizeof(firstChunk));
+
+  match = 1;
+
+  cleanup:
+    if(first != NULL){
+      fclose(first);
+    }
+    if(second != NULL){
+      fclose(second);
+    }
+    return match;
+}
+
+
+/*
+ * updateCopies has a client connected straight to the server update its copies of fileNames[fileCount] in copyFolder, returns 0 on
+ * error and 1 on success
+ */
+static int updateCopies(char *port, char *copyFolder, char **fileNames, uint32_t fileCount)
+{
+  routerObject   *router   = NULL;
+  clientObject   *client   = NULL;
+  diskFileObject *diskFile = NULL;
+  clientOptions  options;
+  int            updated   = 0;
+
+  router   = newRouter();
+  diskFile = newDiskFile();
+  if(router == NULL || diskFile == NULL || !router->ipv4Connect(router, "127.0.0.1", port)){
+    logEvent("Error", "Failed to connect to the server");
+    goto cleanup;
+  }
+
+  //checkDeltas has waited for every file to be hashed, so every rebuilt chunk is checked against the server's hash of it
+  memset(&options, 0, sizeof(options));
+  options.verifyHashes = 1;
+
+  client = newClient(router);
+  if(client == NULL || !client->configure(client, &options)){
+    goto cleanup;
+  }
+
+  updated = client->updateFiles(client, copyFolder, fileNames, fileCount, diskFile);
+
+  //clients have no destructor yet, the one or two a check makes are left to the process exit
+  cleanup:
+    if(diskFile != NULL){
+      diskFile->closeTearDown(&diskFile);
+    }
+    if(router != NULL){
+      router->destroyRouter(&router);
+    }
+    return updated;
+}
+
+
+static void stopServer(pid_t server)
+{
+  if(server == -1){
+    return;
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+}
+
+
+static void removeFolder(const char *folder, char **fileNames, uint32_t fileCount)
+{
+  char     path[4096];
+  uint32_t file = 0;
+
+  if(folder == NULL){
+    return;
+  }
+
+  for(file = 0; file != fileCount; file++){
+    snprintf(path, sizeof(path), "%s/%s", folder, fileNames[file]);
+    unlink(path);
+  }
+
+  rmdir(folder);
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * wipeBenchmark measures the cost of wiping connection buffers when a connection is reinitialized. It compares the old byte at a time
+ * volatile clear over the full filename buffer and dataCache with the new memoryClear over only the bytes of the dataCache marked dirty
+ * for a few typical requests. Connections no longer have a filename buffer, the request is parsed whole in sendBatch. 
+ * 
+ * usage: ./wipeBenchmark [iterations]
+ */
+
+
+enum{ DEFAULT_WIPE_ITERATIONS = 20000 };
+
+
+typedef struct wipeScenario{
+  const char *name;
+  uint32_t   dataCacheDirtyBytesize; 
+}wipeScenario;
+
+
+static void     legacyMemoryClear(void *memoryPointerV, size_t bytesize);
+static uint64_t getNanoseconds(void);
+static double   timeLegacyWipe(char *filename, char *dataCache, uint32_t iterations);
+static double   timeWipe(char *dataCache, const wipeScenario *scenario, uint32_t iterations);
+
+
+
+int main(int argc, char *argv[])
+{
+  char         *filename    = NULL;
+  char         *dataCache   = NULL; 
+  uint32_t     iterations   = DEFAULT_WIPE_ITERATIONS;
+  uint32_t     scenario     = 0;
+  double       legacyNanos  = 0; 
+  double       wipeNanos    = 0; 
+  
+  const wipeScenario scenarios[] = {
+    { "file not found"      , 0                   },
+    { "small file (4 KB)"   , 4096                },
+    { "one chunk (64 KB)"   , FILE_CHUNK_BYTESIZE }
+  };
+  
+  if(argc > 1){
+    iterations = (uint32_t)strtoul(argv[1], NULL, 10);
+    if(iterations == 0){
+      logEvent("Error", "Iteration count must be a positive integer");
+      return 1; 
+    }
+  }
+  
+  filename  = (char *)secureAllocate(MAX_FILE_ID_BYTESIZE);
+  dataCache = (char *)secureAllocate(FILE_CHUNK_BYTESIZE); 
+  if(filename == NULL || dataCache == NULL){
+    logEvent("Error", "Failed to allocate benchmark buffers");
+    return 1; 
+  }
+  
+  legacyNanos = timeLegacyWipe(filename, dataCache, iterations);
+  
+  printf("%-22s %16s %16s %10s\n", "scenario", "legacy ns/conn", "wipe ns/conn", "speedup"); 
+  
+  for(scenario = 0; scenario != sizeof(scenarios) / sizeof(scenarios[0]); scenario++){
+    wipeNanos = timeWipe(dataCache, &scenarios[scenario], iterations);
+    printf("%-22s %16.1f %16.1f %9.1fx\n", scenarios[scenario].name, legacyNanos, wipeNanos, (wipeNanos > 0) ? legacyNanos / wipeNanos : 0); 
+  }
+  
+  secureFree(&filename, MAX_FILE_ID_BYTESIZE);
+  secureFree(&dataCache, FILE_CHUNK_BYTESIZE); 
+  
+  return 0; 
+}
+
+
+
+/*
+ * legacyMemoryClear is the clear loop memoryClear used before it was vectorised, kept here as the baseline
+ */
+static void legacyMemoryClear(void *memoryPointerV, size_t bytesize)
+{
+  volatile unsigned char *memoryPointer = memoryPointerV;
+  
+  while(bytesize--){
+    *memoryPointer++ = 0;
+  }
+}
+
+
+static uint64_t getNanoseconds(void)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec; 
+}
+
+
+/*
+ * timeLegacyWipe returns the mean nanoseconds per connection of the old reinitialize, which always cleared both buffers in full
+ */
+static double timeLegacyWipe(char *filename, char *dataCache, uint32_t iterations)
+{
+  uint64_t start     = 0;
+  uint32_t remaining = iterations; 
+  
+  start = getNanoseconds(); 
+  
+  while(remaining--){
+    legacyMemoryClear(filename, MAX_FILE_ID_BYTESIZE);
+    legacyMemoryClear(dataCache, FILE_CHUNK_BYTESIZE); 
+  }
+  
+  return (double)(getNanoseconds() - start) / iterations; 
+}
+
+
+/*
+ * timeWipe returns the mean nanoseconds per connection of memoryClear over the dirty bytes of scenario
+ */
+static double timeWipe(char *dataCache, const wipeScenario *scenario, uint32_t iterations)
+{
+  uint64_t start     = 0;
+  uint32_t remaining = iterations; 
+  
+  start = getNanoseconds(); 
+  
+  while(remaining--){
+    memoryClear(dataCache, scenario->dataCacheDirtyBytesize); 
+  }
+  
+  return (double)(getNanoseconds() - start) / iterations; 
+}
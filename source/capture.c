@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#include "capture.h"
+#include "metrics.h"
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Traffic capture
+ *
+ * Records every connection the server handles (when it arrived, how long it took, how many bytes it was sent and which files it asked
+ * for) to a compact binary file, see capture.h for the format, so real traffic can be replayed against a test server later (see
+ * benchmark/replay.c). Each connection's record is built on the stack of the thread serving it and written with a single writev once
+ * the connection is done, so capture costs one system call per connection and nothing at all when it is off.
+ */
+
+
+static const char  captureMagic[4]     = { 'O', 'G', 'T', 'R' };
+
+static atomic_int      globalEnabled        = 0;
+static int             globalDescriptor     = -1;
+static uint64_t        globalCaptureStart   = 0;     //monotonic microseconds
+static pthread_mutex_t globalWriteLock      = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int readExactly(FILE *in, void *buffer, size_t bytesize);
+
+
+
+/*
+ * startCapture truncates path and starts recording connections to it, returns 0 on error and 1 on success
+ */
+int startCapture(const char *path)
+{
+  unsigned char  header[sizeof(captureMagic) + sizeof(uint32_t) + sizeof(uint64_t)];
+  uint32_t       version   = CAPTURE_VERSION;
+  uint64_t       wallStart = 0;
+  struct timeval now;
+
+  if(path == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(globalDescriptor != -1){
+    logEvent("Error", "Capture can only be started once per process");
+    return 0;
+  }
+
+  globalDescriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+  if(globalDescriptor == -1){
+    logEvent("Error", "Failed to open capture file");
+    return 0;
+  }
+
+  gettimeofday(&now, NULL);
+  wallStart          = (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_usec;
+  globalCaptureStart = getMonotonicMicroseconds();
+
+  memcpy(&header[0], captureMagic, sizeof(captureMagic));
+  memcpy(&header[sizeof(captureMagic)], &version, sizeof(version));
+  memcpy(&header[sizeof(captureMagic) + sizeof(version)], &wallStart, sizeof(wallStart));
+
+  if( write(globalDescriptor, header, sizeof(header)) != sizeof(header) ){
+    logEvent("Error", "Failed to write capture header");
+    close(globalDescriptor);
+    globalDescriptor = -1;
+    return 0;
+  }
+
+  atomic_store(&globalEnabled, 1);
+
+  return 1;
+}
+
+
+/*
+ * captureBegin starts a record for a connection accepted at acceptTime (monotonic microseconds), the record does nothing if capture is off
+ */
+void captureBegin(captureRecord *record, uint64_t acceptTime)
+{
+  record->enabled = atomic_load_explicit(&globalEnabled, memory_order_relaxed);
+  if( !record->enabled ){
+    return;
+  }
+
+  record->arrival       = (acceptTime > globalCaptureStart) ? acceptTime - globalCaptureStart : 0;
+  record->bytesSent     = 0;
+  record->fileCount     = 0;
+  record->flags         = 0;
+  record->filesBytesize = 0;
+}
+
+
+/*
+ * captureFile adds a requested file to the record, found is 0 if the server didn't have it
+ */
+void captureFile(captureRecord *record, const char *name, uint32_t nameBytesize, int found, uint32_t bytesize)
+{
+  unsigned char *file   = NULL;
+  uint8_t       length  = 0;
+  uint8_t       wasFound = found ? 1 : 0;
+
+  if( !record->enabled ){
+    return;
+  }
+
+  if(nameBytesize > MAX_FILE_ID_BYTESIZE || record->filesBytesize + 2 + sizeof(uint32_t) + nameBytesize > CAPTURE_RECORD_BYTESIZE){
+    record->flags |= CAPTURE_FLAG_TRUNCATED;
+    return;
+  }
+
+  length = (uint8_t)nameBytesize;
+  file   = &record->files[record->filesBytesize];
+
+  memcpy(&file[0], &length, 1);
+  memcpy(&file[1], &wasFound, 1);
+  memcpy(&file[2], &bytesize, sizeof(uint32_t));
+  memcpy(&file[2 + sizeof(uint32_t)], name, nameBytesize);
+
+  record->filesBytesize += 2 + sizeof(uint32_t) + nameBytesize;
+  record->fileCount++;
+}
+
+
+void captureBytesSent(captureRecord *record, uint32_t bytesize)
+{
+  if(record->enabled){
+    record->bytesSent += bytesize;
+  }
+}
+
+
+/*
+ * captureEnd writes the record out, failed is 1 if the connection ended in an error
+ */
+void captureEnd(captureRecord *record, int failed)
+{
+  unsigned char header[sizeof(uint32_t) + 3 * sizeof(uint64_t) + sizeof(uint32_t) + 1];
+  struct iovec  parts[2];
+  uint32_t      recordBytesize = 0;
+  uint64_t      duration       = 0;
+  ssize_t       written        = 0;
+
+  if( !record->enabled ){
+    return;
+  }
+
+  if(failed){
+    record->flags |= CAPTURE_FLAG_FAILED;
+  }
+
+  duration       = getMonotonicMicroseconds() - globalCaptureStart - record->arrival;
+  recordBytesize = sizeof(header) - sizeof(uint32_t) + record->filesBytesize;
+
+  memcpy(&header[0], &recordBytesize, sizeof(uint32_t));
+  memcpy(&header[4], &record->arrival, sizeof(uint64_t));
+  memcpy(&header[12], &duration, sizeof(uint64_t));
+  memcpy(&header[20], &record->bytesSent, sizeof(uint64_t));
+  memcpy(&header[28], &record->fileCount, sizeof(uint32_t));
+  memcpy(&header[32], &record->flags, 1);
+
+  parts[0].iov_base = header;
+  parts[0].iov_len  = sizeof(header);
+  parts[1].iov_base = record->files;
+  parts[1].iov_len  = record->filesBytesize;
+
+  //O_APPEND makes each writev land whole at the end of the file, the lock keeps that true where the kernel doesn't promise it
+  pthread_mutex_lock(&globalWriteLock);
+  written = writev(globalDescriptor, parts, 2);
+  pthread_mutex_unlock(&globalWriteLock);
+
+  if(written != (ssize_t)(sizeof(header) + record->filesBytesize)){
+    //a partial record would make the rest of the file unreadable, so stop capturing rather than carry on after it
+    atomic_store(&globalEnabled, 0);
+    logEvent("Error", "Failed to write capture record, capture stopped");
+  }
+}
+
+
+/*
+ * openCapture opens a capture file for reading and checks its header, returns NULL on error. captureStart is set to when the capture
+ * started, in microseconds since the epoch
+ */
+FILE *openCapture(const char *path, uint64_t *captureStart)
+{
+  FILE     *in          = NULL;
+  char     magic[sizeof(captureMagic)];
+  uint32_t version      = 0;
+
+  if(path == NULL || captureStart == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return NULL;
+  }
+
+  in = fopen(path, "r");
+  if(in == NULL){
+    logEvent("Error", "Failed to open capture file");
+    return NULL;
+  }
+
+  if( !readExactly(in, magic, sizeof(magic)) || memcmp(magic, captureMagic, sizeof(magic)) || !readExactly(in, &version, sizeof(version)) ||
+      version != CAPTURE_VERSION || !readExactly(in, captureStart, sizeof(uint64_t)) ){
+    logEvent("Error", "Not a capture file, or from an unsupported version");
+    fclose(in);
+    return NULL;
+  }
+
+  return in;
+}
+
+
+/*
+ * readCapturedConnection reads the next connection from a capture file, returns 1 if one was read, 0 at the end of the file and -1 on
+ * error. connection->files is allocated here and must be freed by the caller
+ */
+int readCapturedConnection(FILE *in, capturedConnection *connection)
+{
+  uint32_t recordBytesize = 0;
+  uint32_t bytesRead      = 0;
+  uint32_t file           = 0;
+  uint8_t  nameBytesize   = 0;
+
+  if(in == NULL || connection == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return -1;
+  }
+
+  if( fread(&recordBytesize, sizeof(recordBytesize), 1, in) != 1 ){
+    return feof(in) ? 0 : -1;
+  }
+
+  if( !readExactly(in, &connection->arrival, sizeof(uint64_t)) || !readExactly(in, &connection->duration, sizeof(uint64_t)) ||
+      !readExactly(in, &connection->bytesSent, sizeof(uint64_t)) || !readExactly(in, &connection->fileCount, sizeof(uint32_t)) ||
+      !readExactly(in, &connection->flags, 1) ){
+    logEvent("Error", "Truncated capture record");
+    return -1;
+  }
+
+  bytesRead         = 3 * sizeof(uint64_t) + sizeof(uint32_t) + 1;
+  connection->files = NULL;
+
+  if(connection->fileCount > CAPTURE_RECORD_BYTESIZE / (2 + sizeof(uint32_t))){
+    logEvent("Error", "Corrupt capture record");
+    return -1;
+  }
+
+  if(connection->fileCount){
+    connection->files = (capturedFile *)secureAllocateTagged(connection->fileCount * sizeof(capturedFile), MEMORY_TAG_DIAGNOSTICS);
+    if(connection->files == NULL){
+      logEvent("Error", "Failed to allocate captured files");
+      return -1;
+    }
+  }
+
+  for(file = 0; file != connection->fileCount; file++){
+    if( !readExactly(in, &nameBytesize, 1) || nameBytesize > MAX_FILE_ID_BYTESIZE || !readExactly(in, &connection->files[file].found, 1) ||
+        !readExactly(in, &connection->files[file].bytesize, sizeof(uint32_t)) || !readExactly(in, connection->files[file].name, nameBytesize) ){
+      logEvent("Error", "Truncated capture record");
+      secureFree(&connection->files, connection->fileCount * sizeof(capturedFile));
+      return -1;
+    }
+
+    bytesRead += 2 + sizeof(uint32_t) + nameBytesize;
+  }
+
+  if(bytesRead != recordBytesize){
+    logEvent("Error", "Corrupt capture record");
+    secureFree(&connection->files, connection->fileCount * sizeof(capturedFile));
+    return -1;
+  }
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static int readExactly(FILE *in, void *buffer, size_t bytesize)
+{
+  return bytesize == 0 || fread(buffer, bytesize, 1, in) == 1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include "ogEnums.h"
+
+
+/*
+ * Capture file format, integers are in host byte order
+ *
+ * header     | "OGTR" | version uint32 | capture start, microseconds since the epoch uint64 |
+ * connection | record bytesize uint32 (of everything after this field) | arrival uint64 | duration uint64 | bytes sent uint64 |
+ *            | file count uint32 | flags uint8 | files ... |
+ * file       | name bytesize uint8 | found uint8 | file bytesize uint32 | name |
+ *
+ * arrival is microseconds since the capture started, duration runs from arrival until the connection was finished with. File contents
+ * are never recorded.
+ */
+enum{ CAPTURE_FLAG_FAILED    = 1 };   //the connection ended in an error
+enum{ CAPTURE_FLAG_TRUNCATED = 2 };   //the batch had more files than fit in the record, the totals still count them
+
+
+//built up on the stack of the thread serving a connection, then written out whole
+typedef struct captureRecord{
+  int           enabled;
+  uint64_t      arrival;
+  uint64_t      bytesSent;
+  uint32_t      fileCount;
+  uint8_t       flags;
+  uint32_t      filesBytesize;
+  unsigned char files[CAPTURE_RECORD_BYTESIZE];
+}captureRecord;
+
+typedef struct capturedFile{
+  char     name[MAX_FILE_ID_BYTESIZE + 1];
+  uint8_t  found;
+  uint32_t bytesize;
+}capturedFile;
+
+typedef struct capturedConnection{
+  uint64_t     arrival;
+  uint64_t     duration;
+  uint64_t     bytesSent;
+  uint8_t      flags;
+  uint32_t     fileCount;
+  capturedFile *files;      //fileCount files, free with secureFree(&files, fileCount * sizeof(capturedFile))
+}capturedConnection;
+
+
+int  startCapture(const char *path);
+void captureBegin(captureRecord *record, uint64_t acceptTime);
+void captureFile(captureRecord *record, const char *name, uint32_t nameBytesize, int found, uint32_t bytesize);
+void captureBytesSent(captureRecord *record, uint32_t bytesize);
+void captureEnd(captureRecord *record, int failed);
+
+FILE *openCapture(const char *path, uint64_t *captureStart);
+int  readCapturedConnection(FILE *in, capturedConnection *connection);
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdint.h>
 #include  <unistd.h>
+#include <arpa/inet.h>
 
 #include "router.h"
 #include "memoryManager.h"
@@ -10,6 +11,11 @@
 #include "client.h"
 #include "ogEnums.h" 
 #include "macros.h"
+#include "trace.h"
+#include "probes.h"
+#include "transferCompression.h"
+#include "fileHash.h"
+#include "delta.h"
 
 
 
@@ -17,21 +23,36 @@
 typedef struct clientPrivate{
   clientObject   publicClient;
   routerObject  *router;
+  clientOptions options;
 }clientPrivate;
 
+//where a framed file's decoded chunks are written, see writeDecodedChunk
+typedef struct incomingFile{
+  diskFileObject *diskFile;
+  uint32_t       writeOffset;
+  uint32_t       traceId;
+  hashVerifier   *verifier;
+}incomingFile;
+
 
 
 //PUBLIC METHODS
 static int   getFiles(clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface);
+static int   getFilesScheduled(clientObject *this, char *dirPath, char **fileNames, uint32_t *priorities, uint32_t fileCount, diskFileObject *clientFileInterface);
+static int   updateFiles(clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface);
 static int   initializeSocks(clientObject *this, char *torBindAddress, char *torPort);
 static int   establishConnection(clientObject *this, char *onionAddress, char *onionPort);
 static int   setRouter(clientObject *client, routerObject *router);   
+static int   configure(clientObject *this, clientOptions *options);
 
 
 //PRIVATE METHODS
-static uint32_t  calculateTotalRequestBytesize(char **fileNames, uint32_t fileCount);
-static int       sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t fileCount);
-static int       getIncomingFile(clientObject *this, diskFileObject *diskFile);
+static uint32_t  calculateTotalRequestBytesize(char **fileNames, uint32_t *priorities, uint32_t fileCount);
+static int       sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t *priorities, uint32_t fileCount, uint32_t requestFlags);
+static int       getIncomingFile(clientObject *this, diskFileObject *diskFile, uint32_t requestFlags);
+static int       getIncomingDelta(clientObject *this, diskFileObject *diskFile, deltaSignature *signature, uint32_t requestFlags);
+static uint32_t  getRequestFlags(clientObject *this);
+static int       writeDecodedChunk(void *incomingV, unsigned char *bytes, uint32_t bytesize);
 static int       hsValueSanityCheck(char *onionAddress, char *onionPort);
 
 
@@ -55,8 +76,11 @@ clientObject *newClient(routerObject *router)
   
   //initialize public methods
   privateThis->publicClient.getFiles            = &getFiles; 
+  privateThis->publicClient.getFilesScheduled   = &getFilesScheduled; 
+  privateThis->publicClient.updateFiles         = &updateFiles; 
   privateThis->publicClient.establishConnection = &establishConnection; 
   privateThis->publicClient.initializeSocks     = &initializeSocks; 
+  privateThis->publicClient.configure           = &configure; 
   
   //initialize private properties
   privateThis->router = router;
@@ -132,15 +156,16 @@ static int establishConnection(clientObject *this, char *onionAddress, char *oni
  */
 static int getFiles(clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface)
 {
-  int currentFile = 0;
+  int      currentFile  = 0;
+  uint32_t requestFlags = getRequestFlags(this); 
   
   if( this == NULL || dirPath == NULL || fileNames == NULL || clientFileInterface == NULL){
     logEvent("Error", "Something was NULL that shouldn't have been");
     return 0;
   }
   
-  //send the server the requested file names
-  if( !sendRequestedFilenames(this, fileNames, fileCount) ){
+  //send the server the requested file names, asking for whatever the client is configured to decompress and verify
+  if( !sendRequestedFilenames(this, fileNames, NULL, fileCount, requestFlags) ){
     logEvent("Error", "Failed to send server request string");
     return 0;
   }
@@ -154,13 +179,13 @@ static int getFiles(clientObject *this, char *dirPath, char **fileNames, uint32_
     }
     
     //then get the incoming file and write it to the disk
-    if( !getIncomingFile(this, clientFileInterface) ){
+    if( !getIncomingFile(this, clientFileInterface, requestFlags) ){
       logEvent("Error", "Failed to get file");
       return 0; 
     }
     
     //then reinitialize the clientFileInterface
-    if( !clientFileInterace->reinitialize(clientFileInterface) ){ //TODO TODO TODO TODO TODO TODO TODO need to implement this
+    if( !clientFileInterface->dfReinitialize(clientFileInterface) ){
       logEvent("Error", "Failed to tear down disk file");
       return 0;
     }
@@ -174,15 +199,251 @@ static int getFiles(clientObject *this, char *dirPath, char **fileNames, uint32_
 }
 
 
+/*
+ * getFilesScheduled is getFiles, but the server looks up the whole batch first and sends the files smallest first, or in order of
+ * priorities[fileCount] (lowest first) if it isn't NULL. Each file arrives preceded by its index in fileNames. Returns 0 on error and 1 on success
+ */
+static int getFilesScheduled(clientObject *this, char *dirPath, char **fileNames, uint32_t *priorities, uint32_t fileCount, diskFileObject *clientFileInterface)
+{
+  clientPrivate *private      = NULL;
+  unsigned char *received     = NULL;
+  uint32_t      requestFlags  = REQUEST_FLAG_SCHEDULED | getRequestFlags(this);
+  uint32_t      fileIndex     = 0;
+  uint32_t      filesLeft     = 0;
+  int           success       = 0;
+  
+  private = (clientPrivate *)this; 
+  
+  if( private == NULL || dirPath == NULL || fileNames == NULL || clientFileInterface == NULL || fileCount == 0){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if(priorities != NULL){
+    requestFlags |= REQUEST_FLAG_PRIORITIES; 
+  }
+  
+  //which files have arrived, so a server can't send one twice in place of another
+  received = (unsigned char *)secureAllocate(fileCount); 
+  if(received == NULL){
+    logEvent("Error", "Failed to allocate memory for the received files");
+    return 0; 
+  }
+  
+  if( !sendRequestedFilenames(this, fileNames, priorities, fileCount, requestFlags) ){
+    logEvent("Error", "Failed to send server request string");
+    goto cleanup;
+  }
+  
+  for(filesLeft = fileCount; filesLeft; filesLeft--){
+    if( !private->router->receive(private->router, &fileIndex, sizeof(uint32_t)) ){
+      logEvent("Error", "Failed to receive file index");
+      goto cleanup; 
+    }
+    
+    fileIndex = ntohl(fileIndex); 
+    if(fileIndex >= fileCount || received[fileIndex]){
+      logEvent("Error", "Server sent an invalid file index");
+      goto cleanup; 
+    }
+    
+    received[fileIndex] = 1; 
+    
+    if( !clientFileInterface->dfOpen(clientFileInterface, dirPath, fileNames[fileIndex], "w") ){
+      logEvent("Error", "Failed to open file on disk");
+      goto cleanup; 
+    }
+    
+    if( !getIncomingFile(this, clientFileInterface, requestFlags) ){
+      logEvent("Error", "Failed to get file");
+      goto cleanup; 
+    }
+    
+    if( !clientFileInterface->dfReinitialize(clientFileInterface) ){
+      logEvent("Error", "Failed to tear down disk file");
+      goto cleanup;
+    }
+  }
+  
+  sync(); 
+  
+  success = 1; 
+  
+  cleanup:
+    secureFree(&received, fileCount); 
+    return success; 
+}
+
+
+
+/*
+ * updateFiles is getFiles for files there may already be copies of in dirPath, the copies are signed and sent with the request and
+ * each file arrives as a delta against its copy that is rebuilt in place (see delta.h), files without copies arrive whole. Needs a
+ * build with BLAKE3=1. Returns 0 on error and 1 on success
+ */
+static int updateFiles(clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface)
+{
+  clientPrivate  *private     = NULL;
+  deltaSignature *signatures  = NULL;
+  char           path[4096]; 
+  struct stat    status; 
+  uint32_t       requestFlags = REQUEST_FLAG_DELTA; 
+  uint32_t       blockBudget  = DELTA_MAX_BATCH_BLOCKS; 
+  uint32_t       currentFile  = 0; 
+  int            haveCopy     = 0; 
+  int            success      = 0; 
+  
+  private = (clientPrivate *)this; 
+  
+  if( private == NULL || dirPath == NULL || fileNames == NULL || clientFileInterface == NULL || fileCount == 0){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if( !deltaAvailable() ){
+    logEvent("Error", "Updating files needs a build with BLAKE3=1");
+    return 0; 
+  }
+  
+  //compressed literals would need a second decoder in the middle of the delta, so deltas are never asked for compressed
+  requestFlags |= getRequestFlags(this) & REQUEST_FLAG_HASHES; 
+  
+  signatures = (deltaSignature *)secureAllocate(fileCount * sizeof(deltaSignature)); 
+  if(signatures == NULL){
+    logEvent("Error", "Failed to allocate memory for the delta signatures");
+    return 0; 
+  }
+  
+  //sign every copy up front, the signatures follow the request before the server sends anything
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    if( snprintf(path, sizeof(path), "%s/%s", dirPath, fileNames[currentFile]) >= sizeof(path) ){
+      logEvent("Error", "File path is too long");
+      goto cleanup; 
+    }
+    
+    haveCopy = !stat(path, &status) && S_ISREG(status.st_mode) && status.st_size > 0 && status.st_size <= UINT32_MAX; 
+    if( !haveCopy ){
+      deltaSign(&signatures[currentFile], NULL, 0, &blockBudget); 
+      continue; 
+    }
+    
+    if( !clientFileInterface->dfOpen(clientFileInterface, dirPath, fileNames[currentFile], "r") ){
+      logEvent("Error", "Failed to open file on disk");
+      goto cleanup; 
+    }
+    
+    if( !deltaSign(&signatures[currentFile], clientFileInterface, (uint32_t)status.st_size, &blockBudget) ){
+      logEvent("Error", "Failed to sign the copy of a file");
+      goto cleanup; 
+    }
+    
+    if( !clientFileInterface->dfReinitialize(clientFileInterface) ){
+      logEvent("Error", "Failed to tear down disk file");
+      goto cleanup;
+    }
+  }
+  
+  if( !sendRequestedFilenames(this, fileNames, NULL, fileCount, requestFlags) ){
+    logEvent("Error", "Failed to send server request string");
+    goto cleanup;
+  }
+  
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    if( !deltaTransmitSignature(private->router, &signatures[currentFile]) ){
+      logEvent("Error", "Failed to send delta signature");
+      goto cleanup; 
+    }
+  }
+  
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    //the copy is rebuilt where it is, a file without one is rebuilt from nothing
+    if( !clientFileInterface->dfOpen(clientFileInterface, dirPath, fileNames[currentFile], signatures[currentFile].basisBytesize ? "r+" : "w+") ){
+      logEvent("Error", "Failed to open file on disk");
+      goto cleanup; 
+    }
+    
+    if( !getIncomingDelta(this, clientFileInterface, &signatures[currentFile], requestFlags) ){
+      logEvent("Error", "Failed to get file");
+      goto cleanup; 
+    }
+    
+    if( !clientFileInterface->dfReinitialize(clientFileInterface) ){
+      logEvent("Error", "Failed to tear down disk file");
+      goto cleanup;
+    }
+  }
+  
+  sync(); 
+  
+  success = 1; 
+  
+  cleanup:
+    for(currentFile = 0; currentFile != fileCount; currentFile++){
+      deltaSignatureRelease(&signatures[currentFile]); 
+    }
+    secureFree(&signatures, fileCount * sizeof(deltaSignature)); 
+    return success; 
+}
+
+
+
+/*
+ * configure sets the optional client behaviour, before any files are requested. Returns 0 on error, including options this build
+ * can't honour, and 1 on success
+ */
+static int configure(clientObject *this, clientOptions *options)
+{
+  clientPrivate *private = (clientPrivate *)this; 
+  
+  if(private == NULL || options == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  if(options->compressTransfers && !transferCompressionAvailable()){
+    logEvent("Error", "Compressed transfers need a build with ZSTD=1");
+    return 0; 
+  }
+  
+  if(options->verifyHashes && !hashAvailable()){
+    logEvent("Error", "Verifying file hashes needs a build with BLAKE3=1");
+    return 0; 
+  }
+  
+  memcpy(&private->options, options, sizeof(clientOptions)); 
+  
+  return 1; 
+}
+
+
 
 /************* PRIVATE METHODS ****************/ 
 
 
 
+//returns the request flags for what the client is configured to decompress and verify, configure checks the build can
+static uint32_t getRequestFlags(clientObject *this)
+{
+  clientPrivate *private      = (clientPrivate *)this; 
+  uint32_t      requestFlags  = 0; 
+  
+  if(private->options.compressTransfers){
+    requestFlags |= REQUEST_FLAG_COMPRESSED; 
+  }
+  
+  if(private->options.verifyHashes){
+    requestFlags |= REQUEST_FLAG_HASHES; 
+  }
+  
+  return requestFlags; 
+}
+
+
 /*
- * getIncomingFile returns 0 on error and 1 on success TODO check int types
+ * getIncomingFile returns 0 on error and 1 on success, requestFlags are those the file was requested with, with REQUEST_FLAG_HASHES
+ * every chunk is checked against the server's hash of it before it is written TODO check int types
  */ 
-static int getIncomingFile(clientObject *this, diskFileObject *diskFile)
+static int getIncomingFile(clientObject *this, diskFileObject *diskFile, uint32_t requestFlags)
 {  
   char                incomingFileChunk[FILE_CHUNK_BYTESIZE]; 
   
@@ -190,6 +451,12 @@ static int getIncomingFile(clientObject *this, diskFileObject *diskFile)
   size_t              bytesToGet           = 0; 
   uint32_t            bytesWritten         = 0; 
   uint32_t            writeOffset          = FILE_START; 
+  uint32_t            traceId              = 0; 
+  uint64_t            spanStart            = 0; 
+  int                 received             = 0; 
+  transferDecoder     decoder; 
+  incomingFile        incoming; 
+  hashVerifier        verifier; 
   
   clientPrivate *private = NULL;
   private = (clientPrivate *)this; 
@@ -200,14 +467,53 @@ static int getIncomingFile(clientObject *this, diskFileObject *diskFile)
     return 0; 
   }
   
+  traceId = traceBeginRequest(); 
+  
   //the server sends us the incoming file's bytesize
+  spanStart            = traceStart(traceId); 
   incomingFileBytesize = private->router->getIncomingBytesize(private->router); 
+  traceSpan(traceId, "receive file bytesize", spanStart, sizeof(uint32_t)); 
   if(!incomingFileBytesize){
     memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
     logEvent("Error", "Failed to get incoming file bytesize, aborting");
     return 0;
   }
   
+  //a zeroed verifier passes every chunk, so a file the server hasn't hashed goes through the same paths
+  memset(&verifier, 0, sizeof(verifier)); 
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !hashReceive(&verifier, private->router, incomingFileBytesize) ){
+    memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
+    hashVerifierRelease(&verifier); 
+    logEvent("Error", "Failed to receive file hashes");
+    return 0; 
+  }
+  
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !verifier.hashed ){
+    logEvent("Warning", "Server hasn't hashed the file yet, it can't be verified");
+  }
+  
+  //framed, the chunks are decompressed as they arrive and written out once decoded
+  if(requestFlags & REQUEST_FLAG_COMPRESSED){
+    memset(&decoder, 0, sizeof(decoder)); 
+    incoming.diskFile    = diskFile; 
+    incoming.writeOffset = FILE_START; 
+    incoming.traceId     = traceId; 
+    incoming.verifier    = &verifier; 
+    
+    received = transferReceiveFile(&decoder, private->router, incomingFileBytesize, &writeDecodedChunk, &incoming) && hashVerifyEnd(&verifier); 
+    transferDecoderRelease(&decoder); 
+    hashVerifierRelease(&verifier); 
+    memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
+    
+    if( !received ){
+      logEvent("Error", "Failed to receive framed file");
+      return 0; 
+    }
+    
+    traceInstant(traceId, "last byte", incoming.writeOffset); 
+    return 1; 
+  }
+  
    
   //next we get the incoming file from the server in incomingFileChunkBytesize chunks, until there are no more chunks
   for(bytesToGet = 0 ; incomingFileBytesize ; incomingFileBytesize -=  bytesToGet){
@@ -216,35 +522,149 @@ static int getIncomingFile(clientObject *this, diskFileObject *diskFile)
     bytesToGet = (incomingFileBytesize <= FILE_CHUNK_BYTESIZE) ? incomingFileBytesize : FILE_CHUNK_BYTESIZE; 
         
     //get up to FILE_CHUNK_BYTESIZE bytes of the file
+    spanStart = traceStart(traceId); 
     if( !private->router->receive(private->router, incomingFileChunk, bytesToGet) ){
       memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
+      hashVerifierRelease(&verifier); 
       logEvent("Error", "Failed to receive data chunk");
       return 0; // TODO good error checking soon (plus wipe)
     }
+    traceSpan(traceId, "chunk receive", spanStart, bytesToGet); 
+    PROBE2(client_chunk_received, bytesToGet, writeOffset); 
+    
+    if( !hashVerifyChunk(&verifier, incomingFileChunk, bytesToGet) ){
+      memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
+      hashVerifierRelease(&verifier); 
+      logEvent("Error", "Received file is corrupt, aborting");
+      return 0; 
+    }
+    
+    if(writeOffset == FILE_START){
+      traceInstant(traceId, "first byte", bytesToGet); 
+    }
            
     //then write it to disk
+    spanStart    = traceStart(traceId); 
     bytesWritten = diskFile->dfWrite(diskFile, incomingFileChunk, bytesToGet, writeOffset);
     if(bytesWritten == 0){
       memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
+      hashVerifierRelease(&verifier); 
       logEvent("Error", "Failed to write file to disk, aborting");
       return 0;
     }
+    traceSpan(traceId, "chunk write", spanStart, bytesWritten); 
+    PROBE2(client_chunk_written, bytesWritten, writeOffset); 
     writeOffset += bytesWritten; 
 
   }
   
+  traceInstant(traceId, "last byte", writeOffset); 
+  
   memoryClear(incomingFileChunk, FILE_CHUNK_BYTESIZE);
   
+  received = hashVerifyEnd(&verifier); 
+  hashVerifierRelease(&verifier); 
+  
+  return received; 
+}
+
+
+/*
+ * getIncomingDelta receives a file sent as a delta against signature and rebuilds it in diskFile, which holds the copy that was signed.
+ * With REQUEST_FLAG_HASHES the rebuilt file is checked chunk by chunk before it is written. Returns 0 on error and 1 on success
+ */
+static int getIncomingDelta(clientObject *this, diskFileObject *diskFile, deltaSignature *signature, uint32_t requestFlags)
+{
+  clientPrivate *private              = NULL;
+  uint32_t      incomingFileBytesize  = 0; 
+  uint32_t      traceId               = 0; 
+  uint64_t      spanStart             = 0; 
+  int           received              = 0; 
+  hashVerifier  verifier; 
+  
+  private = (clientPrivate *)this; 
+  
+  if(private == NULL || private->router == NULL || diskFile == NULL || signature == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  traceId = traceBeginRequest(); 
+  
+  spanStart            = traceStart(traceId); 
+  incomingFileBytesize = private->router->getIncomingBytesize(private->router); 
+  traceSpan(traceId, "receive file bytesize", spanStart, sizeof(uint32_t)); 
+  if(!incomingFileBytesize){
+    logEvent("Error", "Failed to get incoming file bytesize, aborting");
+    return 0;
+  }
+  
+  memset(&verifier, 0, sizeof(verifier)); 
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !hashReceive(&verifier, private->router, incomingFileBytesize) ){
+    hashVerifierRelease(&verifier); 
+    logEvent("Error", "Failed to receive file hashes");
+    return 0; 
+  }
+  
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !verifier.hashed ){
+    logEvent("Warning", "Server hasn't hashed the file yet, it can't be verified");
+  }
+  
+  spanStart = traceStart(traceId); 
+  received  = deltaReceiveFile(private->router, diskFile, signature, incomingFileBytesize, &verifier) && hashVerifyEnd(&verifier); 
+  traceSpan(traceId, "delta receive", spanStart, incomingFileBytesize); 
+  hashVerifierRelease(&verifier); 
+  
+  if( !received ){
+    logEvent("Error", "Failed to rebuild file from delta");
+    return 0; 
+  }
+  
+  traceInstant(traceId, "last byte", incomingFileBytesize); 
   return 1; 
 }
 
 
 /*
- * sendRequestedFilenames returns 0 on error and 1 on success
+ * writeDecodedChunk is the transferSink of a framed file, it verifies each decoded chunk and writes it to the disk, returns 0 on error
+ * and 1 on success
+ */
+static int writeDecodedChunk(void *incomingV, unsigned char *bytes, uint32_t bytesize)
+{
+  incomingFile *incoming    = (incomingFile *)incomingV; 
+  uint32_t     bytesWritten = 0; 
+  uint64_t     spanStart    = 0; 
+  
+  if(incoming->writeOffset == FILE_START){
+    traceInstant(incoming->traceId, "first byte", bytesize); 
+  }
+  
+  if( !hashVerifyChunk(incoming->verifier, bytes, bytesize) ){
+    logEvent("Error", "Received file is corrupt, aborting");
+    return 0; 
+  }
+  
+  spanStart    = traceStart(incoming->traceId); 
+  bytesWritten = incoming->diskFile->dfWrite(incoming->diskFile, bytes, bytesize, incoming->writeOffset);
+  if(bytesWritten == 0){
+    logEvent("Error", "Failed to write file to disk, aborting");
+    return 0;
+  }
+  traceSpan(incoming->traceId, "chunk write", spanStart, bytesWritten); 
+  PROBE2(client_chunk_written, bytesWritten, incoming->writeOffset); 
+  incoming->writeOffset += bytesWritten; 
+  
+  return 1; 
+}
+
+
+/*
+ * sendRequestedFilenames returns 0 on error and 1 on success, requestFlags go in the high bits of the request string bytesize and
+ * priorities[fileCount] are only sent if it isn't NULL
  * 
- * [request string bytesize][first filename bytesize][first file name][second filename bytesize][second file name]
+ * [request string bytesize | flags][first priority][first filename bytesize][first file name][second priority][second filename bytesize]...
  */
-static int sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t fileCount)
+static int sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t *priorities, uint32_t fileCount, uint32_t requestFlags)
 {
   uint32_t      fileRequestStringBytesize = 0;
   uint32_t      currentFile               = 0;
@@ -257,20 +677,30 @@ static int sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t
     return 0;
   }
   
-  fileRequestStringBytesize = calculateTotalRequestBytesize(fileNames, fileCount);
+  fileRequestStringBytesize = calculateTotalRequestBytesize(fileNames, priorities, fileCount);
   if(fileRequestStringBytesize == -1){
     logEvent("Error", "Failed to calculate file request string bytesize");
     return 0; 
   }
   
+  if(fileRequestStringBytesize > MAX_REQUEST_STRING_BYTESIZE){
+    logEvent("Error", "File request string is larger than the server allows");
+    return 0; 
+  }
+  
   //let the server know the bytesize of the request string
-  if( !private->router->transmitBytesize(private->router, fileRequestStringBytesize) ){
+  if( !private->router->transmitBytesize(private->router, fileRequestStringBytesize | requestFlags) ){
     logEvent("Error", "Failed to transmit request string");
     return 0;
   }
   
   //send the server the requested file file file names TODO clean this up (ie: don't take strlen twice)  
   for(currentFile = 0; currentFile != fileCount; currentFile++){
+    if(priorities != NULL && !private->router->transmitBytesize(private->router, priorities[currentFile]) ){
+      logEvent("Error", "Failed to send server file priority"); 
+      return 0; 
+    }
+    
     if(!private->router->transmitBytesize(private->router, strlen(fileNames[currentFile])) ){
       logEvent("Error", "Failed to send server file name bytesize");
       return 0; 
@@ -290,7 +720,7 @@ static int sendRequestedFilenames(clientObject *this, char **fileNames, uint32_t
 /*
  * calculateTotalRequestBytesize returns 0 on error and the bytesize of the file request string on success //TODO set errno or something?
  */
-static uint32_t calculateTotalRequestBytesize(char **fileNames, uint32_t fileCount)
+static uint32_t calculateTotalRequestBytesize(char **fileNames, uint32_t *priorities, uint32_t fileCount)
 {
   uint32_t fileRequestStringBytesize = 0; 
   uint32_t currentFile               = 0;
@@ -304,6 +734,10 @@ static uint32_t calculateTotalRequestBytesize(char **fileNames, uint32_t fileCou
   //get bytesize of each requested file name and add it to the file request strings total bytesize + 1 byte each for the delimiter
   for(currentFile = 0, fileRequestStringBytesize = 0 ; fileCount-- ; currentFile++ ){
     fileRequestStringBytesize += sizeof(uint32_t) + strlen(fileNames[currentFile]);
+    
+    if(priorities != NULL){
+      fileRequestStringBytesize += sizeof(uint32_t); 
+    }
   }
   
   //return the fileRequestStringBytesize
@@ -5,10 +5,20 @@
 #include "diskFile.h"
 
 
+//optional client behaviour, a zeroed clientOptions asks only for what every server understands. Servers reject request flags they
+//don't know or weren't built or configured for, so these are only for servers known to support them
+typedef struct clientOptions{
+  int compressTransfers;   //1 asks for zstd compressed transfers, needs a build with ZSTD=1 and a server with compressTransfers (see transferCompression.h)
+  int verifyHashes;        //1 asks for the file hashes and checks every chunk against them, needs a build with BLAKE3=1 and a server with a hashIndexPath (see fileHash.h)
+}clientOptions;
+
 typedef struct clientObject{  
   int          (*getFiles)(struct clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface);   
+  int          (*getFilesScheduled)(struct clientObject *this, char *dirPath, char **fileNames, uint32_t *priorities, uint32_t fileCount, diskFileObject *clientFileInterface);
+  int          (*updateFiles)(struct clientObject *this, char *dirPath, char **fileNames, uint32_t fileCount, diskFileObject *clientFileInterface);
   int          (*establishConnection)(struct clientObject *this, char *onionAddress, char *onionPort);
   int          (*initializeSocks)(struct clientObject *client, char *torBindAddress, char *torPort);
+  int          (*configure)(struct clientObject *this, clientOptions *options);
 }clientObject; 
 
 
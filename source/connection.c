@@ -11,26 +11,35 @@
 #include "memoryManager.h"
 
 
-static int reinitialize(connectionObject *this);
+static int  reinitialize(connectionObject *this);
+static void markDataCacheDirty(connectionObject *this, uint32_t bytesize);
 
 connectionObject *newConnection(void)
 {
-  connectionObject *this = (connectionObject *)secureAllocate(sizeof(*this));
+  connectionObject *this = (connectionObject *)secureAllocateTagged(sizeof(*this), MEMORY_TAG_CONNECTION);
   if( this == NULL ){
     logEvent("Error", "Failed to allocate connection object");
     return NULL; 
   }
   
   this->router            = newRouter();
-  this->requestedFilename = (char *)secureAllocate(MAX_FILE_ID_BYTESIZE);
-  this->dataCache         = (char *)secureAllocate(FILE_CHUNK_BYTESIZE); 
+  this->dataCache         = (char *)secureAllocateTagged(CONNECTION_CHUNK_BUFFERS * FILE_CHUNK_BYTESIZE, MEMORY_TAG_CONNECTION); 
   
-  this->reinitialize      = &reinitialize; 
+  this->dataCacheDirtyBytesize         = 0; 
+  this->acceptTime                     = 0;
+  this->traceId                        = 0; 
+  
+  this->reinitialize       = &reinitialize; 
+  this->markDataCacheDirty = &markDataCacheDirty; 
  
   return this; 
 }
 
 
+/*
+ * reinitialize returns 0 on error and 1 on success. It resets the router and wipes the connection's data cache, only clearing up to 
+ * the high water mark recorded by markDataCacheDirty, bytes past it were never written since the last wipe
+ */
 static int reinitialize(connectionObject *this)
 {
   if( this == NULL || this->router == NULL){
@@ -43,15 +52,34 @@ static int reinitialize(connectionObject *this)
     return 0; 
   }
   
-  if( !memoryClear(this->requestedFilename, MAX_FILE_ID_BYTESIZE) ){
-    logEvent("Error", "Failed to reinitialize connection.");
-    return 0; 
-  }
-  
-  if( !memoryClear(this->dataCache, FILE_CHUNK_BYTESIZE ) ){
+  if( !memoryClear(this->dataCache, this->dataCacheDirtyBytesize) ){
     logEvent("Error", "Failed to clear client memory cache");
     return 0; 
   }
+  
+  this->dataCacheDirtyBytesize         = 0; 
+  this->acceptTime                     = 0;
+  this->traceId                        = 0; 
     
   return 1; 
+}
+
+
+/*
+ * markDataCacheDirty records that bytesize bytes from the start of dataCache have been written to, so that reinitialize wipes them
+ */
+static void markDataCacheDirty(connectionObject *this, uint32_t bytesize)
+{
+  if(this == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return; 
+  }
+  
+  if(bytesize > CONNECTION_CHUNK_BUFFERS * FILE_CHUNK_BYTESIZE){
+    bytesize = CONNECTION_CHUNK_BUFFERS * FILE_CHUNK_BYTESIZE; 
+  }
+  
+  if(bytesize > this->dataCacheDirtyBytesize){
+    this->dataCacheDirtyBytesize = bytesize; 
+  }
 }
\ No newline at end of file
@@ -1,11 +1,16 @@
+#pragma once
+
 #include "router.h"
 
 typedef struct connectionObject{
   routerObject *router;
-  char         *requestedFilename;
   char         *dataCache; 
+  uint32_t     dataCacheDirtyBytesize;         //high water mark of bytes written to dataCache since the last reinitialize
+  uint64_t     acceptTime;                     //monotonic microseconds when the connection was accepted
+  uint32_t     traceId;                        //0 unless this connection's request is sampled for tracing
   int          (*reinitialize)(struct connectionObject *this); 
+  void         (*markDataCacheDirty)(struct connectionObject *this, uint32_t bytesize);
 }connectionObject;
 
 
-connectionObject *newConnection(void);
\ No newline at end of file
+connectionObject *newConnection(void);
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <curses.h>
+
+#include "dashboard.h"
+#include "metrics.h"
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Live operations dashboard
+ *
+ * Draws the state of a running server on the terminal with ncurses, redrawn once a second: throughput, connections, worker
+ * utilisation, cache hit rate, memory, the most requested files, the slowest transfers in progress and the latest log lines. Everything
+ * shown comes from reading the metrics (see metrics.h) from the dashboard's own thread, rates are the difference between two reads a
+ * second apart, so the server threads pay nothing for the dashboard beyond keeping the transfer table up to date. Pressing q closes the
+ * dashboard and hands the terminal back to the log, the server keeps running.
+ */
+
+
+typedef struct dashboardSnapshot{
+  uint64_t time;
+  uint64_t counters[METRIC_COUNTER_COUNT];
+  uint64_t samples[METRIC_HISTOGRAM_COUNT];
+  uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRIC_HISTOGRAM_BUCKETS];
+}dashboardSnapshot;
+
+typedef struct dashboardRow{
+  const char *name;
+  uint64_t   requests;
+  uint64_t   rate;
+}dashboardRow;
+
+typedef struct dashboardState{
+  dashboardSource   source;
+  dashboardSnapshot snapshots[2];
+  dashboardFile     *files[2];
+  uint32_t          fileCounts[2];
+  dashboardRow      *rows;
+  metricsTransfer   *transfers;
+  int               current;
+}dashboardState;
+
+
+static pthread_mutex_t globalLogLock                                              = PTHREAD_MUTEX_INITIALIZER;
+static char            globalLogLines[DASHBOARD_LOG_LINES][DASHBOARD_LOG_LINE_BYTESIZE];
+static uint32_t        globalLogNext                                              = 0;
+
+
+static void     *runDashboard(void *stateV);
+static void     takeSnapshot(dashboardState *state);
+static void     drawDashboard(dashboardState *state);
+static int      drawThroughput(dashboardState *state, int row);
+static int      drawTopFiles(dashboardState *state, int row, int rowCount);
+static int      drawSlowTransfers(dashboardState *state, int row, int rowCount);
+static void     drawLog(int row);
+static uint64_t perSecond(uint64_t now, uint64_t before, uint64_t elapsed);
+static uint64_t intervalPercentile(dashboardState *state, int histogram, double percentile);
+static uint64_t readResidentBytes(void);
+static void     formatBytes(char *out, size_t outBytesize, uint64_t bytes);
+static void     keepLogLine(const char *line);
+static int      compareRows(const void *first, const void *second);
+static int      compareTransfers(const void *first, const void *second);
+static void     freeState(dashboardState *state);
+
+
+
+/*
+ * startDashboard takes over the terminal and shows the dashboard from a thread of its own until q is pressed, returns 0 on error and 1
+ * on success. Only one dashboard can run per process
+ */
+int startDashboard(dashboardSource *source)
+{
+  dashboardState *state = NULL;
+  pthread_t      thread;
+  pthread_attr_t attributes;
+
+  if(source == NULL || source->readFileRequests == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) ){
+    logEvent("Error", "The dashboard needs a terminal");
+    return 0;
+  }
+
+  state = (dashboardState *)secureAllocateTagged(sizeof(*state), MEMORY_TAG_DIAGNOSTICS);
+  if(state == NULL){
+    logEvent("Error", "Failed to allocate dashboard");
+    return 0;
+  }
+
+  memcpy(&state->source, source, sizeof(state->source));
+
+  if(state->source.maxFiles){
+    state->files[0] = (dashboardFile *)secureAllocateTagged(state->source.maxFiles * sizeof(dashboardFile), MEMORY_TAG_DIAGNOSTICS);
+    state->files[1] = (dashboardFile *)secureAllocateTagged(state->source.maxFiles * sizeof(dashboardFile), MEMORY_TAG_DIAGNOSTICS);
+    state->rows     = (dashboardRow *)secureAllocateTagged(state->source.maxFiles * sizeof(dashboardRow), MEMORY_TAG_DIAGNOSTICS);
+  }
+  state->transfers = (metricsTransfer *)secureAllocateTagged(METRIC_MAX_TRANSFERS * sizeof(metricsTransfer), MEMORY_TAG_DIAGNOSTICS);
+
+  if( (state->source.maxFiles && (state->files[0] == NULL || state->files[1] == NULL || state->rows == NULL)) || state->transfers == NULL ){
+    logEvent("Error", "Failed to allocate dashboard");
+    freeState(state);
+    return 0;
+  }
+
+  setTransferTracking(1);
+
+  if( pthread_attr_init(&attributes) || pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED) ||
+      pthread_create(&thread, &attributes, &runDashboard, state) ){
+    logEvent("Error", "Failed to start dashboard thread");
+    setTransferTracking(0);
+    freeState(state);
+    return 0;
+  }
+
+  pthread_attr_destroy(&attributes);
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void *runDashboard(void *stateV)
+{
+  dashboardState *state  = (dashboardState *)stateV;
+  SCREEN         *screen = NULL;
+  int            polls   = 0;
+  int            key     = 0;
+
+  //newterm rather than initscr, initscr exits the whole process if the terminal can't be used
+  screen = newterm(NULL, stdout, stdin);
+  if(screen == NULL){
+    logEvent("Error", "Failed to initialize the terminal for the dashboard");
+    setTransferTracking(0);
+    freeState(state);
+    return NULL;
+  }
+
+  cbreak();
+  noecho();
+  curs_set(0);
+  timeout(DASHBOARD_POLL_MSECS);
+
+  setLogSink(&keepLogLine);
+
+  takeSnapshot(state);
+
+  while(key != 'q' && key != 'Q'){
+    for(polls = 0, key = 0; polls != DASHBOARD_REFRESH_MSECS / DASHBOARD_POLL_MSECS && key != 'q' && key != 'Q'; polls++){
+      key = getch();
+    }
+
+    takeSnapshot(state);
+    drawDashboard(state);
+  }
+
+  setLogSink(NULL);
+  setTransferTracking(0);
+
+  endwin();
+  delscreen(screen);
+
+  freeState(state);
+  return NULL;
+}
+
+
+/*
+ * takeSnapshot reads the metrics and file request counts into the current snapshot, keeping the previous one to take rates against
+ */
+static void takeSnapshot(dashboardState *state)
+{
+  dashboardSnapshot *snapshot  = NULL;
+  int               metric     = 0;
+
+  state->current = !state->current;
+  snapshot       = &state->snapshots[state->current];
+
+  snapshot->time = getMonotonicMicroseconds();
+
+  for(metric = 0; metric != METRIC_COUNTER_COUNT; metric++){
+    snapshot->counters[metric] = readCounter(metric);
+  }
+
+  for(metric = 0; metric != METRIC_HISTOGRAM_COUNT; metric++){
+    snapshot->samples[metric] = readHistogram(metric, snapshot->buckets[metric]);
+  }
+
+  if(state->source.maxFiles){
+    state->fileCounts[state->current] = state->source.readFileRequests(state->files[state->current], state->source.maxFiles);
+  }
+}
+
+
+static void drawDashboard(dashboardState *state)
+{
+  int row       = 0;
+  int spareRows = 0;
+
+  erase();
+
+  attron(A_BOLD);
+  mvprintw(row++, 0, "onionGet server dashboard                                              q to close");
+  attroff(A_BOLD);
+  row++;
+
+  row = drawThroughput(state, row);
+  row++;
+
+  //split what is left between the files and the transfers, keeping room for the log
+  spareRows = LINES - row - DASHBOARD_LOG_LINES - 4;
+  if(spareRows < 2){
+    spareRows = 2;
+  }
+
+  row = drawTopFiles(state, row, spareRows / 2);
+  row++;
+  row = drawSlowTransfers(state, row, spareRows - spareRows / 2);
+  row++;
+
+  drawLog(row);
+
+  refresh();
+}
+
+
+static int drawThroughput(dashboardState *state, int row)
+{
+  dashboardSnapshot *now       = &state->snapshots[state->current];
+  dashboardSnapshot *before    = &state->snapshots[!state->current];
+  uint64_t          elapsed    = now->time - before->time;
+  uint64_t          hits       = now->counters[METRIC_CACHE_HITS] - before->counters[METRIC_CACHE_HITS];
+  uint64_t          misses     = now->counters[METRIC_CACHE_MISSES] - before->counters[METRIC_CACHE_MISSES];
+  int64_t           active     = readGauge(METRIC_GAUGE_ACTIVE_CONNECTIONS);
+  int64_t           queued     = readGauge(METRIC_GAUGE_QUEUED_CONNECTIONS);
+  int               barWidth   = 40;
+  int               barFill    = 0;
+  char              sent[32];
+  char              cached[32];
+  char              resident[32];
+  char              allocated[32];
+  char              connections[32];
+  char              fileCache[32];
+  memoryTagStats    memory;
+  uint64_t          allocatedBytes = 0;
+  int               tag            = 0;
+
+  formatBytes(sent, sizeof(sent), perSecond(now->counters[METRIC_BYTES_SENT], before->counters[METRIC_BYTES_SENT], elapsed));
+  formatBytes(cached, sizeof(cached), (uint64_t)readGauge(METRIC_GAUGE_CACHE_BYTES));
+  formatBytes(resident, sizeof(resident), readResidentBytes());
+
+  for(tag = 0; tag != MEMORY_TAG_COUNT; tag++){
+    readMemoryTag(tag, &memory);
+    allocatedBytes += memory.liveBytes;
+
+    if(tag == MEMORY_TAG_CONNECTION){
+      formatBytes(connections, sizeof(connections), memory.liveBytes);
+    }
+    else if(tag == MEMORY_TAG_FILE_CACHE){
+      formatBytes(fileCache, sizeof(fileCache), memory.liveBytes);
+    }
+  }
+  formatBytes(allocated, sizeof(allocated), allocatedBytes);
+
+  if(state->source.maxConnections){
+    barFill = (active >= state->source.maxConnections) ? barWidth : (int)(active * barWidth / state->source.maxConnections);
+  }
+
+  mvprintw(row++, 0, "throughput   %10s/s   %8llu files/s   %8llu not found/s   %8llu connections/s", sent,
+           (unsigned long long)perSecond(now->counters[METRIC_FILES_SERVED], before->counters[METRIC_FILES_SERVED], elapsed),
+           (unsigned long long)perSecond(now->counters[METRIC_FILES_NOT_FOUND], before->counters[METRIC_FILES_NOT_FOUND], elapsed),
+           (unsigned long long)perSecond(now->counters[METRIC_CONNECTIONS_ACCEPTED], before->counters[METRIC_CONNECTIONS_ACCEPTED], elapsed));
+
+  mvprintw(row++, 0, "connections  %6lld active   %6lld queued", (long long)active, (long long)queued);
+
+  mvprintw(row, 0, "workers      [");
+  attron(A_REVERSE);
+  mvprintw(row, 14, "%*s", barFill, "");
+  attroff(A_REVERSE);
+  mvprintw(row++, 14 + barWidth, "] %lld of %u busy", (long long)active, state->source.maxConnections);
+
+  if(hits + misses){
+    mvprintw(row++, 0, "cache        %5.1f%% hit rate   %10s cached", 100.0 * hits / (hits + misses), cached);
+  }
+  else{
+    mvprintw(row++, 0, "cache            -  hit rate   %10s cached", cached);
+  }
+
+  mvprintw(row++, 0, "memory       %10s resident   %10s allocated, %s for connections, %s for the file cache", resident, allocated, connections,
+           fileCache);
+
+  mvprintw(row++, 0, "latency      first byte p50 %8llu us  p99 %8llu us   transfer p50 %8llu us  p99 %8llu us",
+           (unsigned long long)intervalPercentile(state, METRIC_HISTOGRAM_TIME_TO_FIRST_BYTE, 50),
+           (unsigned long long)intervalPercentile(state, METRIC_HISTOGRAM_TIME_TO_FIRST_BYTE, 99),
+           (unsigned long long)intervalPercentile(state, METRIC_HISTOGRAM_TRANSFER_DURATION, 50),
+           (unsigned long long)intervalPercentile(state, METRIC_HISTOGRAM_TRANSFER_DURATION, 99));
+
+  return row;
+}
+
+
+static int drawTopFiles(dashboardState *state, int row, int rowCount)
+{
+  dashboardFile *now        = state->files[state->current];
+  dashboardFile *before     = state->files[!state->current];
+  uint32_t      nowCount    = state->fileCounts[state->current];
+  uint32_t      beforeCount = state->fileCounts[!state->current];
+  uint32_t      file        = 0;
+  int           shown       = 0;
+
+  attron(A_BOLD);
+  mvprintw(row++, 0, "%-48s %12s %12s", "most requested files", "requests/s", "requests");
+  attroff(A_BOLD);
+
+  for(file = 0; file != nowCount; file++){
+    state->rows[file].name     = now[file].name;
+    state->rows[file].requests = now[file].requests;
+    state->rows[file].rate     = 0;
+
+    //the file bank doesn't change once the server is serving, so the same file is at the same index in both reads
+    if(file < beforeCount && before[file].name == now[file].name && now[file].requests >= before[file].requests){
+      state->rows[file].rate = now[file].requests - before[file].requests;
+    }
+  }
+
+  qsort(state->rows, nowCount, sizeof(dashboardRow), &compareRows);
+
+  for(file = 0; file != nowCount && shown != rowCount && state->rows[file].requests; file++, shown++){
+    mvprintw(row++, 0, "%-48.48s %12llu %12llu", state->rows[file].name, (unsigned long long)state->rows[file].rate,
+             (unsigned long long)state->rows[file].requests);
+  }
+
+  return row;
+}
+
+
+static int drawSlowTransfers(dashboardState *state, int row, int rowCount)
+{
+  uint32_t transferCount = readTransfers(state->transfers, METRIC_MAX_TRANSFERS);
+  uint64_t now           = getMonotonicMicroseconds();
+  uint64_t elapsed       = 0;
+  uint32_t transfer      = 0;
+  char     sent[32];
+  char     bytesize[32];
+  char     rate[32];
+
+  attron(A_BOLD);
+  mvprintw(row++, 0, "%-48s %10s %10s %10s %12s", "slowest transfers in progress", "seconds", "sent", "size", "rate");
+  attroff(A_BOLD);
+
+  qsort(state->transfers, transferCount, sizeof(metricsTransfer), &compareTransfers);
+
+  for(transfer = 0; transfer != transferCount && transfer != (uint32_t)rowCount; transfer++){
+    elapsed = (now > state->transfers[transfer].start) ? now - state->transfers[transfer].start : 1;
+
+    formatBytes(sent, sizeof(sent), state->transfers[transfer].bytesSent);
+    formatBytes(bytesize, sizeof(bytesize), state->transfers[transfer].bytesize);
+    formatBytes(rate, sizeof(rate), state->transfers[transfer].bytesSent * 1000000ULL / elapsed);
+
+    mvprintw(row++, 0, "%-48.48s %10.1f %10s %10s %10s/s", state->transfers[transfer].name, elapsed / 1000000.0, sent, bytesize, rate);
+  }
+
+  return row;
+}
+
+
+static void drawLog(int row)
+{
+  uint32_t line = 0;
+
+  attron(A_BOLD);
+  mvprintw(row++, 0, "log");
+  attroff(A_BOLD);
+
+  pthread_mutex_lock(&globalLogLock);
+
+  for(line = 0; line != DASHBOARD_LOG_LINES && row < LINES; line++){
+    mvprintw(row++, 0, "%.*s", COLS, globalLogLines[(globalLogNext + line) % DASHBOARD_LOG_LINES]);
+  }
+
+  pthread_mutex_unlock(&globalLogLock);
+}
+
+
+static uint64_t perSecond(uint64_t now, uint64_t before, uint64_t elapsed)
+{
+  if(elapsed == 0 || now < before){
+    return 0;
+  }
+
+  return (now - before) * 1000000ULL / elapsed;
+}
+
+
+/*
+ * intervalPercentile returns the percentile of the samples recorded into histogram between the last two snapshots
+ */
+static uint64_t intervalPercentile(dashboardState *state, int histogram, double percentile)
+{
+  dashboardSnapshot *now     = &state->snapshots[state->current];
+  dashboardSnapshot *before  = &state->snapshots[!state->current];
+  uint64_t          interval[METRIC_HISTOGRAM_BUCKETS];
+  uint64_t          samples  = 0;
+  uint32_t          bucket   = 0;
+
+  for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+    interval[bucket] = (now->buckets[histogram][bucket] >= before->buckets[histogram][bucket]) ?
+                       now->buckets[histogram][bucket] - before->buckets[histogram][bucket] : 0;
+    samples         += interval[bucket];
+  }
+
+  return histogramPercentile(interval, samples, percentile);
+}
+
+
+/*
+ * readResidentBytes returns the resident set size of the process, or 0 on error
+ */
+static uint64_t readResidentBytes(void)
+{
+  FILE               *statm    = NULL;
+  unsigned long long size      = 0;
+  unsigned long long resident  = 0;
+
+  statm = fopen("/proc/self/statm", "r");
+  if(statm == NULL){
+    return 0;
+  }
+
+  if( fscanf(statm, "%llu %llu", &size, &resident) != 2 ){
+    resident = 0;
+  }
+
+  fclose(statm);
+
+  return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+
+static void formatBytes(char *out, size_t outBytesize, uint64_t bytes)
+{
+  if(bytes >= 1024ULL * 1024 * 1024){
+    snprintf(out, outBytesize, "%.2f GB", bytes / (1024.0 * 1024 * 1024));
+  }
+  else if(bytes >= 1024ULL * 1024){
+    snprintf(out, outBytesize, "%.2f MB", bytes / (1024.0 * 1024));
+  }
+  else if(bytes >= 1024){
+    snprintf(out, outBytesize, "%.1f KB", bytes / 1024.0);
+  }
+  else{
+    snprintf(out, outBytesize, "%llu B", (unsigned long long)bytes);
+  }
+}
+
+
+//the log sink, called from the log flusher thread
+static void keepLogLine(const char *line)
+{
+  pthread_mutex_lock(&globalLogLock);
+
+  snprintf(globalLogLines[globalLogNext], DASHBOARD_LOG_LINE_BYTESIZE, "%s", line);
+  globalLogNext = (globalLogNext + 1) % DASHBOARD_LOG_LINES;
+
+  pthread_mutex_unlock(&globalLogLock);
+}
+
+
+//busiest first, then most requested overall
+static int compareRows(const void *first, const void *second)
+{
+  const dashboardRow *a = (const dashboardRow *)first;
+  const dashboardRow *b = (const dashboardRow *)second;
+
+  if(a->rate != b->rate){
+    return (a->rate < b->rate) ? 1 : -1;
+  }
+
+  if(a->requests != b->requests){
+    return (a->requests < b->requests) ? 1 : -1;
+  }
+
+  return 0;
+}
+
+
+//longest running first
+static int compareTransfers(const void *first, const void *second)
+{
+  const metricsTransfer *a = (const metricsTransfer *)first;
+  const metricsTransfer *b = (const metricsTransfer *)second;
+
+  if(a->start != b->start){
+    return (a->start > b->start) ? 1 : -1;
+  }
+
+  return 0;
+}
+
+
+static void freeState(dashboardState *state)
+{
+  if(state->files[0] != NULL){
+    secureFree(&state->files[0], state->source.maxFiles * sizeof(dashboardFile));
+  }
+
+  if(state->files[1] != NULL){
+    secureFree(&state->files[1], state->source.maxFiles * sizeof(dashboardFile));
+  }
+
+  if(state->rows != NULL){
+    secureFree(&state->rows, state->source.maxFiles * sizeof(dashboardRow));
+  }
+
+  if(state->transfers != NULL){
+    secureFree(&state->transfers, METRIC_MAX_TRANSFERS * sizeof(metricsTransfer));
+  }
+
+  secureFree(&state, sizeof(*state));
+}
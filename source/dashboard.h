@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+
+//a shared file and how many times it has been requested
+typedef struct dashboardFile{
+  const char *name;
+  uint64_t   requests;
+}dashboardFile;
+
+//what the dashboard needs from the server besides the metrics
+typedef struct dashboardSource{
+  uint32_t maxConnections;
+  uint32_t maxFiles;
+  uint32_t (*readFileRequests)(dashboardFile *files, uint32_t maxFiles);   //fills files in the same order every call, returns the count
+}dashboardSource;
+
+
+int startDashboard(dashboardSource *source);
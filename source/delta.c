@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#ifdef ONIONGET_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "delta.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Delta transfers, see delta.h for the protocol. The server slides a block sized window over the file a byte at a time, rolling the
+ * weak checksum along and looking it up in a hash table of the signature's, and only hashes the window when the weak checksum matches
+ * a block. Matching blocks go out as runs, whatever is between them as literals. The client assembles the file a chunk at a time and
+ * writes each chunk once it is whole, skipping chunks that are nothing but blocks already where they belong.
+ */
+
+
+static atomic_ullong globalDeltaFiles;
+static atomic_ullong globalDeltaLiteralBytes;
+static atomic_ullong globalDeltaMatchedBytes;
+
+
+static uint32_t blockBytesizeFor(uint32_t basisBytesize);
+static void     weakChecksum(const unsigned char *block, uint32_t blockBytesize, uint32_t *a, uint32_t *b);
+static void     strongChecksum(const unsigned char *block, uint32_t blockBytesize, unsigned char *strong);
+static uint32_t bucketOf(deltaEncoder *encoder, uint32_t weak);
+static uint32_t findMatch(deltaEncoder *encoder);
+static int      fillWindow(deltaEncoder *encoder, uint32_t offset);
+static int      emitRun(deltaEncoder *encoder, deltaInstruction *instruction);
+static int      emitLiteral(deltaEncoder *encoder, deltaInstruction *instruction, uint32_t end);
+static int      flushChunk(diskFileObject *file, unsigned char *chunk, uint32_t bytesize, uint32_t offset, int unchanged, hashVerifier *verifier);
+static void     renderDeltaTransfers(FILE *out);
+
+
+
+/*
+ * deltaAvailable returns 1 if this build can sign, send and rebuild deltas, otherwise 0
+ */
+int deltaAvailable(void)
+{
+#ifdef ONIONGET_BLAKE3
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * deltaSign fills signature with the checksums of every whole block of basis, basisBytesize bytes of it. A basis of more blocks than
+ * are left in blockBudget is signed as if there were none, so the file comes whole. Returns 0 on error and 1 on success
+ */
+int deltaSign(deltaSignature *signature, diskFileObject *basis, uint32_t basisBytesize, uint32_t *blockBudget)
+{
+  unsigned char *block = NULL;
+  uint32_t      index  = 0;
+  uint32_t      a      = 0;
+  uint32_t      b      = 0;
+
+  if(signature == NULL || blockBudget == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !deltaAvailable() ){
+    logEvent("Error", "Delta transfers need a build with BLAKE3=1");
+    return 0;
+  }
+
+  memset(signature, 0, sizeof(deltaSignature));
+  signature->basisBytesize = basisBytesize;
+  signature->blockBytesize = blockBytesizeFor(basisBytesize);
+  signature->blockCount    = basisBytesize / signature->blockBytesize;
+
+  if(signature->blockCount > *blockBudget || basis == NULL){
+    signature->basisBytesize = 0;
+    signature->blockCount    = 0;
+  }
+
+  if(signature->blockCount == 0){
+    return 1;
+  }
+
+  signature->weak   = (uint32_t *)secureAllocateTagged(signature->blockCount * sizeof(uint32_t), MEMORY_TAG_CONNECTION);
+  signature->strong = (unsigned char *)secureAllocateTagged(signature->blockCount * DELTA_STRONG_BYTESIZE, MEMORY_TAG_CONNECTION);
+  block             = (unsigned char *)secureAllocateTagged(signature->blockBytesize, MEMORY_TAG_CONNECTION);
+  if(signature->weak == NULL || signature->strong == NULL || block == NULL){
+    logEvent("Error", "Failed to allocate memory for the delta signature");
+    goto error;
+  }
+
+  for(index = 0; index != signature->blockCount; index++){
+    if( !basis->dfRead(basis, block, signature->blockBytesize, index * signature->blockBytesize) ){
+      logEvent("Error", "Failed to read the basis to sign it");
+      goto error;
+    }
+
+    weakChecksum(block, signature->blockBytesize, &a, &b);
+    signature->weak[index] = (a & 0xffff) | (b << 16);
+    strongChecksum(block, signature->blockBytesize, &signature->strong[index * DELTA_STRONG_BYTESIZE]);
+  }
+
+  secureFree(&block, signature->blockBytesize);
+  *blockBudget -= signature->blockCount;
+  return 1;
+
+  error:
+    if(block != NULL){
+      secureFree(&block, signature->blockBytesize);
+    }
+    deltaSignatureRelease(signature);
+    return 0;
+}
+
+
+/*
+ * deltaTransmitSignature sends signature, returns 0 on error and 1 on success
+ */
+int deltaTransmitSignature(routerObject *router, deltaSignature *signature)
+{
+  uint32_t *weak  = NULL;
+  uint32_t index  = 0;
+  int      sent   = 0;
+
+  if(router == NULL || signature == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !router->transmitBytesize(router, signature->basisBytesize) || !router->transmitBytesize(router, signature->blockBytesize) ){
+    return 0;
+  }
+
+  if(signature->blockCount == 0){
+    return 1;
+  }
+
+  weak = (uint32_t *)secureAllocateTagged(signature->blockCount * sizeof(uint32_t), MEMORY_TAG_CONNECTION);
+  if(weak == NULL){
+    logEvent("Error", "Failed to allocate memory to send the delta signature");
+    return 0;
+  }
+
+  for(index = 0; index != signature->blockCount; index++){
+    weak[index] = htonl(signature->weak[index]);
+  }
+
+  sent = router->transmit(router, weak, signature->blockCount * sizeof(uint32_t)) &&
+         router->transmit(router, signature->strong, signature->blockCount * DELTA_STRONG_BYTESIZE);
+
+  secureFree(&weak, signature->blockCount * sizeof(uint32_t));
+  return sent;
+}
+
+
+/*
+ * deltaReceiveFile rebuilds a fileBytesize byte file in place over file, which holds the basis signature was made of, from the
+ * instructions the server sends, checking every chunk against verifier. file must be open readable and writable. Returns 0 on error
+ * and 1 on success, after an error file may be neither the basis nor the file
+ */
+int deltaReceiveFile(routerObject *router, diskFileObject *file, deltaSignature *signature, uint32_t fileBytesize, hashVerifier *verifier)
+{
+  unsigned char *chunk         = NULL;
+  unsigned char *block         = NULL;
+  uint32_t      chunkStart     = 0;
+  uint32_t      filled         = 0;
+  uint32_t      produced       = 0;
+  uint32_t      word           = 0;
+  uint32_t      blockCount     = 0;
+  uint32_t      source         = 0;
+  uint32_t      copied         = 0;
+  uint32_t      bytesize       = 0;
+  int           unchanged      = 1;     //the chunk being assembled is all blocks that were already where they go
+  int           inPlace        = 0;
+  int           success        = 0;
+
+  if(router == NULL || file == NULL || signature == NULL || verifier == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  chunk = (unsigned char *)secureAllocateTagged(FILE_CHUNK_BYTESIZE, MEMORY_TAG_CONNECTION);
+  block = (unsigned char *)secureAllocateTagged(signature->blockBytesize, MEMORY_TAG_CONNECTION);
+  if(chunk == NULL || block == NULL){
+    logEvent("Error", "Failed to allocate memory to rebuild the file");
+    goto cleanup;
+  }
+
+  //growing first keeps the basis where it is, shrinking waits until the basis past the end is no longer needed
+  if( fileBytesize > signature->basisBytesize && !file->dfTruncate(file, fileBytesize) ){
+    logEvent("Error", "Failed to grow the file to rebuild it");
+    goto cleanup;
+  }
+
+  while(produced != fileBytesize){
+    if( !router->receive(router, &word, sizeof(uint32_t)) ){
+      logEvent("Error", "Failed to receive a delta instruction");
+      goto cleanup;
+    }
+
+    word = ntohl(word);
+
+    if(word & DELTA_INSTRUCTION_LITERAL){
+      bytesize = word & DELTA_LITERAL_BYTESIZE_MASK;
+      if(bytesize == 0 || bytesize > FILE_CHUNK_BYTESIZE || bytesize > fileBytesize - produced){
+        logEvent("Error", "Server sent a literal that doesn't fit the file");
+        goto cleanup;
+      }
+
+      for(; bytesize; bytesize -= copied){
+        copied = (bytesize < FILE_CHUNK_BYTESIZE - filled) ? bytesize : FILE_CHUNK_BYTESIZE - filled;
+
+        if( !router->receive(router, &chunk[filled], copied) ){
+          logEvent("Error", "Failed to receive literal bytes");
+          goto cleanup;
+        }
+
+        filled   += copied;
+        produced += copied;
+        unchanged = 0;
+
+        if(filled == FILE_CHUNK_BYTESIZE || produced == fileBytesize){
+          if( !flushChunk(file, chunk, filled, chunkStart, unchanged, verifier) ){
+            goto cleanup;
+          }
+
+          chunkStart += filled;
+          filled      = 0;
+          unchanged   = 1;
+        }
+      }
+
+      continue;
+    }
+
+    if( !router->receive(router, &blockCount, sizeof(uint32_t)) ){
+      logEvent("Error", "Failed to receive a delta instruction");
+      goto cleanup;
+    }
+
+    //blocks before where they go have been written over already, so the server never refers to them
+    blockCount = ntohl(blockCount);
+    if( blockCount == 0 || word >= signature->blockCount || blockCount > signature->blockCount - word ||
+        (uint64_t)blockCount * signature->blockBytesize > fileBytesize - produced ||
+        (uint64_t)word * signature->blockBytesize < produced ){
+      logEvent("Error", "Server sent a block run that doesn't fit the file");
+      goto cleanup;
+    }
+
+    for(; blockCount; blockCount--, word++){
+      source = word * signature->blockBytesize;
+      if( !file->dfRead(file, block, signature->blockBytesize, source) ){
+        logEvent("Error", "Failed to read a block of the basis");
+        goto cleanup;
+      }
+
+      inPlace = (source == produced);
+
+      for(bytesize = signature->blockBytesize; bytesize; bytesize -= copied){
+        copied = (bytesize < FILE_CHUNK_BYTESIZE - filled) ? bytesize : FILE_CHUNK_BYTESIZE - filled;
+        memcpy(&chunk[filled], &block[signature->blockBytesize - bytesize], copied);
+
+        filled   += copied;
+        produced += copied;
+        unchanged = unchanged && inPlace;
+
+        if(filled == FILE_CHUNK_BYTESIZE || produced == fileBytesize){
+          if( !flushChunk(file, chunk, filled, chunkStart, unchanged, verifier) ){
+            goto cleanup;
+          }
+
+          chunkStart += filled;
+          filled      = 0;
+          unchanged   = 1;
+        }
+      }
+    }
+  }
+
+  if( fileBytesize < signature->basisBytesize && !file->dfTruncate(file, fileBytesize) ){
+    logEvent("Error", "Failed to shrink the rebuilt file");
+    goto cleanup;
+  }
+
+  success = 1;
+
+  cleanup:
+    if(chunk != NULL){
+      secureFree(&chunk, FILE_CHUNK_BYTESIZE);
+    }
+
+    if(block != NULL){
+      secureFree(&block, signature->blockBytesize);
+    }
+
+    return success;
+}
+
+
+/*
+ * deltaSignatureRelease frees what signature holds
+ */
+void deltaSignatureRelease(deltaSignature *signature)
+{
+  if(signature == NULL){
+    return;
+  }
+
+  if(signature->weak != NULL){
+    secureFree(&signature->weak, signature->blockCount * sizeof(uint32_t));
+  }
+
+  if(signature->strong != NULL){
+    secureFree(&signature->strong, signature->blockCount * DELTA_STRONG_BYTESIZE);
+  }
+}
+
+
+/*
+ * deltaReceiveSignature receives a client's signature of its basis of a file into signature, taking its blocks from blockBudget,
+ * returns 0 on error and 1 on success
+ */
+int deltaReceiveSignature(routerObject *router, deltaSignature *signature, uint32_t *blockBudget)
+{
+  uint32_t header[2];
+  uint32_t index = 0;
+
+  if(router == NULL || signature == NULL || blockBudget == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  memset(signature, 0, sizeof(deltaSignature));
+
+  if( !router->receive(router, header, sizeof(header)) ){
+    logEvent("Error", "Failed to receive a delta signature");
+    return 0;
+  }
+
+  signature->basisBytesize = ntohl(header[0]);
+  signature->blockBytesize = ntohl(header[1]);
+
+  if( signature->blockBytesize == 0 || signature->blockBytesize > FILE_CHUNK_BYTESIZE || signature->blockBytesize % DELTA_BLOCK_ALIGNMENT ){
+    logEvent("Error", "Client sent an invalid delta block bytesize");
+    return 0;
+  }
+
+  signature->blockCount = signature->basisBytesize / signature->blockBytesize;
+  if(signature->blockCount > *blockBudget){
+    logEvent("Error", "Client sent more delta signature blocks than a batch may have");
+    return 0;
+  }
+
+  if(signature->blockCount == 0){
+    return 1;
+  }
+
+  signature->weak   = (uint32_t *)secureAllocateTagged(signature->blockCount * sizeof(uint32_t), MEMORY_TAG_CONNECTION);
+  signature->strong = (unsigned char *)secureAllocateTagged(signature->blockCount * DELTA_STRONG_BYTESIZE, MEMORY_TAG_CONNECTION);
+  if(signature->weak == NULL || signature->strong == NULL){
+    logEvent("Error", "Failed to allocate memory for the delta signature");
+    deltaSignatureRelease(signature);
+    return 0;
+  }
+
+  if( !router->receive(router, signature->weak, signature->blockCount * sizeof(uint32_t)) ||
+      !router->receive(router, signature->strong, signature->blockCount * DELTA_STRONG_BYTESIZE) ){
+    logEvent("Error", "Failed to receive a delta signature");
+    deltaSignatureRelease(signature);
+    return 0;
+  }
+
+  for(index = 0; index != signature->blockCount; index++){
+    signature->weak[index] = ntohl(signature->weak[index]);
+  }
+
+  *blockBudget -= signature->blockCount;
+  return 1;
+}
+
+
+/*
+ * deltaEncoderStart readies encoder to send the delta of file, fileBytesize bytes of it, against signature, reading it through window
+ * (2 file chunks). Returns 0 on error and 1 on success
+ */
+int deltaEncoderStart(deltaEncoder *encoder, diskFileObject *file, uint32_t fileBytesize, deltaSignature *signature, unsigned char *window)
+{
+  uint32_t bucketCount = 16;
+  uint32_t bucket      = 0;
+  uint32_t index       = 0;
+
+  if(encoder == NULL || file == NULL || signature == NULL || window == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !deltaAvailable() ){
+    logEvent("Error", "Delta transfers need a build with BLAKE3=1");
+    return 0;
+  }
+
+  memset(encoder, 0, sizeof(deltaEncoder));
+  encoder->file         = file;
+  encoder->fileBytesize = fileBytesize;
+  encoder->signature    = signature;
+  encoder->window       = window;
+
+  atomic_fetch_add_explicit(&globalDeltaFiles, 1, memory_order_relaxed);
+
+  if(signature->blockCount == 0){
+    return 1;
+  }
+
+  //at most half full, so a miss, by far the most common lookup, usually ends at an empty bucket
+  while(bucketCount < 2 * signature->blockCount){
+    bucketCount *= 2;
+  }
+
+  encoder->bucketMask  = bucketCount - 1;
+  encoder->bucketShift = 32 - __builtin_ctz(bucketCount);
+  encoder->buckets    = (int32_t *)secureAllocateTagged(bucketCount * sizeof(int32_t), MEMORY_TAG_CONNECTION);
+  encoder->chain      = (int32_t *)secureAllocateTagged(signature->blockCount * sizeof(int32_t), MEMORY_TAG_CONNECTION);
+  if(encoder->buckets == NULL || encoder->chain == NULL){
+    logEvent("Error", "Failed to allocate memory for the delta lookup");
+    deltaEncoderRelease(encoder);
+    return 0;
+  }
+
+  memset(encoder->buckets, 0xff, bucketCount * sizeof(int32_t));
+
+  //inserted last block first, so every bucket lists its blocks in order and the first usable one is nearest where it goes
+  for(index = signature->blockCount; index--;){
+    bucket                   = bucketOf(encoder, signature->weak[index]);
+    encoder->chain[index]    = encoder->buckets[bucket];
+    encoder->buckets[bucket] = (int32_t)index;
+  }
+
+  return 1;
+}
+
+
+/*
+ * deltaEncoderNext fills instruction with the next instruction of the delta, returns 0 on error and 1 on success
+ */
+int deltaEncoderNext(deltaEncoder *encoder, deltaInstruction *instruction)
+{
+  uint32_t block = encoder->signature->blockBytesize;
+  uint32_t match = 0;
+  uint32_t need  = 0;
+  uint32_t out   = 0;
+  uint32_t in    = 0;
+
+  memset(instruction, 0, sizeof(deltaInstruction));
+
+  for(;;){
+    //no whole block is left to match, so the rest of the file goes literal
+    if(encoder->signature->blockCount == 0 || encoder->fileBytesize - encoder->position < block){
+      if(encoder->runCount){
+        return emitRun(encoder, instruction);
+      }
+
+      if(encoder->literalStart == encoder->fileBytesize){
+        instruction->endOffset = encoder->fileBytesize;
+        return 1;
+      }
+
+      return emitLiteral(encoder, instruction, encoder->fileBytesize);
+    }
+
+    //literals go out a chunk at a time at most
+    if(encoder->position - encoder->literalStart == FILE_CHUNK_BYTESIZE){
+      return encoder->runCount ? emitRun(encoder, instruction) : emitLiteral(encoder, instruction, encoder->position);
+    }
+
+    //the window must hold the block being matched and the byte after it, the literal before it goes first if it doesn't
+    need = encoder->position + block + (encoder->fileBytesize - encoder->position > block);
+    if(need > encoder->windowOffset + encoder->windowBytesize){
+      if(encoder->position != encoder->literalStart){
+        return encoder->runCount ? emitRun(encoder, instruction) : emitLiteral(encoder, instruction, encoder->position);
+      }
+
+      if( !fillWindow(encoder, encoder->position) ){
+        return 0;
+      }
+    }
+
+    if( !encoder->weakValid ){
+      weakChecksum(&encoder->window[encoder->position - encoder->windowOffset], block, &encoder->weakA, &encoder->weakB);
+      encoder->weakValid = 1;
+    }
+
+    match = findMatch(encoder);
+    if(match){
+      if(encoder->position != encoder->literalStart){
+        return encoder->runCount ? emitRun(encoder, instruction) : emitLiteral(encoder, instruction, encoder->position);
+      }
+
+      if(encoder->runCount && match - 1 != encoder->runBlock + encoder->runCount){
+        return emitRun(encoder, instruction);
+      }
+
+      if(encoder->runCount == 0){
+        encoder->runBlock = match - 1;
+      }
+
+      encoder->runCount++;
+      encoder->position    += block;
+      encoder->literalStart = encoder->position;
+      encoder->runEnd       = encoder->position;
+      encoder->weakValid    = 0;
+      continue;
+    }
+
+    //roll the window a byte on, rsync's checksum drops the byte leaving and adds the byte entering without going over the block
+    if(encoder->fileBytesize - encoder->position > block){
+      out = encoder->window[encoder->position - encoder->windowOffset];
+      in  = encoder->window[encoder->position + block - encoder->windowOffset];
+
+      encoder->weakA += in - out;
+      encoder->weakB += encoder->weakA - block * out;
+    }
+    else{
+      encoder->weakValid = 0;
+    }
+
+    encoder->position++;
+  }
+}
+
+
+/*
+ * deltaEncoderRelease frees what encoder allocated
+ */
+void deltaEncoderRelease(deltaEncoder *encoder)
+{
+  if(encoder->buckets != NULL){
+    secureFree(&encoder->buckets, (encoder->bucketMask + 1) * sizeof(int32_t));
+  }
+
+  if(encoder->chain != NULL){
+    secureFree(&encoder->chain, encoder->signature->blockCount * sizeof(int32_t));
+  }
+}
+
+
+/*
+ * startDeltaTransfers checks this build can send deltas and registers their metrics, returns 0 on error and 1 on success
+ */
+int startDeltaTransfers(void)
+{
+  if( !deltaAvailable() ){
+    logEvent("Error", "Delta transfers need a build with BLAKE3=1");
+    return 0;
+  }
+
+  if( !registerMetricsRenderer(&renderDeltaTransfers) ){
+    logEvent("Error", "Failed to register delta transfer metrics");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+//about the square root of the basis, as rsync picks, so the signature and the literal around each change grow alike
+static uint32_t blockBytesizeFor(uint32_t basisBytesize)
+{
+  uint32_t blockBytesize = DELTA_BLOCK_ALIGNMENT;
+
+  while(blockBytesize < FILE_CHUNK_BYTESIZE && (uint64_t)blockBytesize * blockBytesize < basisBytesize){
+    blockBytesize += DELTA_BLOCK_ALIGNMENT;
+  }
+
+  return blockBytesize;
+}
+
+
+//rsync's rolling checksum of block, a is the sum of its bytes and b the sum of a after every byte, both of which are kept mod 2^16
+static void weakChecksum(const unsigned char *block, uint32_t blockBytesize, uint32_t *a, uint32_t *b)
+{
+  uint32_t byte = 0;
+
+  *a = 0;
+  *b = 0;
+
+  for(byte = 0; byte != blockBytesize; byte++){
+    *a += block[byte];
+    *b += *a;
+  }
+}
+
+
+static void strongChecksum(const unsigned char *block, uint32_t blockBytesize, unsigned char *strong)
+{
+#ifdef ONIONGET_BLAKE3
+  blake3_hasher hasher;
+
+  blake3_hasher_init(&hasher);
+  blake3_hasher_update(&hasher, block, blockBytesize);
+  blake3_hasher_finalize(&hasher, strong, DELTA_STRONG_BYTESIZE);
+#else
+  memset(strong, 0, DELTA_STRONG_BYTESIZE);
+#endif
+}
+
+
+static uint32_t bucketOf(deltaEncoder *encoder, uint32_t weak)
+{
+  return (weak * 0x9e3779b1u) >> encoder->bucketShift;
+}
+
+
+//returns the block the window at position matches plus 1, or 0 if none does. A block continuing the run is preferred, then the
+//first one at or after position, the ones before it will have been written over by the time the client would copy them
+static uint32_t findMatch(deltaEncoder *encoder)
+{
+  deltaSignature *signature = encoder->signature;
+  unsigned char  strong[DELTA_STRONG_BYTESIZE];
+  uint32_t       weak       = (encoder->weakA & 0xffff) | (encoder->weakB << 16);
+  uint32_t       found      = 0;
+  int            hashed     = 0;
+  int32_t        candidate  = 0;
+
+  if(encoder->matchedBlock && encoder->matchedAt == encoder->position){
+    return encoder->matchedBlock;
+  }
+
+  for(candidate = encoder->buckets[bucketOf(encoder, weak)]; candidate != -1; candidate = encoder->chain[candidate]){
+    if( signature->weak[candidate] != weak || (uint64_t)candidate * signature->blockBytesize < encoder->position ){
+      continue;
+    }
+
+    if( !hashed ){
+      strongChecksum(&encoder->window[encoder->position - encoder->windowOffset], signature->blockBytesize, strong);
+      hashed = 1;
+    }
+
+    if( memcmp(strong, &signature->strong[candidate * DELTA_STRONG_BYTESIZE], DELTA_STRONG_BYTESIZE) ){
+      continue;
+    }
+
+    if(encoder->runCount && (uint32_t)candidate == encoder->runBlock + encoder->runCount){
+      found = (uint32_t)candidate + 1;
+      break;
+    }
+
+    if( !found ){
+      found = (uint32_t)candidate + 1;
+    }
+  }
+
+  encoder->matchedAt    = encoder->position;
+  encoder->matchedBlock = found;
+  return found;
+}
+
+
+//reads the window from the page offset is on, the file is read at page offsets so it can be mapped
+static int fillWindow(deltaEncoder *encoder, uint32_t offset)
+{
+  encoder->windowOffset   = offset - offset % DELTA_BLOCK_ALIGNMENT;
+  encoder->windowBytesize = encoder->fileBytesize - encoder->windowOffset;
+  encoder->windowBytesize = (encoder->windowBytesize < 2 * FILE_CHUNK_BYTESIZE) ? encoder->windowBytesize : 2 * FILE_CHUNK_BYTESIZE;
+
+  if( !encoder->file->dfRead(encoder->file, encoder->window, encoder->windowBytesize, encoder->windowOffset) ){
+    logEvent("Error", "Failed to read the file to match it");
+    encoder->windowBytesize = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+static int emitRun(deltaEncoder *encoder, deltaInstruction *instruction)
+{
+  instruction->copyBlock  = encoder->runBlock;
+  instruction->copyBlocks = encoder->runCount;
+  instruction->endOffset  = encoder->runEnd;
+
+  atomic_fetch_add_explicit(&globalDeltaMatchedBytes, (uint64_t)encoder->runCount * encoder->signature->blockBytesize, memory_order_relaxed);
+
+  encoder->runCount = 0;
+  return 1;
+}
+
+
+//emits up to a chunk of the literal bytes from literalStart to end
+static int emitLiteral(deltaEncoder *encoder, deltaInstruction *instruction, uint32_t end)
+{
+  uint32_t bytesize = end - encoder->literalStart;
+
+  bytesize = (bytesize < FILE_CHUNK_BYTESIZE) ? bytesize : FILE_CHUNK_BYTESIZE;
+
+  if( (encoder->literalStart < encoder->windowOffset || encoder->literalStart + bytesize > encoder->windowOffset + encoder->windowBytesize) &&
+      !fillWindow(encoder, encoder->literalStart) ){
+    return 0;
+  }
+
+  instruction->literal         = &encoder->window[encoder->literalStart - encoder->windowOffset];
+  instruction->literalBytesize = bytesize;
+  instruction->endOffset       = encoder->literalStart + bytesize;
+
+  atomic_fetch_add_explicit(&globalDeltaLiteralBytes, bytesize, memory_order_relaxed);
+
+  encoder->literalStart += bytesize;
+  return 1;
+}
+
+
+//verifies a chunk of the file being rebuilt and writes it at offset, unless it is unchanged from the basis
+static int flushChunk(diskFileObject *file, unsigned char *chunk, uint32_t bytesize, uint32_t offset, int unchanged, hashVerifier *verifier)
+{
+  if( !hashVerifyChunk(verifier, chunk, bytesize) ){
+    logEvent("Error", "Rebuilt file is corrupt, aborting");
+    return 0;
+  }
+
+  if( !unchanged && !file->dfWrite(file, chunk, bytesize, offset) ){
+    logEvent("Error", "Failed to write the rebuilt file");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+static void renderDeltaTransfers(FILE *out)
+{
+  fprintf(out, "# HELP onionget_delta_files_total Files sent as deltas against a client's copy\n"
+               "# TYPE onionget_delta_files_total counter\n"
+               "onionget_delta_files_total %llu\n", (unsigned long long)atomic_load_explicit(&globalDeltaFiles, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_delta_bytes_total Bytes of delta files, by whether they were sent or the client had them\n"
+               "# TYPE onionget_delta_bytes_total counter\n"
+               "onionget_delta_bytes_total{part=\"literal\"} %llu\n"
+               "onionget_delta_bytes_total{part=\"matched\"} %llu\n",
+          (unsigned long long)atomic_load_explicit(&globalDeltaLiteralBytes, memory_order_relaxed),
+          (unsigned long long)atomic_load_explicit(&globalDeltaMatchedBytes, memory_order_relaxed));
+}
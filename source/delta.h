@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include "router.h"
+#include "diskFile.h"
+#include "fileHash.h"
+#include "ogEnums.h"
+
+
+/*
+ * Delta transfers
+ *
+ * A client that already has a copy of a file, the basis, can have the server send only what changed. With REQUEST_FLAG_DELTA the batch
+ * request is followed by a signature of the basis of every file, in the order they were asked for:
+ *
+ * [basis bytesize][block bytesize][weak checksum of every whole block][strong checksum of every whole block]
+ *
+ * The weak checksum is rsync's rolling one, the strong one the first DELTA_STRONG_BYTESIZE bytes of the BLAKE3 of the block. A client
+ * with no copy sends a basis bytesize of 0. Every file response is then its bytesize (and hashes, with REQUEST_FLAG_HASHES) followed by
+ * instructions that rebuild it from the basis, until all of its bytes are accounted for:
+ *
+ * [DELTA_INSTRUCTION_LITERAL | bytesize][bytes]      the next bytes of the file, at most a file chunk of them
+ * [first block][block count]                         the next bytes of the file are that run of whole blocks of the basis
+ *
+ * The client rebuilds the file in place over the basis, so the server only refers to blocks at or after where they will be written,
+ * which are never overwritten before they are read. Data that moved toward the end of the file, after an insertion, goes literal.
+ */
+
+
+//a client's signature of its basis, the checksums of every whole block of it
+typedef struct deltaSignature{
+  uint32_t      basisBytesize;
+  uint32_t      blockBytesize;
+  uint32_t      blockCount;
+  uint32_t      *weak;              //blockCount of them
+  unsigned char *strong;            //blockCount of DELTA_STRONG_BYTESIZE
+}deltaSignature;
+
+//sending side of a file's delta, matches the file against a signature through a window of it
+typedef struct deltaEncoder{
+  diskFileObject *file;
+  uint32_t       fileBytesize;
+  deltaSignature *signature;
+  unsigned char  *window;           //2 file chunks of the file from windowOffset
+  uint32_t       windowOffset;
+  uint32_t       windowBytesize;
+  uint32_t       position;          //of the block being matched
+  uint32_t       literalStart;      //bytes from here to position haven't matched and go literal
+  uint32_t       weakA;             //rolling checksum of the block at position, in two halves
+  uint32_t       weakB;
+  int            weakValid;
+  uint32_t       runBlock;          //matched blocks not sent yet
+  uint32_t       runCount;
+  uint32_t       runEnd;            //of the file, once the run is applied
+  uint32_t       matchedAt;         //position whose match is matchedBlock + 1, kept while a literal or run is sent first
+  uint32_t       matchedBlock;
+  int32_t        *buckets;          //first block of every weak checksum bucket, -1 if none
+  int32_t        *chain;            //next block in the same bucket, -1 if none
+  uint32_t       bucketMask;
+  uint32_t       bucketShift;       //of a weak checksum hashed to 32 bits, leaving the bucket
+}deltaEncoder;
+
+//one instruction of a delta, copyBlocks blocks of the basis from copyBlock on if copyBlocks isn't 0, otherwise literalBytesize bytes
+//at literal. Neither means the file is done
+typedef struct deltaInstruction{
+  uint32_t      copyBlock;
+  uint32_t      copyBlocks;
+  unsigned char *literal;
+  uint32_t      literalBytesize;
+  uint32_t      endOffset;          //of the file, once the instruction is applied
+}deltaInstruction;
+
+
+int  deltaAvailable(void);
+
+int  deltaSign(deltaSignature *signature, diskFileObject *basis, uint32_t basisBytesize, uint32_t *blockBudget);
+int  deltaTransmitSignature(routerObject *router, deltaSignature *signature);
+int  deltaReceiveFile(routerObject *router, diskFileObject *file, deltaSignature *signature, uint32_t fileBytesize, hashVerifier *verifier);
+void deltaSignatureRelease(deltaSignature *signature);
+
+int  deltaReceiveSignature(routerObject *router, deltaSignature *signature, uint32_t *blockBudget);
+int  deltaEncoderStart(deltaEncoder *encoder, diskFileObject *file, uint32_t fileBytesize, deltaSignature *signature, unsigned char *window);
+int  deltaEncoderNext(deltaEncoder *encoder, deltaInstruction *instruction);
+void deltaEncoderRelease(deltaEncoder *encoder);
+int  startDeltaTransfers(void);
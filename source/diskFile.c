@@ -1,15 +1,33 @@
+#define _GNU_SOURCE   //preadv2, O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef ONIONGET_LZ4
+#include <lz4.h>
+#endif
 
 #include "diskFile.h"
 #include "memoryManager.h"
 #include "ogEnums.h"
 #include "macros.h"
+#include "metrics.h"
+#include "probes.h"
+#include "requestCost.h"
+
 
+//where a FILE_CHUNK_BYTESIZE chunk of a compressed cache is stored
+typedef struct cacheChunk{
+  uint32_t       offset;           //into cache
+  uint32_t       storedBytesize;   //less than the chunk's bytesize if it is compressed, equal if it is kept raw
+}cacheChunk;
 
 //private internal values 
 typedef struct diskFilePrivate{
@@ -21,17 +39,39 @@ typedef struct diskFilePrivate{
   FILE           *descriptor; 
   unsigned char  *cache; 
   uint32_t       cacheBytesize; 
+  cacheChunk     *cacheChunks;      //NULL unless the cache is compressed, one per chunk of cacheBytesize
+  uint32_t       cacheStoredBytesize; //memory cache takes
   char           *name;
+  int            streaming;        //one of the STREAM values, see setStreaming
+  int            directFid;        //the file opened with O_DIRECT when streaming, else -1
 }diskFilePrivate;
 
+//how a streaming file is kept out of the page cache
+enum{ STREAM_OFF = 0, STREAM_DIRECT = 1, STREAM_DROP = 2 };
+
+
+//aligned chunk sized scratch buffer for O_DIRECT reads and decompressing part of a chunk, one per reading thread. Serving threads
+//come and go with their connections, so the buffer is freed by the key's destructor when its thread exits, see getThreadChunkBuffer
+static __thread unsigned char *threadChunkBuffer = NULL;
+static pthread_key_t          globalChunkBufferKey;
+static pthread_once_t         globalChunkBufferOnce       = PTHREAD_ONCE_INIT;
+static int                    globalChunkBufferKeyCreated = 0;
+
 
 //PUBLIC METHODS
 static uint32_t              dfWrite(diskFileObject *this, void *dataBuffer, size_t bytesize, uint32_t writeOffset); 
 static int                   dfRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset);
+static uint32_t              dfTryRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset);
 static int                   closeTearDown(diskFileObject **thisPointer);
 static uint32_t              dfBytesize(diskFileObject *this);
 static int                   dfOpen(diskFileObject *this, const char *path, char *name, char *mode);
-static uint32_t              cacheBytes(diskFileObject *this, uint32_t maxBytes);
+static uint32_t              cacheBytes(diskFileObject *this, uint32_t maxBytes, int compress);
+static uint32_t              getCacheFootprint(diskFileObject *this);
+static int                   prefetch(diskFileObject *this, uint32_t offset, uint32_t bytesize);
+static int                   setStreaming(diskFileObject *this);
+static int                   dfStat(diskFileObject *this, struct stat *status);
+static int                   dfTruncate(diskFileObject *this, uint32_t bytesize);
+static int                   dfReinitialize(diskFileObject *this);
 static uint32_t              getBytesize(diskFileObject *this);
 
 //PRIVATE METHODS
@@ -40,6 +80,12 @@ static int fileModeWritable(char *mode);
 static int fileModeValid(char *mode);
 static int fileModeSeekable(char *mode); 
 static int initializeFileProperties(diskFileObject *this, const char *path, char *name, char *mode);
+static int directRead(diskFilePrivate *private, unsigned char *outBuffer, uint32_t bytesToRead, uint32_t readOffset);
+static unsigned char *getThreadChunkBuffer(void);
+static void createChunkBufferKey(void);
+static void releaseChunkBuffer(void *buffer);
+static uint32_t cacheCompressed(diskFilePrivate *private, uint32_t bytesize);
+static int readCompressedCache(diskFilePrivate *private, unsigned char *outBuffer, uint32_t bytesToRead, uint32_t readOffset);
 char *getFilename(diskFileObject *this);
 
 
@@ -59,7 +105,7 @@ diskFileObject *newDiskFile(void)
   
       
   //allocate memory for the object
-  privateThis = (diskFilePrivate *)secureAllocate(sizeof(*privateThis)); 
+  privateThis = (diskFilePrivate *)secureAllocateTagged(sizeof(*privateThis), MEMORY_TAG_FILE); 
   if(privateThis == NULL){
     logEvent("Error", "Failed to allocate memory for disk file");
     return NULL; 
@@ -70,10 +116,17 @@ diskFileObject *newDiskFile(void)
   privateThis->publicDiskFile.dfOpen          = &dfOpen;
   privateThis->publicDiskFile.dfWrite         = &dfWrite;
   privateThis->publicDiskFile.dfRead          = &dfRead; 
+  privateThis->publicDiskFile.dfTryRead       = &dfTryRead; 
   privateThis->publicDiskFile.closeTearDown   = &closeTearDown;
   privateThis->publicDiskFile.getBytesize     = &getBytesize;
   privateThis->publicDiskFile.getFilename     = &getFilename; 
   privateThis->publicDiskFile.cacheBytes      = &cacheBytes; 
+  privateThis->publicDiskFile.getCacheFootprint = &getCacheFootprint; 
+  privateThis->publicDiskFile.prefetch        = &prefetch; 
+  privateThis->publicDiskFile.setStreaming    = &setStreaming; 
+  privateThis->publicDiskFile.dfStat          = &dfStat; 
+  privateThis->publicDiskFile.dfTruncate      = &dfTruncate; 
+  privateThis->publicDiskFile.dfReinitialize  = &dfReinitialize; 
   
 
   //initialize private properties 
@@ -84,7 +137,11 @@ diskFileObject *newDiskFile(void)
   privateThis->bytesize         = -1; 
   privateThis->cache            = NULL;
   privateThis->cacheBytesize    = 0; 
+  privateThis->cacheChunks      = NULL; 
+  privateThis->cacheStoredBytesize = 0; 
   privateThis->name             = "\0"; 
+  privateThis->streaming        = STREAM_OFF; 
+  privateThis->directFid        = -1; 
   
 
   return (diskFileObject *) privateThis; 
@@ -131,8 +188,14 @@ static int closeTearDown(diskFileObject **thisPointer)
       return 0;
     }
   }
+  
+  if(privateThis->directFid != -1 && close(privateThis->directFid) == -1){
+    logEvent("Error", "Failed to close direct file descriptor"); 
+    return 0;
+  }
     
-  if( !secureFree( &(privateThis->fullPath), privateThis->fullPathBytesize) ){
+  //a file that was never opened, or was reinitialized, has no path
+  if( privateThis->fullPath != NULL && !secureFree( &(privateThis->fullPath), privateThis->fullPathBytesize) ){
     logEvent("Error", "Failed to free path");
     return 0;
   }
@@ -146,6 +209,53 @@ static int closeTearDown(diskFileObject **thisPointer)
   return 1; 
 }
 
+/*
+ * dfReinitialize returns 0 on error and 1 on success. It closes the file if it is open and puts the object back the way newDiskFile
+ * left it, so one diskFile can open many files in turn. A file with an in memory cache can't be reinitialized, only torn down
+ */
+static int dfReinitialize(diskFileObject *this)
+{
+  diskFilePrivate *private = NULL; 
+  
+  private = (diskFilePrivate *)this; 
+  
+  if(private == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  if(private->cache != NULL){
+    logEvent("Error", "Can't reinitialize a cached disk file");
+    return 0; 
+  }
+  
+  if(private->descriptor != NULL && fclose(private->descriptor) == EOF){
+    logEvent("Error", "Failed to close file descriptor"); 
+    return 0; 
+  }
+  private->descriptor = NULL; 
+  
+  if(private->directFid != -1 && close(private->directFid) == -1){
+    logEvent("Error", "Failed to close direct file descriptor"); 
+    return 0; 
+  }
+  private->directFid = -1; 
+  
+  if(private->fullPath != NULL && !secureFree( &(private->fullPath), private->fullPathBytesize) ){
+    logEvent("Error", "Failed to free path");
+    return 0; 
+  }
+  
+  private->fullPath         = NULL; 
+  private->fullPathBytesize = 0; 
+  private->mode             = NULL; 
+  private->bytesize         = -1; 
+  private->name             = "\0"; 
+  private->streaming        = STREAM_OFF; 
+  
+  return 1; 
+}
+
 /*
  * dfWrite returns 0 on error and bytes written on success
  */
@@ -230,10 +340,29 @@ static int dfRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, u
   
   //if it is cached copy from cache WARNING THIS CODE NEEDS LOOKED AT WARNING WARNING WARNING DRAW IT OUT WARNING
   if( (readOffset < private->cacheBytesize) && (bytesToRead <= private->cacheBytesize - readOffset) ){
-    memcpy(outBuffer, &(private->cache[readOffset]), bytesToRead); 
+    if(private->cacheChunks != NULL){
+      if( !readCompressedCache(private, outBuffer, bytesToRead, readOffset) ){
+        logEvent("Error", "Failed to read from the compressed cache");
+        return 0; 
+      }
+    }
+    else{
+      memcpy(outBuffer, &(private->cache[readOffset]), bytesToRead); 
+    }
+    
+    metricsIncrement(METRIC_CACHE_HITS, 1); 
+    costAdd(COST_COPIED_BYTES, bytesToRead);
+    costAdd(COST_CACHE_BYTES, bytesToRead);
+    PROBE4(chunk_read, this, bytesToRead, readOffset, 1); 
     return 1; 
   }
   
+  metricsIncrement(METRIC_CACHE_MISSES, 1); 
+  
+  if(private->streaming == STREAM_DIRECT){
+    return directRead(private, outBuffer, bytesToRead, readOffset); 
+  }
+  
   fid = fileno(private->descriptor);
   if(fid == -1){
     logEvent("Error", "Failed to get integer file descriptor");
@@ -250,11 +379,90 @@ static int dfRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, u
   memcpy(outBuffer, mmapAddr, bytesToRead); 
   
   munmap(mmapAddr, bytesToRead);
+  
+  //streaming without O_DIRECT, the pages are dropped again once copied so they don't push hot files out of the page cache
+  if(private->streaming == STREAM_DROP){
+    posix_fadvise(fid, readOffset, bytesToRead, POSIX_FADV_DONTNEED); 
+  }
+  
+  costAdd(COST_MMAP_CALLS, 1);
+  costAdd(COST_MUNMAP_CALLS, 1);
+  costAdd(COST_COPIED_BYTES, bytesToRead);
+  costAdd(COST_DISK_BYTES, bytesToRead);
+  
+  PROBE4(chunk_read, this, bytesToRead, readOffset, 0); 
 
   return 1; 
 }
 
 
+/*
+ * dfTryRead reads bytesToRead bytes at readOffset only if that doesn't block on the disk, from the in memory cache or else from the
+ * page cache with preadv2 RWF_NOWAIT. Returns bytesToRead if they were read, 0 if they weren't all in memory, or -1 on error. A
+ * chunk that wasn't can then be read whole with dfRead, on a thread that may block
+ */
+static uint32_t dfTryRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset)
+{
+  int             fid        = 0;
+  ssize_t         readReturn = 0; 
+  struct iovec    vector; 
+  diskFilePrivate *private   = (diskFilePrivate *)this; 
+  
+  if( private == NULL || outBuffer == NULL ){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  
+  if( fileModeReadable(private->mode) != 1 || private->descriptor == NULL ){
+    logEvent("Error", "File must be open and readable to read from it");
+    return -1; 
+  }
+  
+  if( (readOffset < private->cacheBytesize) && (bytesToRead <= private->cacheBytesize - readOffset) ){
+    return dfRead(this, outBuffer, bytesToRead, readOffset) ? bytesToRead : -1; 
+  }
+  
+  //a streaming file stays out of the page cache, so reading it always waits on the disk
+  if(private->streaming != STREAM_OFF){
+    return 0; 
+  }
+  
+  fid = fileno(private->descriptor);
+  if(fid == -1){
+    logEvent("Error", "Failed to get integer file descriptor");
+    return -1; 
+  }
+  
+  vector.iov_base = outBuffer; 
+  vector.iov_len  = bytesToRead; 
+  
+  readReturn = preadv2(fid, &vector, 1, readOffset, RWF_NOWAIT); 
+  costAdd(COST_READ_CALLS, 1); 
+  
+  //EAGAIN is the page cache not having the start of the range, and a kernel without RWF_NOWAIT leaves every read to dfRead
+  if(readReturn == -1){
+    if(errno == EAGAIN || errno == EOPNOTSUPP){
+      return 0; 
+    }
+    
+    logEvent("Error", "Failed to read file");
+    return -1; 
+  }
+  
+  //only part of the range was in the page cache, the rest would have to come from disk. dfRead maps the file, so it can only start
+  //at a page boundary, and rereading the part already in memory is cheap next to the disk
+  if(readReturn != bytesToRead){
+    return 0; 
+  }
+  
+  metricsIncrement(METRIC_CACHE_MISSES, 1); 
+  costAdd(COST_DISK_BYTES, bytesToRead); 
+  PROBE4(chunk_read, this, bytesToRead, readOffset, 0); 
+  
+  return bytesToRead; 
+}
+
+
 /*
  * dfOpen returns 0 on error and 1 on success. Sets this->descriptor to an fd for file at this->fullPath opened in mode mode, and sets this->mode to mode. 
  */
@@ -295,14 +503,19 @@ static int dfOpen(diskFileObject *this, const char *path, char *name, char *mode
     }
   }
   
-  private->name = name; //TODO fix this entire file up  (maybe stop relying on \0 termination externally for this); 
+  //the name passed in may not outlive us (it is a dirent d_name when the server opens its shared files), so point into our copy of it
+  private->name = &private->fullPath[ strlen(private->fullPath) - strlen(name) ]; //TODO fix this entire file up  (maybe stop relying on \0 termination externally for this); 
   return 1;
 }
 
 
 // static int dfRead(diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset)
 //WARNING NOTE TODO to make this mesh with dfRead maxBytes must be a multiple of memory page sizes that are supported
-static uint32_t cacheBytes(diskFileObject *this, uint32_t maxBytes)
+/*
+ * cacheBytes holds up to maxBytes from the start of the file in memory, LZ4 compressed chunk by chunk if compress is set and the build
+ * has LZ4. Returns the bytes of the file cached, see getCacheFootprint for the memory they take, 0 on error
+ */
+static uint32_t cacheBytes(diskFileObject *this, uint32_t maxBytes, int compress)
 {
   uint32_t actualBytes;
   diskFilePrivate *private = (diskFilePrivate *)this;
@@ -324,23 +537,193 @@ static uint32_t cacheBytes(diskFileObject *this, uint32_t maxBytes)
   
   actualBytes = (private->bytesize > maxBytes ) ? maxBytes : private->bytesize; 
   
-  private->cache = (void *) secureAllocate(actualBytes);
+  if(compress){
+    return cacheCompressed(private, actualBytes); 
+  }
+  
+  //from the cache arena and locked in RAM if the server set those up (see startCacheArena and startMemoryLocking)
+  private->cache = (void *) secureAllocateCache(actualBytes, MEMORY_TAG_FILE_CACHE);
   if(private->cache == NULL){
     logEvent("Error", "Failed to allocate memory to cache file");
     return 0; 
   }
   
-  private->cacheBytesize = actualBytes;
-  
+  //NOTE cacheBytesize must only be set once the cache is filled, otherwise dfRead would serve the read from the empty cache itself
   if( !dfRead(this, private->cache, actualBytes, 0) ){
     logEvent("Error", "Failed to read bytes into the cache");
     return 0;
   }
   
+  private->cacheBytesize       = actualBytes;
+  private->cacheStoredBytesize = actualBytes; 
+  
   return actualBytes; 
 }
 
 
+/*
+ * getCacheFootprint returns the bytes of memory the file's cache takes, fewer than it caches if it is compressed
+ */
+static uint32_t getCacheFootprint(diskFileObject *this)
+{
+  diskFilePrivate *private = (diskFilePrivate *)this;
+  
+  if(private == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  return private->cacheStoredBytesize; 
+}
+
+
+/*
+ * prefetch has the kernel start reading bytesize bytes at offset into the page cache without waiting for them, so a dfRead of them soon
+ * after doesn't stall on the disk. Bytes already in the in memory cache are skipped. Returns 0 on error and 1 on success
+ */
+static int prefetch(diskFileObject *this, uint32_t offset, uint32_t bytesize)
+{
+  int             fid      = 0;
+  diskFilePrivate *private = (diskFilePrivate *)this;
+  
+  if(private == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if(private->descriptor == NULL || fileModeReadable(private->mode) != 1){
+    logEvent("Error", "File must be open and readable to prefetch from it");
+    return 0; 
+  }
+  
+  if(offset < private->cacheBytesize){
+    bytesize = (bytesize > private->cacheBytesize - offset) ? bytesize - (private->cacheBytesize - offset) : 0; 
+    offset   = private->cacheBytesize; 
+  }
+  
+  //read ahead would fill the page cache that streaming keeps the file out of
+  if(bytesize == 0 || private->streaming != STREAM_OFF){
+    return 1; 
+  }
+  
+  fid = fileno(private->descriptor);
+  if(fid == -1){
+    logEvent("Error", "Failed to get integer file descriptor");
+    return 0; 
+  }
+  
+  //only advice, the read ahead is queued and this returns without waiting for the disk
+  if( posix_fadvise(fid, offset, bytesize, POSIX_FADV_WILLNEED) ){
+    logEvent("Error", "Failed to advise the kernel to read ahead");
+    return 0; 
+  }
+  
+  PROBE3(prefetch, this, bytesize, offset); 
+  
+  return 1; 
+}
+
+
+/*
+ * setStreaming has reads of the file that miss the in memory cache bypass the page cache with O_DIRECT, or where the filesystem doesn't
+ * support that drop the pages they read from it again, so a large cold file sent whole doesn't evict hot ones. Returns 0 on error and 1
+ * on success
+ */
+static int setStreaming(diskFileObject *this)
+{
+  diskFilePrivate *private = (diskFilePrivate *)this;
+  
+  if(private == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if(private->descriptor == NULL || fileModeReadable(private->mode) != 1 || fileModeWritable(private->mode) == 1){
+    logEvent("Error", "File must be open read only to stream it");
+    return 0; 
+  }
+  
+  if(private->streaming != STREAM_OFF){
+    return 1; 
+  }
+  
+  private->directFid = open(private->fullPath, O_RDONLY | O_DIRECT); 
+  if(private->directFid == -1){
+    //tmpfs for one refuses O_DIRECT
+    if(errno != EINVAL){
+      logEvent("Error", "Failed to open file for direct reads");
+      return 0; 
+    }
+    
+    private->streaming = STREAM_DROP; 
+    return 1; 
+  }
+  
+  private->streaming = STREAM_DIRECT; 
+  
+  return 1; 
+}
+
+
+/*
+ * dfStat fills status with what the filesystem knows of the open file, returns 0 on error and 1 on success
+ */
+static int dfStat(diskFileObject *this, struct stat *status)
+{
+  diskFilePrivate *private = (diskFilePrivate *)this;
+  
+  if(private == NULL || status == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if(private->descriptor == NULL){
+    logEvent("Error", "File must be open to stat it");
+    return 0; 
+  }
+  
+  if( fstat(fileno(private->descriptor), status) == -1 ){
+    logEvent("Error", "Failed to stat file");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * dfTruncate makes the open file bytesize bytes, cutting off its end or extending it with zeros, so dfWrite can map anywhere in it.
+ * Returns 0 on error and 1 on success
+ */
+static int dfTruncate(diskFileObject *this, uint32_t bytesize)
+{
+  diskFilePrivate *private = (diskFilePrivate *)this;
+  
+  if(private == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  if( fileModeWritable(private->mode) != 1 ){
+    logEvent("Error", "File mode isn't writable (or it's NULL)"); 
+    return 0; 
+  }
+  
+  if(private->descriptor == NULL){
+    logEvent("Error", "File is not open");
+    return 0; 
+  }
+  
+  if( ftruncate(fileno(private->descriptor), bytesize) == -1 ){
+    logEvent("Error", "Failed to truncate file");
+    return 0; 
+  }
+  
+  private->bytesize = bytesize; 
+  return 1; 
+}
+
+
 
 
 static uint32_t getBytesize(diskFileObject *this)
@@ -399,6 +782,237 @@ static uint32_t dfBytesize(diskFileObject *this)
 
 
 
+/*
+ * directRead reads bytesToRead bytes at readOffset of a file streaming with O_DIRECT, through the thread's aligned bounce buffer a
+ * chunk at a time. Returns 0 on error and 1 on success
+ */
+static int directRead(diskFilePrivate *private, unsigned char *outBuffer, uint32_t bytesToRead, uint32_t readOffset)
+{
+  uint32_t alignedOffset = 0; 
+  uint32_t skipBytes     = 0; 
+  uint32_t copyBytes     = 0; 
+  uint32_t spanBytes     = 0; 
+  ssize_t  readReturn    = 0; 
+  
+  if(getThreadChunkBuffer() == NULL){
+    logEvent("Error", "Failed to allocate direct read buffer");
+    return 0; 
+  }
+  
+  while(bytesToRead){
+    alignedOffset = readOffset - (readOffset % DIRECT_IO_ALIGNMENT); 
+    skipBytes     = readOffset - alignedOffset; 
+    copyBytes     = (bytesToRead < FILE_CHUNK_BYTESIZE - skipBytes) ? bytesToRead : FILE_CHUNK_BYTESIZE - skipBytes; 
+    
+    //the length has to be aligned too, the read just comes up short at the end of the file
+    spanBytes = skipBytes + copyBytes; 
+    spanBytes = spanBytes + (DIRECT_IO_ALIGNMENT - spanBytes % DIRECT_IO_ALIGNMENT) % DIRECT_IO_ALIGNMENT; 
+    
+    readReturn = pread(private->directFid, threadChunkBuffer, spanBytes, alignedOffset); 
+    costAdd(COST_READ_CALLS, 1); 
+    
+    if(readReturn == -1 || readReturn < skipBytes + copyBytes){
+      logEvent("Error", "Failed to read file directly");
+      return 0; 
+    }
+    
+    memcpy(outBuffer, threadChunkBuffer + skipBytes, copyBytes); 
+    
+    costAdd(COST_COPIED_BYTES, copyBytes); 
+    costAdd(COST_DISK_BYTES, copyBytes); 
+    PROBE4(chunk_read, &private->publicDiskFile, copyBytes, readOffset, 0); 
+    
+    outBuffer   += copyBytes; 
+    readOffset  += copyBytes; 
+    bytesToRead -= copyBytes; 
+  }
+  
+  return 1; 
+}
+
+
+//returns the thread's chunk sized scratch buffer, aligned for O_DIRECT, or NULL on error
+static unsigned char *getThreadChunkBuffer(void)
+{
+  unsigned char *buffer = NULL; 
+  
+  if(threadChunkBuffer != NULL){
+    return threadChunkBuffer; 
+  }
+  
+  pthread_once(&globalChunkBufferOnce, &createChunkBufferKey); 
+  if( !globalChunkBufferKeyCreated ){
+    return NULL; 
+  }
+  
+  if( posix_memalign((void **)&buffer, DIRECT_IO_ALIGNMENT, FILE_CHUNK_BYTESIZE) ){
+    return NULL; 
+  }
+  
+  //registered with the key so it is freed when the thread exits
+  if( pthread_setspecific(globalChunkBufferKey, buffer) != 0 ){
+    free(buffer); 
+    return NULL; 
+  }
+  
+  threadChunkBuffer = buffer; 
+  return threadChunkBuffer; 
+}
+
+
+static void createChunkBufferKey(void)
+{
+  globalChunkBufferKeyCreated = (pthread_key_create(&globalChunkBufferKey, &releaseChunkBuffer) == 0); 
+}
+
+
+//thread specific data destructor, serving threads come and go with their connections
+static void releaseChunkBuffer(void *buffer)
+{
+  threadChunkBuffer = NULL; 
+  free(buffer); 
+}
+
+
+/*
+ * cacheCompressed caches the first bytesize bytes of the file a chunk at a time, each chunk LZ4 compressed unless that saves less than
+ * 1/CACHE_COMPRESSION_MIN_SAVING of it, in which case it is kept raw. Returns bytesize on success and 0 on error
+ */
+static uint32_t cacheCompressed(diskFilePrivate *private, uint32_t bytesize)
+{
+#ifdef ONIONGET_LZ4
+  unsigned char *raw            = NULL; 
+  unsigned char *staging        = NULL; 
+  cacheChunk    *chunks         = NULL; 
+  uint32_t      chunkCount      = 0; 
+  uint32_t      chunk           = 0; 
+  uint32_t      chunkBytesize   = 0; 
+  uint32_t      storedBytesize  = 0; 
+  int           compressed      = 0; 
+  uint32_t      cached          = 0; 
+  
+  if(bytesize == 0){
+    return 0; 
+  }
+  
+  chunkCount = (bytesize + FILE_CHUNK_BYTESIZE - 1) / FILE_CHUNK_BYTESIZE; 
+  
+  raw     = (unsigned char *)secureAllocate(bytesize); 
+  staging = (unsigned char *)secureAllocate((size_t)chunkCount * LZ4_COMPRESSBOUND(FILE_CHUNK_BYTESIZE)); 
+  chunks  = (cacheChunk *)secureAllocateTagged(chunkCount * sizeof(cacheChunk), MEMORY_TAG_FILE_CACHE); 
+  if(raw == NULL || staging == NULL || chunks == NULL){
+    logEvent("Error", "Failed to allocate memory to compress file cache");
+    goto cleanup; 
+  }
+  
+  if( !dfRead(&private->publicDiskFile, raw, bytesize, 0) ){
+    logEvent("Error", "Failed to read bytes into the cache");
+    goto cleanup; 
+  }
+  
+  for(chunk = 0; chunk != chunkCount; chunk++){
+    chunkBytesize = (bytesize - chunk * FILE_CHUNK_BYTESIZE < FILE_CHUNK_BYTESIZE) ? bytesize - chunk * FILE_CHUNK_BYTESIZE : FILE_CHUNK_BYTESIZE; 
+    
+    compressed = LZ4_compress_default((const char *)&raw[chunk * FILE_CHUNK_BYTESIZE], (char *)&staging[storedBytesize], chunkBytesize, 
+                                      LZ4_COMPRESSBOUND(FILE_CHUNK_BYTESIZE)); 
+    
+    //incompressible data, random or already compressed, isn't worth decompressing on every hit
+    if(compressed <= 0 || (uint32_t)compressed > chunkBytesize - chunkBytesize / CACHE_COMPRESSION_MIN_SAVING){
+      memcpy(&staging[storedBytesize], &raw[chunk * FILE_CHUNK_BYTESIZE], chunkBytesize); 
+      compressed = chunkBytesize; 
+    }
+    
+    chunks[chunk].offset         = storedBytesize; 
+    chunks[chunk].storedBytesize = compressed; 
+    storedBytesize              += compressed; 
+  }
+  
+  private->cache = (unsigned char *)secureAllocateCache(storedBytesize, MEMORY_TAG_FILE_CACHE); 
+  if(private->cache == NULL){
+    logEvent("Error", "Failed to allocate memory to cache file");
+    goto cleanup; 
+  }
+  
+  memcpy(private->cache, staging, storedBytesize); 
+  
+  private->cacheChunks         = chunks; 
+  private->cacheStoredBytesize = storedBytesize; 
+  private->cacheBytesize       = bytesize; 
+  chunks                       = NULL; 
+  cached                       = bytesize; 
+  
+  cleanup:
+    if(raw != NULL){
+      secureFree(&raw, bytesize); 
+    }
+    
+    if(staging != NULL){
+      secureFree(&staging, (size_t)chunkCount * LZ4_COMPRESSBOUND(FILE_CHUNK_BYTESIZE)); 
+    }
+    
+    if(chunks != NULL){
+      secureFree(&chunks, chunkCount * sizeof(cacheChunk)); 
+    }
+    
+    return cached; 
+#else
+  logEvent("Error", "Cache compression needs a build with LZ4=1");
+  return 0; 
+#endif
+}
+
+
+/*
+ * readCompressedCache copies bytesToRead bytes at readOffset out of a compressed cache, decompressing whole chunks straight into
+ * outBuffer and the rest through the thread's chunk buffer, which is freed when the thread exits. Returns 0 on error and 1 on success
+ */
+static int readCompressedCache(diskFilePrivate *private, unsigned char *outBuffer, uint32_t bytesToRead, uint32_t readOffset)
+{
+#ifdef ONIONGET_LZ4
+  cacheChunk    *chunk         = NULL; 
+  uint32_t      chunkStart     = 0; 
+  uint32_t      chunkBytesize  = 0; 
+  uint32_t      skipBytes      = 0; 
+  uint32_t      copyBytes      = 0; 
+  unsigned char *scratch       = NULL; 
+  
+  while(bytesToRead){
+    chunk         = &private->cacheChunks[readOffset / FILE_CHUNK_BYTESIZE]; 
+    chunkStart    = readOffset - readOffset % FILE_CHUNK_BYTESIZE; 
+    chunkBytesize = (private->cacheBytesize - chunkStart < FILE_CHUNK_BYTESIZE) ? private->cacheBytesize - chunkStart : FILE_CHUNK_BYTESIZE; 
+    skipBytes     = readOffset - chunkStart; 
+    copyBytes     = (bytesToRead < chunkBytesize - skipBytes) ? bytesToRead : chunkBytesize - skipBytes; 
+    
+    if(chunk->storedBytesize == chunkBytesize){
+      memcpy(outBuffer, &private->cache[chunk->offset + skipBytes], copyBytes); 
+    }
+    else if(copyBytes == chunkBytesize){
+      if( LZ4_decompress_safe((const char *)&private->cache[chunk->offset], (char *)outBuffer, chunk->storedBytesize, chunkBytesize) != chunkBytesize ){
+        return 0; 
+      }
+    }
+    else{
+      scratch = getThreadChunkBuffer(); 
+      if( scratch == NULL || 
+          LZ4_decompress_safe((const char *)&private->cache[chunk->offset], (char *)scratch, chunk->storedBytesize, chunkBytesize) != chunkBytesize ){
+        return 0; 
+      }
+      
+      memcpy(outBuffer, scratch + skipBytes, copyBytes); 
+    }
+    
+    outBuffer   += copyBytes; 
+    readOffset  += copyBytes; 
+    bytesToRead -= copyBytes; 
+  }
+  
+  return 1; 
+#else
+  return 0; 
+#endif
+}
+
+
 /*
  * initializeFileProperties returns 0 on error and 1 on success.  
  */
@@ -427,7 +1041,7 @@ int initializeFileProperties(diskFileObject *this, const char *path, char *name,
   // +1 to ensure NULL termination, +1 to ensure room for terminating / if we need to add it. Wastes up to one byte of memory.
   private->fullPathBytesize = pathBytesize + nameBytesize + 2;  
   
-  private->fullPath = (char *)secureAllocate(private->fullPathBytesize);
+  private->fullPath = (char *)secureAllocateTagged(private->fullPathBytesize, MEMORY_TAG_FILE_PATH);
   if(private->fullPath == NULL){
     logEvent("Error", "Failed to allocate memory for path");
     return 0;
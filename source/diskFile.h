@@ -1,15 +1,23 @@
 #pragma once
 #include "stdint.h"
+#include <sys/stat.h>
 
 
 typedef struct diskFileObject{
   uint32_t            (*dfWrite)(struct diskFileObject* this, void *dataBuffer, size_t bytesize, uint32_t writeOffset);
   int                 (*dfRead)(struct diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset);
+  uint32_t            (*dfTryRead)(struct diskFileObject *this, void* outBuffer, uint32_t bytesToRead, uint32_t readOffset);
   int                 (*closeTearDown)(struct diskFileObject** thisPointer); 
   int                 (*dfOpen)(struct diskFileObject *this, const char *path, char *name, char *mode);
   uint32_t            (*getBytesize)(struct diskFileObject *this);
   char                *(*getFilename)(struct diskFileObject *this); 
-  uint32_t            (*cacheBytes)(struct diskFileObject *this, uint32_t maxBytes); 
+  uint32_t            (*cacheBytes)(struct diskFileObject *this, uint32_t maxBytes, int compress); 
+  uint32_t            (*getCacheFootprint)(struct diskFileObject *this); 
+  int                 (*prefetch)(struct diskFileObject *this, uint32_t offset, uint32_t bytesize); 
+  int                 (*setStreaming)(struct diskFileObject *this); 
+  int                 (*dfStat)(struct diskFileObject *this, struct stat *status); 
+  int                 (*dfTruncate)(struct diskFileObject *this, uint32_t bytesize); 
+  int                 (*dfReinitialize)(struct diskFileObject *this); 
 }diskFileObject; 
 
 
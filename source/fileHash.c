@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#ifdef ONIONGET_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "fileHash.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * File hashes, see fileHash.h. The hashes of the file bank are published slot by slot as the background thread gets to them, so a
+ * file requested before it has been hashed just goes out without. The index is a header followed by a record per file:
+ *
+ * [HASH_INDEX_MAGIC][HASH_INDEX_VERSION][identity][file hash][chunk hashes][identity][file hash][chunk hashes]...
+ *
+ * in the server's own byte order, it is only ever read back by the server that wrote it. BLAKE3 picks the widest SIMD the CPU has at
+ * run time, so hashing costs a small fraction of what receiving the chunk through Tor does.
+ */
+
+
+//how a shared file is recognised in the index, a file with the same identity is taken to be unchanged
+typedef struct fileIdentity{
+  uint64_t device;
+  uint64_t inode;
+  int64_t  mtimeSeconds;
+  uint32_t mtimeNanoseconds;
+  uint32_t bytesize;
+}fileIdentity;
+
+
+static diskFileObject         **globalFiles       = NULL;
+static uint32_t               globalFileCount     = 0;
+static _Atomic(fileHashes *)  *globalHashes       = NULL;  //per file bank slot, NULL until the file has been hashed
+static fileIdentity           *globalIdentities   = NULL;  //per file bank slot
+static const char             *globalIndexPath    = NULL;
+static int                    globalIndexStale    = 0;     //the index on disk has records that no longer match a file
+static atomic_uint            globalLoadedFiles;
+static atomic_uint            globalHashedFiles;
+static atomic_uint            globalPendingFiles;
+static atomic_ullong          globalHashedBytes;
+
+
+static uint32_t   chunksOf(uint32_t bytesize);
+static fileHashes *newFileHashes(uint32_t chunkCount);
+static void       freeFileHashes(fileHashes *hashes);
+static void       loadHashIndex(void);
+static int        writeHashIndex(void);
+static void       *hashFiles(void *unused);
+static fileHashes *hashFile(diskFileObject *file, uint32_t bytesize, unsigned char *buffer);
+static void       hashBytes(const void *bytes, size_t bytesize, unsigned char *hash);
+static void       renderFileHashes(FILE *out);
+
+
+
+/*
+ * hashAvailable returns 1 if this build can hash and verify files, otherwise 0
+ */
+int hashAvailable(void)
+{
+#ifdef ONIONGET_BLAKE3
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * startHashIndex loads the hashes of files[fileCount] (the file bank, NULL slots are skipped) that indexPath has, and starts a thread
+ * hashing the rest which then writes the index back. Returns 0 on error and 1 on success
+ */
+int startHashIndex(diskFileObject **files, uint32_t fileCount, const char *indexPath)
+{
+  pthread_t   thread;
+  struct stat status;
+  uint32_t    slot = 0;
+
+  if(files == NULL || indexPath == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !hashAvailable() ){
+    logEvent("Error", "File hashing needs a build with BLAKE3=1");
+    return 0;
+  }
+
+  globalHashes     = (_Atomic(fileHashes *) *)secureAllocateTagged(fileCount * sizeof(*globalHashes), MEMORY_TAG_FILE);
+  globalIdentities = (fileIdentity *)secureAllocateTagged(fileCount * sizeof(fileIdentity), MEMORY_TAG_FILE);
+  if(globalHashes == NULL || globalIdentities == NULL){
+    logEvent("Error", "Failed to allocate memory for the file hashes");
+    return 0;
+  }
+
+  globalFiles     = files;
+  globalFileCount = fileCount;
+  globalIndexPath = indexPath;
+
+  for(slot = 0; slot != fileCount; slot++){
+    if(files[slot] == NULL){
+      continue;
+    }
+
+    if( !files[slot]->dfStat(files[slot], &status) ){
+      logEvent("Error", "Failed to stat a shared file");
+      return 0;
+    }
+
+    globalIdentities[slot].device           = (uint64_t)status.st_dev;
+    globalIdentities[slot].inode            = (uint64_t)status.st_ino;
+    globalIdentities[slot].mtimeSeconds     = (int64_t)status.st_mtim.tv_sec;
+    globalIdentities[slot].mtimeNanoseconds = (uint32_t)status.st_mtim.tv_nsec;
+    globalIdentities[slot].bytesize         = files[slot]->getBytesize(files[slot]);
+
+    atomic_fetch_add_explicit(&globalPendingFiles, 1, memory_order_relaxed);
+  }
+
+  loadHashIndex();
+
+  if( !registerMetricsRenderer(&renderFileHashes) ){
+    logEvent("Error", "Failed to register file hash metrics");
+    return 0;
+  }
+
+  if( pthread_create(&thread, NULL, &hashFiles, NULL) ){
+    logEvent("Error", "Failed to start the file hashing thread");
+    return 0;
+  }
+
+  pthread_detach(thread);
+
+  return 1;
+}
+
+
+/*
+ * getFileHashes returns the hashes of the file in file bank slot, or NULL if it hasn't been hashed yet
+ */
+fileHashes *getFileHashes(uint32_t slot)
+{
+  if(globalHashes == NULL || slot >= globalFileCount){
+    return NULL;
+  }
+
+  return atomic_load_explicit(&globalHashes[slot], memory_order_acquire);
+}
+
+
+/*
+ * hashTransmit sends hashes after a file's bytesize, or that there are none if hashes is NULL, returns 0 on error and 1 on success
+ */
+int hashTransmit(routerObject *router, fileHashes *hashes)
+{
+  if(router == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(hashes == NULL){
+    return router->transmitBytesize(router, 0);
+  }
+
+  if( !router->transmitBytesize(router, 1) || !router->transmit(router, hashes->fileHash, HASH_BYTESIZE) ){
+    return 0;
+  }
+
+  if( hashes->chunkCount && !router->transmit(router, hashes->chunkHashes, hashes->chunkCount * HASH_BYTESIZE) ){
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * hashReceive receives the hashes sent after a fileBytesize byte file's bytesize and checks the chunk hashes against the file hash,
+ * returns 0 on error and 1 on success, verifier->hashed says if there were hashes to receive
+ */
+int hashReceive(hashVerifier *verifier, routerObject *router, uint32_t fileBytesize)
+{
+  unsigned char fileHash[HASH_BYTESIZE];
+  unsigned char listHash[HASH_BYTESIZE];
+  uint32_t      hashed = 0;
+
+  if(verifier == NULL || router == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  verifier->hashed         = 0;
+  verifier->verifiedChunks = 0;
+  verifier->chunkCount     = chunksOf(fileBytesize);
+
+  //0 is a valid answer here, so unlike getIncomingBytesize a failure has to be told apart from it
+  if( !router->receive(router, &hashed, sizeof(uint32_t)) ){
+    logEvent("Error", "Failed to receive whether the file is hashed");
+    return 0;
+  }
+
+  hashed = ntohl(hashed);
+  if(hashed == 0){
+    return 1;
+  }
+
+  if(hashed != 1 || !hashAvailable()){
+    logEvent("Error", "Server sent hashes this client can't check");
+    return 0;
+  }
+
+  if(verifier->chunkCapacity < verifier->chunkCount){
+    if(verifier->chunkHashes != NULL){
+      secureFree(&verifier->chunkHashes, verifier->chunkCapacity * HASH_BYTESIZE);
+    }
+
+    verifier->chunkCapacity = 0;
+    verifier->chunkHashes   = (unsigned char *)secureAllocateTagged(verifier->chunkCount * HASH_BYTESIZE, MEMORY_TAG_CONNECTION);
+    if(verifier->chunkHashes == NULL){
+      logEvent("Error", "Failed to allocate memory for the chunk hashes");
+      return 0;
+    }
+
+    verifier->chunkCapacity = verifier->chunkCount;
+  }
+
+  if( !router->receive(router, fileHash, HASH_BYTESIZE) ||
+      (verifier->chunkCount && !router->receive(router, verifier->chunkHashes, verifier->chunkCount * HASH_BYTESIZE)) ){
+    logEvent("Error", "Failed to receive the file's hashes");
+    return 0;
+  }
+
+  hashBytes(verifier->chunkHashes, (size_t)verifier->chunkCount * HASH_BYTESIZE, listHash);
+  if( memcmp(listHash, fileHash, HASH_BYTESIZE) ){
+    logEvent("Error", "Server's chunk hashes don't match its file hash");
+    return 0;
+  }
+
+  verifier->hashed = 1;
+  return 1;
+}
+
+
+/*
+ * hashVerifyChunk checks the next chunk of the file, bytesize bytes of it, against its hash. Returns 0 if it doesn't match, 1 if it
+ * does or the file isn't hashed
+ */
+int hashVerifyChunk(hashVerifier *verifier, void *chunk, uint32_t bytesize)
+{
+  unsigned char hash[HASH_BYTESIZE];
+
+  if( !verifier->hashed ){
+    return 1;
+  }
+
+  if(verifier->verifiedChunks == verifier->chunkCount){
+    logEvent("Error", "Server sent more chunks than it has hashes for");
+    return 0;
+  }
+
+  hashBytes(chunk, bytesize, hash);
+  if( memcmp(hash, &verifier->chunkHashes[verifier->verifiedChunks * HASH_BYTESIZE], HASH_BYTESIZE) ){
+    logEvent("Error", "File chunk doesn't match the server's hash of it");
+    return 0;
+  }
+
+  verifier->verifiedChunks++;
+  return 1;
+}
+
+
+/*
+ * hashVerifyEnd returns 1 if every chunk of a hashed file was verified or the file isn't hashed, otherwise 0
+ */
+int hashVerifyEnd(hashVerifier *verifier)
+{
+  if(verifier->hashed && verifier->verifiedChunks != verifier->chunkCount){
+    logEvent("Error", "File ended before all of its chunks were verified");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * hashVerifierRelease frees what verifier allocated, it can be used again afterwards
+ */
+void hashVerifierRelease(hashVerifier *verifier)
+{
+  if(verifier != NULL && verifier->chunkHashes != NULL){
+    secureFree(&verifier->chunkHashes, verifier->chunkCapacity * HASH_BYTESIZE);
+    verifier->chunkCapacity = 0;
+  }
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static uint32_t chunksOf(uint32_t bytesize)
+{
+  return bytesize / FILE_CHUNK_BYTESIZE + (bytesize % FILE_CHUNK_BYTESIZE != 0);
+}
+
+
+static fileHashes *newFileHashes(uint32_t chunkCount)
+{
+  fileHashes *hashes = (fileHashes *)secureAllocateTagged(sizeof(fileHashes), MEMORY_TAG_FILE);
+
+  if(hashes == NULL){
+    return NULL;
+  }
+
+  hashes->chunkCount = chunkCount;
+  if(chunkCount == 0){
+    return hashes;
+  }
+
+  hashes->chunkHashes = (unsigned char *)secureAllocateTagged(chunkCount * HASH_BYTESIZE, MEMORY_TAG_FILE);
+  if(hashes->chunkHashes == NULL){
+    secureFree(&hashes, sizeof(fileHashes));
+    return NULL;
+  }
+
+  return hashes;
+}
+
+
+static void freeFileHashes(fileHashes *hashes)
+{
+  if(hashes->chunkHashes != NULL){
+    secureFree(&hashes->chunkHashes, hashes->chunkCount * HASH_BYTESIZE);
+  }
+
+  secureFree(&hashes, sizeof(fileHashes));
+}
+
+
+/*
+ * loadHashIndex publishes the hashes the index has for files whose identity hasn't changed. A missing or unreadable index only means
+ * more hashing, so it is never an error
+ */
+static void loadHashIndex(void)
+{
+  FILE         *in        = NULL;
+  fileHashes   *hashes    = NULL;
+  fileIdentity identity;
+  uint32_t     header[2];
+  uint32_t     slot       = 0;
+  int          used       = 0;
+
+  in = fopen(globalIndexPath, "rb");
+  if(in == NULL){
+    if(errno != ENOENT){
+      logEvent("Warning", "Failed to open the hash index, every shared file will be hashed");
+    }
+
+    globalIndexStale = 1;
+    return;
+  }
+
+  if( fread(header, sizeof(header), 1, in) != 1 || header[0] != HASH_INDEX_MAGIC || header[1] != HASH_INDEX_VERSION ){
+    logEvent("Warning", "Ignoring a hash index that isn't one, or is from another version");
+    globalIndexStale = 1;
+    fclose(in);
+    return;
+  }
+
+  while( fread(&identity, sizeof(identity), 1, in) == 1 ){
+    hashes = newFileHashes( chunksOf(identity.bytesize) );
+    if(hashes == NULL){
+      logEvent("Warning", "Failed to allocate memory for indexed file hashes");
+      break;
+    }
+
+    if( fread(hashes->fileHash, HASH_BYTESIZE, 1, in) != 1 ||
+        (hashes->chunkCount && fread(hashes->chunkHashes, (size_t)hashes->chunkCount * HASH_BYTESIZE, 1, in) != 1) ){
+      logEvent("Warning", "Hash index is truncated, the files it ends part way through will be hashed again");
+      freeFileHashes(hashes);
+      globalIndexStale = 1;
+      break;
+    }
+
+    //hard links share an identity, and so their hashes
+    used = 0;
+    for(slot = 0; slot != globalFileCount; slot++){
+      if( globalFiles[slot] != NULL && atomic_load_explicit(&globalHashes[slot], memory_order_relaxed) == NULL &&
+          !memcmp(&globalIdentities[slot], &identity, sizeof(identity)) ){
+        atomic_store_explicit(&globalHashes[slot], hashes, memory_order_release);
+        atomic_fetch_add_explicit(&globalLoadedFiles, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&globalPendingFiles, 1, memory_order_relaxed);
+        used = 1;
+      }
+    }
+
+    if( !used ){
+      freeFileHashes(hashes);
+      globalIndexStale = 1;
+    }
+  }
+
+  fclose(in);
+}
+
+
+/*
+ * writeHashIndex writes the hashes of every hashed file to the index, through a temporary file so a crash never leaves half an index,
+ * returns 0 on error and 1 on success
+ */
+static int writeHashIndex(void)
+{
+  char       temporaryPath[PATH_MAX];
+  uint32_t   header[2] = { HASH_INDEX_MAGIC, HASH_INDEX_VERSION };
+  uint32_t   slot      = 0;
+  fileHashes *hashes   = NULL;
+  FILE       *out      = NULL;
+
+  if( snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", globalIndexPath) >= (int)sizeof(temporaryPath) ){
+    logEvent("Error", "Hash index path is too long");
+    return 0;
+  }
+
+  out = fopen(temporaryPath, "wb");
+  if(out == NULL){
+    logEvent("Error", "Failed to create the hash index");
+    return 0;
+  }
+
+  if( fwrite(header, sizeof(header), 1, out) != 1 ){
+    goto error;
+  }
+
+  for(slot = 0; slot != globalFileCount; slot++){
+    hashes = getFileHashes(slot);
+    if(hashes == NULL){
+      continue;
+    }
+
+    if( fwrite(&globalIdentities[slot], sizeof(fileIdentity), 1, out) != 1 || fwrite(hashes->fileHash, HASH_BYTESIZE, 1, out) != 1 ||
+        (hashes->chunkCount && fwrite(hashes->chunkHashes, (size_t)hashes->chunkCount * HASH_BYTESIZE, 1, out) != 1) ){
+      goto error;
+    }
+  }
+
+  if( fclose(out) != 0 ){
+    out = NULL;
+    goto error;
+  }
+
+  if( rename(temporaryPath, globalIndexPath) == -1 ){
+    logEvent("Error", "Failed to replace the hash index");
+    remove(temporaryPath);
+    return 0;
+  }
+
+  return 1;
+
+  error:
+    logEvent("Error", "Failed to write the hash index");
+    if(out != NULL){
+      fclose(out);
+    }
+    remove(temporaryPath);
+    return 0;
+}
+
+
+//the hashing thread, it hashes every file the index didn't have and then writes the index back if anything changed
+static void *hashFiles(void *unused)
+{
+  unsigned char *buffer = NULL;
+  fileHashes    *hashes = NULL;
+  uint32_t      slot    = 0;
+  uint32_t      hashed  = 0;
+
+  buffer = (unsigned char *)secureAllocateTagged(FILE_CHUNK_BYTESIZE, MEMORY_TAG_FILE);
+  if(buffer == NULL){
+    logEvent("Error", "Failed to allocate memory to hash shared files");
+    return NULL;
+  }
+
+  for(slot = 0; slot != globalFileCount; slot++){
+    if(globalFiles[slot] == NULL || getFileHashes(slot) != NULL){
+      continue;
+    }
+
+    hashes = hashFile(globalFiles[slot], globalIdentities[slot].bytesize, buffer);
+    atomic_fetch_sub_explicit(&globalPendingFiles, 1, memory_order_relaxed);
+    if(hashes == NULL){
+      logEvent("Warning", "Failed to hash a shared file, it will be sent without hashes");
+      continue;
+    }
+
+    atomic_store_explicit(&globalHashes[slot], hashes, memory_order_release);
+    atomic_fetch_add_explicit(&globalHashedFiles, 1, memory_order_relaxed);
+    hashed++;
+  }
+
+  secureFree(&buffer, FILE_CHUNK_BYTESIZE);
+
+  if( (hashed || globalIndexStale) && !writeHashIndex() ){
+    logEvent("Warning", "Failed to persist the file hashes, they will be computed again next start");
+  }
+
+  return NULL;
+}
+
+
+//returns the hashes of bytesize byte file read through buffer, a chunk, or NULL on error
+static fileHashes *hashFile(diskFileObject *file, uint32_t bytesize, unsigned char *buffer)
+{
+  fileHashes *hashes      = NULL;
+  uint32_t   chunk        = 0;
+  uint32_t   chunkBytesize = 0;
+
+  hashes = newFileHashes( chunksOf(bytesize) );
+  if(hashes == NULL){
+    return NULL;
+  }
+
+  for(chunk = 0; chunk != hashes->chunkCount; chunk++){
+    chunkBytesize = bytesize - chunk * FILE_CHUNK_BYTESIZE;
+    chunkBytesize = (chunkBytesize < FILE_CHUNK_BYTESIZE) ? chunkBytesize : FILE_CHUNK_BYTESIZE;
+
+    if( !file->dfRead(file, buffer, chunkBytesize, chunk * FILE_CHUNK_BYTESIZE) ){
+      freeFileHashes(hashes);
+      return NULL;
+    }
+
+    hashBytes(buffer, chunkBytesize, &hashes->chunkHashes[chunk * HASH_BYTESIZE]);
+    atomic_fetch_add_explicit(&globalHashedBytes, chunkBytesize, memory_order_relaxed);
+  }
+
+  hashBytes(hashes->chunkHashes, (size_t)hashes->chunkCount * HASH_BYTESIZE, hashes->fileHash);
+
+  return hashes;
+}
+
+
+static void hashBytes(const void *bytes, size_t bytesize, unsigned char *hash)
+{
+#ifdef ONIONGET_BLAKE3
+  blake3_hasher hasher;
+
+  blake3_hasher_init(&hasher);
+  blake3_hasher_update(&hasher, bytes, bytesize);
+  blake3_hasher_finalize(&hasher, hash, HASH_BYTESIZE);
+#else
+  memset(hash, 0, HASH_BYTESIZE);
+#endif
+}
+
+
+static void renderFileHashes(FILE *out)
+{
+  fprintf(out, "# HELP onionget_hash_index_files Shared files by where their hashes came from, pending ones go out without hashes\n"
+               "# TYPE onionget_hash_index_files gauge\n"
+               "onionget_hash_index_files{state=\"loaded\"} %u\n"
+               "onionget_hash_index_files{state=\"hashed\"} %u\n"
+               "onionget_hash_index_files{state=\"pending\"} %u\n",
+          atomic_load_explicit(&globalLoadedFiles, memory_order_relaxed), atomic_load_explicit(&globalHashedFiles, memory_order_relaxed),
+          atomic_load_explicit(&globalPendingFiles, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_hash_bytes_total Bytes of shared files hashed since the server started\n"
+               "# TYPE onionget_hash_bytes_total counter\n"
+               "onionget_hash_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalHashedBytes, memory_order_relaxed));
+}
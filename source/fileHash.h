@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include "router.h"
+#include "diskFile.h"
+#include "ogEnums.h"
+
+
+/*
+ * File hashes
+ *
+ * The server hashes every FILE_CHUNK_BYTESIZE chunk of a shared file with BLAKE3, and the file as the BLAKE3 of its chunk hashes in
+ * order, so a client checks each chunk as it arrives and never hashes the data twice. Hashing happens once, in a background thread
+ * that persists the hashes to an index keyed by device, inode, mtime and bytesize, so a restart only hashes what changed.
+ *
+ * A client that sets REQUEST_FLAG_HASHES gets every file response with the hashes after its bytesize:
+ *
+ * [file bytesize][hashed][file hash][first chunk hash][second chunk hash]...[file, raw or framed]
+ *
+ * hashed is 0, and nothing but the file follows, if the server hasn't hashed the file yet or doesn't hash at all.
+ */
+
+
+//the hashes of a shared file
+typedef struct fileHashes{
+  unsigned char fileHash[HASH_BYTESIZE];
+  uint32_t      chunkCount;
+  unsigned char *chunkHashes;       //chunkCount of them
+}fileHashes;
+
+//receiving side of a file's hashes, zeroed before first use and released after last use, can be reused for many files
+typedef struct hashVerifier{
+  unsigned char *chunkHashes;
+  uint32_t      chunkCount;
+  uint32_t      chunkCapacity;      //chunk hashes there is room for
+  uint32_t      verifiedChunks;
+  int           hashed;             //the server sent hashes for the file being received
+}hashVerifier;
+
+
+int        hashAvailable(void);
+
+int        startHashIndex(diskFileObject **files, uint32_t fileCount, const char *indexPath);
+fileHashes *getFileHashes(uint32_t slot);
+int        hashTransmit(routerObject *router, fileHashes *hashes);
+
+int        hashReceive(hashVerifier *verifier, routerObject *router, uint32_t fileBytesize);
+int        hashVerifyChunk(hashVerifier *verifier, void *chunk, uint32_t bytesize);
+int        hashVerifyEnd(hashVerifier *verifier);
+void       hashVerifierRelease(hashVerifier *verifier);
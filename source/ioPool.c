@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ioPool.h"
+#include "diskFile.h"
+#include "profiledMutex.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Disk I/O pool
+ *
+ * Reads that can't be served from memory without blocking (see dfTryRead) are handed to a few dedicated threads, so a thread serving
+ * a connection can go on sending the chunk it already has while the disk works on the next one. Requests are queued first in first out
+ * and each connection has at most one outstanding, so the queue needs no bound. A request stays owned by its submitter, which must
+ * ioWait for it before reusing or freeing the request or its buffer.
+ */
+
+
+static atomic_int      globalRunning     = 0;
+static ioRequest       *globalQueueHead  = NULL;
+static ioRequest       *globalQueueTail  = NULL;
+static uint32_t        globalQueueDepth  = 0;
+static profiledMutex   globalIoLock      = PROFILED_MUTEX_INITIALIZER("ioPool");
+static pthread_cond_t  globalQueued      = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  globalCompleted   = PTHREAD_COND_INITIALIZER;
+static atomic_ullong   globalReads;
+static atomic_ullong   globalBytes;
+static atomic_ullong   globalWaitNanoseconds;
+
+
+static void     *ioWorker(void *unused);
+static uint64_t getNanoseconds(void);
+static void     renderIoPool(FILE *out);
+
+
+
+/*
+ * ioSubmit queues request to be read by the pool, returns 0 on error and 1 on success
+ */
+int ioSubmit(ioRequest *request)
+{
+  if(request == NULL || request->file == NULL || request->buffer == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( !atomic_load_explicit(&globalRunning, memory_order_relaxed) ){
+    logEvent("Error", "The disk I/O pool isn't running");
+    return 0;
+  }
+
+  profiledLock(&globalIoLock);
+
+  request->done    = 0;
+  request->success = 0;
+  request->next    = NULL;
+
+  if(globalQueueTail == NULL){
+    globalQueueHead = request;
+  }
+  else{
+    globalQueueTail->next = request;
+  }
+
+  globalQueueTail = request;
+  globalQueueDepth++;
+
+  pthread_cond_signal(&globalQueued);
+  profiledUnlock(&globalIoLock);
+
+  return 1;
+}
+
+
+/*
+ * ioWait waits for the pool to finish request, returns 0 if the read failed and 1 if it succeeded
+ */
+int ioWait(ioRequest *request)
+{
+  uint64_t start   = getNanoseconds();
+  int      success = 0;
+
+  profiledLock(&globalIoLock);
+
+  while( !request->done ){
+    profiledCondWait(&globalCompleted, &globalIoLock);
+  }
+
+  success = request->success;
+
+  profiledUnlock(&globalIoLock);
+
+  atomic_fetch_add_explicit(&globalWaitNanoseconds, getNanoseconds() - start, memory_order_relaxed);
+
+  return success;
+}
+
+
+int ioPoolRunning(void)
+{
+  return atomic_load_explicit(&globalRunning, memory_order_relaxed);
+}
+
+
+/*
+ * startIoPool starts the given number of disk I/O threads and adds the pool to the stats output, returns 0 on error and 1 on success
+ */
+int startIoPool(uint32_t threads)
+{
+  pthread_t thread;
+
+  if(threads == 0 || threads > IO_POOL_MAX_THREADS){
+    logEvent("Error", "Invalid disk I/O thread count");
+    return 0;
+  }
+
+  if( !registerMetricsRenderer(&renderIoPool) ){
+    logEvent("Error", "Failed to register disk I/O pool metrics");
+    return 0;
+  }
+
+  while(threads--){
+    if( pthread_create(&thread, NULL, &ioWorker, NULL) ){
+      logEvent("Error", "Failed to start a disk I/O thread");
+      return 0;
+    }
+
+    pthread_detach(thread);
+  }
+
+  atomic_store(&globalRunning, 1);
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void *ioWorker(void *unused)
+{
+  ioRequest *request = NULL;
+  int       success  = 0;
+
+  for(;;){
+    profiledLock(&globalIoLock);
+
+    while(globalQueueHead == NULL){
+      profiledCondWait(&globalQueued, &globalIoLock);
+    }
+
+    request         = globalQueueHead;
+    globalQueueHead = request->next;
+    if(globalQueueHead == NULL){
+      globalQueueTail = NULL;
+    }
+
+    globalQueueDepth--;
+
+    profiledUnlock(&globalIoLock);
+
+    //the read blocks this thread rather than the connection
+    success = request->file->dfRead(request->file, request->buffer, request->bytesize, request->offset);
+
+    atomic_fetch_add_explicit(&globalReads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&globalBytes, request->bytesize, memory_order_relaxed);
+
+    profiledLock(&globalIoLock);
+    request->success = success;
+    request->done    = 1;
+    pthread_cond_broadcast(&globalCompleted);
+    profiledUnlock(&globalIoLock);
+  }
+
+  return NULL;
+}
+
+
+static uint64_t getNanoseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+static void renderIoPool(FILE *out)
+{
+  uint32_t depth = 0;
+
+  profiledLock(&globalIoLock);
+  depth = globalQueueDepth;
+  profiledUnlock(&globalIoLock);
+
+  fprintf(out, "# HELP onionget_io_pool_reads_total File chunk reads that would have blocked and went to the disk I/O pool\n"
+               "# TYPE onionget_io_pool_reads_total counter\n"
+               "onionget_io_pool_reads_total %llu\n", (unsigned long long)atomic_load_explicit(&globalReads, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_io_pool_read_bytes_total Bytes read by the disk I/O pool\n"
+               "# TYPE onionget_io_pool_read_bytes_total counter\n"
+               "onionget_io_pool_read_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalBytes, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_io_pool_wait_seconds_total Time connections spent waiting for the pool once they had nothing left to send\n"
+               "# TYPE onionget_io_pool_wait_seconds_total counter\n"
+               "onionget_io_pool_wait_seconds_total %.6f\n", atomic_load_explicit(&globalWaitNanoseconds, memory_order_relaxed) / 1e9);
+
+  fprintf(out, "# HELP onionget_io_pool_queued_reads Reads waiting for a disk I/O thread\n"
+               "# TYPE onionget_io_pool_queued_reads gauge\n"
+               "onionget_io_pool_queued_reads %u\n", depth);
+}
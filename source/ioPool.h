@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include "diskFile.h"
+
+
+//a chunk read handed to the disk I/O pool, owned by the thread that submitted it until ioWait returns
+typedef struct ioRequest{
+  diskFileObject   *file;
+  void             *buffer;
+  uint32_t         bytesize;
+  uint32_t         offset;
+  int              done;       //only touched with the pool lock held
+  int              success;
+  struct ioRequest *next;      //queue link, only touched with the pool lock held
+}ioRequest;
+
+
+int ioSubmit(ioRequest *request);
+int ioWait(ioRequest *request);
+int ioPoolRunning(void);
+
+int startIoPool(uint32_t threads);
@@ -1,44 +1,473 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-static char *getTimeInString(void);
+#include "macros.h"
+#include "ogEnums.h"
 
 
-/*** For logging macro ***/ 
-//TODO time function internals were acting very weird when they were in the ogLogMacroBackEnd function, this warrants looking into
+/*
+ * Logging backend
+ *
+ * logEvent never formats or writes anything on the calling thread. Each thread that logs owns a single producer single consumer ring of
+ * log entries, the call just copies the message into the next free entry and publishes it. A background flusher thread drains every
+ * ring, formats the entries and writes them to stdout. When a ring is full the entry is dropped and counted rather than blocking.
+ *
+ * Timestamps are whole seconds cached by the flusher (coarse, but a log line only ever showed seconds anyway), replacing ctime which
+ * returned a shared static buffer. Each thread also rate limits every call site (file:line) to LOG_RATE_LIMIT_PER_SECOND events
+ * per second, so a misbehaving client can't flood the log, the number of suppressed events is reported with the next accepted one.
+ *
+ * Rings are never freed, when a thread exits its ring is released and adopted by the next thread that logs. The server spawns a thread
+ * per connection so this bounds the number of rings by the number of concurrent threads.
+ */
 
-//never call this directly but always with macro logEvent(category, message) 
-void ogLogMacroBackEnd(char *category, char *message, char *filename, unsigned int lineNumber) 
+
+typedef struct logEntry{
+  time_t       timestamp;
+  const char   *filename;     //__FILE__ so always a string literal, safe to keep the pointer
+  unsigned int lineNumber;
+  uint32_t     suppressed;    //events from this call site dropped by rate limiting prior to this one
+  char         category[LOG_CATEGORY_BYTESIZE];
+  char         message[LOG_MESSAGE_BYTESIZE];
+}logEntry;
+
+typedef struct logRateSlot{
+  const char   *filename;
+  unsigned int lineNumber;
+  time_t       window;
+  uint32_t     count;
+  uint32_t     suppressed;
+}logRateSlot;
+
+typedef struct logRing{
+  struct logRing *next;                             //set once before the ring is published, never changes
+  atomic_int     inUse;
+  atomic_uint    head;                              //only written by the owning thread
+  atomic_uint    tail;                              //only written by the flusher
+  atomic_ulong   dropped;
+  logRateSlot    rateSlots[LOG_RATE_LIMIT_SLOTS];   //only touched by the owning thread
+  logEntry       entries[LOG_RING_ENTRIES];
+}logRing;
+
+
+static _Atomic(logRing *)  globalRings          = NULL;
+static atomic_int          globalThreshold      = LOG_LEVEL_INFO;
+static atomic_llong        globalCoarseTime     = 0;
+static atomic_int          globalFlusherRunning = 0;
+static atomic_ulong        globalUnloggable     = 0;
+static pthread_t           globalFlusher;
+static pthread_key_t       globalRingKey;
+static int                 globalRingKeyCreated = 0;   //only written by initializeLogging, under globalLogOnce
+static pthread_once_t      globalLogOnce        = PTHREAD_ONCE_INIT;
+static pthread_mutex_t     globalDrainLock      = PTHREAD_MUTEX_INITIALIZER;
+static void                (*globalSink)(const char *line) = NULL;   //only read and written with the drain lock held
+
+static __thread logRing    *threadRing          = NULL;
+
+
+static void    initializeLogging(void);
+static void    stopLoggingAtExit(void);
+static void    releaseRing(void *ringV);
+static logRing *acquireRing(void);
+static void    logSynchronously(char *category, char *message, char *filename, unsigned int lineNumber);
+static int     categoryLevel(const char *category);
+static int     rateLimitAllows(logRing *ring, const char *filename, unsigned int lineNumber, time_t now, uint32_t *suppressed);
+static void    *flushLoop(void *unused);
+static void    drainRings(void);
+static void    writeEntry(const logEntry *entry);
+static void    writeLine(const char *line);
+static char    *getTimeInString(time_t timeInSeconds);
+
+
+
+/*** For logging macro ***/
+
+//never call this directly but always with macro logEvent(category, message)
+void ogLogMacroBackEnd(char *category, char *message, char *filename, unsigned int lineNumber)
+{
+  logRing      *ring       = NULL;
+  logEntry     *entry      = NULL;
+  unsigned int head        = 0;
+  uint32_t     suppressed  = 0;
+  time_t       now         = 0;
+
+  if(category == NULL || message == NULL || filename == NULL){
+    fputs("Error: Failed to log error, but didn't fail to log log error error\n", stderr);
+    return;
+  }
+
+  if( categoryLevel(category) < atomic_load_explicit(&globalThreshold, memory_order_relaxed) ){
+    return;
+  }
+
+  pthread_once(&globalLogOnce, initializeLogging);
+
+  //without the key a ring couldn't be handed back when its thread exits, so every thread that logs would leak one
+  if( !globalRingKeyCreated ){
+    logSynchronously(category, message, filename, lineNumber);
+    return;
+  }
+
+  ring = acquireRing();
+  if(ring == NULL){
+    atomic_fetch_add_explicit(&globalUnloggable, 1, memory_order_relaxed);
+    return;
+  }
+
+  now = (time_t)atomic_load_explicit(&globalCoarseTime, memory_order_relaxed);
+
+  if( !rateLimitAllows(ring, filename, lineNumber, now, &suppressed) ){
+    return;
+  }
+
+  //single producer, so only the flusher can move tail underneath us, and only forward
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if( head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_ENTRIES ){
+    atomic_fetch_add_explicit(&ring->dropped, 1 + suppressed, memory_order_relaxed);
+    return;
+  }
+
+  entry = &ring->entries[head & (LOG_RING_ENTRIES - 1)];
+
+  entry->timestamp  = now;
+  entry->filename   = filename;
+  entry->lineNumber = lineNumber;
+  entry->suppressed = suppressed;
+  strncpy(entry->category, category, LOG_CATEGORY_BYTESIZE - 1);
+  entry->category[LOG_CATEGORY_BYTESIZE - 1] = '\0';
+  strncpy(entry->message, message, LOG_MESSAGE_BYTESIZE - 1);
+  entry->message[LOG_MESSAGE_BYTESIZE - 1] = '\0';
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+/*
+ * setLogThreshold sets the lowest severity level that is logged, events below it are discarded on the calling thread
+ */
+void setLogThreshold(int level)
+{
+  if(level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR){
+    logEvent("Error", "Invalid log threshold");
+    return;
+  }
+
+  atomic_store_explicit(&globalThreshold, level, memory_order_relaxed);
+}
+
+
+/*
+ * setLogSink sends every formatted log line (without a trailing newline) to sink instead of stdout, for when something else owns the
+ * terminal. sink is called from the flusher thread, NULL restores stdout
+ */
+void setLogSink(void (*sink)(const char *line))
+{
+  pthread_mutex_lock(&globalDrainLock);
+  globalSink = sink;
+  pthread_mutex_unlock(&globalDrainLock);
+}
+
+
+/*
+ * flushLog synchronously writes out every log entry published so far, for use before a deliberate exit or crash report
+ */
+void flushLog(void)
+{
+  drainRings();
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+/*
+ * initializeLogging runs once per process on the first logged event, it starts the flusher thread. If the flusher can't be started
+ * entries are still queued and then written by flushLog or at exit
+ */
+static void initializeLogging(void)
+{
+  atomic_store(&globalCoarseTime, (long long)time(NULL));
+
+  if( pthread_key_create(&globalRingKey, releaseRing) != 0 ){
+    fputs("Error: Failed to create log ring key, events will be written as they are logged\n", stderr);
+  }
+  else{
+    globalRingKeyCreated = 1;
+  }
+
+  atomic_store(&globalFlusherRunning, 1);
+  if( pthread_create(&globalFlusher, NULL, flushLoop, NULL) != 0 ){
+    atomic_store(&globalFlusherRunning, 0);
+    fputs("Error: Failed to start log flusher thread\n", stderr);
+  }
+
+  atexit(stopLoggingAtExit);
+}
+
+
+static void stopLoggingAtExit(void)
+{
+  if( atomic_exchange(&globalFlusherRunning, 0) ){
+    pthread_join(globalFlusher, NULL);
+  }
+
+  drainRings();
+}
+
+
+/*
+ * releaseRing is the thread specific data destructor, it hands the exiting threads ring back so another thread can adopt it
+ */
+static void releaseRing(void *ringV)
+{
+  logRing *ring = (logRing *)ringV;
+
+  if(ring != NULL){
+    atomic_store_explicit(&ring->inUse, 0, memory_order_release);
+  }
+}
+
+
+/*
+ * acquireRing returns the calling threads log ring, adopting a released ring or allocating a new one the first time a thread logs.
+ * Returns NULL on error.
+ *
+ * NOTE: uses calloc directly rather than secureAllocate, which logs on failure and would recurse back into here
+ */
+static logRing *acquireRing(void)
+{
+  logRing *ring     = NULL;
+  logRing *listHead = NULL;
+  int     expected  = 0;
+
+  if(threadRing != NULL){
+    return threadRing;
+  }
+
+  for(ring = atomic_load_explicit(&globalRings, memory_order_acquire); ring != NULL; ring = ring->next){
+    expected = 0;
+    if( atomic_compare_exchange_strong_explicit(&ring->inUse, &expected, 1, memory_order_acquire, memory_order_relaxed) ){
+      break;
+    }
+  }
+
+  if(ring == NULL){
+    ring = (logRing *)calloc(1, sizeof(*ring));
+    if(ring == NULL){
+      return NULL;
+    }
+
+    atomic_init(&ring->inUse, 1);
+
+    listHead = atomic_load_explicit(&globalRings, memory_order_relaxed);
+    do{
+      ring->next = listHead;
+    }while( !atomic_compare_exchange_weak_explicit(&globalRings, &listHead, ring, memory_order_release, memory_order_relaxed) );
+  }
+
+  pthread_setspecific(globalRingKey, ring);
+  threadRing = ring;
+
+  return ring;
+}
+
+
+/*
+ * logSynchronously writes an event straight out under the drain lock, for when log rings can't be used. Events logged this way aren't
+ * rate limited
+ */
+static void logSynchronously(char *category, char *message, char *filename, unsigned int lineNumber)
 {
-  char *timeInString = getTimeInString(); 
-  
-  
-  if(category == NULL || message == NULL || filename == NULL || timeInString == NULL){
-    printf("Error: Failed to log error, but didn't fail to log log error error\n");
-    return; 
+  logEntry entry;
+
+  entry.timestamp  = (time_t)atomic_load_explicit(&globalCoarseTime, memory_order_relaxed);
+  entry.filename   = filename;
+  entry.lineNumber = lineNumber;
+  entry.suppressed = 0;
+  strncpy(entry.category, category, LOG_CATEGORY_BYTESIZE - 1);
+  entry.category[LOG_CATEGORY_BYTESIZE - 1] = '\0';
+  strncpy(entry.message, message, LOG_MESSAGE_BYTESIZE - 1);
+  entry.message[LOG_MESSAGE_BYTESIZE - 1] = '\0';
+
+  pthread_mutex_lock(&globalDrainLock);
+  writeEntry(&entry);
+  pthread_mutex_unlock(&globalDrainLock);
+}
+
+
+/*
+ * categoryLevel returns the severity level of a logEvent category, unknown categories are treated as Info
+ */
+static int categoryLevel(const char *category)
+{
+  if( !strcmp(category, "Error") ){
+    return LOG_LEVEL_ERROR;
+  }
+
+  if( !strcmp(category, "Warning") ){
+    return LOG_LEVEL_WARNING;
+  }
+
+  if( !strcmp(category, "Debug") ){
+    return LOG_LEVEL_DEBUG;
   }
-  
-  printf("%s: %s --- %s:%u --- %s \n", category, message, filename, lineNumber, timeInString); 
+
+  return LOG_LEVEL_INFO;
 }
 
 
-//returns string from ctime function or NULL on error
-static char *getTimeInString(void)
+/*
+ * rateLimitAllows returns 1 if an event from filename:lineNumber may be logged this second and 0 if it is suppressed. On 1 suppressed is
+ * set to the number of events from the call site that were suppressed since the last one that was logged.
+ *
+ * Call sites are hashed into a small per thread table, a colliding call site simply takes the slot over and starts a fresh window
+ */
+static int rateLimitAllows(logRing *ring, const char *filename, unsigned int lineNumber, time_t now, uint32_t *suppressed)
 {
-  time_t timeInSeconds;
-  char   *timeInString;
-  
-  timeInSeconds = time(NULL);
-  if(timeInSeconds == (time_t) (-1)){
-    return NULL; 
+  logRateSlot *slot = NULL;
+  uintptr_t   hash  = 0;
+
+  hash = ((uintptr_t)filename >> 4) ^ ((uintptr_t)lineNumber * 2654435761u);
+  slot = &ring->rateSlots[hash & (LOG_RATE_LIMIT_SLOTS - 1)];
+
+  if(slot->filename != filename || slot->lineNumber != lineNumber){
+    slot->filename   = filename;
+    slot->lineNumber = lineNumber;
+    slot->window     = now;
+    slot->count      = 0;
+    slot->suppressed = 0;
+  }
+
+  if(slot->window != now){
+    slot->window = now;
+    slot->count  = 0;
   }
-  
-  timeInString = ctime((const time_t *)&timeInSeconds); 
-  if(timeInString == NULL){
-    return NULL; 
+
+  if(slot->count >= LOG_RATE_LIMIT_PER_SECOND){
+    slot->suppressed++;
+    return 0;
   }
-  
-  return timeInString; 
-}
\ No newline at end of file
+
+  slot->count++;
+
+  *suppressed      = slot->suppressed;
+  slot->suppressed = 0;
+
+  return 1;
+}
+
+
+static void *flushLoop(void *unused)
+{
+  struct timespec interval;
+
+  interval.tv_sec  = 0;
+  interval.tv_nsec = LOG_FLUSH_INTERVAL_USECS * 1000L;
+
+  while( atomic_load(&globalFlusherRunning) ){
+    atomic_store_explicit(&globalCoarseTime, (long long)time(NULL), memory_order_relaxed);
+    drainRings();
+    nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * drainRings writes every published entry of every ring to stdout (or the sink). Only one thread drains at a time, normally the flusher
+ */
+static void drainRings(void)
+{
+  logRing       *ring       = NULL;
+  unsigned int  tail        = 0;
+  unsigned int  head        = 0;
+  unsigned long dropped     = 0;
+  char          line[128];
+
+  pthread_mutex_lock(&globalDrainLock);
+
+  for(ring = atomic_load_explicit(&globalRings, memory_order_acquire); ring != NULL; ring = ring->next){
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for(; tail != head; tail++){
+      writeEntry(&ring->entries[tail & (LOG_RING_ENTRIES - 1)]);
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if(dropped){
+      snprintf(line, sizeof(line), "Warning: %lu log events dropped, log ring was full", dropped);
+      writeLine(line);
+    }
+  }
+
+  dropped = atomic_exchange_explicit(&globalUnloggable, 0, memory_order_relaxed);
+  if(dropped){
+    snprintf(line, sizeof(line), "Warning: %lu log events dropped, failed to allocate log ring", dropped);
+    writeLine(line);
+  }
+
+  fflush(stdout);
+
+  pthread_mutex_unlock(&globalDrainLock);
+}
+
+
+static void writeEntry(const logEntry *entry)
+{
+  char *timeInString = getTimeInString(entry->timestamp);
+  char line[LOG_CATEGORY_BYTESIZE + LOG_MESSAGE_BYTESIZE + 256];
+
+  if(entry->suppressed){
+    snprintf(line, sizeof(line), "%s: (%u similar events suppressed) --- %s:%u --- %s", entry->category, entry->suppressed, entry->filename,
+             entry->lineNumber, timeInString);
+    writeLine(line);
+  }
+
+  snprintf(line, sizeof(line), "%s: %s --- %s:%u --- %s", entry->category, entry->message, entry->filename, entry->lineNumber, timeInString);
+  writeLine(line);
+}
+
+
+//called with the drain lock held
+static void writeLine(const char *line)
+{
+  if(globalSink != NULL){
+    globalSink(line);
+    return;
+  }
+
+  fputs(line, stdout);
+  fputc('\n', stdout);
+}
+
+
+/*
+ * getTimeInString returns timeInSeconds formatted like ctime (without the newline). Only called with the drain lock held, the formatted
+ * string is cached as nearly every entry drained together shares the same second
+ */
+static char *getTimeInString(time_t timeInSeconds)
+{
+  static char   timeInString[32] = "unknown time";
+  static time_t cachedSeconds    = -1;
+  struct tm     brokenDown;
+
+  if(timeInSeconds == cachedSeconds){
+    return timeInString;
+  }
+
+  if( localtime_r(&timeInSeconds, &brokenDown) == NULL || !strftime(timeInString, sizeof(timeInString), "%a %b %e %H:%M:%S %Y", &brokenDown) ){
+    strcpy(timeInString, "unknown time");
+  }
+
+  cachedSeconds = timeInSeconds;
+
+  return timeInString;
+}
@@ -1,5 +1,18 @@
+#pragma once
+
 #define logEvent(category, message) (ogLogMacroBackEnd((category), (message), (__FILE__) , (__LINE__) ))
 
 
+//severity levels, the category passed to logEvent is mapped onto one of these ("Error", "Warning", "Info", "Debug")
+enum{ LOG_LEVEL_DEBUG   = 0 };
+enum{ LOG_LEVEL_INFO    = 1 };
+enum{ LOG_LEVEL_WARNING = 2 };
+enum{ LOG_LEVEL_ERROR   = 3 };
+
+
 //never call this directly but always with macro logEvent(category, message) 
-void ogLogMacroBackEnd(char *category, char *message, char *filename, unsigned int lineNumber); 
\ No newline at end of file
+void ogLogMacroBackEnd(char *category, char *message, char *filename, unsigned int lineNumber); 
+
+void setLogThreshold(int level); 
+void setLogSink(void (*sink)(const char *line)); 
+void flushLog(void); 
@@ -1,57 +1,342 @@
+#define _GNU_SOURCE   //mlock2
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "memoryManager.h"
+#include "ogEnums.h"
 #include "macros.h"
 
 
+/*
+ * Every allocation is preceded by a header recording its bytesize and tag, so that secureFree can account for it (and catch a wrong
+ * bytesize, or memory that secureAllocate never handed out) without the caller having to say what it was for again. Live bytes, peak
+ * bytes and allocation totals are kept per tag, the metrics output renders them and reportMemoryLeaks lists what is still allocated.
+ *
+ * secureAllocateLocked allocations are mappings of their own, locked in RAM with MLOCK_ONFAULT so that swapping can't stall a read of
+ * them, and marked by their canary so secureFree unmaps rather than frees them. What they lock is taken from a budget that
+ * startMemoryLocking sets from RLIMIT_MEMLOCK, once it runs out they are ordinary allocations.
+ *
+ * secureAllocateCache carves the file cache out of one arena mapped by startCacheArena, so a large cache sits on a few huge pages rather
+ * than thousands of small ones and misses the TLB far less. Arena allocations are handed out in order and what secureFree gives back
+ * isn't reused, which suits a cache filled once when the server starts. Once the arena is full they are allocated as before.
+ */
+typedef struct allocationHeader{
+  uint64_t bytesize;
+  uint32_t tag;
+  uint32_t canary;
+}allocationHeader;
+
+//the header is as big as calloc's alignment, so the memory after it stays aligned for anything
+_Static_assert(sizeof(allocationHeader) == 16, "allocation header must keep allocations 16 byte aligned");
+
+typedef struct memoryTagCounters{
+  atomic_ullong liveBytes;
+  atomic_ullong liveAllocations;
+  atomic_ullong peakBytes;
+  atomic_ullong allocations;
+  atomic_ullong allocatedBytes;
+  atomic_ullong lockedBytes;
+}memoryTagCounters;
+
+
+static memoryTagCounters globalTags[MEMORY_TAG_COUNT];
+static atomic_ullong     globalLockableBytes;    //what secureAllocateLocked may still lock, 0 until startMemoryLocking
+static atomic_int        globalLockingStarted;
+static atomic_int        globalLockingDegraded;  //set once an allocation couldn't be locked
+static unsigned char     *globalArena            = NULL;
+static cacheArenaStats   globalArenaStats;
+static atomic_ullong     globalArenaUsed;
+
+static const char *arenaBackingNames[4] = {
+  "none", "hugetlb", "transparent", "pages"
+};
+
+static const char *tagNames[MEMORY_TAG_COUNT] = {
+  "untagged", "connection", "router", "file", "file_path", "file_cache", "server", "diagnostics"
+};
+
+
+static void countAllocation(int tag, uint64_t bytesize);
+static void countFree(int tag, uint64_t bytesize);
+static size_t lockedMappingBytesize(size_t bytesize);
+static int  takeLockable(uint64_t bytesize);
+static void lockingDegraded(char *reason);
+static unsigned char *mapArena(size_t bytesize, int *backing);
+
+
 
 /*
  * secureAllocate returns NULL on error, otherwise returns a pointer to the allocated memory buffer, which is bytesize bytes and initialized to NULL. 
  */
 void *secureAllocate(size_t bytesize)
 {
-  void *memory;
+  return secureAllocateTagged(bytesize, MEMORY_TAG_UNTAGGED); 
+}
+
+
+/*
+ * secureAllocateTagged is secureAllocate with the memory accounted to tag (one of the MEMORY_TAG values)
+ */
+void *secureAllocateTagged(size_t bytesize, int tag)
+{
+  allocationHeader *header;
   
   if(bytesize == 0){
     logEvent("Error", "Cannot allocate 0 bytes of memory");
     return NULL; 
   }
   
-  memory = calloc(1, bytesize);
+  if(tag < 0 || tag >= MEMORY_TAG_COUNT || bytesize > SIZE_MAX - sizeof(allocationHeader)){
+    logEvent("Error", "Invalid memory allocation");
+    return NULL; 
+  }
   
-  if( memory == NULL ){
+  header = (allocationHeader *)calloc(1, sizeof(allocationHeader) + bytesize);
+  
+  if( header == NULL ){
     logEvent("Error", "Failed to allocate memory!");
     return NULL; 
   }
   
-  return memory;
+  header->bytesize = bytesize; 
+  header->tag      = (uint32_t)tag; 
+  header->canary   = MEMORY_HEADER_CANARY; 
+  
+  countAllocation(tag, bytesize); 
+  
+  return header + 1;
+}
+
+
+/*
+ * secureAllocateLocked is secureAllocateTagged with the memory locked in RAM if the budget set by startMemoryLocking allows it, and an
+ * ordinary allocation otherwise. Either way it is freed with secureFree, returns NULL on error
+ */
+void *secureAllocateLocked(size_t bytesize, int tag)
+{
+  allocationHeader *header          = NULL; 
+  size_t           mappingBytesize  = 0; 
+  
+  if(bytesize == 0 || tag < 0 || tag >= MEMORY_TAG_COUNT || bytesize > SIZE_MAX / 2){
+    logEvent("Error", "Invalid memory allocation");
+    return NULL; 
+  }
+  
+  mappingBytesize = lockedMappingBytesize(bytesize); 
+  
+  if( !takeLockable(mappingBytesize) ){
+    lockingDegraded("RLIMIT_MEMLOCK is used up, allocating the rest unlocked"); 
+    return secureAllocateTagged(bytesize, tag); 
+  }
+  
+  //anonymous mappings come zeroed like calloc's memory
+  header = (allocationHeader *)mmap(NULL, mappingBytesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); 
+  if(header == MAP_FAILED){
+    atomic_fetch_add_explicit(&globalLockableBytes, mappingBytesize, memory_order_relaxed); 
+    logEvent("Error", "Failed to map memory to lock");
+    return NULL; 
+  }
+  
+  //pages are locked as they are first touched, so a cache that is never filled doesn't pin memory it doesn't use
+  if( mlock2(header, mappingBytesize, MLOCK_ONFAULT) ){
+    munmap(header, mappingBytesize); 
+    atomic_fetch_add_explicit(&globalLockableBytes, mappingBytesize, memory_order_relaxed); 
+    lockingDegraded("Failed to lock memory, allocating the rest unlocked"); 
+    return secureAllocateTagged(bytesize, tag); 
+  }
+  
+  header->bytesize = bytesize; 
+  header->tag      = (uint32_t)tag; 
+  header->canary   = MEMORY_LOCKED_CANARY; 
+  
+  countAllocation(tag, bytesize); 
+  atomic_fetch_add_explicit(&globalTags[tag].lockedBytes, mappingBytesize, memory_order_relaxed); 
+  
+  return header + 1; 
 }
 
+
+/*
+ * startMemoryLocking has secureAllocateLocked lock memory up to RLIMIT_MEMLOCK, less reservedBytesize left for other locking such as
+ * MAP_LOCKED mappings. Returns 0 on error and 1 on success
+ */
+int startMemoryLocking(uint64_t reservedBytesize)
+{
+  struct rlimit limit; 
+  
+  if( getrlimit(RLIMIT_MEMLOCK, &limit) ){
+    logEvent("Error", "Failed to get the locked memory limit");
+    return 0; 
+  }
+  
+  if(limit.rlim_cur == RLIM_INFINITY){
+    atomic_store(&globalLockableBytes, UINT64_MAX); 
+  }
+  else{
+    atomic_store(&globalLockableBytes, limit.rlim_cur > reservedBytesize ? limit.rlim_cur - reservedBytesize : 0); 
+  }
+  
+  atomic_store(&globalLockingStarted, 1); 
+  
+  return 1; 
+}
+
+
+/*
+ * secureAllocateCache allocates bytesize bytes of file cache, from the cache arena while it has room and otherwise as
+ * secureAllocateLocked does. Freed with secureFree, returns NULL on error
+ */
+void *secureAllocateCache(size_t bytesize, int tag)
+{
+  allocationHeader *header    = NULL; 
+  uint64_t         slot       = 0; 
+  uint64_t         used       = 0; 
+  
+  if(bytesize == 0 || tag < 0 || tag >= MEMORY_TAG_COUNT || bytesize > SIZE_MAX / 2){
+    logEvent("Error", "Invalid memory allocation");
+    return NULL; 
+  }
+  
+  if(globalArena == NULL){
+    return secureAllocateLocked(bytesize, tag); 
+  }
+  
+  //slots keep the 16 byte alignment of ordinary allocations
+  slot = (sizeof(allocationHeader) + bytesize + 15) & ~(uint64_t)15; 
+  used = atomic_load_explicit(&globalArenaUsed, memory_order_relaxed); 
+  
+  do{
+    if(globalArenaStats.bytesize - used < slot){
+      return secureAllocateLocked(bytesize, tag); 
+    }
+  }while( !atomic_compare_exchange_weak_explicit(&globalArenaUsed, &used, used + slot, memory_order_relaxed, memory_order_relaxed) ); 
+  
+  header = (allocationHeader *)(globalArena + used); 
+  
+  header->bytesize = bytesize; 
+  header->tag      = (uint32_t)tag; 
+  header->canary   = MEMORY_ARENA_CANARY; 
+  
+  countAllocation(tag, bytesize); 
+  
+  return header + 1; 
+}
+
+
+/*
+ * startCacheArena maps an arena of bytesize bytes for secureAllocateCache, from reserved huge pages if there are enough of them, or
+ * else asking for transparent huge pages, or else of ordinary pages. If startMemoryLocking was called first it locks as much of the
+ * arena as the budget allows. Returns 0 on error and 1 on success
+ */
+int startCacheArena(size_t bytesize)
+{
+  uint64_t lockable  = 0; 
+  int      backing   = ARENA_BACKING_NONE; 
+  char     report[128]; 
+  
+  if(bytesize == 0 || globalArena != NULL){
+    logEvent("Error", "Invalid cache arena");
+    return 0; 
+  }
+  
+  bytesize    = (bytesize + HUGE_PAGE_BYTESIZE - 1) / HUGE_PAGE_BYTESIZE * HUGE_PAGE_BYTESIZE; 
+  globalArena = mapArena(bytesize, &backing); 
+  if(globalArena == NULL){
+    logEvent("Error", "Failed to map the cache arena");
+    return 0; 
+  }
+  
+  globalArenaStats.backing  = backing; 
+  globalArenaStats.bytesize = bytesize; 
+  
+  //huge pages from the reserved pool are never swapped, so they don't need locking
+  if( atomic_load_explicit(&globalLockingStarted, memory_order_relaxed) && backing != ARENA_BACKING_HUGETLB ){
+    lockable = atomic_load_explicit(&globalLockableBytes, memory_order_relaxed); 
+    lockable = (lockable < bytesize) ? lockable / HUGE_PAGE_BYTESIZE * HUGE_PAGE_BYTESIZE : bytesize; 
+    
+    if(lockable < bytesize){
+      lockingDegraded("RLIMIT_MEMLOCK doesn't cover the cache arena, locking part of it"); 
+    }
+    
+    if( lockable != 0 && takeLockable(lockable) ){
+      if( mlock2(globalArena, lockable, MLOCK_ONFAULT) ){
+        atomic_fetch_add_explicit(&globalLockableBytes, lockable, memory_order_relaxed); 
+        lockingDegraded("Failed to lock the cache arena, leaving it unlocked"); 
+      }
+      else{
+        globalArenaStats.lockedBytes = lockable; 
+      }
+    }
+  }
+  
+  snprintf(report, sizeof(report), "%llu byte cache arena backed by %s", (unsigned long long)bytesize, arenaBackingNames[backing]); 
+  logEvent("Info", report); 
+  
+  return 1; 
+}
+
+
+/*
+ * readCacheArena fills stats with the state of the cache arena, returns 0 on error and 1 on success
+ */
+int readCacheArena(cacheArenaStats *stats)
+{
+  if(stats == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  memcpy(stats, &globalArenaStats, sizeof(*stats)); 
+  stats->usedBytes = atomic_load_explicit(&globalArenaUsed, memory_order_relaxed); 
+  
+  return 1; 
+}
+
+
+const char *arenaBackingName(int backing)
+{
+  if(backing < 0 || backing > ARENA_BACKING_PAGES){
+    return "unknown"; 
+  }
+  
+  return arenaBackingNames[backing]; 
+}
+
+
 /*
  * returns 1 on success and 0 on error
  * 
  * memoryClear is passed a void* pointing to bytesize bytes, clears each byte by setting to 0
  * 
- * implemented because the memset solution in MEM03-C causes compiler warnings, this should do the same thing without
- * compiler warning 
+ * uses explicit_bzero where libc provides it (glibc 2.25+), which is guaranteed not to be optimized out, otherwise falls back to memset
+ * followed by a compiler barrier on the buffer in compliance with MEM03-C. Both paths use libc's vectorised store loops rather than
+ * clearing a byte per iteration through a volatile pointer, which matters because this runs over every connection buffer on teardown
  */
 int memoryClear(void *memoryPointerV, size_t bytesize)
 {
-  volatile unsigned char *memoryPointer = NULL;
-  
   if(memoryPointerV == NULL){
     logEvent("Error", "Something was NULL that shouldn't have been");
     return 0; 
   }
   
-  memoryPointer = memoryPointerV; 
-  
-  while(bytesize--){
-    *memoryPointer++ = 0;
+  if(bytesize == 0){
+    return 1; 
   }
   
+#if defined(__GLIBC__) && ( (__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25) )
+  explicit_bzero(memoryPointerV, bytesize);
+#else
+  memset(memoryPointerV, 0, bytesize);
+  
+  //memory barrier in compliance with https://sourceware.org/ml/libc-alpha/2014-12/msg00506.html
+  __asm__ __volatile__ ( "" : : "r"(memoryPointerV) : "memory" );
+#endif
+  
   return 1; 
 }
 
@@ -64,15 +349,14 @@ int memoryClear(void *memoryPointerV, size_t bytesize)
  * frees the memory, and points the pointer to NULL
  * 
  * Superficial testing confirms memory is freed, pointer is set to NULL, and memory is cleared, though more in depth testing of memory cleared is required
- * TODO: preferably the memory clearing function will be replaced with explicit_bzero, memset_s, memzero_explicit, or similar, or at least the custom 
- * implementation will be verified as not optimized out, however using a volatile pointer in compliance with MEM03-C, and also using a memory barrier as 
- * suggested by various security experts. 
+ * NOTE: memoryClear uses explicit_bzero when available, the memory barrier below is kept for libcs that lack it
  * 
  */
 int secureFree(void *memory, size_t bytesize)
 {
-  void **memoryCorrectCast; 
-  void *dataBuffer;
+  void             **memoryCorrectCast; 
+  void             *dataBuffer;
+  allocationHeader *header; 
 
   //this function is actually passed a void**, declared void* in function definition for technical reasons
   memoryCorrectCast = (void**)memory; 
@@ -90,9 +374,23 @@ int secureFree(void *memory, size_t bytesize)
 
   //prepare to clear memory buffer
   dataBuffer = *(void**)memoryCorrectCast; 
+  header     = (allocationHeader *)dataBuffer - 1; 
+  
+  if(header->canary != MEMORY_HEADER_CANARY && header->canary != MEMORY_LOCKED_CANARY && header->canary != MEMORY_ARENA_CANARY){
+    logEvent("Error", "secureFree was passed memory that secureAllocate didn't allocate, or that was already freed");
+    return 0; 
+  }
+  
+  //the header knows the real bytesize, clear all of it even if the caller got it wrong
+  if(header->bytesize != bytesize){
+    logEvent("Error", "secureFree was passed the wrong bytesize");
+    bytesize = header->bytesize; 
+  }
+  
+  countFree(header->tag, header->bytesize); 
     
-  //clear memory buffer, volatile pointer in compliance with MEM03-C
-  if( !memoryClear(dataBuffer, bytesize) ){
+  //clear memory buffer and its header in compliance with MEM03-C
+  if( !memoryClear(header, sizeof(allocationHeader) + bytesize) ){
     logEvent("Error", "Failed to clear memory buffer");
     return 0;
   }
@@ -101,11 +399,181 @@ int secureFree(void *memory, size_t bytesize)
   //memory barrier in compliance with https://sourceware.org/ml/libc-alpha/2014-12/msg00506.html
   __asm__ __volatile__ ( "" : : "r"(dataBuffer) : "memory" );
   
-  //tested with valgrind as correctly freeing memory
-  free(*memoryCorrectCast);
+  //unmapping unlocks, and what was locked goes back to the budget
+  if(header->canary == MEMORY_LOCKED_CANARY){
+    atomic_fetch_sub_explicit(&globalTags[header->tag].lockedBytes, lockedMappingBytesize(bytesize), memory_order_relaxed); 
+    atomic_fetch_add_explicit(&globalLockableBytes, lockedMappingBytesize(bytesize), memory_order_relaxed); 
+    munmap(header, lockedMappingBytesize(bytesize)); 
+  }
+  else if(header->canary == MEMORY_ARENA_CANARY){
+    //stays part of the arena
+  }
+  else{
+    //tested with valgrind as correctly freeing memory
+    free(header);
+  }
   
   //tested to confirm proper pointer set to NULL in compliance with MEM01-C
   *memoryCorrectCast = NULL; 
   
   return 1; 
-}
\ No newline at end of file
+}
+
+
+/*
+ * readMemoryTag fills stats with the memory accounted to tag, returns 0 on error and 1 on success
+ */
+int readMemoryTag(int tag, memoryTagStats *stats)
+{
+  if(stats == NULL || tag < 0 || tag >= MEMORY_TAG_COUNT){
+    logEvent("Error", "Invalid memory tag read");
+    return 0; 
+  }
+  
+  stats->liveBytes       = atomic_load_explicit(&globalTags[tag].liveBytes, memory_order_relaxed); 
+  stats->liveAllocations = atomic_load_explicit(&globalTags[tag].liveAllocations, memory_order_relaxed); 
+  stats->peakBytes       = atomic_load_explicit(&globalTags[tag].peakBytes, memory_order_relaxed); 
+  stats->allocations     = atomic_load_explicit(&globalTags[tag].allocations, memory_order_relaxed); 
+  stats->allocatedBytes  = atomic_load_explicit(&globalTags[tag].allocatedBytes, memory_order_relaxed); 
+  stats->lockedBytes     = atomic_load_explicit(&globalTags[tag].lockedBytes, memory_order_relaxed); 
+  
+  return 1; 
+}
+
+
+const char *memoryTagName(int tag)
+{
+  if(tag < 0 || tag >= MEMORY_TAG_COUNT){
+    return "unknown"; 
+  }
+  
+  return tagNames[tag]; 
+}
+
+
+/*
+ * reportMemoryLeaks logs every tag that still has memory allocated, for calling just before a deliberate exit. Returns the number of
+ * allocations still live
+ */
+uint64_t reportMemoryLeaks(void)
+{
+  memoryTagStats stats; 
+  uint64_t       live = 0; 
+  int            tag  = 0; 
+  char           report[128]; 
+  
+  for(tag = 0; tag != MEMORY_TAG_COUNT; tag++){
+    readMemoryTag(tag, &stats); 
+    
+    if(stats.liveAllocations == 0){
+      continue; 
+    }
+    
+    snprintf(report, sizeof(report), "%llu bytes in %llu %s allocations were never freed", (unsigned long long)stats.liveBytes, 
+             (unsigned long long)stats.liveAllocations, tagNames[tag]); 
+    logEvent("Warning", report); 
+    
+    live += stats.liveAllocations; 
+  }
+  
+  return live; 
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void countAllocation(int tag, uint64_t bytesize)
+{
+  memoryTagCounters *counters = &globalTags[tag]; 
+  uint64_t          live      = 0; 
+  uint64_t          peak      = 0; 
+  
+  live = atomic_fetch_add_explicit(&counters->liveBytes, bytesize, memory_order_relaxed) + bytesize; 
+  atomic_fetch_add_explicit(&counters->liveAllocations, 1, memory_order_relaxed); 
+  atomic_fetch_add_explicit(&counters->allocations, 1, memory_order_relaxed); 
+  atomic_fetch_add_explicit(&counters->allocatedBytes, bytesize, memory_order_relaxed); 
+  
+  peak = atomic_load_explicit(&counters->peakBytes, memory_order_relaxed); 
+  while(live > peak && !atomic_compare_exchange_weak_explicit(&counters->peakBytes, &peak, live, memory_order_relaxed, memory_order_relaxed)); 
+}
+
+
+static void countFree(int tag, uint64_t bytesize)
+{
+  if(tag < 0 || tag >= MEMORY_TAG_COUNT){
+    return; 
+  }
+  
+  atomic_fetch_sub_explicit(&globalTags[tag].liveBytes, bytesize, memory_order_relaxed); 
+  atomic_fetch_sub_explicit(&globalTags[tag].liveAllocations, 1, memory_order_relaxed); 
+}
+
+
+//a locked allocation is its header and memory rounded up to whole pages
+static size_t lockedMappingBytesize(size_t bytesize)
+{
+  size_t pageBytesize = (size_t)sysconf(_SC_PAGESIZE); 
+  
+  return (sizeof(allocationHeader) + bytesize + pageBytesize - 1) / pageBytesize * pageBytesize; 
+}
+
+
+//takes bytesize from the locking budget, returns 0 if there isn't that much left
+static int takeLockable(uint64_t bytesize)
+{
+  uint64_t lockable = atomic_load_explicit(&globalLockableBytes, memory_order_relaxed); 
+  
+  do{
+    if(lockable < bytesize){
+      return 0; 
+    }
+    
+    //unlimited stays unlimited
+    if(lockable == UINT64_MAX){
+      return 1; 
+    }
+  }while( !atomic_compare_exchange_weak_explicit(&globalLockableBytes, &lockable, lockable - bytesize, memory_order_relaxed, memory_order_relaxed) ); 
+  
+  return 1; 
+}
+
+
+/*
+ * mapArena maps bytesize bytes, a multiple of HUGE_PAGE_BYTESIZE, as huge pages as it can and sets backing to what it got. Returns NULL
+ * on error
+ */
+static unsigned char *mapArena(size_t bytesize, int *backing)
+{
+  unsigned char *mapping = NULL; 
+  uintptr_t     aligned  = 0; 
+  
+  //fails straight away unless enough huge pages are reserved (vm.nr_hugepages)
+  mapping = mmap(NULL, bytesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0); 
+  if(mapping != MAP_FAILED){
+    *backing = ARENA_BACKING_HUGETLB; 
+    return mapping; 
+  }
+  
+  //a transparent huge page can only back a huge page aligned range, so map a huge page extra and start at the first boundary
+  mapping = mmap(NULL, bytesize + HUGE_PAGE_BYTESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); 
+  if(mapping == MAP_FAILED){
+    return NULL; 
+  }
+  
+  aligned = ((uintptr_t)mapping + HUGE_PAGE_BYTESIZE - 1) & ~(uintptr_t)(HUGE_PAGE_BYTESIZE - 1); 
+  
+  //EINVAL when transparent huge pages are disabled or not built in
+  *backing = madvise((void *)aligned, bytesize, MADV_HUGEPAGE) ? ARENA_BACKING_PAGES : ARENA_BACKING_TRANSPARENT; 
+  
+  return (unsigned char *)aligned; 
+}
+
+
+//warns the first time memory that should have been locked isn't, it is still served from ordinary memory
+static void lockingDegraded(char *reason)
+{
+  if( atomic_load_explicit(&globalLockingStarted, memory_order_relaxed) && !atomic_exchange(&globalLockingDegraded, 1) ){
+    logEvent("Warning", reason); 
+  }
+}
@@ -1,6 +1,53 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+
+//what an allocation is for, so memory use can be broken down by it (see readMemoryTag)
+enum{ MEMORY_TAG_UNTAGGED    = 0 };
+enum{ MEMORY_TAG_CONNECTION  = 1 };   //connection objects and their per connection buffers
+enum{ MEMORY_TAG_ROUTER      = 2 };
+enum{ MEMORY_TAG_FILE        = 3 };   //diskFile objects
+enum{ MEMORY_TAG_FILE_PATH   = 4 };
+enum{ MEMORY_TAG_FILE_CACHE  = 5 };
+enum{ MEMORY_TAG_SERVER      = 6 };
+enum{ MEMORY_TAG_DIAGNOSTICS = 7 };   //metrics, tracing, capture and the dashboard
+enum{ MEMORY_TAG_COUNT       = 8 };
+
+typedef struct memoryTagStats{
+  uint64_t liveBytes;
+  uint64_t liveAllocations;
+  uint64_t peakBytes;
+  uint64_t allocations;      //ever made
+  uint64_t allocatedBytes;   //ever allocated
+  uint64_t lockedBytes;      //live bytes that are locked in RAM, counted in whole pages as RLIMIT_MEMLOCK counts them
+}memoryTagStats;
+
+//what the cache arena is backed by, see startCacheArena
+enum{ ARENA_BACKING_NONE        = 0 };   //no arena, the cache is allocated like anything else
+enum{ ARENA_BACKING_HUGETLB     = 1 };   //reserved huge pages
+enum{ ARENA_BACKING_TRANSPARENT = 2 };   //ordinary pages the kernel is asked to back with transparent huge pages
+enum{ ARENA_BACKING_PAGES       = 3 };   //ordinary pages
+
+typedef struct cacheArenaStats{
+  int      backing;          //one of the ARENA_BACKING values
+  uint64_t bytesize;
+  uint64_t usedBytes;        //handed out, space freed back isn't reused
+  uint64_t lockedBytes;      //from the start of the arena
+}cacheArenaStats;
 
 
 void *secureAllocate(size_t bytesize);
+void *secureAllocateTagged(size_t bytesize, int tag);
+void *secureAllocateLocked(size_t bytesize, int tag);
+int  startMemoryLocking(uint64_t reservedBytesize);
+void *secureAllocateCache(size_t bytesize, int tag);
+int  startCacheArena(size_t bytesize);
+int  readCacheArena(cacheArenaStats *stats);
+const char *arenaBackingName(int backing);
 int memoryClear(void *memoryPointerV, size_t bytesize);
-int secureFree(void *memory, size_t bytesize); //NOTE memory is really a void**
\ No newline at end of file
+int secureFree(void *memory, size_t bytesize); //NOTE memory is really a void**
+
+int        readMemoryTag(int tag, memoryTagStats *stats);
+const char *memoryTagName(int tag);
+uint64_t   reportMemoryLeaks(void);
@@ -0,0 +1,811 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Metrics registry
+ *
+ * Counters and histograms are written to a slot owned by the calling thread, so recording never contends on a shared cache line, and
+ * are summed over every slot when read. Only the owning thread writes a slot so a relaxed load and store replaces a locked add. Slots
+ * are never freed, when a thread exits its slot (values included, counters are monotonic) is adopted by the next thread that records.
+ *
+ * Histograms are HDR style log linear, METRIC_HISTOGRAM_SUB_BUCKET_BITS linear sub buckets per power of two, so the relative error of
+ * any percentile is bounded regardless of magnitude.
+ *
+ * Gauges are plain shared atomics, or callbacks that are sampled on read.
+ *
+ * Transfers in progress are tracked, when something wants to see them (see setTransferTracking), in a fixed table of
+ * METRIC_MAX_TRANSFERS slots. A transfer claims a free slot with a compare and swap and publishes it with a sequence number, so readers
+ * never see a half written one and never hold up the transfers.
+ */
+
+
+typedef struct metricsSlot{
+  struct metricsSlot *next;                 //set once before the slot is published, never changes
+  atomic_int         inUse;
+  atomic_ullong      counters[METRIC_COUNTER_COUNT];
+  atomic_ullong      histograms[METRIC_HISTOGRAM_COUNT][METRIC_HISTOGRAM_BUCKETS];
+  atomic_ullong      histogramSums[METRIC_HISTOGRAM_COUNT];
+}metricsSlot;
+
+typedef struct metricsTransferSlot{
+  atomic_int    inUse;
+  atomic_uint   sequence;    //odd while the slot is being written
+  char          name[MAX_FILE_ID_BYTESIZE + 1];
+  uint64_t      start;
+  uint64_t      bytesize;
+  atomic_ullong bytesSent;
+}metricsTransferSlot;
+
+
+static _Atomic(metricsSlot *) globalSlots                                        = NULL;
+static atomic_llong           globalGauges[METRIC_GAUGE_COUNT];
+static int64_t                (*globalGaugeCallbacks[METRIC_GAUGE_COUNT])(void)  = { NULL };
+static void                   (*globalRenderers[METRIC_MAX_RENDERERS])(FILE *out) = { NULL };
+static uint32_t               globalRendererCount                                = 0;
+static pthread_key_t          globalSlotKey;
+static pthread_once_t         globalSlotKeyOnce                                  = PTHREAD_ONCE_INIT;
+static pthread_mutex_t        globalRegistrationLock                             = PTHREAD_MUTEX_INITIALIZER;
+static metricsTransferSlot    globalTransfers[METRIC_MAX_TRANSFERS];
+static atomic_int             globalTrackTransfers                               = 0;
+static atomic_uint            globalTransferHint                                 = 0;
+
+static __thread metricsSlot   *threadSlot                                        = NULL;
+
+
+static const char *counterNames[METRIC_COUNTER_COUNT][2] = {
+  { "onionget_bytes_sent_total"          , "File bytes transmitted to clients"                      },
+  { "onionget_files_served_total"        , "Files transmitted in full"                              },
+  { "onionget_files_not_found_total"     , "Requests for files that are not shared"                 },
+  { "onionget_cache_hits_total"          , "File chunks read from the in memory cache"              },
+  { "onionget_cache_misses_total"        , "File chunks read from disk"                             },
+  { "onionget_connections_accepted_total", "Connections accepted"                                   }
+};
+
+static const char *gaugeNames[METRIC_GAUGE_COUNT][2] = {
+  { "onionget_active_connections"        , "Connections currently being processed"                  },
+  { "onionget_queued_connections"        , "Connections waiting in the listen queue to be accepted" },
+  { "onionget_cache_bytes"               , "Bytes of file data held in the in memory cache"         },
+  { "onionget_cache_stored_bytes"        , "Bytes of memory the in memory cache takes, compressed"  }
+};
+
+static const char *histogramNames[METRIC_HISTOGRAM_COUNT][2] = {
+  { "onionget_time_to_first_byte_seconds", "Time from a file being requested to its first byte being sent" },
+  { "onionget_transfer_duration_seconds" , "Time from a file being requested to its last byte being sent"  }
+};
+
+
+static metricsSlot *acquireSlot(void);
+static void        createSlotKey(void);
+static void        releaseSlot(void *slotV);
+static void        *serveEndpoint(void *listenSocketV);
+static void        *answerRequest(void *clientSocketV);
+static void        renderHistogram(FILE *out, int histogram);
+static void        renderMemory(FILE *out);
+
+
+
+/************ RECORDING ******************/
+
+void metricsIncrement(int counter, uint64_t amount)
+{
+  metricsSlot *slot = acquireSlot();
+
+  if(slot == NULL || counter < 0 || counter >= METRIC_COUNTER_COUNT){
+    return;
+  }
+
+  atomic_store_explicit(&slot->counters[counter], atomic_load_explicit(&slot->counters[counter], memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+
+void metricsGaugeAdd(int gauge, int64_t amount)
+{
+  if(gauge < 0 || gauge >= METRIC_GAUGE_COUNT){
+    return;
+  }
+
+  atomic_fetch_add_explicit(&globalGauges[gauge], amount, memory_order_relaxed);
+}
+
+
+void metricsRecord(int histogram, uint64_t microseconds)
+{
+  metricsSlot      *slot   = acquireSlot();
+  atomic_ullong    *bucket = NULL;
+
+  if(slot == NULL || histogram < 0 || histogram >= METRIC_HISTOGRAM_COUNT){
+    return;
+  }
+
+  bucket = &slot->histograms[histogram][histogramBucket(microseconds)];
+
+  atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+  atomic_store_explicit(&slot->histogramSums[histogram], atomic_load_explicit(&slot->histogramSums[histogram], memory_order_relaxed) + microseconds, memory_order_relaxed);
+}
+
+
+
+/*
+ * setTransferTracking turns tracking of transfers in progress on or off, while it is off metricsTransferBegin does nothing
+ */
+void setTransferTracking(int enabled)
+{
+  atomic_store_explicit(&globalTrackTransfers, enabled ? 1 : 0, memory_order_relaxed);
+}
+
+
+/*
+ * metricsTransferBegin starts tracking a transfer of bytesize bytes of the file name (nameBytesize bytes, not necessarily NULL
+ * terminated). Returns the transfer to pass to metricsTransferProgress and metricsTransferEnd, or -1 if it isn't tracked
+ */
+int metricsTransferBegin(const char *name, uint32_t nameBytesize, uint64_t bytesize)
+{
+  metricsTransferSlot *slot  = NULL;
+  uint32_t            first  = 0;
+  uint32_t            probe  = 0;
+  int                 free   = 0;
+
+  if( !atomic_load_explicit(&globalTrackTransfers, memory_order_relaxed) || name == NULL ){
+    return -1;
+  }
+
+  //start each search somewhere new so concurrent transfers don't all fight over the first free slot
+  first = atomic_fetch_add_explicit(&globalTransferHint, 1, memory_order_relaxed);
+
+  for(probe = 0; probe != METRIC_MAX_TRANSFERS; probe++){
+    slot = &globalTransfers[(first + probe) % METRIC_MAX_TRANSFERS];
+    free = 0;
+
+    if( atomic_compare_exchange_strong_explicit(&slot->inUse, &free, 1, memory_order_acquire, memory_order_relaxed) ){
+      break;
+    }
+  }
+
+  if(probe == METRIC_MAX_TRANSFERS){
+    return -1;
+  }
+
+  if(nameBytesize > MAX_FILE_ID_BYTESIZE){
+    nameBytesize = MAX_FILE_ID_BYTESIZE;
+  }
+
+  atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  memcpy(slot->name, name, nameBytesize);
+  slot->name[nameBytesize] = '\0';
+  slot->start              = getMonotonicMicroseconds();
+  slot->bytesize           = bytesize;
+  atomic_store_explicit(&slot->bytesSent, 0, memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_release);
+
+  return (int)(slot - globalTransfers);
+}
+
+
+void metricsTransferProgress(int transfer, uint64_t bytesSent)
+{
+  if(transfer < 0 || transfer >= METRIC_MAX_TRANSFERS){
+    return;
+  }
+
+  atomic_store_explicit(&globalTransfers[transfer].bytesSent, bytesSent, memory_order_relaxed);
+}
+
+
+void metricsTransferEnd(int transfer)
+{
+  if(transfer < 0 || transfer >= METRIC_MAX_TRANSFERS){
+    return;
+  }
+
+  atomic_store_explicit(&globalTransfers[transfer].inUse, 0, memory_order_release);
+}
+
+
+
+/************ READING ******************/
+
+uint64_t readCounter(int counter)
+{
+  metricsSlot *slot  = NULL;
+  uint64_t    total  = 0;
+
+  if(counter < 0 || counter >= METRIC_COUNTER_COUNT){
+    return 0;
+  }
+
+  for(slot = atomic_load_explicit(&globalSlots, memory_order_acquire); slot != NULL; slot = slot->next){
+    total += atomic_load_explicit(&slot->counters[counter], memory_order_relaxed);
+  }
+
+  return total;
+}
+
+
+int64_t readGauge(int gauge)
+{
+  if(gauge < 0 || gauge >= METRIC_GAUGE_COUNT){
+    return 0;
+  }
+
+  if(globalGaugeCallbacks[gauge] != NULL){
+    return globalGaugeCallbacks[gauge]();
+  }
+
+  return atomic_load_explicit(&globalGauges[gauge], memory_order_relaxed);
+}
+
+
+/*
+ * readHistogram sums histogram over all threads into buckets, which must hold METRIC_HISTOGRAM_BUCKETS values, and returns the sample count
+ */
+uint64_t readHistogram(int histogram, uint64_t *buckets)
+{
+  metricsSlot *slot    = NULL;
+  uint32_t    bucket   = 0;
+  uint64_t    samples  = 0;
+
+  if(buckets == NULL || histogram < 0 || histogram >= METRIC_HISTOGRAM_COUNT){
+    logEvent("Error", "Invalid histogram read");
+    return 0;
+  }
+
+  memset(buckets, 0, METRIC_HISTOGRAM_BUCKETS * sizeof(uint64_t));
+
+  for(slot = atomic_load_explicit(&globalSlots, memory_order_acquire); slot != NULL; slot = slot->next){
+    for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+      buckets[bucket] += atomic_load_explicit(&slot->histograms[histogram][bucket], memory_order_relaxed);
+    }
+  }
+
+  for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+    samples += buckets[bucket];
+  }
+
+  return samples;
+}
+
+
+/*
+ * histogramBucket returns the bucket value is counted in, values below 2^SUB_BUCKET_BITS get a bucket each, above that every power of
+ * two is split into 2^SUB_BUCKET_BITS linear buckets
+ */
+uint32_t histogramBucket(uint64_t value)
+{
+  uint32_t subBuckets  = 1 << METRIC_HISTOGRAM_SUB_BUCKET_BITS;
+  uint32_t magnitude   = 0;
+  uint32_t shift       = 0;
+  uint32_t bucket      = 0;
+
+  if(value < subBuckets){
+    return (uint32_t)value;
+  }
+
+  magnitude = 63 - __builtin_clzll(value);
+  shift     = magnitude - METRIC_HISTOGRAM_SUB_BUCKET_BITS;
+  bucket    = (shift + 1) * subBuckets + ( (value >> shift) & (subBuckets - 1) );
+
+  return (bucket < METRIC_HISTOGRAM_BUCKETS) ? bucket : METRIC_HISTOGRAM_BUCKETS - 1;
+}
+
+
+/*
+ * histogramBucketUpperBound returns the largest value that is counted in bucket
+ */
+uint64_t histogramBucketUpperBound(uint32_t bucket)
+{
+  uint32_t subBuckets = 1 << METRIC_HISTOGRAM_SUB_BUCKET_BITS;
+  uint32_t shift      = 0;
+
+  if(bucket < subBuckets){
+    return bucket;
+  }
+
+  shift = bucket / subBuckets - 1;
+
+  return ( (uint64_t)(subBuckets + bucket % subBuckets + 1) << shift ) - 1;
+}
+
+
+/*
+ * histogramPercentile returns the upper bound of the bucket holding the given percentile (0 to 100) of sampleCount samples
+ */
+uint64_t histogramPercentile(const uint64_t *buckets, uint64_t sampleCount, double percentile)
+{
+  uint64_t rank   = 0;
+  uint64_t seen   = 0;
+  uint32_t bucket = 0;
+
+  if(buckets == NULL || sampleCount == 0){
+    return 0;
+  }
+
+  rank = (uint64_t)( (percentile / 100.0) * sampleCount + 0.5 );
+  if(rank == 0){
+    rank = 1;
+  }
+
+  for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+    seen += buckets[bucket];
+    if(seen >= rank){
+      return histogramBucketUpperBound(bucket);
+    }
+  }
+
+  return histogramBucketUpperBound(METRIC_HISTOGRAM_BUCKETS - 1);
+}
+
+
+/*
+ * readTransfers copies up to maxTransfers of the transfers in progress into transfers and returns how many it copied
+ */
+uint32_t readTransfers(metricsTransfer *transfers, uint32_t maxTransfers)
+{
+  metricsTransferSlot *slot     = NULL;
+  uint32_t            index     = 0;
+  uint32_t            copied    = 0;
+  unsigned int        sequence  = 0;
+
+  if(transfers == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  for(index = 0; index != METRIC_MAX_TRANSFERS && copied != maxTransfers; index++){
+    slot = &globalTransfers[index];
+
+    if( !atomic_load_explicit(&slot->inUse, memory_order_acquire) ){
+      continue;
+    }
+
+    //seqlock style read, skip the slot if it is being written or is reused while we copy it
+    sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if(sequence & 1){
+      continue;
+    }
+
+    memcpy(transfers[copied].name, slot->name, sizeof(slot->name));
+    transfers[copied].start     = slot->start;
+    transfers[copied].bytesize  = slot->bytesize;
+    transfers[copied].bytesSent = atomic_load_explicit(&slot->bytesSent, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    if( atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence || !atomic_load_explicit(&slot->inUse, memory_order_relaxed) ){
+      continue;
+    }
+
+    transfers[copied].name[MAX_FILE_ID_BYTESIZE] = '\0';
+    copied++;
+  }
+
+  return copied;
+}
+
+
+
+/************ REGISTRATION ******************/
+
+/*
+ * registerGaugeCallback makes gauge read from the return value of read rather than the shared value, for gauges that are cheaper to
+ * sample on demand than to keep up to date. Returns 0 on error and 1 on success
+ */
+int registerGaugeCallback(int gauge, int64_t (*read)(void))
+{
+  if(read == NULL || gauge < 0 || gauge >= METRIC_GAUGE_COUNT){
+    logEvent("Error", "Invalid gauge callback registration");
+    return 0;
+  }
+
+  pthread_mutex_lock(&globalRegistrationLock);
+  globalGaugeCallbacks[gauge] = read;
+  pthread_mutex_unlock(&globalRegistrationLock);
+
+  return 1;
+}
+
+
+/*
+ * registerMetricsRenderer adds render to the functions called after the built in metrics are rendered, so that other subsystems can
+ * append their own Prometheus text to the stats output. Returns 0 on error and 1 on success
+ */
+int registerMetricsRenderer(void (*render)(FILE *out))
+{
+  if(render == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  pthread_mutex_lock(&globalRegistrationLock);
+
+  if(globalRendererCount == METRIC_MAX_RENDERERS){
+    pthread_mutex_unlock(&globalRegistrationLock);
+    logEvent("Error", "Too many metrics renderers registered");
+    return 0;
+  }
+
+  globalRenderers[globalRendererCount++] = render;
+
+  pthread_mutex_unlock(&globalRegistrationLock);
+
+  return 1;
+}
+
+
+/*
+ * renderMetrics writes every metric to out in the Prometheus text exposition format, returns 0 on error and 1 on success
+ */
+int renderMetrics(FILE *out)
+{
+  int      metric   = 0;
+  uint32_t renderer = 0;
+
+  if(out == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  for(metric = 0; metric != METRIC_COUNTER_COUNT; metric++){
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counterNames[metric][0], counterNames[metric][1], counterNames[metric][0],
+            counterNames[metric][0], (unsigned long long)readCounter(metric));
+  }
+
+  for(metric = 0; metric != METRIC_GAUGE_COUNT; metric++){
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gaugeNames[metric][0], gaugeNames[metric][1], gaugeNames[metric][0],
+            gaugeNames[metric][0], (long long)readGauge(metric));
+  }
+
+  for(metric = 0; metric != METRIC_HISTOGRAM_COUNT; metric++){
+    renderHistogram(out, metric);
+  }
+
+  renderMemory(out);
+
+  pthread_mutex_lock(&globalRegistrationLock);
+  for(renderer = 0; renderer != globalRendererCount; renderer++){
+    globalRenderers[renderer](out);
+  }
+  pthread_mutex_unlock(&globalRegistrationLock);
+
+  return 1;
+}
+
+
+
+/************ STATS ENDPOINT ******************/
+
+/*
+ * startMetricsEndpoint listens on a UNIX socket at socketPath and answers every connection with the rendered metrics, preceded by an
+ * HTTP header if the request looks like HTTP (so both Prometheus through a socket proxy and socat - UNIX-CONNECT:path work).
+ * Returns 0 on error and 1 on success, the endpoint is served by its own thread and each connection is answered on a thread of its own,
+ * so a client that connects and stalls can't hold up the others
+ */
+int startMetricsEndpoint(const char *socketPath)
+{
+  struct sockaddr_un address;
+  int                *listenSocket = NULL;
+  pthread_t          endpointThread;
+
+  if(socketPath == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(strlen(socketPath) >= sizeof(address.sun_path)){
+    logEvent("Error", "Metrics socket path is too long");
+    return 0;
+  }
+
+  listenSocket = (int *)secureAllocateTagged(sizeof(int), MEMORY_TAG_DIAGNOSTICS);
+  if(listenSocket == NULL){
+    logEvent("Error", "Failed to allocate metrics endpoint socket");
+    return 0;
+  }
+
+  *listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(*listenSocket == -1){
+    logEvent("Error", "Failed to create metrics socket");
+    secureFree(&listenSocket, sizeof(int));
+    return 0;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+  //a stale socket file from a previous run would make bind fail
+  unlink(socketPath);
+
+  if( bind(*listenSocket, (const struct sockaddr *)&address, sizeof(address)) || listen(*listenSocket, SOMAXCONN) ){
+    logEvent("Error", "Failed to listen on metrics socket");
+    close(*listenSocket);
+    secureFree(&listenSocket, sizeof(int));
+    return 0;
+  }
+
+  if( pthread_create(&endpointThread, NULL, serveEndpoint, (void *)listenSocket) != 0 ){
+    logEvent("Error", "Failed to create metrics endpoint thread");
+    close(*listenSocket);
+    secureFree(&listenSocket, sizeof(int));
+    return 0;
+  }
+
+  pthread_detach(endpointThread);
+
+  return 1;
+}
+
+
+uint64_t getMonotonicMicroseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000ULL;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+/*
+ * acquireSlot returns the calling threads metrics slot, adopting a released slot or allocating a new one the first time a thread records.
+ * Returns NULL on error
+ */
+static metricsSlot *acquireSlot(void)
+{
+  metricsSlot *slot     = NULL;
+  metricsSlot *listHead = NULL;
+  int         expected  = 0;
+
+  if(threadSlot != NULL){
+    return threadSlot;
+  }
+
+  pthread_once(&globalSlotKeyOnce, createSlotKey);
+
+  for(slot = atomic_load_explicit(&globalSlots, memory_order_acquire); slot != NULL; slot = slot->next){
+    expected = 0;
+    if( atomic_compare_exchange_strong_explicit(&slot->inUse, &expected, 1, memory_order_acquire, memory_order_relaxed) ){
+      break;
+    }
+  }
+
+  if(slot == NULL){
+    slot = (metricsSlot *)secureAllocateTagged(sizeof(*slot), MEMORY_TAG_DIAGNOSTICS);
+    if(slot == NULL){
+      logEvent("Error", "Failed to allocate metrics slot");
+      return NULL;
+    }
+
+    atomic_init(&slot->inUse, 1);
+
+    listHead = atomic_load_explicit(&globalSlots, memory_order_relaxed);
+    do{
+      slot->next = listHead;
+    }while( !atomic_compare_exchange_weak_explicit(&globalSlots, &listHead, slot, memory_order_release, memory_order_relaxed) );
+  }
+
+  pthread_setspecific(globalSlotKey, slot);
+  threadSlot = slot;
+
+  return slot;
+}
+
+
+static void createSlotKey(void)
+{
+  if( pthread_key_create(&globalSlotKey, releaseSlot) != 0 ){
+    logEvent("Error", "Failed to create metrics slot key, slots of exiting threads won't be reused");
+  }
+}
+
+
+/*
+ * releaseSlot is the thread specific data destructor, it hands the exiting threads slot back so another thread can adopt it
+ */
+static void releaseSlot(void *slotV)
+{
+  metricsSlot *slot = (metricsSlot *)slotV;
+
+  if(slot != NULL){
+    atomic_store_explicit(&slot->inUse, 0, memory_order_release);
+  }
+}
+
+
+static void renderHistogram(FILE *out, int histogram)
+{
+  uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+  uint64_t samples      = 0;
+  uint64_t cumulative   = 0;
+  uint64_t sum          = 0;
+  uint32_t bucket       = 0;
+  uint32_t lastUsed     = 0;
+  metricsSlot *slot     = NULL;
+
+  samples = readHistogram(histogram, buckets);
+
+  for(slot = atomic_load_explicit(&globalSlots, memory_order_acquire); slot != NULL; slot = slot->next){
+    sum += atomic_load_explicit(&slot->histogramSums[histogram], memory_order_relaxed);
+  }
+
+  for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+    if(buckets[bucket]){
+      lastUsed = bucket;
+    }
+  }
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", histogramNames[histogram][0], histogramNames[histogram][1], histogramNames[histogram][0]);
+
+  //only buckets up to the highest one used, the le bounds are fixed so series still line up between scrapes
+  for(bucket = 0; samples && bucket <= lastUsed; bucket++){
+    cumulative += buckets[bucket];
+    fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", histogramNames[histogram][0], histogramBucketUpperBound(bucket) / 1000000.0, (unsigned long long)cumulative);
+  }
+
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", histogramNames[histogram][0], (unsigned long long)samples);
+  fprintf(out, "%s_sum %.6f\n", histogramNames[histogram][0], sum / 1000000.0);
+  fprintf(out, "%s_count %llu\n", histogramNames[histogram][0], (unsigned long long)samples);
+}
+
+
+/*
+ * renderMemory writes what secureAllocate has handed out, broken down by tag (see memoryManager.h)
+ */
+static void renderMemory(FILE *out)
+{
+  static const char *memoryNames[6][3] = {
+    { "onionget_memory_live_bytes"            , "gauge"  , "Bytes allocated and not yet freed"       },
+    { "onionget_memory_live_allocations"      , "gauge"  , "Allocations not yet freed"               },
+    { "onionget_memory_peak_bytes"            , "gauge"  , "Most bytes that were ever live at once"  },
+    { "onionget_memory_allocations_total"     , "counter", "Allocations ever made"                   },
+    { "onionget_memory_allocated_bytes_total" , "counter", "Bytes ever allocated"                    },
+    { "onionget_memory_locked_bytes"          , "gauge"  , "Bytes locked in RAM, in whole pages"     }
+  };
+  memoryTagStats  stats[MEMORY_TAG_COUNT];
+  cacheArenaStats arena;
+  uint64_t        value  = 0;
+  int             metric = 0;
+  int             tag    = 0;
+
+  for(tag = 0; tag != MEMORY_TAG_COUNT; tag++){
+    readMemoryTag(tag, &stats[tag]);
+  }
+
+  for(metric = 0; metric != 6; metric++){
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", memoryNames[metric][0], memoryNames[metric][2], memoryNames[metric][0], memoryNames[metric][1]);
+
+    for(tag = 0; tag != MEMORY_TAG_COUNT; tag++){
+      switch(metric){
+        case 0:  value = stats[tag].liveBytes;       break;
+        case 1:  value = stats[tag].liveAllocations; break;
+        case 2:  value = stats[tag].peakBytes;       break;
+        case 3:  value = stats[tag].allocations;     break;
+        case 4:  value = stats[tag].allocatedBytes;  break;
+        default: value = stats[tag].lockedBytes;     break;
+      }
+
+      fprintf(out, "%s{tag=\"%s\"} %llu\n", memoryNames[metric][0], memoryTagName(tag), (unsigned long long)value);
+    }
+  }
+  
+  if( !readCacheArena(&arena) || arena.backing == ARENA_BACKING_NONE ){
+    return; 
+  }
+  
+  fprintf(out, "# HELP onionget_memory_cache_arena_bytes Size of the arena the file cache is carved from, by what backs it\n"
+               "# TYPE onionget_memory_cache_arena_bytes gauge\n"
+               "onionget_memory_cache_arena_bytes{backing=\"%s\"} %llu\n", arenaBackingName(arena.backing), (unsigned long long)arena.bytesize);
+  
+  fprintf(out, "# HELP onionget_memory_cache_arena_used_bytes Bytes of the cache arena handed out\n"
+               "# TYPE onionget_memory_cache_arena_used_bytes gauge\n"
+               "onionget_memory_cache_arena_used_bytes %llu\n", (unsigned long long)arena.usedBytes);
+  
+  fprintf(out, "# HELP onionget_memory_cache_arena_locked_bytes Bytes of the cache arena locked in RAM\n"
+               "# TYPE onionget_memory_cache_arena_locked_bytes gauge\n"
+               "onionget_memory_cache_arena_locked_bytes %llu\n", (unsigned long long)arena.lockedBytes);
+}
+
+
+static void *serveEndpoint(void *listenSocketV)
+{
+  int       listenSocket    = *(int *)listenSocketV;
+  int       acceptedSocket  = -1;
+  int       *clientSocket   = NULL;
+  pthread_t requestThread;
+
+  secureFree(&listenSocketV, sizeof(int));
+
+  while(1){
+    acceptedSocket = accept(listenSocket, NULL, NULL);
+    if(acceptedSocket == -1){
+      logEvent("Error", "Failed to accept metrics connection");
+      continue;
+    }
+
+    clientSocket = (int *)secureAllocateTagged(sizeof(int), MEMORY_TAG_DIAGNOSTICS);
+    if(clientSocket == NULL){
+      logEvent("Error", "Failed to allocate metrics connection socket");
+      close(acceptedSocket);
+      continue;
+    }
+
+    *clientSocket = acceptedSocket;
+
+    if( pthread_create(&requestThread, NULL, answerRequest, (void *)clientSocket) != 0 ){
+      logEvent("Error", "Failed to create metrics request thread");
+      close(*clientSocket);
+      secureFree(&clientSocket, sizeof(int));
+      continue;
+    }
+
+    pthread_detach(requestThread);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * answerRequest writes the metrics to the client socket and closes it, the thread of a client that stops reading gives up after
+ * METRIC_RESPONSE_TIMEOUT_SECONDS
+ */
+static void *answerRequest(void *clientSocketV)
+{
+  int            clientSocket = *(int *)clientSocketV;
+  struct timeval requestTimeout;
+  struct timeval responseTimeout;
+  char           request[METRIC_REQUEST_BYTESIZE];
+  ssize_t        requestBytes = 0;
+  FILE           *out         = NULL;
+
+  secureFree(&clientSocketV, sizeof(int));
+
+  //a plain socat connection sends nothing, so don't wait long for a request
+  requestTimeout.tv_sec  = 0;
+  requestTimeout.tv_usec = METRIC_REQUEST_TIMEOUT_USECS;
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &requestTimeout, sizeof(requestTimeout));
+
+  responseTimeout.tv_sec  = METRIC_RESPONSE_TIMEOUT_SECONDS;
+  responseTimeout.tv_usec = 0;
+  setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &responseTimeout, sizeof(responseTimeout));
+
+  //the request itself is ignored, but it must be read, closing a UNIX socket with unread data resets the connection
+  requestBytes = recv(clientSocket, request, sizeof(request), 0);
+
+  out = fdopen(clientSocket, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open metrics connection for writing");
+    close(clientSocket);
+    return NULL;
+  }
+
+  if(requestBytes >= 4 && !memcmp(request, "GET ", 4)){
+    fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n", out);
+  }
+
+  renderMetrics(out);
+
+  fclose(out);
+
+  return NULL;
+}
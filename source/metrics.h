@@ -0,0 +1,59 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include "ogEnums.h"
+
+
+//counters, monotonic, kept per thread and summed when read
+enum{ METRIC_BYTES_SENT                  = 0 };
+enum{ METRIC_FILES_SERVED                = 1 };
+enum{ METRIC_FILES_NOT_FOUND             = 2 };
+enum{ METRIC_CACHE_HITS                  = 3 };
+enum{ METRIC_CACHE_MISSES                = 4 };
+enum{ METRIC_CONNECTIONS_ACCEPTED        = 5 };
+enum{ METRIC_COUNTER_COUNT               = 6 };
+
+//gauges, current values shared by all threads
+enum{ METRIC_GAUGE_ACTIVE_CONNECTIONS    = 0 };
+enum{ METRIC_GAUGE_QUEUED_CONNECTIONS    = 1 };
+enum{ METRIC_GAUGE_CACHE_BYTES           = 2 };
+enum{ METRIC_GAUGE_CACHE_STORED_BYTES    = 3 };
+enum{ METRIC_GAUGE_COUNT                 = 4 };
+
+//latency histograms, recorded in microseconds
+enum{ METRIC_HISTOGRAM_TIME_TO_FIRST_BYTE = 0 };
+enum{ METRIC_HISTOGRAM_TRANSFER_DURATION  = 1 };
+enum{ METRIC_HISTOGRAM_COUNT              = 2 };
+
+//a file transfer in progress, see metricsTransferBegin
+typedef struct metricsTransfer{
+  char     name[MAX_FILE_ID_BYTESIZE + 1];
+  uint64_t start;       //monotonic microseconds
+  uint64_t bytesize;
+  uint64_t bytesSent;
+}metricsTransfer;
+
+
+void     metricsIncrement(int counter, uint64_t amount);
+void     metricsGaugeAdd(int gauge, int64_t amount);
+void     metricsRecord(int histogram, uint64_t microseconds);
+
+void     setTransferTracking(int enabled);
+int      metricsTransferBegin(const char *name, uint32_t nameBytesize, uint64_t bytesize);
+void     metricsTransferProgress(int transfer, uint64_t bytesSent);
+void     metricsTransferEnd(int transfer);
+
+uint64_t readCounter(int counter);
+int64_t  readGauge(int gauge);
+uint64_t readHistogram(int histogram, uint64_t *buckets);  //buckets must hold METRIC_HISTOGRAM_BUCKETS, returns the sample count
+uint32_t histogramBucket(uint64_t value);
+uint64_t histogramBucketUpperBound(uint32_t bucket);
+uint64_t histogramPercentile(const uint64_t *buckets, uint64_t sampleCount, double percentile);
+uint32_t readTransfers(metricsTransfer *transfers, uint32_t maxTransfers);
+
+int      registerGaugeCallback(int gauge, int64_t (*read)(void));
+int      registerMetricsRenderer(void (*render)(FILE *out));
+int      renderMetrics(FILE *out);
+int      startMetricsEndpoint(const char *socketPath);
+
+uint64_t getMonotonicMicroseconds(void);
@@ -42,6 +42,8 @@ enum{  FILE_CHUNK_BYTESIZE    = 65536 };
 
 enum{ COUNT = 1 };
 enum{ FILE_START = 0}; 
+enum{ CACHE_COMPRESSION_MIN_SAVING = 8 }; //a cached chunk is kept compressed only if that saves at least 1/8 of it
+enum{ DIRECT_IO_ALIGNMENT = 4096 }; //offset, length and buffer alignment of O_DIRECT reads, covers 512 and 4096 byte logical blocks
 
 
 
@@ -54,4 +56,109 @@ enum{ RECEIVE_WAIT_TIMEOUT_USECS   = 0  };
 
 enum{  MAX_REQUEST_STRING_BYTESIZE = 1000000   };
 enum{  BYTES_IN_A_MEGABYTE         = 1000000   }; 
-enum{  MAX_FILE_ID_BYTESIZE        = 200       }; //todo make this saner
\ No newline at end of file
+enum{  MAX_FILE_ID_BYTESIZE        = 200       }; //todo make this saner
+enum{  CONNECTION_CHUNK_BUFFERS    = 2         }; //a connection reads its next file chunk into one while it sends from the other
+
+//request flags, in the high bits of the request bytesize
+enum{  REQUEST_BYTESIZE_MASK       = 0x000fffff }; //covers MAX_REQUEST_STRING_BYTESIZE
+enum{  REQUEST_FLAG_SCHEDULED      = 0x40000000 }; //look up the whole batch first and send it smallest first, each file preceded by its index
+enum{  REQUEST_FLAG_PRIORITIES     = 0x20000000 }; //with SCHEDULED, every filename is preceded by a uint32 priority, lowest is sent first
+enum{  REQUEST_FLAG_COMPRESSED     = 0x10000000 }; //every file is sent as frames the server may compress, see transferCompression.h
+enum{  REQUEST_FLAG_HASHES         = 0x08000000 }; //every file response carries the file's hashes after its bytesize, see fileHash.h
+enum{  REQUEST_FLAG_DELTA          = 0x04000000 }; //the request is followed by signatures of the client's copies and every file is sent as a delta, see delta.h
+
+
+//memory
+enum{  MEMORY_HEADER_CANARY        = 0x6f674d4d }; //marks memory handed out by secureAllocate
+enum{  MEMORY_LOCKED_CANARY        = 0x6f674d4c }; //marks memory handed out locked by secureAllocateLocked
+enum{  MEMORY_ARENA_CANARY         = 0x6f674d41 }; //marks memory handed out from the cache arena by secureAllocateCache
+enum{  HUGE_PAGE_BYTESIZE          = 2097152    }; //the cache arena is sized and aligned for 2 MiB huge pages
+
+
+
+//logging
+enum{  LOG_RING_ENTRIES            = 256       }; //per thread, must be a power of two
+enum{  LOG_CATEGORY_BYTESIZE       = 16        };
+enum{  LOG_MESSAGE_BYTESIZE        = 160       }; //longer messages are truncated
+enum{  LOG_FLUSH_INTERVAL_USECS    = 20000     };
+enum{  LOG_RATE_LIMIT_PER_SECOND   = 10        }; //per call site, per thread
+enum{  LOG_RATE_LIMIT_SLOTS        = 32        }; //per thread, must be a power of two
+
+
+
+//metrics
+enum{  METRIC_HISTOGRAM_SUB_BUCKET_BITS = 3         }; //8 buckets per power of two, roughly 12% precision
+enum{  METRIC_HISTOGRAM_BUCKETS         = 304       }; //covers up to 2^40 microseconds
+enum{  METRIC_MAX_RENDERERS             = 8         };
+enum{  METRIC_MAX_GAUGE_CALLBACKS       = 8         };
+enum{  METRIC_REQUEST_TIMEOUT_USECS     = 100000    };
+enum{  METRIC_RESPONSE_TIMEOUT_SECONDS  = 5         }; //a client that stops reading the metrics is dropped after this long
+enum{  METRIC_REQUEST_BYTESIZE          = 4096      };
+enum{  METRIC_MAX_TRANSFERS             = 256       }; //transfers in progress that can be tracked at once, more go untracked
+
+
+
+//tracing
+enum{  TRACE_RING_ENTRIES          = 65536     }; //must be a power of two
+enum{  TRACE_DUMP_POLL_USECS       = 200000    };
+
+
+
+//dashboard
+enum{  DASHBOARD_REFRESH_MSECS     = 1000      };
+enum{  DASHBOARD_POLL_MSECS        = 100       }; //how often a key press is checked for
+enum{  DASHBOARD_LOG_LINES         = 8         };
+enum{  DASHBOARD_LOG_LINE_BYTESIZE = 256       };
+
+
+
+//lock profiling
+enum{  LOCK_PROFILE_MAX_LOCKS      = 32        };
+
+
+
+//request costs
+enum{  REQUEST_COST_SIZE_BUCKETS   = 6         }; //not found, then files up to 4 KiB, 64 KiB, 1 MiB, 16 MiB and larger
+
+
+
+//shaping
+enum{  SHAPER_QUANTUM_BYTESIZE     = 16384     }; //credit a waiting connection gets each round, a full chunk takes four rounds
+enum{  SHAPER_BURST_MILLISECONDS   = 100       }; //a bucket holds this long of its rate, and never less than a chunk
+
+
+
+//disk I/O pool
+enum{  IO_POOL_MAX_THREADS         = 64        };
+
+
+
+//transfer compression
+enum{  TRANSFER_FRAME_COMPRESSED       = 0x80000000 }; //in a frame header, the payload is zstd compressed
+enum{  TRANSFER_FRAME_LAST             = 0x40000000 }; //in a frame header, the file ends with this frame
+enum{  TRANSFER_FRAME_BYTESIZE_MASK    = 0x000fffff }; //covers FILE_CHUNK_BYTESIZE, the most a payload can be
+enum{  TRANSFER_COMPRESSION_LEVEL      = 3          };
+enum{  TRANSFER_COMPRESSION_MIN_SAVING = 8          }; //a chunk is sent compressed only if that saves at least 1/8 of it
+enum{  TRANSFER_INCOMPRESSIBLE_CHUNKS  = 2          }; //after this many chunks in a row that didn't compress the rest of the file goes raw
+
+
+
+//file hashes
+enum{  HASH_BYTESIZE               = 32         }; //BLAKE3's default output
+enum{  HASH_INDEX_MAGIC            = 0x6f674849 }; //starts a persisted hash index
+enum{  HASH_INDEX_VERSION          = 1          };
+
+
+
+//delta transfers
+enum{  DELTA_INSTRUCTION_LITERAL   = 0x80000000 }; //in a delta instruction, literal bytes of the file follow
+enum{  DELTA_LITERAL_BYTESIZE_MASK = 0x000fffff }; //covers FILE_CHUNK_BYTESIZE, the most bytes a literal can have
+enum{  DELTA_STRONG_BYTESIZE       = 16         }; //of a block's BLAKE3, only compared once its weak checksum has matched
+enum{  DELTA_BLOCK_ALIGNMENT       = 4096       }; //blocks are a multiple of this, so every one starts on a page and can be mapped
+enum{  DELTA_MAX_BATCH_BLOCKS      = 131072     }; //signature blocks a batch may send, bounds what the server holds for it to about 5 MB
+
+
+
+//capture
+enum{  CAPTURE_RECORD_BYTESIZE     = 16384     }; //per connection, files past this are counted but not named
+enum{  CAPTURE_VERSION             = 1         };
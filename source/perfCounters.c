@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfCounters.h"
+#include "metrics.h"
+#include "macros.h"
+
+
+/*
+ * Hardware performance counters
+ *
+ * Counts cycles, instructions, cache misses, context switches and page faults with perf_event_open, so the cost of serving can be
+ * put as cycles per byte and misses per request and it can be told whether serving is CPU, memory or system call bound.
+ *
+ * The server handles each connection on a thread of its own that lives only as long as the connection, so rather than opening
+ * counters on every one of them the counters are opened once, with inherit set, on the thread that accepts connections and creates the
+ * workers. Every worker then counts into its own inherited counters at no cost to the others, and the kernel folds them into the
+ * totals read here when the worker exits. The totals cover the serving threads only, not the log, metrics or other helper threads.
+ *
+ * Kernel time is counted where perf_event_paranoid allows it, otherwise only user time is.
+ */
+
+
+static const char *counterNames[PERF_COUNTER_COUNT][2] = {
+  { "cycles"           , "CPU cycles spent on the serving threads"                  },
+  { "instructions"     , "Instructions retired on the serving threads"              },
+  { "cache_misses"     , "Last level cache misses on the serving threads"           },
+  { "context_switches" , "Context switches of the serving threads"                  },
+  { "page_faults"      , "Page faults taken by the serving threads"                 }
+};
+
+static const uint32_t counterTypes[PERF_COUNTER_COUNT][2] = {
+  { PERF_TYPE_HARDWARE , PERF_COUNT_HW_CPU_CYCLES        },
+  { PERF_TYPE_HARDWARE , PERF_COUNT_HW_INSTRUCTIONS      },
+  { PERF_TYPE_HARDWARE , PERF_COUNT_HW_CACHE_MISSES      },
+  { PERF_TYPE_SOFTWARE , PERF_COUNT_SW_CONTEXT_SWITCHES  },
+  { PERF_TYPE_SOFTWARE , PERF_COUNT_SW_PAGE_FAULTS       }
+};
+
+static perfCounterGroup globalServingCounters;
+
+
+static int  openCounter(int counter, pid_t thread, int excludeKernel);
+static void renderPerfCounters(FILE *out);
+
+
+
+/*
+ * openPerfCounters opens every counter that is available on thread (0 for the calling thread, or a process id), counting it and the
+ * threads it creates from then on. Returns 0 if no counter could be opened and 1 otherwise
+ */
+int openPerfCounters(perfCounterGroup *group, pid_t thread)
+{
+  int counter = 0;
+  int opened  = 0;
+
+  if(group == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  for(counter = 0; counter != PERF_COUNTER_COUNT; counter++){
+    group->descriptors[counter] = openCounter(counter, thread, 0);
+
+    if(group->descriptors[counter] == -1 && (errno == EACCES || errno == EPERM)){
+      group->descriptors[counter] = openCounter(counter, thread, 1);
+    }
+
+    opened += (group->descriptors[counter] != -1);
+  }
+
+  if( !opened ){
+    logEvent("Error", "No performance counters are available, check perf_event_paranoid");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * readPerfCounters reads the totals so far, returns 0 on error and 1 on success
+ */
+int readPerfCounters(perfCounterGroup *group, perfCounts *counts)
+{
+  uint64_t reading[3];   //value, time enabled, time running
+  int      counter = 0;
+
+  if(group == NULL || counts == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  for(counter = 0; counter != PERF_COUNTER_COUNT; counter++){
+    counts->values[counter]    = 0;
+    counts->available[counter] = 0;
+
+    if(group->descriptors[counter] == -1){
+      continue;
+    }
+
+    if( read(group->descriptors[counter], reading, sizeof(reading)) != sizeof(reading) ){
+      logEvent("Error", "Failed to read performance counter");
+      return 0;
+    }
+
+    //when there are more counters than the CPU has registers the kernel time slices them, scale up to the whole period
+    counts->values[counter]    = (reading[2] && reading[2] < reading[1]) ? (uint64_t)( (double)reading[0] * reading[1] / reading[2] ) : reading[0];
+    counts->available[counter] = 1;
+  }
+
+  return 1;
+}
+
+
+void closePerfCounters(perfCounterGroup *group)
+{
+  int counter = 0;
+
+  if(group == NULL){
+    return;
+  }
+
+  for(counter = 0; counter != PERF_COUNTER_COUNT; counter++){
+    if(group->descriptors[counter] != -1){
+      close(group->descriptors[counter]);
+      group->descriptors[counter] = -1;
+    }
+  }
+}
+
+
+const char *perfCounterName(int counter)
+{
+  if(counter < 0 || counter >= PERF_COUNTER_COUNT){
+    return "unknown";
+  }
+
+  return counterNames[counter][0];
+}
+
+
+/*
+ * startPerfCounters counts the calling thread, and every thread it creates from then on, as the server's serving threads and adds the
+ * counts to the stats output. Must be called from the thread that goes on to accept connections. Returns 0 on error and 1 on success
+ */
+int startPerfCounters(void)
+{
+  if( !openPerfCounters(&globalServingCounters, 0) ){
+    logEvent("Error", "Failed to open performance counters");
+    return 0;
+  }
+
+  if( !registerMetricsRenderer(&renderPerfCounters) ){
+    logEvent("Error", "Failed to register performance counter metrics");
+    closePerfCounters(&globalServingCounters);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static int openCounter(int counter, pid_t thread, int excludeKernel)
+{
+  struct perf_event_attr attributes;
+
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.size           = sizeof(attributes);
+  attributes.type           = counterTypes[counter][0];
+  attributes.config         = counterTypes[counter][1];
+  attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attributes.inherit        = 1;
+  attributes.exclude_kernel = excludeKernel;
+  attributes.exclude_hv     = 1;
+
+  return (int)syscall(SYS_perf_event_open, &attributes, thread, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+
+/*
+ * renderPerfCounters appends the counters, and what they cost per byte and per request, to the stats output
+ */
+static void renderPerfCounters(FILE *out)
+{
+  perfCounts counts;
+  uint64_t   bytes    = readCounter(METRIC_BYTES_SENT);
+  uint64_t   requests = readCounter(METRIC_FILES_SERVED) + readCounter(METRIC_FILES_NOT_FOUND);
+  int        counter  = 0;
+
+  if( !readPerfCounters(&globalServingCounters, &counts) ){
+    return;
+  }
+
+  for(counter = 0; counter != PERF_COUNTER_COUNT; counter++){
+    if( !counts.available[counter] ){
+      continue;
+    }
+
+    fprintf(out, "# HELP onionget_perf_%s_total %s\n# TYPE onionget_perf_%s_total counter\nonionget_perf_%s_total %llu\n", counterNames[counter][0],
+            counterNames[counter][1], counterNames[counter][0], counterNames[counter][0], (unsigned long long)counts.values[counter]);
+  }
+
+  if(counts.available[PERF_COUNTER_CYCLES] && bytes){
+    fprintf(out, "# HELP onionget_perf_cycles_per_byte CPU cycles per byte sent\n# TYPE onionget_perf_cycles_per_byte gauge\n"
+            "onionget_perf_cycles_per_byte %.6f\n", (double)counts.values[PERF_COUNTER_CYCLES] / bytes);
+  }
+
+  if(counts.available[PERF_COUNTER_CYCLES] && counts.available[PERF_COUNTER_INSTRUCTIONS] && counts.values[PERF_COUNTER_CYCLES]){
+    fprintf(out, "# HELP onionget_perf_instructions_per_cycle Instructions retired per CPU cycle\n"
+            "# TYPE onionget_perf_instructions_per_cycle gauge\nonionget_perf_instructions_per_cycle %.6f\n",
+            (double)counts.values[PERF_COUNTER_INSTRUCTIONS] / counts.values[PERF_COUNTER_CYCLES]);
+  }
+
+  if( !requests ){
+    return;
+  }
+
+  for(counter = PERF_COUNTER_CACHE_MISSES; counter != PERF_COUNTER_COUNT; counter++){
+    if( !counts.available[counter] ){
+      continue;
+    }
+
+    fprintf(out, "# HELP onionget_perf_%s_per_request %s per file requested\n# TYPE onionget_perf_%s_per_request gauge\n"
+            "onionget_perf_%s_per_request %.6f\n", counterNames[counter][0], counterNames[counter][1], counterNames[counter][0],
+            counterNames[counter][0], (double)counts.values[counter] / requests);
+  }
+}
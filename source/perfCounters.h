@@ -0,0 +1,30 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+//hardware and software counters, any of them may be unavailable (virtual machines often have no hardware counters)
+enum{ PERF_COUNTER_CYCLES            = 0 };
+enum{ PERF_COUNTER_INSTRUCTIONS      = 1 };
+enum{ PERF_COUNTER_CACHE_MISSES      = 2 };   //last level cache misses on most CPUs
+enum{ PERF_COUNTER_CONTEXT_SWITCHES  = 3 };
+enum{ PERF_COUNTER_PAGE_FAULTS       = 4 };
+enum{ PERF_COUNTER_COUNT             = 5 };
+
+typedef struct perfCounterGroup{
+  int descriptors[PERF_COUNTER_COUNT];   //-1 where the counter isn't available
+}perfCounterGroup;
+
+typedef struct perfCounts{
+  uint64_t values[PERF_COUNTER_COUNT];   //scaled up if the kernel had to multiplex the counters
+  int      available[PERF_COUNTER_COUNT];
+}perfCounts;
+
+
+int        openPerfCounters(perfCounterGroup *group, pid_t thread);
+int        readPerfCounters(perfCounterGroup *group, perfCounts *counts);
+void       closePerfCounters(perfCounterGroup *group);
+const char *perfCounterName(int counter);
+
+int        startPerfCounters(void);
@@ -0,0 +1,45 @@
+#pragma once
+
+
+/*
+ * USDT static probes for perf, bpftrace and systemtap
+ *
+ * Building with USDT=1 (make USDT=1, needs sys/sdt.h from systemtap-sdt-dev) compiles the probes below into the binary under the
+ * provider onionget. Each one is a single nop in the code plus a note in the ELF file telling tracers where to attach and where to find
+ * the arguments, so they stay put even when the function around them is static and gets inlined, and cost nothing until something
+ * attaches. Without USDT=1 they compile to nothing and their arguments are never evaluated. For example
+ *
+ *   perf probe -x ./onionGet sdt_onionget:chunk_read
+ *   bpftrace -e 'usdt:./loadGenerator:onionget:lookup_miss { @[str(arg1, arg2)] = count(); }'
+ *
+ * probe                   arguments
+ * connection_accept       connection, socket
+ * connection_withdraw     connection
+ * connection_deposit      connection
+ * request_parsed          connection, name, name bytesize (name is not NULL terminated)
+ * lookup_hit              connection, name, name bytesize, file bytesize
+ * lookup_miss             connection, name, name bytesize
+ * chunk_read              diskFile, bytes, offset, cached (1 if it was read from the in memory cache, 0 if from disk)
+ * prefetch                diskFile, bytes, offset (after skipping what is in the in memory cache)
+ * chunk_sent              connection, bytes, offset
+ * connection_closed       connection, failed
+ * client_chunk_received   bytes, offset
+ * client_chunk_written    bytes, offset
+ */
+#ifdef ONIONGET_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)              DTRACE_PROBE1(onionget, name, a)
+#define PROBE2(name, a, b)           DTRACE_PROBE2(onionget, name, a, b)
+#define PROBE3(name, a, b, c)        DTRACE_PROBE3(onionget, name, a, b, c)
+#define PROBE4(name, a, b, c, d)     DTRACE_PROBE4(onionget, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a)              do{ }while(0)
+#define PROBE2(name, a, b)           do{ }while(0)
+#define PROBE3(name, a, b, c)        do{ }while(0)
+#define PROBE4(name, a, b, c, d)     do{ }while(0)
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "profiledMutex.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Lock contention profiling
+ *
+ * profiledMutex wraps a pthread mutex. While lock profiling is off taking it costs one relaxed load more than the bare mutex. Once it
+ * is on, every acquisition is counted and the time spent waiting for the mutex and holding it are recorded into histograms (with the
+ * same buckets as the metrics histograms, in nanoseconds). All of this is written by the thread holding the mutex, so the statistics
+ * need no locking of their own and add no contention, they are atomics only so the stats output can read them at any time.
+ *
+ * A mutex registers itself for the stats output the first time it is taken with profiling on, so new locks only need to be declared
+ * with PROFILED_MUTEX_INITIALIZER to show up.
+ */
+
+
+static atomic_int      globalEnabled                          = 0;
+static profiledMutex   *globalLocks[LOCK_PROFILE_MAX_LOCKS];
+static uint32_t        globalLockCount                        = 0;
+static pthread_mutex_t globalRegistryLock                     = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t getNanoseconds(void);
+static void     recordAcquired(profiledMutex *lock, uint64_t now, uint64_t waited, int contended);
+static void     recordReleased(profiledMutex *lock);
+static void     addTo(atomic_ullong *statistic, uint64_t amount);
+static void     renderLockProfile(FILE *out);
+static void     renderLockHistogram(FILE *out, const char *metric, profiledMutex *lock, atomic_ullong *buckets, atomic_ullong *sum);
+
+
+
+void profiledLock(profiledMutex *lock)
+{
+  uint64_t start = 0;
+  uint64_t now   = 0;
+
+  if( !atomic_load_explicit(&globalEnabled, memory_order_relaxed) ){
+    pthread_mutex_lock(&lock->mutex);
+    lock->timed = 0;
+    return;
+  }
+
+  if( pthread_mutex_trylock(&lock->mutex) == 0 ){
+    recordAcquired(lock, getNanoseconds(), 0, 0);
+    return;
+  }
+
+  start = getNanoseconds();
+  pthread_mutex_lock(&lock->mutex);
+  now   = getNanoseconds();
+
+  recordAcquired(lock, now, now - start, 1);
+}
+
+
+void profiledUnlock(profiledMutex *lock)
+{
+  if(lock->timed){
+    recordReleased(lock);
+  }
+
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+
+/*
+ * profiledCondWait waits on condition like pthread_cond_wait, the time spent waiting for the condition doesn't count as holding the
+ * mutex or as contention. Returns the result of pthread_cond_wait
+ */
+int profiledCondWait(pthread_cond_t *condition, profiledMutex *lock)
+{
+  int result = 0;
+  int timed  = lock->timed;
+
+  if(timed){
+    recordReleased(lock);
+  }
+
+  result = pthread_cond_wait(condition, &lock->mutex);
+
+  //the mutex is held again, carry on timing the hold if it was being timed before
+  if(timed){
+    lock->timed      = 1;
+    lock->acquiredAt = getNanoseconds();
+  }
+
+  return result;
+}
+
+
+/*
+ * profiledCondTimedWait is profiledCondWait with a deadline, like pthread_cond_timedwait. Returns the result of pthread_cond_timedwait
+ */
+int profiledCondTimedWait(pthread_cond_t *condition, profiledMutex *lock, const struct timespec *deadline)
+{
+  int result = 0;
+  int timed  = lock->timed;
+
+  if(timed){
+    recordReleased(lock);
+  }
+
+  result = pthread_cond_timedwait(condition, &lock->mutex, deadline);
+
+  if(timed){
+    lock->timed      = 1;
+    lock->acquiredAt = getNanoseconds();
+  }
+
+  return result;
+}
+
+
+/*
+ * startLockProfiling starts recording every profiledMutex and adds them to the stats output, returns 0 on error and 1 on success
+ */
+int startLockProfiling(void)
+{
+  if( !registerMetricsRenderer(&renderLockProfile) ){
+    logEvent("Error", "Failed to register lock profile metrics");
+    return 0;
+  }
+
+  atomic_store(&globalEnabled, 1);
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static uint64_t getNanoseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+//called with lock held
+static void recordAcquired(profiledMutex *lock, uint64_t now, uint64_t waited, int contended)
+{
+  if( !atomic_load_explicit(&lock->registered, memory_order_relaxed) ){
+    pthread_mutex_lock(&globalRegistryLock);
+
+    if(globalLockCount != LOCK_PROFILE_MAX_LOCKS){
+      globalLocks[globalLockCount++] = lock;
+    }
+    else{
+      logEvent("Error", "Too many profiled locks, the rest won't be in the stats output");
+    }
+
+    pthread_mutex_unlock(&globalRegistryLock);
+    atomic_store_explicit(&lock->registered, 1, memory_order_relaxed);
+  }
+
+  addTo(&lock->acquisitions, 1);
+  addTo(&lock->contended, contended);
+  addTo(&lock->waitNanoseconds, waited);
+  addTo(&lock->waitBuckets[histogramBucket(waited)], 1);
+
+  lock->timed      = 1;
+  lock->acquiredAt = now;
+}
+
+
+//called with lock held
+static void recordReleased(profiledMutex *lock)
+{
+  uint64_t held = getNanoseconds() - lock->acquiredAt;
+
+  addTo(&lock->holdNanoseconds, held);
+  addTo(&lock->holdBuckets[histogramBucket(held)], 1);
+
+  lock->timed = 0;
+}
+
+
+//only the holder of the mutex writes its statistics, so a load and a store is enough and cheaper than an atomic add
+static void addTo(atomic_ullong *statistic, uint64_t amount)
+{
+  atomic_store_explicit(statistic, atomic_load_explicit(statistic, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+
+static void renderLockProfile(FILE *out)
+{
+  profiledMutex *locks[LOCK_PROFILE_MAX_LOCKS];
+  uint32_t      lockCount = 0;
+  uint32_t      lock      = 0;
+
+  pthread_mutex_lock(&globalRegistryLock);
+  lockCount = globalLockCount;
+  memcpy(locks, globalLocks, lockCount * sizeof(profiledMutex *));
+  pthread_mutex_unlock(&globalRegistryLock);
+
+  fprintf(out, "# HELP onionget_lock_acquisitions_total Times the lock was taken while profiling\n# TYPE onionget_lock_acquisitions_total counter\n");
+  for(lock = 0; lock != lockCount; lock++){
+    fprintf(out, "onionget_lock_acquisitions_total{lock=\"%s\"} %llu\n", locks[lock]->name,
+            (unsigned long long)atomic_load_explicit(&locks[lock]->acquisitions, memory_order_relaxed));
+  }
+
+  fprintf(out, "# HELP onionget_lock_contended_total Times the lock was taken only after waiting for another thread to release it\n"
+               "# TYPE onionget_lock_contended_total counter\n");
+  for(lock = 0; lock != lockCount; lock++){
+    fprintf(out, "onionget_lock_contended_total{lock=\"%s\"} %llu\n", locks[lock]->name,
+            (unsigned long long)atomic_load_explicit(&locks[lock]->contended, memory_order_relaxed));
+  }
+
+  fprintf(out, "# HELP onionget_lock_wait_seconds Time spent waiting to take the lock\n# TYPE onionget_lock_wait_seconds histogram\n");
+  for(lock = 0; lock != lockCount; lock++){
+    renderLockHistogram(out, "onionget_lock_wait_seconds", locks[lock], locks[lock]->waitBuckets, &locks[lock]->waitNanoseconds);
+  }
+
+  fprintf(out, "# HELP onionget_lock_hold_seconds Time the lock was held for\n# TYPE onionget_lock_hold_seconds histogram\n");
+  for(lock = 0; lock != lockCount; lock++){
+    renderLockHistogram(out, "onionget_lock_hold_seconds", locks[lock], locks[lock]->holdBuckets, &locks[lock]->holdNanoseconds);
+  }
+}
+
+
+static void renderLockHistogram(FILE *out, const char *metric, profiledMutex *lock, atomic_ullong *buckets, atomic_ullong *sum)
+{
+  uint64_t counts[METRIC_HISTOGRAM_BUCKETS];
+  uint64_t cumulative = 0;
+  uint32_t bucket     = 0;
+  uint32_t lastUsed   = 0;
+
+  for(bucket = 0; bucket != METRIC_HISTOGRAM_BUCKETS; bucket++){
+    counts[bucket] = atomic_load_explicit(&buckets[bucket], memory_order_relaxed);
+    if(counts[bucket]){
+      lastUsed = bucket;
+    }
+  }
+
+  //the hold of the current holder isn't recorded yet, so the buckets can trail the acquisitions by one
+  for(bucket = 0; bucket <= lastUsed; bucket++){
+    cumulative += counts[bucket];
+    fprintf(out, "%s_bucket{lock=\"%s\",le=\"%.9f\"} %llu\n", metric, lock->name, histogramBucketUpperBound(bucket) / 1e9, (unsigned long long)cumulative);
+  }
+
+  fprintf(out, "%s_bucket{lock=\"%s\",le=\"+Inf\"} %llu\n", metric, lock->name, (unsigned long long)cumulative);
+  fprintf(out, "%s_sum{lock=\"%s\"} %.9f\n", metric, lock->name, atomic_load_explicit(sum, memory_order_relaxed) / 1e9);
+  fprintf(out, "%s_count{lock=\"%s\"} %llu\n", metric, lock->name, (unsigned long long)cumulative);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ogEnums.h"
+
+
+//a mutex that records how often it is taken, how long threads wait for it and how long it is held, once lock profiling is started
+typedef struct profiledMutex{
+  pthread_mutex_t mutex;
+  const char      *name;
+  int             timed;            //whether the current holder is being timed, only touched by the holder
+  uint64_t        acquiredAt;       //nanoseconds, only touched by the holder
+  atomic_int      registered;
+  atomic_ullong   acquisitions;
+  atomic_ullong   contended;        //acquisitions that had to wait
+  atomic_ullong   waitNanoseconds;
+  atomic_ullong   holdNanoseconds;
+  atomic_ullong   waitBuckets[METRIC_HISTOGRAM_BUCKETS];
+  atomic_ullong   holdBuckets[METRIC_HISTOGRAM_BUCKETS];
+}profiledMutex;
+
+#define PROFILED_MUTEX_INITIALIZER(lockName) { .mutex = PTHREAD_MUTEX_INITIALIZER, .name = (lockName) }
+
+
+void profiledLock(profiledMutex *lock);
+void profiledUnlock(profiledMutex *lock);
+int  profiledCondWait(pthread_cond_t *condition, profiledMutex *lock);
+int  profiledCondTimedWait(pthread_cond_t *condition, profiledMutex *lock, const struct timespec *deadline);
+
+int  startLockProfiling(void);
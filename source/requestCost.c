@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "requestCost.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Per request cost accounting
+ *
+ * The router and diskFile count the system calls they make and the bytes they copy with costAdd into counters private to the calling
+ * thread. The server brackets each file request with costBegin and costEnd, as every request is served start to finish by one thread
+ * the counters then hold exactly what that request cost. costEnd adds them to totals kept per file size bucket, which the stats output
+ * renders as averages per request, so the cost of serving e.g. a 64 KB file can be read off directly and compared between builds.
+ *
+ * Counting into the thread's own counters is always on and costs an add, the totals are only kept once startRequestCosts is called.
+ */
+
+
+static const char *costNames[COST_COUNT][2] = {
+  { "recv_calls"   , "recv system calls"                          },
+  { "send_calls"   , "send system calls"                          },
+  { "mmap_calls"   , "mmap system calls"                          },
+  { "munmap_calls" , "munmap system calls"                        },
+  { "copied_bytes" , "Bytes copied with memcpy in user space"     },
+  { "cache_bytes"  , "File bytes read from the in memory cache"   },
+  { "disk_bytes"   , "File bytes read from disk"                  },
+  { "chunks_sent"  , "File chunks sent"                           },
+  { "read_calls"   , "preadv2 system calls"                       }
+};
+
+//files up to each bound go in its bucket, the first bucket is requests for files the server doesn't have
+static const uint64_t sizeBucketBounds[REQUEST_COST_SIZE_BUCKETS] = { 0, 4096, 65536, 1048576, 16777216, UINT64_MAX };
+static const char     *sizeBucketNames[REQUEST_COST_SIZE_BUCKETS] = { "not_found", "le_4KiB", "le_64KiB", "le_1MiB", "le_16MiB", "larger" };
+
+
+static atomic_int     globalEnabled                                          = 0;
+static atomic_ullong  globalRequests[REQUEST_COST_SIZE_BUCKETS];
+static atomic_ullong  globalTotals[REQUEST_COST_SIZE_BUCKETS][COST_COUNT];
+
+static __thread uint64_t threadCosts[COST_COUNT];
+
+
+static void renderRequestCosts(FILE *out);
+
+
+
+/*
+ * costBegin starts counting a new request on the calling thread
+ */
+void costBegin(void)
+{
+  memset(threadCosts, 0, sizeof(threadCosts));
+}
+
+
+void costAdd(int cost, uint64_t amount)
+{
+  threadCosts[cost] += amount;
+}
+
+
+/*
+ * costEnd adds what the calling thread's request cost to the totals for its file size, found is 0 if the file wasn't found
+ */
+void costEnd(int found, uint64_t fileBytesize)
+{
+  uint32_t bucket = 0;
+  int      cost   = 0;
+
+  if( !atomic_load_explicit(&globalEnabled, memory_order_relaxed) ){
+    return;
+  }
+
+  if(found){
+    for(bucket = 1; bucket != REQUEST_COST_SIZE_BUCKETS - 1 && fileBytesize > sizeBucketBounds[bucket]; bucket++);
+  }
+
+  atomic_fetch_add_explicit(&globalRequests[bucket], 1, memory_order_relaxed);
+
+  for(cost = 0; cost != COST_COUNT; cost++){
+    if(threadCosts[cost]){
+      atomic_fetch_add_explicit(&globalTotals[bucket][cost], threadCosts[cost], memory_order_relaxed);
+    }
+  }
+}
+
+
+/*
+ * startRequestCosts starts keeping the totals and adds them to the stats output, returns 0 on error and 1 on success
+ */
+int startRequestCosts(void)
+{
+  if( !registerMetricsRenderer(&renderRequestCosts) ){
+    logEvent("Error", "Failed to register request cost metrics");
+    return 0;
+  }
+
+  atomic_store(&globalEnabled, 1);
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void renderRequestCosts(FILE *out)
+{
+  uint64_t requests[REQUEST_COST_SIZE_BUCKETS];
+  uint32_t bucket = 0;
+  int      cost   = 0;
+
+  fprintf(out, "# HELP onionget_request_cost_requests_total File requests the costs were averaged over, by file size\n"
+               "# TYPE onionget_request_cost_requests_total counter\n");
+
+  for(bucket = 0; bucket != REQUEST_COST_SIZE_BUCKETS; bucket++){
+    requests[bucket] = atomic_load_explicit(&globalRequests[bucket], memory_order_relaxed);
+    fprintf(out, "onionget_request_cost_requests_total{size=\"%s\"} %llu\n", sizeBucketNames[bucket], (unsigned long long)requests[bucket]);
+  }
+
+  for(cost = 0; cost != COST_COUNT; cost++){
+    fprintf(out, "# HELP onionget_request_%s_per_request %s per file request, by file size\n# TYPE onionget_request_%s_per_request gauge\n",
+            costNames[cost][0], costNames[cost][1], costNames[cost][0]);
+
+    for(bucket = 0; bucket != REQUEST_COST_SIZE_BUCKETS; bucket++){
+      if(requests[bucket]){
+        fprintf(out, "onionget_request_%s_per_request{size=\"%s\"} %.3f\n", costNames[cost][0], sizeBucketNames[bucket],
+                (double)atomic_load_explicit(&globalTotals[bucket][cost], memory_order_relaxed) / requests[bucket]);
+      }
+    }
+  }
+}
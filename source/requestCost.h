@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+
+//what serving a file request costs, counted by the thread serving it
+enum{ COST_RECV_CALLS       = 0 };
+enum{ COST_SEND_CALLS       = 1 };
+enum{ COST_MMAP_CALLS       = 2 };
+enum{ COST_MUNMAP_CALLS     = 3 };
+enum{ COST_COPIED_BYTES     = 4 };   //bytes memcpy'd in user space
+enum{ COST_CACHE_BYTES      = 5 };   //file bytes read from the in memory cache
+enum{ COST_DISK_BYTES       = 6 };   //file bytes read from disk
+enum{ COST_CHUNKS_SENT      = 7 };
+enum{ COST_READ_CALLS       = 8 };   //preadv2 system calls
+enum{ COST_COUNT            = 9 };
+
+
+void costBegin(void);
+void costAdd(int cost, uint64_t amount);
+void costEnd(int found, uint64_t fileBytesize);
+
+int  startRequestCosts(void);
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <sys/time.h> 
 #include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 
 //
@@ -20,6 +22,7 @@
 #include "memoryManager.h"
 #include "ogEnums.h"
 #include "macros.h"
+#include "requestCost.h"
 
 //private internal values 
 typedef struct routerPrivate{
@@ -39,6 +42,7 @@ static int                  setSocket           ( routerObject *this
 static int                  destroyRouter       ( routerObject **thisPointer                                                                                   );
 static int                  ipv4Listen          ( routerObject *this            , char *ipv4Address          , int port                                        );
 static int                  getConnection       ( routerObject *this                                                                                           );
+static int                  getPendingConnections( routerObject *this                                                                                          );
 static int                  reinitialize        ( routerObject *this                                                                                           ); 
 
 //private methods
@@ -62,7 +66,7 @@ routerObject *newRouter(void)
   routerPrivate *privateThis = NULL;
   
   //allocate memory for the object
-  privateThis = (routerPrivate *) secureAllocate(sizeof(*privateThis)); 
+  privateThis = (routerPrivate *) secureAllocateTagged(sizeof(*privateThis), MEMORY_TAG_ROUTER); 
   if(privateThis == NULL){
     logEvent("Error", "Failed to allocate memory for router object");
     return NULL;  
@@ -78,6 +82,7 @@ routerObject *newRouter(void)
   privateThis->publicRouter.ipv4Connect           = &ipv4Connect; 
   privateThis->publicRouter.ipv4Listen            = &ipv4Listen;
   privateThis->publicRouter.getConnection         = &getConnection;
+  privateThis->publicRouter.getPendingConnections = &getPendingConnections;
   privateThis->publicRouter.setSocket             = &setSocket; 
   privateThis->publicRouter.destroyRouter         = &destroyRouter;
   privateThis->publicRouter.reinitialize          = &reinitialize; 
@@ -168,6 +173,7 @@ static int receive(routerObject *this, void *receiveBuffer, uint32_t payloadByte
     
   for(bytesReceived = 0, recvReturn = 0; bytesReceived != payloadBytesize; bytesReceived += recvReturn){
     recvReturn = recv(private->socket, &((unsigned char*)receiveBuffer)[bytesReceived], payloadBytesize - bytesReceived, 0);    //TODO look into this cast from void* 
+    costAdd(COST_RECV_CALLS, 1);
     if(recvReturn == -1 || recvReturn == 0){ 
       logEvent("Error", "Failed to receive bytes");
       return 0; 
@@ -226,8 +232,10 @@ static int transmit(routerObject *this, void *payload, uint32_t payloadBytesize)
     return 0;
   }
   
+  //MSG_NOSIGNAL so a client hanging up is an error return rather than a SIGPIPE that kills the process
   for(sentBytes = 0, sendReturn = 0; sentBytes != payloadBytesize; sentBytes += sendReturn){
-    sendReturn = send(private->socket, payload, payloadBytesize - sentBytes, 0); //TODO note not currently keeping track of payload position because it is void, think of a way around this
+    sendReturn = send(private->socket, &((unsigned char*)payload)[sentBytes], payloadBytesize - sentBytes, MSG_NOSIGNAL);
+    costAdd(COST_SEND_CALLS, 1);
     if(sendReturn == -1){
       logEvent("Error", "Failed to send bytes");
       return 0;
@@ -322,6 +330,7 @@ static int ipv4Connect(routerObject *this, char *ipv4Address, char *port)
 {
   struct addrinfo connectionInformation;
   struct addrinfo *encodedAddress;
+  int             noDelay = 1;
   
   routerPrivate *private = NULL; 
   
@@ -366,6 +375,13 @@ static int ipv4Connect(routerObject *this, char *ipv4Address, char *port)
     return 0; 
   }
   
+  //requests go out as several small writes and then wait on the reply, so Nagle would only hold the tail of each request back until
+  //the peer's delayed ACK, about 40ms per request once the SOCKS exchange has put the connection in interactive mode
+  if( setsockopt(private->socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) ){
+    logEvent("Error", "Failed to disable Nagle on socket");
+    return 0; 
+  }
+  
   if( connect(private->socket, encodedAddress->ai_addr, encodedAddress->ai_addrlen) ){
     logEvent("Error", "Failed to connect to ipv4 address");
     return 0; 
@@ -383,6 +399,7 @@ int ipv4Listen(routerObject *this, char *ipv4Address, int port)
 {
   struct sockaddr_in bindInfo;
   struct in_addr     formattedAddress;
+  int                reuseAddress = 1;
   
   routerPrivate *private = NULL; 
   private                = (routerPrivate *)this;
@@ -407,6 +424,12 @@ int ipv4Listen(routerObject *this, char *ipv4Address, int port)
     return 0; 
   }
   
+  //connections the server closed first sit in TIME_WAIT on this port, don't let them stop a restarted server from binding
+  if( setsockopt(private->socket, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)) ){
+    logEvent("Error", "Failed to set socket to reuse address");
+    return 0; 
+  }
+  
   if( !inet_aton( (const char*)ipv4Address , &formattedAddress) ){
     logEvent("Error", "Failed to convert IP bind address to network order"); 
     return 0; 
@@ -454,6 +477,39 @@ static int getConnection(routerObject *this)
 }
 
 
+/*
+ * getPendingConnections returns the number of established connections waiting in the accept queue of the listening socket, which must
+ * already be initialized (see ipv4Listen). Returns -1 on error
+ * 
+ * NOTE: relies on Linux reporting the current accept queue length of a listening socket in tcpi_unacked
+ */
+static int getPendingConnections(routerObject *this)
+{
+  struct tcp_info connectionInformation;
+  socklen_t       informationBytesize = sizeof(connectionInformation);
+  
+  routerPrivate *private = NULL; 
+  private                = (routerPrivate *)this;
+  
+  if(private == NULL || this == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  
+  if(private->socket == -1){
+    logEvent("Error", "Socket not initialized, can't get pending connections");
+    return -1; 
+  }
+  
+  if( getsockopt(private->socket, IPPROTO_TCP, TCP_INFO, &connectionInformation, &informationBytesize) ){
+    logEvent("Error", "Failed to get listening socket information");
+    return -1; 
+  }
+  
+  return (int)connectionInformation.tcpi_unacked; 
+}
+
+
 /*
  * setSocket sets the routers socket to the argument socket
  * returns 0 on error and 1 on success
@@ -12,6 +12,7 @@ typedef struct routerObject{
   int (*ipv4Connect)(struct routerObject *this, char *ipv4Address, char *port);
   int (*ipv4Listen)(struct routerObject *this, char *address, int port);
   int  (*getConnection)(struct routerObject *this);
+  int  (*getPendingConnections)(struct routerObject *this);
   int  (*setSocket)(struct routerObject *this, int socket);
   int (*destroyRouter)(struct routerObject **thisPointer); 
   int (*reinitialize)(struct routerObject *this); 
@@ -3,9 +3,11 @@
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 
 
 #include "router.h"
@@ -15,49 +17,129 @@
 #include "server.h"
 #include "ogEnums.h"
 #include "macros.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "dashboard.h"
+#include "probes.h"
+#include "perfCounters.h"
+#include "profiledMutex.h"
+#include "requestCost.h"
+#include "shaper.h"
+#include "ioPool.h"
+#include "transferCompression.h"
+#include "fileHash.h"
+#include "delta.h"
 
 
 
 //GLOBAL VARIABLES
 //currently hardcoding pointer array sizes, think of a cleaner way to do this with variable number
 static diskFileObject      **globalFileBank         = NULL;  
+static atomic_ullong       *globalFileRequests      = NULL;  //times each file bank slot has been requested, for the dashboard
+static struct sidecarPair  *globalSidecars          = NULL;  //shared files with a .zst sidecar, see initializeTransferCompression
+static uint32_t            globalSidecarCount       = 0; 
 static connectionObject    **globalConnectionBank   = NULL; 
 static routerObject        *globalServerRouter      = NULL;
 static uint32_t            globalMaxCacheBytes      = 0;
 static uint32_t            globalMaxConnections     = 0;
 static uint32_t            globalMaxSharedFiles     = 0; 
+static serverOptions       globalServerOptions;
 //
 
 
 //THREAD SAFETY LOCKS
-static pthread_mutex_t connectionDepositLock  = PTHREAD_MUTEX_INITIALIZER; 
-static pthread_mutex_t connectionWithdrawLock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t fileDepositLock        = PTHREAD_MUTEX_INITIALIZER; 
-static pthread_mutex_t fileWithdrawLock       = PTHREAD_MUTEX_INITIALIZER;
+static profiledMutex   connectionDepositLock  = PROFILED_MUTEX_INITIALIZER("connectionDeposit"); 
+static profiledMutex   connectionWithdrawLock = PROFILED_MUTEX_INITIALIZER("connectionWithdraw");
+static profiledMutex   fileDepositLock        = PROFILED_MUTEX_INITIALIZER("fileDeposit"); 
+static profiledMutex   fileWithdrawLock       = PROFILED_MUTEX_INITIALIZER("fileWithdraw");
+
+static pthread_cond_t  connectionDepositedCondition = PTHREAD_COND_INITIALIZER; 
 //
 
 
+//a file of a batch request, the filename points into the received request
+typedef struct batchFile{
+  char           *filename;
+  uint32_t       filenameBytesize;
+  uint32_t       priority;
+  uint32_t       index;            //position in the batch, sent ahead of the file
+  diskFileObject *file;            //NULL if not found
+  diskFileObject *sidecar;         //sent in place of file if the client takes compressed frames, NULL if there is none
+  uint32_t       slot;             //of file in the file bank
+  deltaSignature signature;        //of the client's copy of file, with REQUEST_FLAG_DELTA
+  uint32_t       bytesize;
+}batchFile;
+
+//a shared file and its precompressed sidecar, which is the file's name with .zst on the end
+typedef struct sidecarPair{
+  diskFileObject *file;
+  diskFileObject *sidecar;
+}sidecarPair;
+
+//how far a connection has read ahead of what it has sent, see readAheadOf
+typedef struct readAhead{
+  uint32_t       prefetched;       //bytes from the start of the file being sent that have been prefetched
+  diskFileObject *nextFile;        //the file the batch sends after it, NULL if there is none
+  uint32_t       nextPrefetched;   //bytes from the start of nextFile that have been prefetched
+}readAhead;
+
+//a file chunk being read into one of the connection's chunk buffers, see startChunkRead
+typedef struct chunkRead{
+  ioRequest      request;
+  int            pending;          //1 while the disk I/O pool has the read
+}chunkRead;
+
+
 //PUBLIC METHODS
 static int serve(const char *sharedFolderPath, uint32_t maxCacheMegabytes, char *bindAddress, char *listenPort);
+static int configure(serverOptions *options);
 //
 
 
 //PRIVATE METHODS
 static int listenForConnections(void);
 static int initializeSharedFiles(const char *sharedFolderPath, uint32_t maxCacheMegabytes);
+static int initializeCacheLocking(void);
 static int initializeNetworking(char *bindAddress, char *listenPort);
 static void *processConnection(void *connectionV);
-static uint32_t sendNextRequestedFile(connectionObject *connection);
-static int sendFileNotFound(connectionObject *connection);
+static int sendBatch(connectionObject *connection, captureRecord *capture, shaperFlow *flow, uint32_t requestBytesize, uint32_t requestFlags);
+static int compareBatchFiles(const void *first, const void *second);
+static int sendRequestedFile(connectionObject *connection, captureRecord *capture, shaperFlow *flow, char *filename, uint32_t filenameBytesize,
+                             diskFileObject *outgoingFile, diskFileObject *sidecar, fileHashes *hashes, uint32_t requestFlags, uint64_t requestTime,
+                             readAhead *ahead);
+static int sendRequestedDelta(connectionObject *connection, captureRecord *capture, shaperFlow *flow, batchFile *requested, uint32_t requestFlags,
+                              uint64_t requestTime);
+static void readAheadOf(readAhead *ahead, diskFileObject *file, uint32_t fileBytesize, uint32_t sentBytes);
+static int startChunkRead(connectionObject *connection, chunkRead *read, diskFileObject *file, char *buffer, uint32_t bytesize, uint32_t offset);
+static int finishChunkRead(chunkRead *read);
+static int sendFileNotFound(connectionObject *connection, uint32_t requestFlags);
+static diskFileObject *getSidecarOf(diskFileObject *file);
+static int initializeMetrics(void);
+static int initializeTracing(void);
+static int initializeCapture(void);
+static int initializeDashboard(void);
+static int initializePerfCounters(void);
+static int initializeLockProfiling(void);
+static int initializeRequestCosts(void);
+static int initializeShaping(void);
+static int initializeIoPool(void);
+static int initializeTransferCompression(void);
+static int initializeHashIndex(void);
+static int initializeDeltaTransfers(void);
+static uint32_t readFileRequests(dashboardFile *files, uint32_t maxFiles);
+static int64_t readQueuedConnections(void);
 //
 
 
 
 //PRIVATE BANK METHODS
 static int depositFile(diskFileObject *file);
-static diskFileObject *getFileById(char *id, uint32_t idBytesize);
+static diskFileObject *getFileById(char *id, uint32_t idBytesize, uint32_t *slot);
 static connectionObject *withdrawConnection(void);
 static int depositConnection(connectionObject *connection);
+static void initializeFileBank(void);
+static int initializeConnectionBank(void);
 //
 
 
@@ -81,26 +163,54 @@ static int depositConnection(connectionObject *connection);
 
 serverObject *newServer(routerObject *router, diskFileObject** fileBank, uint32_t maxSharedFiles, connectionObject** connectionBank, uint32_t maxConnections) 
 {
-  serverObject *this = (serverObject *)secureAllocate(sizeof(*this));
+  serverObject *this = (serverObject *)secureAllocateTagged(sizeof(*this), MEMORY_TAG_SERVER);
   if(this == NULL){ 
     logEvent("Error", "Failed to allocate memory to instantiate server");
     return NULL; 
   }
   
+  globalFileRequests = (atomic_ullong *)secureAllocateTagged(maxSharedFiles * sizeof(atomic_ullong), MEMORY_TAG_SERVER); 
+  if(globalFileRequests == NULL){
+    logEvent("Error", "Failed to allocate memory to instantiate server");
+    secureFree(&this, sizeof(*this)); 
+    return NULL; 
+  }
+  
   //initialize public methods
-  this->serve = &serve; 
+  this->serve     = &serve; 
+  this->configure = &configure; 
 
   //dependency injections
   globalServerRouter   = router; 
   globalFileBank       = fileBank;
   globalConnectionBank = connectionBank; 
+  globalMaxSharedFiles = maxSharedFiles;
+  globalMaxConnections = maxConnections; 
   
+  memset(&globalServerOptions, 0, sizeof(globalServerOptions)); 
    
   return this;
 }
 
 
 
+/*
+ * configure sets the optional server behaviour, it must be called before serve. Returns 0 on error and 1 on success
+ */
+static int configure(serverOptions *options)
+{
+  if(options == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  memcpy(&globalServerOptions, options, sizeof(globalServerOptions)); 
+  
+  return 1; 
+}
+
+
+
 static int serve(const char *sharedFolderPath, uint32_t maxCacheMegabytes, char *bindAddress, char *listenPort)
 {
   if(sharedFolderPath == NULL || bindAddress == NULL || listenPort == NULL){ //TODO NOTE sanity check maxCachebytesize here?
@@ -113,7 +223,15 @@ static int serve(const char *sharedFolderPath, uint32_t maxCacheMegabytes, char
     return 0;
   }
   
-  if( !initializeSharedFiles(sharedFolderPath, maxCacheMegabytes) ){
+  if( !initializeCacheLocking() || !initializeSharedFiles(sharedFolderPath, maxCacheMegabytes) ){
+    logEvent("Error", "Failed to initialize server");
+    return 0; 
+  }
+  
+  if( !initializeMetrics() || !initializeTracing() || !initializeCapture() || !initializeDashboard() ||
+      !initializePerfCounters() || !initializeLockProfiling() || !initializeRequestCosts() ||
+      !initializeShaping() || !initializeIoPool() || !initializeTransferCompression() || !initializeHashIndex() ||
+      !initializeDeltaTransfers() ){
     logEvent("Error", "Failed to initialize server");
     return 0; 
   }
@@ -166,10 +284,34 @@ static int initializeNetworking(char *bindAddress, char *listenPort)
 
 
 
+/*
+ * initializeCacheLocking has the file cache allocated in locked memory if configured, returns 0 on error and 1 on success
+ */
+static int initializeCacheLocking(void)
+{
+  uint64_t reservedBytesize = 0; 
+  
+  if( !globalServerOptions.lockCache ){
+    return 1; 
+  }
+  
+  //every thread that reads a chunk from disk maps it MAP_LOCKED, which counts against RLIMIT_MEMLOCK too
+  reservedBytesize = (uint64_t)(globalMaxConnections + globalServerOptions.ioThreads + 1) * FILE_CHUNK_BYTESIZE; 
+  
+  if( !startMemoryLocking(reservedBytesize) ){
+    logEvent("Error", "Failed to start locking the file cache");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
 static int initializeSharedFiles(const char *sharedFolderPath, uint32_t maxCacheMegabytes)
 {
   uint32_t            availableCacheBytes; 
   uint32_t            fileBytesCached; 
+  uint32_t            fileBytesStored; 
   DIR                 *directory; 
   struct dirent       *fileEntry; 
   diskFileObject      *diskFile; 
@@ -190,7 +332,19 @@ static int initializeSharedFiles(const char *sharedFolderPath, uint32_t maxCache
     globalMaxCacheBytes = maxCacheMegabytes * BYTES_IN_A_MEGABYTE;
   }
   
+  if( globalServerOptions.cacheArena && globalMaxCacheBytes && !startCacheArena(globalMaxCacheBytes) ){
+    logEvent("Error", "Failed to start the cache arena");
+    return 0; 
+  }
+  
   availableCacheBytes = globalMaxCacheBytes; 
+  
+#ifndef ONIONGET_LZ4
+  if(globalServerOptions.compressCache){
+    logEvent("Error", "Cache compression needs a build with LZ4=1");
+    return 0; 
+  }
+#endif
 
   
   directory = opendir( sharedFolderPath );
@@ -216,8 +370,29 @@ static int initializeSharedFiles(const char *sharedFolderPath, uint32_t maxCache
       return 0; 
     }
     
-    fileBytesCached = diskFile->cacheBytes(diskFile, FILE_CHUNK_BYTESIZE); //TODO we need to switch from a byte paradigm to a file chunk paradigm to ensure compatibility with mmap page sizes, don't keep track of max cached bytes but rather max cached file chunks, this cache is too small
-    availableCacheBytes -= fileBytesCached; //BROKEN WARNING SEE ABOVE TODO                                                                       //and should be available cache bytes TODO TODO TODO TODO TODO TODO BROKEN WARNING
+    //a file big enough to stream is rarely worth its place in memory, and sending it whole mustn't evict the files that are
+    if( globalServerOptions.streamingBytesize && diskFile->getBytesize(diskFile) >= globalServerOptions.streamingBytesize ){
+      if( !diskFile->setStreaming(diskFile) ){
+        logEvent("Error", "Failed to set shared file streaming");
+        return 0; 
+      }
+      
+      if( depositFile(diskFile) != 1){
+        logEvent("Error", "Failed to deposit a file into shared file bank, does the shared folder have too many files in it?");
+        return 0;
+      }
+      
+      continue; 
+    }
+    
+    //files are cached until the budget is spent, a file is cached whole or not at all so the last one can go over it by up to a chunk
+    if(availableCacheBytes != 0){
+      fileBytesCached = diskFile->cacheBytes(diskFile, FILE_CHUNK_BYTESIZE, globalServerOptions.compressCache); //TODO we need to switch from a byte paradigm to a file chunk paradigm to ensure compatibility with mmap page sizes, don't keep track of max cached bytes but rather max cached file chunks, this cache is too small
+      fileBytesStored = diskFile->getCacheFootprint(diskFile); 
+      availableCacheBytes -= (fileBytesStored < availableCacheBytes) ? fileBytesStored : availableCacheBytes; 
+      metricsGaugeAdd(METRIC_GAUGE_CACHE_BYTES, fileBytesCached); 
+      metricsGaugeAdd(METRIC_GAUGE_CACHE_STORED_BYTES, fileBytesStored); 
+    }
     
     if( depositFile(diskFile) != 1){
       logEvent("Error", "Failed to deposit a file into shared file bank, does the shared folder have too many files in it?");
@@ -233,27 +408,46 @@ static int initializeSharedFiles(const char *sharedFolderPath, uint32_t maxCache
 static int listenForConnections(void)
 {
   pthread_t        processingThread;
+  pthread_attr_t   processingThreadAttributes; 
   connectionObject *availableConnection; 
+  int              incomingSocket; 
   
   if(globalServerRouter == NULL){
     logEvent("Error", "Global server router must be initialized prior to connection processing");
     return 0;
   }
   
+  //processing threads are never joined, so they must be detached for their resources to be released when they finish
+  if( pthread_attr_init(&processingThreadAttributes) || pthread_attr_setdetachstate(&processingThreadAttributes, PTHREAD_CREATE_DETACHED) ){
+    logEvent("Error", "Failed to initialize connection processing thread attributes");
+    return 0; 
+  }
+  
   while(1){     
-    //keep trying to get an available connection
-    while( !(availableConnection = withdrawConnection()) ){ //NOTE wtf I don't think I actually need a mutex on withdraw only one thread accesses it
-      //block until a connecting client needs the available router (TODO make sure globalServerRouter doesn't need error checking...)
-      if( !availableConnection->router->setSocket(availableConnection->router, globalServerRouter->getConnection(globalServerRouter)) ){
-	logEvent("Error", "Failed to set connection socket");
-	return 0; //TODO don't want to return here add better error handling 
-      }
-      
-      if( pthread_create(&processingThread, NULL, processConnection, (void*)availableConnection) != 0 ){
-	logEvent("Error", "Failed to create thread to handle connection");
-	return 0; //TODO don't want to return here add better error handling
-      }
-      
+    //wait for an available connection, depositConnection signals when one is returned to the bank
+    profiledLock(&connectionDepositLock); 
+    while( !(availableConnection = withdrawConnection()) ){
+      profiledCondWait(&connectionDepositedCondition, &connectionDepositLock); 
+    }
+    profiledUnlock(&connectionDepositLock); 
+    
+    //block until a connecting client needs the available router (TODO make sure globalServerRouter doesn't need error checking...)
+    incomingSocket = globalServerRouter->getConnection(globalServerRouter); 
+    if( incomingSocket == -1 || !availableConnection->router->setSocket(availableConnection->router, incomingSocket) ){
+      logEvent("Error", "Failed to set connection socket");
+      depositConnection(availableConnection); 
+      continue; 
+    }
+    
+    availableConnection->acceptTime = getMonotonicMicroseconds(); 
+    PROBE2(connection_accept, availableConnection, incomingSocket); 
+    metricsIncrement(METRIC_CONNECTIONS_ACCEPTED, 1); 
+    
+    if( pthread_create(&processingThread, &processingThreadAttributes, processConnection, (void*)availableConnection) != 0 ){
+      logEvent("Error", "Failed to create thread to handle connection");
+      availableConnection->reinitialize(availableConnection); 
+      depositConnection(availableConnection); 
+      continue; 
     }
   }
 }
@@ -269,7 +463,11 @@ static void *processConnection(void *connectionV)
 {
   connectionObject *connection           = NULL; 
   uint32_t         requestBytesize       = 0;
-  uint32_t         requestBytesProcessed = 0; 
+  uint32_t         requestFlags          = 0; 
+  uint64_t         spanStart             = 0; 
+  int              failed                = 1; 
+  captureRecord    capture; 
+  shaperFlow       flow; 
   
   //cast correctly the connection
   connection = (connectionObject *)connectionV;  
@@ -280,30 +478,62 @@ static void *processConnection(void *connectionV)
     return NULL; 
   }
   
+  metricsGaugeAdd(METRIC_GAUGE_ACTIVE_CONNECTIONS, 1); 
+  captureBegin(&capture, connection->acceptTime); 
+  shaperFlowBegin(&flow); 
+  
+  connection->traceId = traceBeginRequest(); 
+  traceSpan(connection->traceId, "accept", connection->acceptTime, 0); 
+  
   //get the total incoming bytesize, perform basic sanity check
-  requestBytesize = connection->router->getIncomingBytesize(connection->router); 
+  spanStart = traceStart(connection->traceId); 
+  if( !connection->router->receive(connection->router, &requestBytesize, sizeof(uint32_t)) ){
+    logEvent("Error", "Failed to receive request bytesize"); 
+    goto cleanup; 
+  }
+  requestBytesize = ntohl(requestBytesize); 
+  traceSpan(connection->traceId, "receive request bytesize", spanStart, sizeof(uint32_t)); 
+  
+  //an empty request, a bytesize of 0 without flags, asks for nothing and is answered by closing the connection, it probes the server is up
+  if(requestBytesize == 0){
+    failed = 0; 
+    goto cleanup; 
+  }
+  
+  //the request flags ride in the high bits of the request bytesize, clients that don't know about them leave them clear
+  requestFlags     = requestBytesize & ~REQUEST_BYTESIZE_MASK; 
+  requestBytesize &= REQUEST_BYTESIZE_MASK; 
+  
   if(requestBytesize > MAX_REQUEST_STRING_BYTESIZE || requestBytesize == 0){
     logEvent("Error", "Client wants to send more bytes than allowed, or error in getting total request bytesize"); //TODO better error checking soon to come! stay tuned! 
     goto cleanup; 
   }
   
+  if( (requestFlags & ~(REQUEST_FLAG_SCHEDULED | REQUEST_FLAG_PRIORITIES | REQUEST_FLAG_COMPRESSED | REQUEST_FLAG_HASHES | REQUEST_FLAG_DELTA)) || 
+      ((requestFlags & REQUEST_FLAG_PRIORITIES) && !(requestFlags & REQUEST_FLAG_SCHEDULED)) ){
+    logEvent("Error", "Client sent unknown request flags");
+    goto cleanup; 
+  }
+  
+  //deltas cost a pass over the whole file, so they are only sent by servers configured to, and the literals go uncompressed
+  if( (requestFlags & REQUEST_FLAG_DELTA) && (!globalServerOptions.deltaTransfers || (requestFlags & REQUEST_FLAG_COMPRESSED)) ){
+    logEvent("Error", "Client asked for deltas this server doesn't send");
+    goto cleanup; 
+  }
+  
   //send all the requested files
-  for(requestBytesProcessed = 0; requestBytesize > 0; requestBytesize -= requestBytesProcessed + sizeof(uint32_t)){ //+ sizeof(uint32_t) because requestBytesize includes the uint32_t seperators between file names requested
-    requestBytesProcessed = sendNextRequestedFile(connection);
-    
-    //should we check for this?
-    if(requestBytesize - requestBytesProcessed < 0){
-      logEvent("Error", "Client sent more bytes than it said it was going to");
-      goto cleanup; 
-    }
-    
-    if(requestBytesProcessed == -1){
-      logEvent("Error", "Failed to send file to client");
-      goto cleanup;  
-    }
+  if( !sendBatch(connection, &capture, &flow, requestBytesize, requestFlags) ){
+    logEvent("Error", "Failed to send requested files to client");
+    goto cleanup; 
   }
+  
+  failed = 0; 
     
   cleanup:  
+    PROBE2(connection_closed, connection, failed); 
+    metricsGaugeAdd(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1); 
+    captureEnd(&capture, failed); 
+    
     if( !connection->reinitialize(connection) ){
       logEvent("Error", "Failed to reinitialize connection");
       return NULL; 
@@ -316,137 +546,1012 @@ static void *processConnection(void *connectionV)
   
   
   
-//returns bytesize of sent filename (or -1 on error); 
-static uint32_t sendNextRequestedFile(connectionObject *connection)
+/*
+ * sendBatch serves a batch request. The whole batch is received and every file looked up before anything is sent, so each file can be
+ * read ahead while the one before it is still going out. The files are sent in the order they were asked for, unless the request has
+ * REQUEST_FLAG_SCHEDULED: then they go out smallest first (or by the client's priorities first with REQUEST_FLAG_PRIORITIES), each
+ * response preceded by the index of the file in the batch. With REQUEST_FLAG_COMPRESSED every response is framed, see transferCompression.h,
+ * and with REQUEST_FLAG_HASHES every file bytesize is followed by the file's hashes, see fileHash.h. With REQUEST_FLAG_DELTA the request is
+ * followed by a signature of the client's copy of every file, and each file is sent as a delta against it, see delta.h.
+ * requestBytesize is without the flags. Returns 0 on error and 1 on success
+ *
+ * [request bytesize | flags][priority (with REQUEST_FLAG_PRIORITIES)][first filename bytesize][first filename][priority]...
+ */
+static int sendBatch(connectionObject *connection, captureRecord *capture, shaperFlow *flow, uint32_t requestBytesize, uint32_t requestFlags)
 {
-  uint32_t       filenameBytesize = 0;
-  diskFileObject *outgoingFile    = NULL; 
-  uint32_t       bytesAlreadyRead = 0; 
-  uint32_t       bytesToRead      = 0; 
-  uint32_t       fileBytesize     = 0; //TODO eventually make uint64_t + support this in networking + client + server +disklfile etc, switch to 64 bit eventually (used many spots make sure to change all when I do it)...
+  unsigned char  *request         = NULL; 
+  batchFile      *files           = NULL; 
+  uint32_t       fileCount        = 0; 
+  uint32_t       currentFile      = 0; 
+  uint32_t       offset           = 0; 
+  uint32_t       filenameBytesize = 0; 
+  uint32_t       entryBytesize    = 0; 
+  uint32_t       word             = 0; 
+  uint32_t       blockBudget      = DELTA_MAX_BATCH_BLOCKS; 
+  uint64_t       requestTime      = 0; 
+  uint64_t       spanStart        = 0; 
+  int            success          = 0; 
+  readAhead      ahead; 
   
-  if(connection == NULL){
-    logEvent("Error", "Something was NULL that shouldn't have been");
-    goto error; 
+  memset(&ahead, 0, sizeof(ahead)); 
+  
+  //each filename is preceded by its bytesize, and by its priority before that if the client sent priorities
+  entryBytesize = (requestFlags & REQUEST_FLAG_PRIORITIES) ? 2 * sizeof(uint32_t) : sizeof(uint32_t); 
+  
+  request = (unsigned char *)secureAllocateTagged(requestBytesize, MEMORY_TAG_CONNECTION); 
+  if(request == NULL){
+    logEvent("Error", "Failed to allocate memory for the batch request");
+    return 0; 
   }
   
-  //get the requested file name bytesize
-  filenameBytesize = connection->router->getIncomingBytesize(connection->router); 
+  costBegin(); 
+  spanStart = traceStart(connection->traceId); 
+  if( !connection->router->receive(connection->router, request, requestBytesize) ){
+    logEvent("Error", "Failed to receive the batch request");
+    goto cleanup; 
+  }
   
-  //WARNING the assumption that MAX_FILE_ID_BYTESIZE is exact size of buffer connection->requestedFilename must hold true for security to be present
-  if(filenameBytesize > MAX_FILE_ID_BYTESIZE || filenameBytesize == 0){ 
-   return 0;  
+  //check every entry lies within the request before trusting any of them
+  for(offset = 0; offset != requestBytesize; offset += entryBytesize + filenameBytesize, fileCount++){
+    if(requestBytesize - offset < entryBytesize){
+      logEvent("Error", "Batch request ends part way through an entry");
+      goto cleanup; 
+    }
+    
+    memcpy(&word, &request[offset + entryBytesize - sizeof(uint32_t)], sizeof(uint32_t)); 
+    filenameBytesize = ntohl(word); 
+    if(filenameBytesize == 0 || filenameBytesize > MAX_FILE_ID_BYTESIZE || filenameBytesize > requestBytesize - offset - entryBytesize){
+      logEvent("Error", "Batch request has an invalid file name bytesize");
+      goto cleanup; 
+    }
   }
   
-  //initialize filename
-  if( !connection->router->receive(connection->router, connection->requestedFilename, filenameBytesize) ){
-    logEvent("Error", "Failed to determine requested file name");
-    return 0;
+  traceSpan(connection->traceId, "parse", spanStart, requestBytesize); 
+  
+  files = (batchFile *)secureAllocateTagged(fileCount * sizeof(batchFile), MEMORY_TAG_CONNECTION); 
+  if(files == NULL){
+    logEvent("Error", "Failed to allocate memory for the batch schedule");
+    goto cleanup; 
   }
-     
-  //random NOTE (Stop relying on strlen for anything anywhere)
-  outgoingFile = getFileById(connection->requestedFilename, filenameBytesize); 
-  if(!outgoingFile && !sendFileNotFound(connection)){
-    logEvent("Error", "Failed to send file not found to client");
-    goto error; 
+  
+  requestTime = getMonotonicMicroseconds(); 
+  
+  for(offset = 0, currentFile = 0; currentFile != fileCount; offset += entryBytesize + files[currentFile].filenameBytesize, currentFile++){
+    if(requestFlags & REQUEST_FLAG_PRIORITIES){
+      memcpy(&word, &request[offset], sizeof(uint32_t)); 
+      files[currentFile].priority = ntohl(word); 
+    }
+    
+    memcpy(&word, &request[offset + entryBytesize - sizeof(uint32_t)], sizeof(uint32_t)); 
+    files[currentFile].filenameBytesize = ntohl(word); 
+    files[currentFile].filename         = (char *)&request[offset + entryBytesize]; 
+    files[currentFile].index            = currentFile; 
+    PROBE3(request_parsed, connection, files[currentFile].filename, files[currentFile].filenameBytesize); 
+    
+    spanStart               = traceStart(connection->traceId); 
+    files[currentFile].file = getFileById(files[currentFile].filename, files[currentFile].filenameBytesize, &files[currentFile].slot); 
+    traceSpan(connection->traceId, "lookup", spanStart, 0); 
+    
+    //files that aren't there only cost the not found response, so they sort as empty
+    if(files[currentFile].file != NULL){
+      files[currentFile].bytesize = files[currentFile].file->getBytesize(files[currentFile].file); 
+      
+      if(requestFlags & REQUEST_FLAG_COMPRESSED){
+        files[currentFile].sidecar = getSidecarOf(files[currentFile].file); 
+      }
+    }
+  }
+  
+  //the signatures come in the order the files were asked for, all before anything is sent or the client could be stuck sending them
+  for(currentFile = 0; (requestFlags & REQUEST_FLAG_DELTA) && currentFile != fileCount; currentFile++){
+    if( !deltaReceiveSignature(connection->router, &files[currentFile].signature, &blockBudget) ){
+      logEvent("Error", "Failed to receive the client's delta signatures");
+      goto cleanup; 
+    }
+  }
+  
+  if(requestFlags & REQUEST_FLAG_SCHEDULED){
+    qsort(files, fileCount, sizeof(batchFile), &compareBatchFiles); 
+  }
+  
+  for(currentFile = 0; currentFile != fileCount; currentFile++){
+    //receiving the batch is counted as part of what its first file cost
+    if(currentFile != 0){
+      costBegin(); 
+    }
+    
+    if( (requestFlags & REQUEST_FLAG_SCHEDULED) && !connection->router->transmitBytesize(connection->router, files[currentFile].index) ){
+      logEvent("Error", "Failed to transmit file index to client");
+      goto cleanup; 
+    }
+    
+    //what is read ahead of the next file is what will be sent of it
+    ahead.nextFile = NULL; 
+    if(currentFile + 1 != fileCount){
+      ahead.nextFile = (files[currentFile + 1].sidecar != NULL) ? files[currentFile + 1].sidecar : files[currentFile + 1].file; 
+    }
+    
+    if( (requestFlags & REQUEST_FLAG_DELTA) && files[currentFile].file != NULL ){
+      if( !sendRequestedDelta(connection, capture, flow, &files[currentFile], requestFlags, requestTime) ){
+        goto cleanup; 
+      }
+    }
+    else if( !sendRequestedFile(connection, capture, flow, files[currentFile].filename, files[currentFile].filenameBytesize, files[currentFile].file, 
+                                files[currentFile].sidecar, getFileHashes(files[currentFile].slot), requestFlags, requestTime, &ahead) ){
+      goto cleanup; 
+    }
+    
+    ahead.prefetched     = ahead.nextPrefetched; 
+    ahead.nextPrefetched = 0; 
+  }
+  
+  success = 1; 
+  
+  cleanup:
+    if(files != NULL){
+      for(currentFile = 0; currentFile != fileCount; currentFile++){
+        deltaSignatureRelease(&files[currentFile].signature); 
+      }
+      
+      secureFree(&files, fileCount * sizeof(batchFile)); 
+    }
+    
+    secureFree(&request, requestBytesize); 
+    return success; 
+}
+
+
+//qsort comparator ordering a batch by priority, then bytesize, then the order the client asked for the files in
+static int compareBatchFiles(const void *first, const void *second)
+{
+  const batchFile *firstFile  = (const batchFile *)first; 
+  const batchFile *secondFile = (const batchFile *)second; 
+  
+  if(firstFile->priority != secondFile->priority){
+    return (firstFile->priority > secondFile->priority) - (firstFile->priority < secondFile->priority); 
+  }
+  
+  if(firstFile->bytesize != secondFile->bytesize){
+    return (firstFile->bytesize > secondFile->bytesize) - (firstFile->bytesize < secondFile->bytesize); 
+  }
+  
+  return (firstFile->index > secondFile->index) - (firstFile->index < secondFile->index); 
+}
+
+
+/*
+ * sendRequestedFile sends the client outgoingFile, or not found if it is NULL, for the request of filename. With REQUEST_FLAG_COMPRESSED
+ * in requestFlags the file goes out as frames (see transferCompression.h), as its sidecar if that isn't NULL and otherwise compressed
+ * chunk by chunk if the server is configured to. With REQUEST_FLAG_HASHES its hashes go out ahead of it, or that it has none if hashes
+ * is NULL. requestTime is when the request was parsed, in monotonic microseconds, ahead is the connection's read ahead. Returns 0 on
+ * error and 1 on success
+ */
+static int sendRequestedFile(connectionObject *connection, captureRecord *capture, shaperFlow *flow, char *filename, uint32_t filenameBytesize,
+                             diskFileObject *outgoingFile, diskFileObject *sidecar, fileHashes *hashes, uint32_t requestFlags, uint64_t requestTime,
+                             readAhead *ahead)
+{
+  uint32_t       bytesAlreadyRead = 0; 
+  uint32_t       bytesToRead      = 0; 
+  uint32_t       nextBytesize     = 0; 
+  uint32_t       current          = 0; 
+  char           *buffers[CONNECTION_CHUNK_BUFFERS]; 
+  chunkRead      reads[CONNECTION_CHUNK_BUFFERS]; 
+  uint64_t       spanStart        = 0; 
+  int            transfer         = -1; 
+  uint32_t       fileBytesize     = 0; //TODO eventually make uint64_t + support this in networking + client + server +disklfile etc, switch to 64 bit eventually (used many spots make sure to change all when I do it)...
+  diskFileObject *source          = NULL; 
+  uint32_t       sourceBytesize   = 0; 
+  void           *payload         = NULL; 
+  uint32_t       payloadBytesize  = 0; 
+  uint32_t       wireBytesize     = 0; 
+  uint32_t       frameHeader      = 0; 
+  int            compressing      = 0; 
+  uint32_t       incompressible   = 0; 
+  int            framed           = (requestFlags & REQUEST_FLAG_COMPRESSED) != 0; 
+  
+  if(!outgoingFile){
+    PROBE3(lookup_miss, connection, filename, filenameBytesize); 
+    captureFile(capture, filename, filenameBytesize, 0, 0); 
+    
+    if( !sendFileNotFound(connection, requestFlags) ){
+      logEvent("Error", "Failed to send file not found to client");
+      return 0; 
+    }
+    
+    metricsIncrement(METRIC_FILES_NOT_FOUND, 1); 
+    costEnd(0, 0); 
+    return 1; 
   }
   
+  memset(reads, 0, sizeof(reads)); 
+  
   fileBytesize = outgoingFile->getBytesize(outgoingFile);
   if(fileBytesize == -1){
     logEvent("Error", "Failed to get file bytesize");
     goto error; 
   }
   
+  //what is read and sent is the sidecar if there is one, the client still gets the bytesize of the file it decompresses to
+  source         = outgoingFile; 
+  sourceBytesize = fileBytesize; 
+  
+  if(sidecar != NULL){
+    source         = sidecar; 
+    sourceBytesize = sidecar->getBytesize(sidecar); 
+    if(sourceBytesize == -1){
+      logEvent("Error", "Failed to get sidecar bytesize");
+      goto error; 
+    }
+    
+    transferCountSidecar(fileBytesize, sourceBytesize); 
+  }
+  
+  compressing = framed && sidecar == NULL && globalServerOptions.compressTransfers; 
+  
+  PROBE4(lookup_hit, connection, filename, filenameBytesize, fileBytesize); 
+  captureFile(capture, filename, filenameBytesize, 1, fileBytesize); 
+  transfer = metricsTransferBegin(filename, filenameBytesize, fileBytesize); 
+  
   if( !connection->router->transmitBytesize(connection->router, fileBytesize) ){ 
     logEvent("Error", "Failed to transmit file bytesize to client");
     goto error;
   }
   
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !hashTransmit(connection->router, hashes) ){
+    logEvent("Error", "Failed to transmit file hashes to client");
+    goto error; 
+  }
+  
+  
+  
+  //the next chunk is read into one buffer while the last is sent from the other
+  buffers[0] = connection->dataCache; 
+  buffers[1] = connection->dataCache + FILE_CHUNK_BYTESIZE; 
+  
+  //the first chunk has nothing to be sent alongside, so it is waited for straight away
+  bytesToRead = sourceBytesize < FILE_CHUNK_BYTESIZE ? sourceBytesize : FILE_CHUNK_BYTESIZE; 
+  readAheadOf(ahead, source, sourceBytesize, 0); 
+  
+  spanStart = traceStart(connection->traceId); 
+  if( !startChunkRead(connection, &reads[0], source, buffers[0], bytesToRead, 0) || !finishChunkRead(&reads[0]) ){
+    logEvent("Error", "Failed to read file bytes");
+    goto error; 
+  }
+  traceSpan(connection->traceId, "chunk read", spanStart, bytesToRead); 
+  
+  for(bytesAlreadyRead = 0; bytesAlreadyRead < sourceBytesize; bytesAlreadyRead += bytesToRead, current = !current){
+    bytesToRead  = ( (sourceBytesize - bytesAlreadyRead) < FILE_CHUNK_BYTESIZE ) ? (sourceBytesize - bytesAlreadyRead) : FILE_CHUNK_BYTESIZE; 
+    nextBytesize = sourceBytesize - bytesAlreadyRead - bytesToRead; 
+    nextBytesize = nextBytesize < FILE_CHUNK_BYTESIZE ? nextBytesize : FILE_CHUNK_BYTESIZE; 
+    
+    if(nextBytesize){
+      readAheadOf(ahead, source, sourceBytesize, bytesAlreadyRead + bytesToRead); 
+      
+      spanStart = traceStart(connection->traceId); 
+      if( !startChunkRead(connection, &reads[!current], source, buffers[!current], nextBytesize, bytesAlreadyRead + bytesToRead) ){
+        logEvent("Error", "Failed to read file bytes");
+        goto error; 
+      }
+      traceSpan(connection->traceId, "chunk read", spanStart, nextBytesize); 
+    }
+    
+    payload         = buffers[current]; 
+    payloadBytesize = bytesToRead; 
+    
+    if(framed){
+      frameHeader = (nextBytesize == 0) ? TRANSFER_FRAME_LAST : 0; 
+      
+      if(sidecar != NULL){
+        frameHeader |= TRANSFER_FRAME_COMPRESSED; 
+      }
+      else if(compressing && transferCompressChunk(buffers[current], bytesToRead, &payload, &payloadBytesize)){
+        frameHeader   |= TRANSFER_FRAME_COMPRESSED; 
+        incompressible = 0; 
+      }
+      //a file whose chunks keep not compressing is most likely compressed already, so the rest of it isn't tried
+      else if(compressing && ++incompressible == TRANSFER_INCOMPRESSIBLE_CHUNKS){
+        compressing = 0; 
+      }
+    }
   
-  for(bytesAlreadyRead = 0, bytesToRead = 0; bytesAlreadyRead < fileBytesize; bytesAlreadyRead += bytesToRead){
-    bytesToRead = ( (fileBytesize - bytesAlreadyRead) < FILE_CHUNK_BYTESIZE ) ? (fileBytesize - bytesAlreadyRead) : FILE_CHUNK_BYTESIZE; 
+    //a frame header is counted with its payload, the way sendRequestedDelta counts instructions
+    wireBytesize = framed ? sizeof(uint32_t) + payloadBytesize : payloadBytesize; 
   
-    if( !outgoingFile->dfRead(outgoingFile, connection->dataCache, bytesToRead, bytesAlreadyRead) ){
-      logEvent("Error", "Failed to read file bytes");
+    //wait for bandwidth if shaping, which connection goes next is decided fairly across all of them
+    if( !shaperAcquire(flow, wireBytesize) ){
+      logEvent("Error", "Failed to acquire bandwidth for file chunk");
       goto error; 
     }
   
-    if( !connection->router->transmit(connection->router, connection->dataCache, bytesToRead) ){ //TODO should we make a packet format that is padded and fixed size? I think so. 
+    spanStart = traceStart(connection->traceId); 
+    if( (framed && !connection->router->transmitBytesize(connection->router, frameHeader | payloadBytesize)) || 
+        !connection->router->transmit(connection->router, payload, payloadBytesize) ){ //TODO should we make a packet format that is padded and fixed size? I think so. 
       logEvent("Error", "Failed to transmit file to client");
       goto error; 
     }
+    traceSpan(connection->traceId, "chunk send", spanStart, wireBytesize); 
+    PROBE3(chunk_sent, connection, wireBytesize, bytesAlreadyRead); 
+    costAdd(COST_CHUNKS_SENT, 1); 
+    
+    if(bytesAlreadyRead == 0){
+      metricsRecord(METRIC_HISTOGRAM_TIME_TO_FIRST_BYTE, getMonotonicMicroseconds() - requestTime); 
+      traceInstant(connection->traceId, "first byte", wireBytesize); 
+    }
+    
+    metricsIncrement(METRIC_BYTES_SENT, wireBytesize); 
+    captureBytesSent(capture, wireBytesize); 
+    metricsTransferProgress(transfer, (uint32_t)( (uint64_t)(bytesAlreadyRead + bytesToRead) * fileBytesize / sourceBytesize )); 
+    
+    if(reads[!current].pending){
+      spanStart = traceStart(connection->traceId); 
+      if( !finishChunkRead(&reads[!current]) ){
+        logEvent("Error", "Failed to read file bytes");
+        goto error; 
+      }
+      traceSpan(connection->traceId, "chunk wait", spanStart, nextBytesize); 
+    }
   }
   
+  traceInstant(connection->traceId, "last byte", fileBytesize); 
+  metricsIncrement(METRIC_FILES_SERVED, 1); 
+  metricsRecord(METRIC_HISTOGRAM_TRANSFER_DURATION, getMonotonicMicroseconds() - requestTime); 
+  metricsTransferEnd(transfer); 
+  costEnd(1, fileBytesize); 
 
-  return filenameBytesize; 
+  return 1; 
   
   error:
-   return -1; 
+   //the pool may still be writing into the connection's buffers
+   for(current = 0; current < CONNECTION_CHUNK_BUFFERS; current++){
+     finishChunkRead(&reads[current]); 
+   }
+   
+   metricsTransferEnd(transfer); 
+   return 0; 
 }
   
   
   
 
-static int sendFileNotFound(connectionObject *connection)
+/*
+ * sendRequestedDelta sends the client requested->file as a delta against its signature of its copy (see delta.h), with its hashes
+ * first with REQUEST_FLAG_HASHES. The file is read through the connection's buffers as it is matched. requestTime is when the request
+ * was parsed, in monotonic microseconds. Returns 0 on error and 1 on success
+ */
+static int sendRequestedDelta(connectionObject *connection, captureRecord *capture, shaperFlow *flow, batchFile *requested, uint32_t requestFlags,
+                              uint64_t requestTime)
 {
-  if( !connection->router->transmitBytesize( connection->router, strlen("not found") ) ){ 
-    return 0;
-  }
-      
-  if( !connection->router->transmit( connection->router, "not found", strlen("not found") ) ){
+  deltaEncoder     encoder; 
+  deltaInstruction instruction; 
+  uint32_t         fileBytesize = 0; 
+  uint32_t         wireBytesize = 0; 
+  uint64_t         spanStart    = 0; 
+  int              transfer     = -1; 
+  int              sentAny      = 0; 
+  int              success      = 0; 
+  
+  fileBytesize = requested->file->getBytesize(requested->file); 
+  if(fileBytesize == -1){
+    logEvent("Error", "Failed to get file bytesize");
     return 0; 
   }
-    
-  return 1; 
-}
-
-
-
-
-
-
-
-//file bank functions
-
-
-static int depositFile(diskFileObject *file)
-{
-  if(file == NULL){
-    logEvent("Error", "Something was NULL that shouldn't have been");
-    return -1; 
-  }
-  pthread_mutex_lock(&fileDepositLock);
-  uint32_t slots = globalMaxSharedFiles;
-  while(slots--){
-   if(globalFileBank[slots] == NULL){
-     globalFileBank[slots] = file;
-     pthread_mutex_unlock(&fileDepositLock); 
-     return 1;
-   }
+  
+  spanStart = traceStart(connection->traceId); 
+  if( !deltaEncoderStart(&encoder, requested->file, fileBytesize, &requested->signature, (unsigned char *)connection->dataCache) ){
+    logEvent("Error", "Failed to start the file's delta");
+    return 0; 
   }
-  pthread_mutex_unlock(&fileDepositLock); 
-  return 0; 
-}
-
-static diskFileObject *getFileById(char *id, uint32_t idBytesize)
-{
-  pthread_mutex_lock(&fileWithdrawLock);
+  traceSpan(connection->traceId, "delta start", spanStart, requested->signature.blockCount); 
   
-  uint32_t slots = globalMaxSharedFiles;
+  PROBE4(lookup_hit, connection, requested->filename, requested->filenameBytesize, fileBytesize); 
+  captureFile(capture, requested->filename, requested->filenameBytesize, 1, fileBytesize); 
+  transfer = metricsTransferBegin(requested->filename, requested->filenameBytesize, fileBytesize); 
   
-  if(id == NULL || idBytesize == 0){
-    logEvent("Error", "Something was NULL that shouldn't have been");
-    return NULL; 
+  if( !connection->router->transmitBytesize(connection->router, fileBytesize) ){ 
+    logEvent("Error", "Failed to transmit file bytesize to client");
+    goto cleanup;
   }
   
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !hashTransmit(connection->router, getFileHashes(requested->slot)) ){
+    logEvent("Error", "Failed to transmit file hashes to client");
+    goto cleanup; 
+  }
+  
+  for(;;){
+    spanStart = traceStart(connection->traceId); 
+    if( !deltaEncoderNext(&encoder, &instruction) ){
+      logEvent("Error", "Failed to match the file against the client's copy");
+      goto cleanup; 
+    }
+    traceSpan(connection->traceId, "delta match", spanStart, instruction.literalBytesize); 
+    
+    if(instruction.copyBlocks == 0 && instruction.literalBytesize == 0){
+      break; 
+    }
+    
+    wireBytesize = instruction.copyBlocks ? 2 * sizeof(uint32_t) : sizeof(uint32_t) + instruction.literalBytesize; 
+    
+    if( !shaperAcquire(flow, wireBytesize) ){
+      logEvent("Error", "Failed to acquire bandwidth for delta instruction");
+      goto cleanup; 
+    }
+    
+    spanStart = traceStart(connection->traceId); 
+    if(instruction.copyBlocks){
+      if( !connection->router->transmitBytesize(connection->router, instruction.copyBlock) || 
+          !connection->router->transmitBytesize(connection->router, instruction.copyBlocks) ){
+        logEvent("Error", "Failed to transmit delta to client");
+        goto cleanup; 
+      }
+    }
+    else if( !connection->router->transmitBytesize(connection->router, DELTA_INSTRUCTION_LITERAL | instruction.literalBytesize) || 
+             !connection->router->transmit(connection->router, instruction.literal, instruction.literalBytesize) ){
+      logEvent("Error", "Failed to transmit delta to client");
+      goto cleanup; 
+    }
+    traceSpan(connection->traceId, "chunk send", spanStart, wireBytesize); 
+    PROBE3(chunk_sent, connection, wireBytesize, instruction.endOffset); 
+    costAdd(COST_CHUNKS_SENT, 1); 
+    
+    if( !sentAny ){
+      metricsRecord(METRIC_HISTOGRAM_TIME_TO_FIRST_BYTE, getMonotonicMicroseconds() - requestTime); 
+      traceInstant(connection->traceId, "first byte", wireBytesize); 
+      sentAny = 1; 
+    }
+    
+    metricsIncrement(METRIC_BYTES_SENT, wireBytesize); 
+    captureBytesSent(capture, wireBytesize); 
+    metricsTransferProgress(transfer, instruction.endOffset); 
+  }
+  
+  traceInstant(connection->traceId, "last byte", fileBytesize); 
+  metricsIncrement(METRIC_FILES_SERVED, 1); 
+  metricsRecord(METRIC_HISTOGRAM_TRANSFER_DURATION, getMonotonicMicroseconds() - requestTime); 
+  costEnd(1, fileBytesize); 
+  
+  success = 1; 
+  
+  cleanup:
+    connection->markDataCacheDirty(connection, CONNECTION_CHUNK_BUFFERS * FILE_CHUNK_BYTESIZE); 
+    deltaEncoderRelease(&encoder); 
+    metricsTransferEnd(transfer); 
+    return success; 
+}
+  
+  
+  
+
+/*
+ * readAheadOf keeps the readAheadBytesize bytes of file after the first sentBytes prefetched, and once the rest of file is covered
+ * whatever is left of that window from the head of the batch's next file. It tops up in steps of at least half the window, so it
+ * costs a system call every few chunks rather than every chunk
+ */
+static void readAheadOf(readAhead *ahead, diskFileObject *file, uint32_t fileBytesize, uint32_t sentBytes)
+{
+  uint32_t window       = globalServerOptions.readAheadBytesize; 
+  uint32_t target       = 0; 
+  uint32_t nextBytesize = 0; 
+  
+  if(window == 0){
+    return; 
+  }
+  
+  target = (fileBytesize - sentBytes > window) ? sentBytes + window : fileBytesize; 
+  if( target > ahead->prefetched && (target - ahead->prefetched >= window / 2 || target == fileBytesize) ){
+    //a failed prefetch only loses the head start, the read itself still goes to the disk
+    file->prefetch(file, ahead->prefetched, target - ahead->prefetched); 
+    ahead->prefetched = target; 
+  }
+  
+  if(ahead->nextFile == NULL || fileBytesize - sentBytes >= window){
+    return; 
+  }
+  
+  nextBytesize = ahead->nextFile->getBytesize(ahead->nextFile); 
+  if(nextBytesize == -1){
+    return; 
+  }
+  
+  target = window - (fileBytesize - sentBytes); 
+  if(target > nextBytesize){
+    target = nextBytesize; 
+  }
+  
+  if( target > ahead->nextPrefetched && (target - ahead->nextPrefetched >= window / 2 || target == nextBytesize) ){
+    ahead->nextFile->prefetch(ahead->nextFile, ahead->nextPrefetched, target - ahead->nextPrefetched); 
+    ahead->nextPrefetched = target; 
+  }
+}
+
+
+/*
+ * startChunkRead starts reading bytesize bytes of file at offset into buffer, one of the connection's chunk buffers. A chunk that is
+ * in memory is read straight away, one that would have to come from disk is handed to the disk I/O pool if it is running so the
+ * connection can go on sending, finishChunkRead waits for it. Returns 0 on error and 1 on success
+ */
+static int startChunkRead(connectionObject *connection, chunkRead *read, diskFileObject *file, char *buffer, uint32_t bytesize, uint32_t offset)
+{
+  uint32_t bytesRead = 0; 
+  
+  connection->markDataCacheDirty(connection, (buffer - connection->dataCache) + bytesize); 
+  
+  if( !ioPoolRunning() ){
+    return file->dfRead(file, buffer, bytesize, offset); 
+  }
+  
+  bytesRead = file->dfTryRead(file, buffer, bytesize, offset); 
+  if(bytesRead == -1){
+    return 0; 
+  }
+  
+  if(bytesRead == bytesize){
+    return 1; 
+  }
+  
+  read->request.file     = file; 
+  read->request.buffer   = buffer; 
+  read->request.bytesize = bytesize; 
+  read->request.offset   = offset; 
+  
+  if( !ioSubmit(&read->request) ){
+    return 0; 
+  }
+  
+  read->pending = 1; 
+  return 1; 
+}
+
+
+/*
+ * finishChunkRead waits for the disk I/O pool if it has read, returns 0 if the read failed and 1 if it succeeded
+ */
+static int finishChunkRead(chunkRead *read)
+{
+  if( !read->pending ){
+    return 1; 
+  }
+  
+  read->pending = 0; 
+  return ioWait(&read->request); 
+}
+
+
+
+
+//framed, not found goes out as a single raw frame, as a delta a single literal, and it never has hashes
+static int sendFileNotFound(connectionObject *connection, uint32_t requestFlags)
+{
+  if( !connection->router->transmitBytesize( connection->router, strlen("not found") ) ){ 
+    return 0;
+  }
+  
+  if( (requestFlags & REQUEST_FLAG_HASHES) && !hashTransmit(connection->router, NULL) ){
+    return 0; 
+  }
+  
+  if( (requestFlags & REQUEST_FLAG_COMPRESSED) && !connection->router->transmitBytesize( connection->router, TRANSFER_FRAME_LAST | strlen("not found") ) ){
+    return 0; 
+  }
+  
+  if( (requestFlags & REQUEST_FLAG_DELTA) && !connection->router->transmitBytesize( connection->router, DELTA_INSTRUCTION_LITERAL | strlen("not found") ) ){
+    return 0; 
+  }
+      
+  if( !connection->router->transmit( connection->router, "not found", strlen("not found") ) ){
+    return 0; 
+  }
+    
+  return 1; 
+}
+
+
+
+
+
+
+
+/*
+ * initializeMetrics starts the stats endpoint if one is configured, returns 0 on error and 1 on success
+ */
+static int initializeMetrics(void)
+{
+  if(globalServerOptions.metricsSocketPath == NULL){
+    return 1; 
+  }
+  
+  if( !registerGaugeCallback(METRIC_GAUGE_QUEUED_CONNECTIONS, &readQueuedConnections) ){
+    logEvent("Error", "Failed to register queued connections gauge");
+    return 0; 
+  }
+  
+  if( !startMetricsEndpoint(globalServerOptions.metricsSocketPath) ){
+    logEvent("Error", "Failed to start metrics endpoint");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeTracing starts sampling requests for tracing if configured, returns 0 on error and 1 on success
+ */
+static int initializeTracing(void)
+{
+  if(globalServerOptions.traceSampleOneIn == 0){
+    return 1; 
+  }
+  
+  if( !startTracing(globalServerOptions.traceSampleOneIn, globalServerOptions.traceDumpPath) ){
+    logEvent("Error", "Failed to start tracing");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeCapture starts recording connections if configured, returns 0 on error and 1 on success
+ */
+static int initializeCapture(void)
+{
+  if(globalServerOptions.capturePath == NULL){
+    return 1; 
+  }
+  
+  if( !startCapture(globalServerOptions.capturePath) ){
+    logEvent("Error", "Failed to start capture");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeDashboard takes over the terminal with the live dashboard if configured, returns 0 on error and 1 on success
+ */
+static int initializeDashboard(void)
+{
+  dashboardSource source; 
+  
+  if( !globalServerOptions.dashboard ){
+    return 1; 
+  }
+  
+  if( !registerGaugeCallback(METRIC_GAUGE_QUEUED_CONNECTIONS, &readQueuedConnections) ){
+    logEvent("Error", "Failed to register queued connections gauge");
+    return 0; 
+  }
+  
+  source.maxConnections   = globalMaxConnections; 
+  source.maxFiles         = globalMaxSharedFiles; 
+  source.readFileRequests = &readFileRequests; 
+  
+  if( !startDashboard(&source) ){
+    logEvent("Error", "Failed to start dashboard");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializePerfCounters starts counting the serving threads if configured, it runs on the thread that goes on to accept connections
+ * so that the counters follow every connection thread it creates. Returns 0 on error and 1 on success
+ */
+static int initializePerfCounters(void)
+{
+  if( !globalServerOptions.perfCounters ){
+    return 1; 
+  }
+  
+  if( !startPerfCounters() ){
+    logEvent("Error", "Failed to start performance counters");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeLockProfiling starts recording how the server's locks are contended if configured, returns 0 on error and 1 on success
+ */
+static int initializeLockProfiling(void)
+{
+  if( !globalServerOptions.lockProfiling ){
+    return 1; 
+  }
+  
+  if( !startLockProfiling() ){
+    logEvent("Error", "Failed to start lock profiling");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeRequestCosts starts averaging what each request costs by file size if configured, returns 0 on error and 1 on success
+ */
+static int initializeRequestCosts(void)
+{
+  if( !globalServerOptions.requestCosts ){
+    return 1; 
+  }
+  
+  if( !startRequestCosts() ){
+    logEvent("Error", "Failed to start request cost accounting");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeShaping limits the server's egress if configured, returns 0 on error and 1 on success
+ */
+static int initializeShaping(void)
+{
+  if(globalServerOptions.globalBytesPerSecond == 0 && globalServerOptions.connectionBytesPerSecond == 0){
+    return 1; 
+  }
+  
+  if( !startShaper(globalServerOptions.globalBytesPerSecond, globalServerOptions.connectionBytesPerSecond) ){
+    logEvent("Error", "Failed to start bandwidth shaping");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeIoPool starts the disk I/O threads if configured, returns 0 on error and 1 on success
+ */
+static int initializeIoPool(void)
+{
+  if(globalServerOptions.ioThreads == 0){
+    return 1; 
+  }
+  
+  if( !startIoPool(globalServerOptions.ioThreads) ){
+    logEvent("Error", "Failed to start the disk I/O pool");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeTransferCompression lets clients that ask for compressed frames have them if configured, and pairs the shared files with
+ * their .zst sidecars, returns 0 on error and 1 on success
+ */
+static int initializeTransferCompression(void)
+{
+  uint32_t slot           = 0; 
+  uint32_t baseSlot       = 0; 
+  char     *name          = NULL; 
+  size_t   nameBytesize   = 0; 
+  size_t   suffixBytesize = strlen(".zst"); 
+  uint32_t fileBytesize   = 0; 
+  
+  if( !globalServerOptions.compressTransfers ){
+    return 1; 
+  }
+  
+  if( !startTransferCompression() ){
+    logEvent("Error", "Failed to start transfer compression");
+    return 0; 
+  }
+  
+  globalSidecars = (sidecarPair *)secureAllocateTagged(globalMaxSharedFiles * sizeof(sidecarPair), MEMORY_TAG_SERVER); 
+  if(globalSidecars == NULL){
+    logEvent("Error", "Failed to allocate memory for the sidecars");
+    return 0; 
+  }
+  
+  //the file bank is only written before the server starts serving, so it can be read without the lock
+  for(slot = 0; slot != globalMaxSharedFiles; slot++){
+    if(globalFileBank[slot] == NULL){
+      continue; 
+    }
+    
+    name         = globalFileBank[slot]->getFilename(globalFileBank[slot]); 
+    nameBytesize = strlen(name); 
+    if(nameBytesize <= suffixBytesize || strcmp(&name[nameBytesize - suffixBytesize], ".zst")){
+      continue; 
+    }
+    
+    for(baseSlot = 0; baseSlot != globalMaxSharedFiles; baseSlot++){
+      if( globalFileBank[baseSlot] != NULL && 
+          !strncmp(globalFileBank[baseSlot]->getFilename(globalFileBank[baseSlot]), name, nameBytesize - suffixBytesize) &&
+          globalFileBank[baseSlot]->getFilename(globalFileBank[baseSlot])[nameBytesize - suffixBytesize] == '\0' ){
+        break; 
+      }
+    }
+    
+    if(baseSlot == globalMaxSharedFiles){
+      continue; 
+    }
+    
+    //a stale sidecar would hand out the wrong file, the bytesize it decompresses to is the one check that is cheap
+    fileBytesize = globalFileBank[baseSlot]->getBytesize(globalFileBank[baseSlot]); 
+    if( fileBytesize == -1 || !transferSidecarMatches(globalFileBank[slot], fileBytesize) ){
+      logEvent("Warning", "Ignoring a .zst sidecar that isn't a smaller zstd frame of its whole file");
+      continue; 
+    }
+    
+    globalSidecars[globalSidecarCount].file    = globalFileBank[baseSlot]; 
+    globalSidecars[globalSidecarCount].sidecar = globalFileBank[slot]; 
+    globalSidecarCount++; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeDeltaTransfers lets clients that ask have files sent as deltas against their copies if configured, returns 0 on error and
+ * 1 on success
+ */
+static int initializeDeltaTransfers(void)
+{
+  if( !globalServerOptions.deltaTransfers ){
+    return 1; 
+  }
+  
+  if( !startDeltaTransfers() ){
+    logEvent("Error", "Failed to start delta transfers");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * initializeHashIndex loads the hashes of the shared files from the hash index if configured, and starts hashing the files it doesn't
+ * have in the background, returns 0 on error and 1 on success
+ */
+static int initializeHashIndex(void)
+{
+  if(globalServerOptions.hashIndexPath == NULL){
+    return 1; 
+  }
+  
+  //the file bank is only written before the server starts serving, so it can be read without the lock
+  if( !startHashIndex(globalFileBank, globalMaxSharedFiles, globalServerOptions.hashIndexPath) ){
+    logEvent("Error", "Failed to start the hash index");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/*
+ * readFileRequests fills files with every shared file and how often it has been requested, in file bank order, returns the count
+ */
+static uint32_t readFileRequests(dashboardFile *files, uint32_t maxFiles)
+{
+  uint32_t slot  = 0; 
+  uint32_t count = 0; 
+  
+  //the file bank is only written before the server starts serving, so it can be read without the lock
+  for(slot = 0; slot != globalMaxSharedFiles && count != maxFiles; slot++){
+    if(globalFileBank[slot] == NULL){
+      continue; 
+    }
+    
+    files[count].name     = globalFileBank[slot]->getFilename(globalFileBank[slot]); 
+    files[count].requests = atomic_load_explicit(&globalFileRequests[slot], memory_order_relaxed); 
+    count++; 
+  }
+  
+  return count; 
+}
+
+
+/*
+ * readQueuedConnections returns the number of connections the kernel has accepted that the server hasn't gotten to yet, or 0 on error
+ */
+static int64_t readQueuedConnections(void)
+{
+  int pendingConnections = globalServerRouter->getPendingConnections(globalServerRouter); 
+  
+  return (pendingConnections == -1) ? 0 : pendingConnections; 
+}
+
+
+
+
+
+
+
+//file bank functions
+
+
+static int depositFile(diskFileObject *file)
+{
+  if(file == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  profiledLock(&fileDepositLock);
+  uint32_t slots = globalMaxSharedFiles;
   while(slots--){
-    if(memcmp(globalFileBank[slots]->getFilename(globalFileBank[slots]), id, idBytesize)){
-      pthread_mutex_unlock(&fileWithdrawLock);
+   if(globalFileBank[slots] == NULL){
+     globalFileBank[slots] = file;
+     profiledUnlock(&fileDepositLock); 
+     return 1;
+   }
+  }
+  profiledUnlock(&fileDepositLock); 
+  return 0; 
+}
+
+//returns the shared file named id, and its file bank slot in slot if that isn't NULL, or NULL if there is no such file
+static diskFileObject *getFileById(char *id, uint32_t idBytesize, uint32_t *slot)
+{
+  uint32_t slots    = globalMaxSharedFiles;
+  char     *name    = NULL; 
+  
+  if(id == NULL || idBytesize == 0){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return NULL; 
+  }
+  
+  //file names are NULL terminated, an id containing a NULL could match a shorter name and the check below would read past its end
+  if( memchr(id, '\0', idBytesize) != NULL ){
+    return NULL; 
+  }
+  
+  profiledLock(&fileWithdrawLock);
+  
+  while(slots--){
+    if(globalFileBank[slots] == NULL){
+      continue; 
+    }
+    
+    name = globalFileBank[slots]->getFilename(globalFileBank[slots]); 
+    
+    //strncmp stops at the end of a shorter name, then the name must end exactly where the id does
+    if( !strncmp(name, id, idBytesize) && name[idBytesize] == '\0' ){
+      atomic_fetch_add_explicit(&globalFileRequests[slots], 1, memory_order_relaxed); 
+      profiledUnlock(&fileWithdrawLock);
+      
+      if(slot != NULL){
+        *slot = slots; 
+      }
+
       return globalFileBank[slots];   
     }
   }
   
-  pthread_mutex_unlock(&fileWithdrawLock);
+  profiledUnlock(&fileWithdrawLock);
+  return NULL; 
+}
+
+
+
+//returns the sidecar paired with file by initializeTransferCompression, or NULL if it has none
+static diskFileObject *getSidecarOf(diskFileObject *file)
+{
+  uint32_t pair = 0; 
+  
+  for(pair = 0; pair != globalSidecarCount; pair++){
+    if(globalSidecars[pair].file == file){
+      return globalSidecars[pair].sidecar; 
+    }
+  }
+  
   return NULL; 
 }
 
@@ -455,33 +1560,53 @@ static diskFileObject *getFileById(char *id, uint32_t idBytesize)
 //connection bank functions
 static connectionObject *withdrawConnection(void)
 {
-  pthread_mutex_lock(&connectionWithdrawLock); 
+  profiledLock(&connectionWithdrawLock); 
   uint32_t         check   = globalMaxConnections;
   connectionObject *holder = NULL; 
   while(check--){
     if(globalConnectionBank[check] != NULL){
       holder = globalConnectionBank[check];
       globalConnectionBank[check] = NULL;
-      pthread_mutex_unlock(&connectionWithdrawLock); 
+      PROBE1(connection_withdraw, holder); 
+      profiledUnlock(&connectionWithdrawLock); 
       return holder; 
     }
   }
-  pthread_mutex_unlock(&connectionWithdrawLock); 
+  profiledUnlock(&connectionWithdrawLock); 
   return NULL; 
 }
 
 
 static int depositConnection(connectionObject *connection)
 {
-  pthread_mutex_lock(&connectionDepositLock); 
+  profiledLock(&connectionDepositLock); 
   uint32_t slots = globalMaxConnections; 
   while(slots--){
     if(globalConnectionBank[slots] == NULL){ 
       globalConnectionBank[slots] = connection;
-      pthread_mutex_unlock(&connectionDepositLock); 
+      PROBE1(connection_deposit, connection); 
+      pthread_cond_signal(&connectionDepositedCondition); 
+      profiledUnlock(&connectionDepositLock); 
       return 1;
     }
   }
-  pthread_mutex_unlock(&connectionDepositLock);
+  profiledUnlock(&connectionDepositLock);
   return 0;
+}
+
+
+static void initializeFileBank(void)
+{
+  uint32_t fill = globalMaxSharedFiles;
+  while(fill--) globalFileBank[fill] = NULL;
+}
+
+
+static int initializeConnectionBank(void)
+{
+  uint32_t fill       = globalMaxConnections;
+  uint32_t errorCheck = globalMaxConnections;
+  while(fill--) globalConnectionBank[fill] = newConnection(); 
+  while(errorCheck--) if(globalConnectionBank[errorCheck] == NULL) return 0;  
+  return 1; 
 }
\ No newline at end of file
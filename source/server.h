@@ -1,10 +1,36 @@
 #pragma once
 #include "router.h"
+#include "diskFile.h"
+#include "connection.h"
+
+//optional server behaviour, a zeroed serverOptions is the default configuration
+typedef struct serverOptions{
+  char     *metricsSocketPath;   //UNIX socket path to serve Prometheus text stats on, NULL disables the stats endpoint
+  uint32_t traceSampleOneIn;    //trace one in every traceSampleOneIn requests, 0 disables tracing
+  char     *traceDumpPath;       //where SIGUSR2 dumps the trace as Chrome trace JSON, required if tracing is enabled
+  char     *capturePath;         //file to record every connection to for replay (see capture.h), NULL disables capture
+  int      dashboard;           //1 takes over the terminal with a live dashboard (see dashboard.h), needs stdin and stdout to be a terminal
+  int      perfCounters;        //1 counts cycles, cache misses and more on the serving threads into the stats output (see perfCounters.h)
+  int      lockProfiling;       //1 records acquisitions, wait and hold times of the server's locks into the stats output (see profiledMutex.h)
+  int      requestCosts;        //1 averages the system calls and copies each request costs, by file size, into the stats output (see requestCost.h)
+  uint64_t globalBytesPerSecond;     //egress limit across all connections, 0 is unlimited (see shaper.h)
+  uint64_t connectionBytesPerSecond; //egress limit of each connection, 0 is unlimited
+  uint32_t readAheadBytesize;        //per connection bound on bytes prefetched ahead of what has been sent, across the files of a batch, 0 disables read ahead
+  uint32_t ioThreads;                //threads reading file chunks that aren't in memory while connections send (see ioPool.h), 0 reads them inline
+  uint32_t streamingBytesize;        //shared files at least this large bypass the page cache and the server's cache (see diskFile setStreaming), 0 disables
+  int      lockCache;                //1 keeps the file cache locked in RAM as far as RLIMIT_MEMLOCK allows, the rest of it is left unlocked
+  int      cacheArena;               //1 carves the file cache from one arena of huge pages where the system has them (see startCacheArena)
+  int      compressCache;            //1 LZ4 compresses the file cache chunk by chunk so the budget holds more, needs a build with LZ4=1
+  int      compressTransfers;        //1 zstd compresses files for clients that ask, or sends their .zst sidecars, needs a build with ZSTD=1 (see transferCompression.h)
+  char     *hashIndexPath;           //where the BLAKE3 hashes of the shared files persist, sent to clients that ask, needs a build with BLAKE3=1 (see fileHash.h), NULL disables
+  int      deltaTransfers;           //1 sends clients that ask only what changed against their copies of files, needs a build with BLAKE3=1 (see delta.h)
+}serverOptions;
 
 typedef struct serverObject{
   int (*serve)(const char *sharedFolderPath, uint32_t maxCacheBytesize, char *bindAddress, char *listenPort); 
+  int (*configure)(serverOptions *options); 
 }serverObject;
 
 
-serverObject *newServer(routerObject *router, diskFileObject** fileBank, connectionObject** connectionBank);
+serverObject *newServer(routerObject *router, diskFileObject** fileBank, uint32_t maxSharedFiles, connectionObject** connectionBank, uint32_t maxConnections);
 
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "shaper.h"
+#include "profiledMutex.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Bandwidth shaping
+ *
+ * Every file chunk the server sends first goes through shaperAcquire. Egress is limited by a token bucket shared by all connections
+ * and by a token bucket per connection, either can be left unlimited. When the shared bucket is short, which connection gets the next
+ * tokens is decided by deficit round robin: the connections waiting to send form a ring, and each time its turn comes round a
+ * connection is credited SHAPER_QUANTUM_BYTESIZE until its credit covers its chunk. A connection sending the short last chunk of a
+ * small file is therefore through in one round, while one pulling a large file gets a full chunk every four rounds, so small downloads
+ * finish quickly however many large ones are in progress. A connection over its own limit is passed over without holding up the ring.
+ * A send larger than a bucket holds, a full chunk and its header on a slow bucket, goes once the bucket is full and leaves it owing
+ * the difference, so no size of send can hold up the ring for good.
+ *
+ * The scheduling is done by whichever waiting thread holds the shaper lock, threads sleep until the tokens they need could be there.
+ * With shaping off shaperAcquire costs one relaxed load.
+ */
+
+
+static atomic_int      globalEnabled                  = 0;
+static uint64_t        globalConnectionBytesPerSecond = 0;
+static shaperBucket    globalBucket;
+static shaperFlow      *globalRing                    = NULL;   //whose turn it is, NULL if no connection is waiting
+static uint32_t        globalRingLength               = 0;
+static profiledMutex   globalShaperLock               = PROFILED_MUTEX_INITIALIZER("shaper");
+static pthread_cond_t  globalTurn;
+static atomic_ullong   globalDelayedChunks;
+static atomic_ullong   globalDelayNanoseconds;
+
+
+static uint64_t getNanoseconds(void);
+static uint64_t schedule(uint64_t now, int *granted);
+static void     ringAppend(shaperFlow *flow);
+static void     ringRemove(shaperFlow *flow);
+static void     bucketInitialize(shaperBucket *bucket, uint64_t bytesPerSecond, uint64_t now);
+static void     bucketRefill(shaperBucket *bucket, uint64_t now);
+static int      bucketHas(shaperBucket *bucket, uint32_t bytes);
+static void     bucketTake(shaperBucket *bucket, uint32_t bytes);
+static uint64_t bucketReadyAt(shaperBucket *bucket, uint32_t bytes, uint64_t now);
+static uint32_t bucketNeeds(shaperBucket *bucket, uint32_t bytes);
+static void     renderShaper(FILE *out);
+
+
+
+/*
+ * shaperFlowBegin readies flow for a new connection
+ */
+void shaperFlowBegin(shaperFlow *flow)
+{
+  memset(flow, 0, sizeof(*flow));
+
+  if( atomic_load_explicit(&globalEnabled, memory_order_relaxed) ){
+    bucketInitialize(&flow->bucket, globalConnectionBytesPerSecond, getNanoseconds());
+  }
+}
+
+
+/*
+ * shaperAcquire waits until the connection of flow may send bytes, returns 0 on error and 1 on success
+ */
+int shaperAcquire(shaperFlow *flow, uint32_t bytes)
+{
+  uint64_t        start    = 0;
+  uint64_t        readyAt  = 0;
+  int             granted  = 0;
+  int             waited   = 0;
+  int             result   = 0;
+  struct timespec deadline;
+
+  if( !atomic_load_explicit(&globalEnabled, memory_order_relaxed) ){
+    return 1;
+  }
+
+  start = getNanoseconds();
+
+  profiledLock(&globalShaperLock);
+
+  flow->pending = bytes;
+  flow->granted = 0;
+  ringAppend(flow);
+
+  for(;;){
+    granted = 0;
+    readyAt = schedule(getNanoseconds(), &granted);
+
+    //whoever schedules hands out tokens for everyone, so wake the threads it let go
+    if(granted){
+      pthread_cond_broadcast(&globalTurn);
+    }
+
+    if(flow->granted){
+      break;
+    }
+
+    waited = 1;
+
+    //a connection still in the ring always gets a time back, checking again in a second is only a safety net
+    if(readyAt == UINT64_MAX){
+      readyAt = getNanoseconds() + 1000000000ULL;
+    }
+
+    deadline.tv_sec  = readyAt / 1000000000ULL;
+    deadline.tv_nsec = readyAt % 1000000000ULL;
+
+    result = profiledCondTimedWait(&globalTurn, &globalShaperLock, &deadline);
+    if(result != 0 && result != ETIMEDOUT){
+      ringRemove(flow);
+      profiledUnlock(&globalShaperLock);
+      logEvent("Error", "Failed to wait for the shaper");
+      return 0;
+    }
+  }
+
+  profiledUnlock(&globalShaperLock);
+
+  if(waited){
+    atomic_fetch_add_explicit(&globalDelayedChunks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&globalDelayNanoseconds, getNanoseconds() - start, memory_order_relaxed);
+  }
+
+  return 1;
+}
+
+
+/*
+ * startShaper limits egress to globalBytesPerSecond in total and connectionBytesPerSecond per connection, 0 leaves either unlimited.
+ * Must be called before any connection is served, returns 0 on error and 1 on success
+ */
+int startShaper(uint64_t globalBytesPerSecond, uint64_t connectionBytesPerSecond)
+{
+  pthread_condattr_t attributes;
+
+  if(globalBytesPerSecond == 0 && connectionBytesPerSecond == 0){
+    logEvent("Error", "Shaping needs a global or a per connection limit");
+    return 0;
+  }
+
+  //the deadlines are on the monotonic clock so changes to the wall clock can't stall or flood the server
+  if( pthread_condattr_init(&attributes) || pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC) ||
+      pthread_cond_init(&globalTurn, &attributes) ){
+    logEvent("Error", "Failed to initialize the shaper condition");
+    return 0;
+  }
+
+  pthread_condattr_destroy(&attributes);
+
+  bucketInitialize(&globalBucket, globalBytesPerSecond, getNanoseconds());
+  globalConnectionBytesPerSecond = connectionBytesPerSecond;
+
+  if( !registerMetricsRenderer(&renderShaper) ){
+    logEvent("Error", "Failed to register shaper metrics");
+    return 0;
+  }
+
+  atomic_store(&globalEnabled, 1);
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static uint64_t getNanoseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/*
+ * schedule hands out tokens to the waiting connections in deficit round robin order for as long as there are enough, sets granted if
+ * it let any go. Returns the earliest time one of those still waiting could go, UINT64_MAX if none are. Called with the shaper lock held
+ */
+static uint64_t schedule(uint64_t now, int *granted)
+{
+  shaperFlow *flow    = NULL;
+  uint64_t   readyAt  = UINT64_MAX;
+  uint64_t   globalAt = 0;
+  uint32_t   blocked  = 0;
+
+  bucketRefill(&globalBucket, now);
+
+  //stops once every connection left is over its own limit, a round that only builds up credit still counts as progress
+  while(globalRing != NULL && blocked < globalRingLength){
+    flow = globalRing;
+
+    if(flow->deficit < flow->pending){
+      flow->deficit += SHAPER_QUANTUM_BYTESIZE;
+
+      if(flow->deficit < flow->pending){
+        globalRing = flow->next;
+        blocked    = 0;
+        continue;
+      }
+    }
+
+    //nobody can go until the shared bucket refills, and when it has it is still this connection's turn
+    if( !bucketHas(&globalBucket, flow->pending) ){
+      globalAt = bucketReadyAt(&globalBucket, flow->pending, now);
+      return globalAt < readyAt ? globalAt : readyAt;
+    }
+
+    bucketRefill(&flow->bucket, now);
+    if( !bucketHas(&flow->bucket, flow->pending) ){
+      if(bucketReadyAt(&flow->bucket, flow->pending, now) < readyAt){
+        readyAt = bucketReadyAt(&flow->bucket, flow->pending, now);
+      }
+
+      blocked++;
+      globalRing = flow->next;
+      continue;
+    }
+
+    bucketTake(&globalBucket, flow->pending);
+    bucketTake(&flow->bucket, flow->pending);
+
+    //nothing else is queued behind the chunk, so like an emptied queue in deficit round robin the credit doesn't carry over
+    flow->granted = 1;
+    flow->deficit = 0;
+    ringRemove(flow);
+
+    *granted = 1;
+    blocked  = 0;
+  }
+
+  return readyAt;
+}
+
+
+//adds flow at the back of the ring, so it has its turn after everyone already waiting
+static void ringAppend(shaperFlow *flow)
+{
+  if(globalRing == NULL){
+    flow->next = flow;
+    flow->prev = flow;
+    globalRing = flow;
+  }
+  else{
+    flow->next             = globalRing;
+    flow->prev             = globalRing->prev;
+    globalRing->prev->next = flow;
+    globalRing->prev       = flow;
+  }
+
+  globalRingLength++;
+}
+
+
+//removes flow from the ring, if it was its turn the turn passes to the next
+static void ringRemove(shaperFlow *flow)
+{
+  if(flow->next == flow){
+    globalRing = NULL;
+  }
+  else{
+    flow->prev->next = flow->next;
+    flow->next->prev = flow->prev;
+
+    if(globalRing == flow){
+      globalRing = flow->next;
+    }
+  }
+
+  flow->next = NULL;
+  flow->prev = NULL;
+  globalRingLength--;
+}
+
+
+static void bucketInitialize(shaperBucket *bucket, uint64_t bytesPerSecond, uint64_t now)
+{
+  bucket->bytesPerSecond = bytesPerSecond;
+  bucket->burst          = bytesPerSecond * SHAPER_BURST_MILLISECONDS / 1000;
+  bucket->refilledAt     = now;
+
+  //bursts shorter than a chunk would make every chunk wait for a full bucket
+  if(bucket->burst < FILE_CHUNK_BYTESIZE){
+    bucket->burst = FILE_CHUNK_BYTESIZE;
+  }
+
+  bucket->tokens = bucket->burst;
+}
+
+
+static void bucketRefill(shaperBucket *bucket, uint64_t now)
+{
+  if(bucket->bytesPerSecond == 0 || now <= bucket->refilledAt){
+    return;
+  }
+
+  bucket->tokens     += (double)(now - bucket->refilledAt) * bucket->bytesPerSecond / 1e9;
+  bucket->refilledAt  = now;
+
+  if(bucket->tokens > bucket->burst){
+    bucket->tokens = bucket->burst;
+  }
+}
+
+
+static int bucketHas(shaperBucket *bucket, uint32_t bytes)
+{
+  return bucket->bytesPerSecond == 0 || bucket->tokens >= bucketNeeds(bucket, bytes);
+}
+
+
+static void bucketTake(shaperBucket *bucket, uint32_t bytes)
+{
+  if(bucket->bytesPerSecond != 0){
+    bucket->tokens -= bytes;
+  }
+}
+
+
+//when the bucket will have the tokens to send bytes, the bucket must have been refilled at now
+static uint64_t bucketReadyAt(shaperBucket *bucket, uint32_t bytes, uint64_t now)
+{
+  return now + (uint64_t)((bucketNeeds(bucket, bytes) - bucket->tokens) * 1e9 / bucket->bytesPerSecond) + 1;
+}
+
+
+//the tokens the bucket must have to send bytes, a full bucket is enough for more than it holds and bucketTake leaves it in debt
+static uint32_t bucketNeeds(shaperBucket *bucket, uint32_t bytes)
+{
+  return bytes < bucket->burst ? bytes : (uint32_t)bucket->burst;
+}
+
+
+static void renderShaper(FILE *out)
+{
+  uint32_t waiting = 0;
+
+  profiledLock(&globalShaperLock);
+  waiting = globalRingLength;
+  profiledUnlock(&globalShaperLock);
+
+  fprintf(out, "# HELP onionget_shaper_delayed_chunks_total File chunks that had to wait for bandwidth before being sent\n"
+               "# TYPE onionget_shaper_delayed_chunks_total counter\n"
+               "onionget_shaper_delayed_chunks_total %llu\n",
+               (unsigned long long)atomic_load_explicit(&globalDelayedChunks, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_shaper_delay_seconds_total Time file chunks spent waiting for bandwidth\n"
+               "# TYPE onionget_shaper_delay_seconds_total counter\n"
+               "onionget_shaper_delay_seconds_total %.6f\n",
+               atomic_load_explicit(&globalDelayNanoseconds, memory_order_relaxed) / 1e9);
+
+  fprintf(out, "# HELP onionget_shaper_waiting_connections Connections waiting for bandwidth\n"
+               "# TYPE onionget_shaper_waiting_connections gauge\n"
+               "onionget_shaper_waiting_connections %u\n", waiting);
+}
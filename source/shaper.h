@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+
+//a token bucket of bytes
+typedef struct shaperBucket{
+  uint64_t bytesPerSecond;     //0 is unlimited
+  uint64_t burst;              //most tokens the bucket holds
+  double   tokens;
+  uint64_t refilledAt;         //nanoseconds
+}shaperBucket;
+
+//one per connection, on the stack of the thread serving it
+typedef struct shaperFlow{
+  struct shaperFlow *next;     //ring of connections waiting to send, only touched with the shaper lock held
+  struct shaperFlow *prev;
+  uint32_t          pending;   //bytes waiting to be sent
+  uint32_t          deficit;   //credit built up while waiting, deficit round robin
+  int               granted;
+  shaperBucket      bucket;    //the per connection limit
+}shaperFlow;
+
+
+void shaperFlowBegin(shaperFlow *flow);
+int  shaperAcquire(shaperFlow *flow, uint32_t bytes);
+
+int  startShaper(uint64_t globalBytesPerSecond, uint64_t connectionBytesPerSecond);
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "metrics.h"
+#include "memoryManager.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Per request phase tracing
+ *
+ * One in every sampleOneIn requests gets a trace id, the phases of sampled requests are recorded as spans in a global ring of
+ * TRACE_RING_ENTRIES events that is overwritten oldest first, so tracing can stay on in production at a bounded memory cost. Recording
+ * claims an entry with a single atomic add and publishes it with a sequence number, so writers never wait for each other or the dumper.
+ *
+ * Sending the process SIGUSR2 dumps the ring to dumpPath in the Chrome trace event format, which chrome://tracing and Perfetto load.
+ * The signal handler only sets a flag, the dump itself is written by a background thread.
+ */
+
+
+typedef struct traceEvent{
+  atomic_ullong sequence;   //index + 1 of the event once published, 0 while being written
+  const char    *name;      //always a string literal
+  uint64_t      start;
+  uint64_t      duration;
+  uint64_t      bytes;
+  uint32_t      traceId;
+  uint32_t      threadId;
+  int           instant;
+}traceEvent;
+
+
+static traceEvent            *globalRing         = NULL;
+static atomic_ullong         globalWriteIndex    = 0;
+static atomic_uint           globalRequestCount  = 0;
+static atomic_int            globalEnabled       = 0;
+static uint32_t              globalSampleOneIn   = 0;
+static const char            *globalDumpPath     = NULL;
+static volatile sig_atomic_t globalDumpRequested = 0;
+
+static __thread uint32_t     threadId            = 0;
+
+
+static void     recordEvent(uint32_t traceId, const char *name, uint64_t start, uint64_t duration, uint64_t bytes, int instant);
+static uint32_t getThreadId(void);
+static void     requestDump(int signalNumber);
+static void     *dumpLoop(void *unused);
+
+
+
+/*
+ * startTracing enables tracing of one in every sampleOneIn requests and dumps the trace to dumpPath on SIGUSR2. Returns 0 on error and
+ * 1 on success, may be called once per process
+ */
+int startTracing(uint32_t sampleOneIn, const char *dumpPath)
+{
+  struct sigaction dumpAction;
+  pthread_t        dumpThread;
+
+  if(dumpPath == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(sampleOneIn == 0){
+    logEvent("Error", "Trace sample rate must be at least one in one");
+    return 0;
+  }
+
+  if(globalRing != NULL){
+    logEvent("Error", "Tracing can only be started once per process");
+    return 0;
+  }
+
+  globalRing = (traceEvent *)secureAllocateTagged(TRACE_RING_ENTRIES * sizeof(traceEvent), MEMORY_TAG_DIAGNOSTICS);
+  if(globalRing == NULL){
+    logEvent("Error", "Failed to allocate trace ring");
+    return 0;
+  }
+
+  globalSampleOneIn = sampleOneIn;
+  globalDumpPath    = dumpPath;
+
+  memset(&dumpAction, 0, sizeof(dumpAction));
+  dumpAction.sa_handler = requestDump;
+  dumpAction.sa_flags   = SA_RESTART;
+  sigemptyset(&dumpAction.sa_mask);
+
+  if( sigaction(SIGUSR2, &dumpAction, NULL) ){
+    logEvent("Error", "Failed to install trace dump signal handler");
+    return 0;
+  }
+
+  if( pthread_create(&dumpThread, NULL, dumpLoop, NULL) != 0 ){
+    logEvent("Error", "Failed to create trace dump thread");
+    return 0;
+  }
+
+  pthread_detach(dumpThread);
+
+  atomic_store(&globalEnabled, 1);
+
+  return 1;
+}
+
+
+/*
+ * traceBeginRequest returns a new trace id if this request is sampled, and 0 if it isn't (or tracing is off)
+ */
+uint32_t traceBeginRequest(void)
+{
+  uint32_t request = 0;
+
+  if( !atomic_load_explicit(&globalEnabled, memory_order_relaxed) ){
+    return 0;
+  }
+
+  request = atomic_fetch_add_explicit(&globalRequestCount, 1, memory_order_relaxed);
+  if(request % globalSampleOneIn){
+    return 0;
+  }
+
+  //0 is reserved for unsampled
+  return (request / globalSampleOneIn) + 1;
+}
+
+
+/*
+ * traceStart returns the start time of a span for traceId, or 0 without reading the clock if the request isn't sampled
+ */
+uint64_t traceStart(uint32_t traceId)
+{
+  return traceId ? getMonotonicMicroseconds() : 0;
+}
+
+
+/*
+ * traceSpan records a span named name from start (see traceStart) until now, bytes is the number of bytes the phase handled if any
+ */
+void traceSpan(uint32_t traceId, const char *name, uint64_t start, uint64_t bytes)
+{
+  uint64_t now = 0;
+
+  if(traceId == 0){
+    return;
+  }
+
+  now = getMonotonicMicroseconds();
+
+  recordEvent(traceId, name, start, (now > start) ? now - start : 0, bytes, 0);
+}
+
+
+/*
+ * traceInstant records a point in time event named name
+ */
+void traceInstant(uint32_t traceId, const char *name, uint64_t bytes)
+{
+  if(traceId == 0){
+    return;
+  }
+
+  recordEvent(traceId, name, getMonotonicMicroseconds(), 0, bytes, 1);
+}
+
+
+/*
+ * dumpTrace writes every event in the ring to path as Chrome trace event JSON, returns 0 on error and 1 on success. Events that are
+ * being overwritten while the dump runs are skipped. The file is written next to path and renamed over it so readers never see half a dump
+ */
+int dumpTrace(const char *path)
+{
+  char          temporaryPath[4096];
+  FILE          *out          = NULL;
+  traceEvent    event;
+  uint64_t      writeIndex    = 0;
+  uint64_t      index         = 0;
+  int           firstEvent    = 1;
+
+  if(path == NULL || globalRing == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if( snprintf(temporaryPath, sizeof(temporaryPath), "%s.partial", path) >= (int)sizeof(temporaryPath) ){
+    logEvent("Error", "Trace dump path is too long");
+    return 0;
+  }
+
+  out = fopen(temporaryPath, "w");
+  if(out == NULL){
+    logEvent("Error", "Failed to open trace dump file");
+    return 0;
+  }
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+
+  writeIndex = atomic_load_explicit(&globalWriteIndex, memory_order_acquire);
+  index      = (writeIndex > TRACE_RING_ENTRIES) ? writeIndex - TRACE_RING_ENTRIES : 0;
+
+  for(; index != writeIndex; index++){
+    traceEvent *slot = &globalRing[index & (TRACE_RING_ENTRIES - 1)];
+
+    //seqlock style read, skip the event if it isn't published or is overwritten while we copy it
+    if( atomic_load_explicit(&slot->sequence, memory_order_acquire) != index + 1 ){
+      continue;
+    }
+
+    event.name     = slot->name;
+    event.start    = slot->start;
+    event.duration = slot->duration;
+    event.bytes    = slot->bytes;
+    event.traceId  = slot->traceId;
+    event.threadId = slot->threadId;
+    event.instant  = slot->instant;
+
+    atomic_thread_fence(memory_order_acquire);
+    if( atomic_load_explicit(&slot->sequence, memory_order_relaxed) != index + 1 ){
+      continue;
+    }
+
+    if(event.instant){
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%u,\"args\":{\"request\":%u,\"bytes\":%llu}}",
+              firstEvent ? "" : ",\n", event.name, (unsigned long long)event.start, (int)getpid(), event.threadId, event.traceId, (unsigned long long)event.bytes);
+    }
+    else{
+      fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u,\"args\":{\"request\":%u,\"bytes\":%llu}}",
+              firstEvent ? "" : ",\n", event.name, (unsigned long long)event.start, (unsigned long long)event.duration, (int)getpid(), event.threadId,
+              event.traceId, (unsigned long long)event.bytes);
+    }
+
+    firstEvent = 0;
+  }
+
+  fputs("\n]}\n", out);
+
+  if( fclose(out) == EOF ){
+    logEvent("Error", "Failed to write trace dump file");
+    return 0;
+  }
+
+  if( rename(temporaryPath, path) ){
+    logEvent("Error", "Failed to move trace dump into place");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static void recordEvent(uint32_t traceId, const char *name, uint64_t start, uint64_t duration, uint64_t bytes, int instant)
+{
+  uint64_t   index = 0;
+  traceEvent *slot = NULL;
+
+  index = atomic_fetch_add_explicit(&globalWriteIndex, 1, memory_order_relaxed);
+  slot  = &globalRing[index & (TRACE_RING_ENTRIES - 1)];
+
+  atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  slot->name     = name;
+  slot->start    = start;
+  slot->duration = duration;
+  slot->bytes    = bytes;
+  slot->traceId  = traceId;
+  slot->threadId = getThreadId();
+  slot->instant  = instant;
+
+  atomic_store_explicit(&slot->sequence, index + 1, memory_order_release);
+}
+
+
+static uint32_t getThreadId(void)
+{
+  if(threadId == 0){
+    threadId = (uint32_t)syscall(SYS_gettid);
+  }
+
+  return threadId;
+}
+
+
+static void requestDump(int signalNumber)
+{
+  globalDumpRequested = 1;
+}
+
+
+static void *dumpLoop(void *unused)
+{
+  struct timespec interval;
+
+  interval.tv_sec  = 0;
+  interval.tv_nsec = TRACE_DUMP_POLL_USECS * 1000L;
+
+  while(1){
+    nanosleep(&interval, NULL);
+
+    if( !globalDumpRequested ){
+      continue;
+    }
+
+    globalDumpRequested = 0;
+
+    if( !dumpTrace(globalDumpPath) ){
+      logEvent("Error", "Failed to dump trace");
+      continue;
+    }
+
+    logEvent("Info", "Dumped request trace");
+  }
+
+  return NULL;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+
+//a trace id of 0 means the request isn't sampled, every function below is then a no op
+
+int      startTracing(uint32_t sampleOneIn, const char *dumpPath);
+uint32_t traceBeginRequest(void);
+uint64_t traceStart(uint32_t traceId);
+void     traceSpan(uint32_t traceId, const char *name, uint64_t start, uint64_t bytes);
+void     traceInstant(uint32_t traceId, const char *name, uint64_t bytes);
+int      dumpTrace(const char *path);
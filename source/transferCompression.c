@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef ONIONGET_ZSTD
+#include <zstd.h>
+#endif
+
+#include "transferCompression.h"
+#include "memoryManager.h"
+#include "metrics.h"
+#include "ogEnums.h"
+#include "macros.h"
+
+
+/*
+ * Transfer compression, see transferCompression.h for the framing. The server compresses a chunk at a time with a zstd context kept
+ * per serving thread, and sends a chunk raw when that doesn't save at least 1/TRANSFER_COMPRESSION_MIN_SAVING of it. The client feeds
+ * compressed payloads through one zstd stream per file, which decodes a chunk compressed frame the same as a sidecar cut anywhere.
+ */
+
+
+#ifdef ONIONGET_ZSTD
+//the most a zstd frame header takes, zstd.h only declares ZSTD_FRAMEHEADERSIZE_MAX for static linking
+#define TRANSFER_FRAME_HEADER_MAX 18
+
+//what a serving thread compresses chunks with, created the first time it compresses one and released when the thread exits
+typedef struct transferEncoder{
+  ZSTD_CCtx     *context;
+  unsigned char *output;           //FILE_CHUNK_BYTESIZE
+}transferEncoder;
+
+static pthread_key_t   globalEncoderKey;
+static pthread_once_t  globalEncoderOnce       = PTHREAD_ONCE_INIT;
+static int             globalEncoderKeyCreated = 0;
+#endif
+
+static atomic_ullong   globalChunksCompressed;
+static atomic_ullong   globalChunksIncompressible;
+static atomic_ullong   globalInputBytes;
+static atomic_ullong   globalOutputBytes;
+static atomic_ullong   globalSidecarFiles;
+static atomic_ullong   globalSidecarFileBytes;
+static atomic_ullong   globalSidecarSentBytes;
+
+
+static int  decodeRaw(transferDecoder *decoder, uint32_t bytesize, transferSink sink, void *context);
+static int  decodeCompressed(transferDecoder *decoder, uint32_t bytesize, transferSink sink, void *context);
+static int  flushOutput(transferDecoder *decoder, transferSink sink, void *context);
+static void renderTransferCompression(FILE *out);
+
+#ifdef ONIONGET_ZSTD
+static transferEncoder *getThreadEncoder(void);
+static void            createEncoderKey(void);
+static void            releaseEncoder(void *encoderV);
+#endif
+
+
+
+/*
+ * transferCompressionAvailable returns 1 if this build can compress and decompress transfers, 0 if it can only frame them raw
+ */
+int transferCompressionAvailable(void)
+{
+#ifdef ONIONGET_ZSTD
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * transferReceiveFile receives the frames of a fileBytesize byte file from router and hands the file to sink as it is decoded,
+ * returns 0 on error and 1 on success
+ */
+int transferReceiveFile(transferDecoder *decoder, routerObject *router, uint32_t fileBytesize, transferSink sink, void *context)
+{
+  uint32_t header          = 0;
+  uint32_t payloadBytesize = 0;
+  int      decoded         = 0;
+
+  if(decoder == NULL || router == NULL || sink == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  if(decoder->frame == NULL){
+    decoder->frame  = (unsigned char *)secureAllocateTagged(FILE_CHUNK_BYTESIZE, MEMORY_TAG_CONNECTION);
+    decoder->output = (unsigned char *)secureAllocateTagged(FILE_CHUNK_BYTESIZE, MEMORY_TAG_CONNECTION);
+    if(decoder->frame == NULL || decoder->output == NULL){
+      logEvent("Error", "Failed to allocate memory for the transfer decoder");
+      return 0;
+    }
+  }
+
+#ifdef ONIONGET_ZSTD
+  //a file that failed part way through leaves the stream wherever it got to
+  if(decoder->stream != NULL && ZSTD_isError( ZSTD_DCtx_reset((ZSTD_DCtx *)decoder->stream, ZSTD_reset_session_only) )){
+    logEvent("Error", "Failed to reset the decompression stream");
+    return 0;
+  }
+#endif
+
+  decoder->outputBytesize    = 0;
+  decoder->undecodedBytesize = fileBytesize;
+  decoder->streamOpen        = 0;
+
+  do{
+    header          = router->getIncomingBytesize(router);
+    payloadBytesize = header & TRANSFER_FRAME_BYTESIZE_MASK;
+
+    if( payloadBytesize == 0 || payloadBytesize > FILE_CHUNK_BYTESIZE ||
+        (header & ~(TRANSFER_FRAME_BYTESIZE_MASK | TRANSFER_FRAME_COMPRESSED | TRANSFER_FRAME_LAST)) ){
+      logEvent("Error", "Failed to receive a valid frame header");
+      return 0;
+    }
+
+    if( !router->receive(router, decoder->frame, payloadBytesize) ){
+      logEvent("Error", "Failed to receive frame payload");
+      return 0;
+    }
+
+    decoder->wireBytesize += sizeof(uint32_t) + payloadBytesize;
+
+    if(header & TRANSFER_FRAME_COMPRESSED){
+      decoded = decodeCompressed(decoder, payloadBytesize, sink, context);
+    }
+    else{
+      decoded = decodeRaw(decoder, payloadBytesize, sink, context);
+    }
+
+    if( !decoded ){
+      return 0;
+    }
+  }while( !(header & TRANSFER_FRAME_LAST) );
+
+  if(decoder->undecodedBytesize != 0 || decoder->streamOpen){
+    logEvent("Error", "Server ended the file before all of it was sent");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * transferDecoderRelease frees what decoder allocated, it can be used again afterwards
+ */
+void transferDecoderRelease(transferDecoder *decoder)
+{
+  if(decoder == NULL){
+    return;
+  }
+
+#ifdef ONIONGET_ZSTD
+  if(decoder->stream != NULL){
+    ZSTD_freeDCtx((ZSTD_DCtx *)decoder->stream);
+    decoder->stream = NULL;
+  }
+#endif
+
+  if(decoder->frame != NULL){
+    secureFree(&decoder->frame, FILE_CHUNK_BYTESIZE);
+  }
+
+  if(decoder->output != NULL){
+    secureFree(&decoder->output, FILE_CHUNK_BYTESIZE);
+  }
+}
+
+
+/*
+ * transferCompressChunk compresses bytesize bytes of chunk, returns 1 with compressed pointing at the calling thread's copy of
+ * compressedBytesize bytes if that saved enough to be worth sending, 0 if the chunk should go raw
+ */
+int transferCompressChunk(void *chunk, uint32_t bytesize, void **compressed, uint32_t *compressedBytesize)
+{
+#ifdef ONIONGET_ZSTD
+  transferEncoder *encoder = getThreadEncoder();
+  size_t          result   = 0;
+
+  if(encoder == NULL || chunk == NULL || compressed == NULL || compressedBytesize == NULL || bytesize > FILE_CHUNK_BYTESIZE){
+    return 0;
+  }
+
+  atomic_fetch_add_explicit(&globalInputBytes, bytesize, memory_order_relaxed);
+
+  //the output only has room for a worthwhile result, so zstd gives up on a chunk that won't compress rather than finishing it
+  result = ZSTD_compressCCtx(encoder->context, encoder->output, bytesize - bytesize / TRANSFER_COMPRESSION_MIN_SAVING, chunk, bytesize,
+                             TRANSFER_COMPRESSION_LEVEL);
+  if( ZSTD_isError(result) ){
+    atomic_fetch_add_explicit(&globalChunksIncompressible, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&globalOutputBytes, bytesize, memory_order_relaxed);
+    return 0;
+  }
+
+  atomic_fetch_add_explicit(&globalChunksCompressed, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&globalOutputBytes, result, memory_order_relaxed);
+
+  *compressed         = encoder->output;
+  *compressedBytesize = (uint32_t)result;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * transferSidecarMatches returns 1 if sidecar is a zstd compression of a fileBytesize byte file worth sending in its place, otherwise 0
+ */
+int transferSidecarMatches(diskFileObject *sidecar, uint32_t fileBytesize)
+{
+#ifdef ONIONGET_ZSTD
+  unsigned char header[TRANSFER_FRAME_HEADER_MAX];
+  uint32_t      sidecarBytesize = 0;
+  uint32_t      headerBytesize  = 0;
+
+  if(sidecar == NULL){
+    logEvent("Error", "Something was NULL that shouldn't have been");
+    return 0;
+  }
+
+  sidecarBytesize = sidecar->getBytesize(sidecar);
+  if(sidecarBytesize == -1 || sidecarBytesize == 0 || sidecarBytesize >= fileBytesize){
+    return 0;
+  }
+
+  headerBytesize = sidecarBytesize < sizeof(header) ? sidecarBytesize : sizeof(header);
+  if( !sidecar->dfRead(sidecar, header, headerBytesize, 0) ){
+    return 0;
+  }
+
+  //finding where a frame ends means walking all of its blocks, so a sidecar is trusted only if its first frame says it is the whole file
+  return ZSTD_getFrameContentSize(header, headerBytesize) == fileBytesize;
+#else
+  return 0;
+#endif
+}
+
+
+/*
+ * transferCountSidecar counts a fileBytesize byte file going out as its sidecarBytesize byte sidecar
+ */
+void transferCountSidecar(uint32_t fileBytesize, uint32_t sidecarBytesize)
+{
+  atomic_fetch_add_explicit(&globalSidecarFiles, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&globalSidecarFileBytes, fileBytesize, memory_order_relaxed);
+  atomic_fetch_add_explicit(&globalSidecarSentBytes, sidecarBytesize, memory_order_relaxed);
+}
+
+
+/*
+ * startTransferCompression adds transfer compression to the stats output, returns 0 on error and 1 on success
+ */
+int startTransferCompression(void)
+{
+  if( !transferCompressionAvailable() ){
+    logEvent("Error", "Transfer compression needs a build with ZSTD=1");
+    return 0;
+  }
+
+  if( !registerMetricsRenderer(&renderTransferCompression) ){
+    logEvent("Error", "Failed to register transfer compression metrics");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+/****************** PRIVATE METHODS *******************/
+
+static int decodeRaw(transferDecoder *decoder, uint32_t bytesize, transferSink sink, void *context)
+{
+  uint32_t copied    = 0;
+  uint32_t copyBytes = 0;
+
+  //raw frames only ever come between whole zstd frames
+  if(decoder->streamOpen || bytesize > decoder->undecodedBytesize){
+    logEvent("Error", "Server sent a raw frame that doesn't fit the file");
+    return 0;
+  }
+
+  for(copied = 0; copied != bytesize; copied += copyBytes){
+    copyBytes = FILE_CHUNK_BYTESIZE - decoder->outputBytesize;
+    copyBytes = (bytesize - copied < copyBytes) ? bytesize - copied : copyBytes;
+
+    memcpy(decoder->output + decoder->outputBytesize, decoder->frame + copied, copyBytes);
+    decoder->outputBytesize    += copyBytes;
+    decoder->undecodedBytesize -= copyBytes;
+
+    if( !flushOutput(decoder, sink, context) ){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+static int decodeCompressed(transferDecoder *decoder, uint32_t bytesize, transferSink sink, void *context)
+{
+#ifdef ONIONGET_ZSTD
+  ZSTD_inBuffer  input  = { decoder->frame, bytesize, 0 };
+  ZSTD_outBuffer output;
+  size_t         result   = 0;
+  size_t         consumed = 0;
+  uint32_t       room     = 0;
+
+  if(decoder->stream == NULL){
+    decoder->stream = ZSTD_createDCtx();
+    if(decoder->stream == NULL){
+      logEvent("Error", "Failed to create a decompression stream");
+      return 0;
+    }
+  }
+
+  while(input.pos != input.size){
+    //never more than is left of the file, so a stream holding more than the file stops making progress instead of overrunning it
+    room = FILE_CHUNK_BYTESIZE - decoder->outputBytesize;
+    room = (decoder->undecodedBytesize < room) ? decoder->undecodedBytesize : room;
+
+    output.dst  = decoder->output + decoder->outputBytesize;
+    output.size = room;
+    output.pos  = 0;
+    consumed    = input.pos;
+
+    result = ZSTD_decompressStream((ZSTD_DCtx *)decoder->stream, &output, &input);
+    if( ZSTD_isError(result) ){
+      logEvent("Error", "Failed to decompress frame from server");
+      return 0;
+    }
+
+    decoder->streamOpen         = (result != 0);
+    decoder->outputBytesize    += output.pos;
+    decoder->undecodedBytesize -= output.pos;
+
+    if( !flushOutput(decoder, sink, context) ){
+      return 0;
+    }
+
+    if(output.pos == 0 && input.pos == consumed){
+      logEvent("Error", "Server sent more compressed data than the file holds");
+      return 0;
+    }
+  }
+
+  return 1;
+#else
+  logEvent("Error", "Server sent a compressed frame, decompressing needs a build with ZSTD=1");
+  return 0;
+#endif
+}
+
+
+//hands the decoded bytes to sink once they make a whole chunk or the rest of the file, so the sink always writes chunk aligned
+static int flushOutput(transferDecoder *decoder, transferSink sink, void *context)
+{
+  uint32_t bytesize = decoder->outputBytesize;
+
+  if( bytesize != FILE_CHUNK_BYTESIZE && !(decoder->undecodedBytesize == 0 && bytesize != 0) ){
+    return 1;
+  }
+
+  decoder->outputBytesize = 0;
+  return sink(context, decoder->output, bytesize);
+}
+
+
+#ifdef ONIONGET_ZSTD
+static transferEncoder *getThreadEncoder(void)
+{
+  transferEncoder *encoder = NULL;
+
+  pthread_once(&globalEncoderOnce, &createEncoderKey);
+  if( !globalEncoderKeyCreated ){
+    return NULL;
+  }
+
+  encoder = (transferEncoder *)pthread_getspecific(globalEncoderKey);
+  if(encoder != NULL){
+    return encoder;
+  }
+
+  encoder = (transferEncoder *)secureAllocateTagged(sizeof(*encoder), MEMORY_TAG_CONNECTION);
+  if(encoder == NULL){
+    logEvent("Error", "Failed to allocate memory for a transfer encoder");
+    return NULL;
+  }
+
+  encoder->context = ZSTD_createCCtx();
+  encoder->output  = (unsigned char *)secureAllocateTagged(FILE_CHUNK_BYTESIZE, MEMORY_TAG_CONNECTION);
+  if(encoder->context == NULL || encoder->output == NULL || pthread_setspecific(globalEncoderKey, encoder) != 0){
+    logEvent("Error", "Failed to set up a transfer encoder");
+    releaseEncoder(encoder);
+    return NULL;
+  }
+
+  return encoder;
+}
+
+
+static void createEncoderKey(void)
+{
+  globalEncoderKeyCreated = (pthread_key_create(&globalEncoderKey, &releaseEncoder) == 0);
+}
+
+
+//thread specific data destructor, serving threads come and go with their connections
+static void releaseEncoder(void *encoderV)
+{
+  transferEncoder *encoder = (transferEncoder *)encoderV;
+
+  if(encoder == NULL){
+    return;
+  }
+
+  if(encoder->context != NULL){
+    ZSTD_freeCCtx(encoder->context);
+  }
+
+  if(encoder->output != NULL){
+    secureFree(&encoder->output, FILE_CHUNK_BYTESIZE);
+  }
+
+  secureFree(&encoder, sizeof(*encoder));
+}
+#endif
+
+
+static void renderTransferCompression(FILE *out)
+{
+  fprintf(out, "# HELP onionget_transfer_chunks_compressed_total File chunks sent zstd compressed\n"
+               "# TYPE onionget_transfer_chunks_compressed_total counter\n"
+               "onionget_transfer_chunks_compressed_total %llu\n", (unsigned long long)atomic_load_explicit(&globalChunksCompressed, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_chunks_incompressible_total File chunks sent raw because compressing them didn't save enough\n"
+               "# TYPE onionget_transfer_chunks_incompressible_total counter\n"
+               "onionget_transfer_chunks_incompressible_total %llu\n", (unsigned long long)atomic_load_explicit(&globalChunksIncompressible, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_compression_input_bytes_total Bytes of file chunks the server tried to compress\n"
+               "# TYPE onionget_transfer_compression_input_bytes_total counter\n"
+               "onionget_transfer_compression_input_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalInputBytes, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_compression_output_bytes_total Bytes those chunks were sent as, compressed or raw\n"
+               "# TYPE onionget_transfer_compression_output_bytes_total counter\n"
+               "onionget_transfer_compression_output_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalOutputBytes, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_sidecar_files_total Files sent as their precompressed .zst sidecar\n"
+               "# TYPE onionget_transfer_sidecar_files_total counter\n"
+               "onionget_transfer_sidecar_files_total %llu\n", (unsigned long long)atomic_load_explicit(&globalSidecarFiles, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_sidecar_file_bytes_total Bytes of the files sent as sidecars\n"
+               "# TYPE onionget_transfer_sidecar_file_bytes_total counter\n"
+               "onionget_transfer_sidecar_file_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalSidecarFileBytes, memory_order_relaxed));
+
+  fprintf(out, "# HELP onionget_transfer_sidecar_sent_bytes_total Bytes of sidecars sent in their place\n"
+               "# TYPE onionget_transfer_sidecar_sent_bytes_total counter\n"
+               "onionget_transfer_sidecar_sent_bytes_total %llu\n", (unsigned long long)atomic_load_explicit(&globalSidecarSentBytes, memory_order_relaxed));
+}
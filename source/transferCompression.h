@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include "router.h"
+#include "diskFile.h"
+
+
+/*
+ * Transfer compression
+ *
+ * A client that sets REQUEST_FLAG_COMPRESSED gets every file response as its bytesize followed by frames rather than raw chunks:
+ *
+ * [file bytesize][frame header][payload][frame header][payload]...
+ *
+ * The frame header is the payload bytesize with TRANSFER_FRAME_COMPRESSED set if the payload is zstd compressed, and TRANSFER_FRAME_LAST
+ * set on the last frame of the file. A payload is at most a file chunk. Raw payloads are file chunks as they are, compressed payloads
+ * continue one zstd stream for the whole file, either a frame per chunk compressed on the fly or a precompressed sidecar cut into
+ * chunks. Either way the server picks per frame, so one that won't compress just sends everything raw.
+ */
+
+
+//sink for what a transferDecoder decodes, gets whole file chunks but for the last one of the file, returns 0 on error and 1 on success
+typedef int (*transferSink)(void *context, unsigned char *bytes, uint32_t bytesize);
+
+//receiving side of a framed file, zeroed before first use and released after last use, can be reused for many files
+typedef struct transferDecoder{
+  void          *stream;            //zstd decompression stream, created the first time a compressed frame arrives
+  unsigned char *frame;             //the payload of the frame being received
+  unsigned char *output;            //decoded bytes, handed to the sink once a chunk has built up
+  uint32_t      outputBytesize;
+  uint32_t      undecodedBytesize;  //of the file, not decoded yet
+  int           streamOpen;         //a zstd frame has started and not ended
+  uint64_t      wireBytesize;       //frame headers and payloads received, across all the files
+}transferDecoder;
+
+
+int  transferCompressionAvailable(void);
+
+int  transferReceiveFile(transferDecoder *decoder, routerObject *router, uint32_t fileBytesize, transferSink sink, void *context);
+void transferDecoderRelease(transferDecoder *decoder);
+
+int  transferCompressChunk(void *chunk, uint32_t bytesize, void **compressed, uint32_t *compressedBytesize);
+int  transferSidecarMatches(diskFileObject *sidecar, uint32_t fileBytesize);
+void transferCountSidecar(uint32_t fileBytesize, uint32_t sidecarBytesize);
+int  startTransferCompression(void);